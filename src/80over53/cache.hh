@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include <80over53/http.hh>
+#include <80over53/compress.hh>
+#include <80over53/memory.hh>
+#include <80over53/store.hh>
+
+/*
+ * http response cache
+ *
+ * complete responses to GETs are kept under their url and the request's
+ * values of the headers the response varies on. each entry holds the raw
+ * response as the backend sent it, plus its coding for the tunnel in every
+ * coding served so far, in buffer chains, so a hit hands the stream the
+ * segments it is in, shared rather than copied.
+ *
+ * an entry stays fresh for its s-maxage, max-age, or Expires less Date.
+ * with none of those it gets a tenth of its age since Last-Modified, at
+ * most CACHE_HEURISTIC_MAX_S. a stale entry with an ETag or Last-Modified
+ * is revalidated with If-None-Match or If-Modified-Since, and a 304
+ * freshens it.
+ *
+ * some responses are never kept: no-store, private, Set-Cookie or Vary: *,
+ * and those without freshness or a validator. some requests go around the
+ * cache: Authorization, no-store, or conditionals of their own. a request
+ * with no-cache revalidates. POST, PUT and DELETE drop what is kept for
+ * their url.
+ *
+ * entries are charged to the memory budget. past the cache's limit, or when
+ * the budget is over, the least recently used are let go. an entry larger
+ * than 1/CACHE_ENTRY_SHARE of the limit is not kept.
+ *
+ * given a file, entries are written through to a cache_store of the same
+ * size and restarts find them there. an entry found on opening is loaded on
+ * its first lookup. one let go from memory while its record is still in the
+ * file is only unloaded, the file keeping it; one whose record is overwritten
+ * is dropped once it is not in memory.
+ *
+ */
+
+#define CACHE_CODINGS         3
+#define CACHE_ENTRY_SHARE     8
+#define CACHE_HEURISTIC_MAX_S 86400
+
+struct cache_stats {
+	size_t hits = 0;
+	size_t revalidated = 0;
+	size_t changed = 0;
+	size_t misses = 0;
+	size_t stored = 0;
+	size_t evicted = 0;
+	size_t bypassed = 0;
+	size_t uncacheable = 0;
+	size_t restored = 0;
+	size_t unloaded = 0;
+};
+
+struct cache_entry {
+
+	std::string key;
+	std::string url;
+
+	buffer_chain raw;
+	buffer_chain coded[CACHE_CODINGS];
+	bool compressible = true;
+
+	time_t fresh_until = 0;
+	bool no_cache = false;
+
+	std::string etag;
+	std::string last_modified;
+
+	size_t hits = 0;
+
+	int64_t offset = -1;
+	bool loaded = true;
+
+	lru_link lru;
+	memory_charge memory;
+
+	size_t footprint() const;
+};
+
+/*
+ * what an upstream fetch fills the cache with: nothing with an empty url,
+ * else the response to url, the request's headers saying which variant it
+ * is, and with revalidating the key of the stale entry it asks about
+ */
+
+struct cache_fill {
+	std::string url;
+	http_headers headers;
+	std::string revalidating;
+};
+
+enum struct cache_lookup : uint8_t {
+	BYPASS,
+	MISS,
+	FRESH,
+	STALE
+};
+
+struct http_cache {
+
+	size_t limit = 0;
+	memory_budget *budget = nullptr;
+
+	std::map<std::string, std::vector<std::string>> vary;
+	std::map<std::string, cache_entry> entries;
+
+	lru_list lru;
+
+	size_t size = 0;
+
+	cache_stats stats;
+
+	cache_store disk;
+	std::map<uint64_t, std::string> persisted;
+
+	http_cache() {}
+	http_cache(const http_cache&) = delete;
+	http_cache& operator=(const http_cache&) = delete;
+
+	bool enabled() const {
+		return limit > 0;
+	}
+
+	int persist(const char *);
+
+	cache_lookup lookup(const http_request&, time_t, cache_entry **, cache_fill *);
+
+	void ask(const cache_entry&, http_request *) const;
+
+	const buffer_chain *coded(cache_entry&, coding);
+
+	cache_entry *store(const cache_fill&, buffer_chain&, time_t);
+	cache_entry *refresh(const std::string&, const char *, size_t, time_t);
+
+	void invalidate(const std::string&);
+	void forget(cache_entry *);
+
+	bool load(cache_entry *);
+	void write(cache_entry *);
+
+	bool evict();
+	void charge(cache_entry *);
+};
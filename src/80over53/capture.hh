@@ -0,0 +1,63 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+/*
+ * captured DNS traffic (offline batch mode)
+ *
+ * files are memory-mapped read-only and walked in place, nothing is copied.
+ *
+ * PCAP : libpcap savefile (either byte order, usec or nsec timestamps)
+ *        link types NULL, EN10MB, RAW and LINUX_SLL, IPv4 or IPv6 carrying UDP
+ * RAW  : a stream of DNS messages each prefixed by a 16-bit network order
+ *        length (the DNS-over-TCP framing), or a single bare DNS message
+ *
+ */
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+
+#define PCAP_LINKTYPE_NULL      0
+#define PCAP_LINKTYPE_EN10MB    1
+#define PCAP_LINKTYPE_RAW       101
+#define PCAP_LINKTYPE_LINUX_SLL 113
+
+enum struct capture_format { RAW, FRAMED, PCAP };
+
+struct capture_packet {
+
+	const void *data = nullptr;
+	size_t data_sz = 0;
+
+	timeval ts = { 0, 0 };
+
+	sockaddr_storage from;
+	uint16_t dport = 0;
+};
+
+struct capture_file {
+
+	const char *path = nullptr;
+
+	int fd = -1;
+
+	const uint8_t *data = nullptr;
+	size_t data_sz = 0;
+
+	capture_format format = capture_format::RAW;
+
+	bool swapped = false;
+	bool nsec = false;
+	uint32_t linktype = 0;
+
+	int open(const char *);
+	void close();
+
+	ssize_t next(size_t, capture_packet *) const;
+
+	size_t begin() const;
+};
+
+const char *capture_format_str(capture_format);
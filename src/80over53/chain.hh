@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/*
+ * buffer chains
+ *
+ * bytes held as slices of fixed-size, refcounted segments, so what is read
+ * or coded into a segment is taken by reference rather than copied: upstream
+ * reads land in segments and an identity-coded response is those very
+ * slices, a cached response answers a stream with its segments shared, and
+ * a chunk is packed out of them where it lies. what a chain holds never
+ * changes once appended, chains only grow.
+ *
+ * segments come from slabs of CHAIN_SLAB_SEGMENTS and go back to a free list
+ * per thread once no slice of them is left. writes are carved one after the
+ * other out of the thread's open segment, so a short response doesn't hold a
+ * segment of its own, and appending a write that follows a chain's last
+ * slice in its segment just extends the slice. a chain belongs to one
+ * thread at a time.
+ *
+ * a segment goes back to the pool of the thread that took it, whichever
+ * thread lets it go: straight to the free list on that thread, through a
+ * locked list from others (a worker's state is restored before the worker
+ * starts and torn down after it ends, on the main thread). a pool outlives
+ * its thread until its last segment is back.
+ *
+ * the pool's footprint is its free segments, given back a slab at a time
+ * when memory is short.
+ *
+ */
+
+#define CHAIN_SEGMENT_SZ    (16 << 10)
+#define CHAIN_SLAB_SEGMENTS 16
+#define CHAIN_ROOM_MIN      2048
+
+struct chain_slab;
+
+struct chain_segment {
+	chain_slab *slab;
+	chain_segment *next_free;
+	std::atomic<uint32_t> refs;
+	uint32_t used;
+	uint8_t data[CHAIN_SEGMENT_SZ];
+};
+
+struct chain_slice {
+
+	chain_segment *segment = nullptr;
+	uint32_t offset = 0;
+	uint32_t sz = 0;
+
+	uint8_t *data() const {
+		return segment->data + offset;
+	}
+};
+
+chain_slice chain_room(size_t);
+void chain_wrote(chain_slice *, size_t);
+
+void chain_hold(chain_segment *);
+void chain_release(chain_segment *);
+
+size_t chain_pool_footprint();
+void chain_pool_trim();
+
+struct buffer_chain {
+
+	std::vector<chain_slice> slices;
+	std::vector<size_t> ends;
+
+	size_t sz = 0;
+
+	buffer_chain() {}
+	buffer_chain(const buffer_chain&);
+	buffer_chain& operator=(const buffer_chain&);
+
+	~buffer_chain() {
+		clear();
+	}
+
+	size_t size() const {
+		return sz;
+	}
+
+	bool empty() const {
+		return sz == 0;
+	}
+
+	void clear();
+	void swap(buffer_chain&);
+
+	void append(const chain_slice&);
+	void append(const void *, size_t);
+	void append(const buffer_chain&, size_t, size_t);
+
+	size_t find(size_t) const;
+	chain_slice slice(size_t) const;
+
+	const uint8_t *contiguous(size_t, size_t) const;
+	void copy(size_t, size_t, void *) const;
+	std::string str(size_t, size_t) const;
+
+	size_t footprint() const;
+};
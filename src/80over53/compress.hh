@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+#include <80over53/chain.hh>
+
+/*
+ * streaming response compression
+ *
+ * deflate (zlib format) always, zstd when built with HAVE_ZSTD. contexts are
+ * not created per stream but taken from a per-thread pool and reset, and
+ * output goes through a per-thread scratch buffer onto a string, or straight
+ * into a buffer chain's segments, so compressing many short responses
+ * doesn't churn the allocator.
+ *
+ * the footprints are what a context holds, estimated for the levels used, for
+ * memory accounting. idle pooled contexts can be freed when memory is short.
+ *
+ */
+
+#define COMPRESS_POOL_MAX   64
+#define COMPRESS_SCRATCH_SZ (16<<10)
+
+enum struct coding : uint8_t { IDENTITY = 0, DEFLATE = 1, ZSTD = 2 };
+
+const char *coding_str(coding);
+
+bool coding_available(coding);
+
+size_t compress_footprint(coding);
+size_t decompress_footprint(coding);
+
+size_t compress_pools_footprint();
+void compress_pools_trim();
+
+struct compressor {
+
+	coding method = coding::IDENTITY;
+
+	void *ctx = nullptr;
+
+	compressor() {}
+	compressor(const compressor&) = delete;
+	compressor& operator=(const compressor&) = delete;
+
+	~compressor() {
+		end();
+	}
+
+	int begin(coding);
+	int update(const void *, size_t, std::string *, bool);
+	int update(const void *, size_t, buffer_chain *, bool);
+	void end();
+};
+
+struct decompressor {
+
+	coding method = coding::IDENTITY;
+
+	void *ctx = nullptr;
+
+	decompressor() {}
+	decompressor(const decompressor&) = delete;
+	decompressor& operator=(const decompressor&) = delete;
+
+	~decompressor() {
+		end();
+	}
+
+	int begin(coding);
+	int update(const void *, size_t, std::string *);
+	void end();
+};
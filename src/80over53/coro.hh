@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <coroutine>
+#include <sys/types.h>
+
+/*
+ * coroutines driven by the event loop
+ *
+ * a coro_task is a coroutine that starts suspended and stays suspended when
+ * it finishes, so whoever holds its handle resumes it as events arrive, sees
+ * it done() and destroys it, suspended anywhere or finished. what it awaits
+ * are the caller's own awaiters, resumed by the loop delivering the event.
+ *
+ * frames come from a per thread pool of free lists by size class instead of
+ * the heap, a finished task's frame reused by the next of about its size.
+ * frames past the largest class go to the heap.
+ *
+ */
+
+#define CORO_FRAME_ALIGN   64
+#define CORO_FRAME_CLASSES 32
+
+void *coro_frame_alloc(size_t);
+void coro_frame_free(void *, size_t);
+
+struct coro_frame_stats {
+	size_t allocated = 0;
+	size_t reused = 0;
+	size_t live = 0;
+	size_t pooled = 0;
+};
+
+const coro_frame_stats& coro_frames();
+size_t coro_frames_footprint();
+void coro_frames_trim();
+
+struct coro_task {
+
+	struct promise_type {
+
+		coro_task get_return_object() {
+			return coro_task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+
+		std::suspend_always final_suspend() noexcept {
+			return {};
+		}
+
+		void return_void() {}
+
+		void unhandled_exception() {
+			abort();
+		}
+
+		static void *operator new(size_t sz) {
+			return coro_frame_alloc(sz);
+		}
+
+		static void operator delete(void *p, size_t sz) {
+			coro_frame_free(p, sz);
+		}
+	};
+
+	std::coroutine_handle<> handle;
+
+	explicit coro_task(std::coroutine_handle<> h) : handle(h) {}
+};
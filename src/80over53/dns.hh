@@ -42,6 +42,8 @@ enum struct dns_type : uint16_t {
 	NSEC = 47,
 	NSEC3 = 50,
 	NSEC3PARAM = 51,
+	NULL_ = 10, /* NULL, which is a macro */
+	OPT = 41,
 	PTR = 12,
 	RRSIG = 46,
 	RP = 17,
@@ -64,6 +66,15 @@ enum struct dns_class : uint16_t {
 	ANY = 255
 };
 
+enum struct dns_rcode : uint8_t {
+	NOERROR = 0,
+	FORMERR = 1,
+	SERVFAIL = 2,
+	NXDOMAIN = 3,
+	NOTIMP = 4,
+	REFUSED = 5
+};
+
 enum struct dns_opcode : uint8_t {
 	QUERY = 0,
 	IQUERY = 1,
@@ -82,29 +93,152 @@ struct dns_question {
 	dns_class qclass = dns_class::IN;
 
 	virtual ssize_t parse(size_t, const void *, size_t);
+	virtual ssize_t write(size_t, void *, size_t) const;
 
 	virtual int sprint(char *, size_t);
 };
 
+/*
+ * when name_offset is set the owner name is written as a compression
+ * pointer to it rather than spelled out from qname
+ */
+
 struct dns_rr : dns_question {
 
-	uint16_t ttl = 0;
+	uint32_t ttl = 0;
 
 	uint8_t rdata[DNS_MSG_MAX_SZ];
 
 	size_t rdata_sz = 0;
 
+	uint16_t name_offset = 0;
+
 	virtual ssize_t parse(size_t, const void *, size_t);
+	virtual ssize_t write(size_t, void *, size_t) const;
 
 	virtual int sprint(char *, size_t);
 };
 
+/*
+ * an RR read in place, nothing copied: its type, class and ttl, and where
+ * its owner name and rdata are in the packet. parsing steps over the name by
+ * its labels and over the rdata by its length, so walking a section costs
+ * its names' labels however much rdata it carries. an OPT's class is its
+ * udp payload size, kept as is.
+ */
+
+struct dns_rr_view {
+
+	size_t name_offset = 0;
+
+	dns_type type = dns_type::A;
+	uint16_t rclass = 0;
+	uint32_t ttl = 0;
+
+	size_t rdata_offset = 0;
+	size_t rdata_sz = 0;
+
+	ssize_t parse(size_t, const void *, size_t);
+
+	int sprint(char *, size_t, const void *, size_t) const;
+};
+
+/*
+ * typed rdata, for the types anything reads the rdata of. a view is decoded
+ * by the decoder its type's kind indexes in a table, checking the rdata is
+ * well formed as it goes. other types are of no kind and not decoded.
+ */
+
+enum struct dns_rdata_kind : uint8_t {
+	NONE  = 0,
+	OPT   = 1,
+	TXT   = 2,
+	NULL_ = 3,
+	AAAA  = 4,
+	CNAME = 5
+};
+
+#define DNS_RDATA_KINDS 6
+
+constexpr dns_rdata_kind dns_rdata_kind_of(dns_type type) {
+
+	switch(type) {
+
+		case dns_type::OPT: return dns_rdata_kind::OPT;
+		case dns_type::TXT: return dns_rdata_kind::TXT;
+		case dns_type::NULL_: return dns_rdata_kind::NULL_;
+		case dns_type::AAAA: return dns_rdata_kind::AAAA;
+		case dns_type::CNAME: return dns_rdata_kind::CNAME;
+
+		default: return dns_rdata_kind::NONE;
+	}
+}
+
+/*
+ * the OPT pseudo-RR's fields (RFC 6891), from its class and ttl, and how
+ * many options its rdata holds
+ */
+
+struct dns_opt {
+	uint16_t udp_sz;
+	uint8_t extended_rcode;
+	uint8_t version;
+	bool dnssec_ok;
+	size_t options;
+};
+
+/*
+ * a TXT's character-strings, the first pointing into the packet
+ */
+
+struct dns_txt {
+	size_t strings;
+	size_t data_sz;
+	const uint8_t *first;
+	size_t first_sz;
+};
+
+struct dns_null {
+	const uint8_t *data;
+	size_t data_sz;
+};
+
+struct dns_aaaa {
+	uint8_t address[16];
+};
+
+struct dns_cname {
+	char name[DNS_NAME_MAX_SZ + 1];
+	size_t name_sz;
+};
+
+struct dns_rdata {
+
+	dns_rdata_kind kind = dns_rdata_kind::NONE;
+
+	union {
+		dns_opt opt;
+		dns_txt txt;
+		dns_null null;
+		dns_aaaa aaaa;
+		dns_cname cname;
+	};
+
+	dns_rdata() {}
+
+	int decode(const dns_rr_view&, const void *, size_t);
+
+	int sprint(char *, size_t) const;
+};
+
 #pragma pack(push, 1)
 
 struct dns_header {
 
 	uint16_t id;
 
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+
 	uint8_t qr:1,
 			opcode:4,
 			aa:1,
@@ -114,6 +248,18 @@ struct dns_header {
 	uint8_t  ra:1,
 			 z:3,
 			 rcode:4;
+#else
+
+	uint8_t rd:1,
+			tc:1,
+			aa:1,
+			opcode:4,
+			qr:1;
+
+	uint8_t  rcode:4,
+			 z:3,
+			 ra:1;
+#endif
 
 	uint16_t qdcount;
 	uint16_t ancount;
@@ -121,6 +267,7 @@ struct dns_header {
 	uint16_t arcount;
 
 	ssize_t parse(const void *, size_t);
+	ssize_t write(void *, size_t) const;
 
 	int sprint(char *, size_t);
 
@@ -142,6 +289,8 @@ const char *dns_opcode_str(dns_opcode);
 
 ssize_t expand_label(size_t, const void *, size_t, char *, size_t *);
 ssize_t expand_name(size_t, const void *, size_t, char *, size_t *);
+ssize_t skip_name(size_t, const void *, size_t);
+ssize_t encode_name(size_t, void *, size_t, const char *);
 
 size_t get_label_sz(size_t, const void *);
 size_t get_pointer_offset(size_t, const void *);
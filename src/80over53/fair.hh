@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+#include <80over53/session.hh>
+
+/*
+ * per-client fair queuing
+ *
+ * work is queued per flow (a client address, or a session) and served by
+ * deficit round robin: each flow's turn adds quantum to its deficit and it is
+ * served while its deficit covers the cost of its next item, so flows get
+ * equal shares of cost however much each queues. with a rate set each flow
+ * also has a token bucket of burst tokens refilled at rate per second, one
+ * spent per item, and a flow out of tokens is passed over until it has one.
+ * flows live in a session_table keyed by flow id, the ones with work queued
+ * in a ring. an emptied flow is kept until its bucket is full again (so going
+ * idle does not refill it), idle ones swept out as the table doubles.
+ *
+ */
+
+#define FAIR_QUANTUM 1
+
+template <typename T> struct fair_queue {
+
+	struct flow {
+
+		uint32_t key = 0;
+
+		std::deque<std::pair<T, size_t>> items;
+
+		size_t deficit = 0;
+		bool turn = false;
+
+		double tokens = 0;
+		uint64_t refilled_ms = 0;
+
+		bool waited = false;
+	};
+
+	session_table<flow> flows;
+
+	std::deque<uint32_t> ring;
+
+	size_t count = 0;
+
+	size_t quantum = FAIR_QUANTUM;
+
+	double rate = 0;
+	double burst = 1;
+
+	/*
+	 * items that had to wait for a token
+	 */
+
+	size_t throttled = 0;
+
+	size_t sweep_at = SESSION_TABLE_MIN_SZ;
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	size_t flow_size(uint32_t key) {
+		flow *f = flows.find(key);
+		return f == nullptr ? 0 : f->items.size();
+	}
+
+	void refill(flow& f, uint64_t now_ms) {
+
+		if(rate <= 0)
+			return;
+
+		if(now_ms > f.refilled_ms)
+			f.tokens = std::min(burst, f.tokens + (now_ms - f.refilled_ms) * rate / 1000);
+
+		f.refilled_ms = now_ms;
+	}
+
+	void push(uint32_t key, const T& x, size_t cost, uint64_t now_ms) {
+
+		flow *f = flows.find(key);
+
+		if(f == nullptr) {
+
+			if(flows.size() >= sweep_at) {
+				forget_idle(now_ms);
+				sweep_at = std::max((size_t)SESSION_TABLE_MIN_SZ, 2 * flows.size());
+			}
+
+			f = &flows.insert(key);
+			f->key = key;
+			f->tokens = burst;
+			f->refilled_ms = now_ms;
+		}
+
+		if(f->items.empty())
+			ring.push_back(key);
+
+		f->items.push_back(std::make_pair(x, cost));
+
+		count++;
+	}
+
+	/*
+	 * the next item due, false when there is none or every flow with work
+	 * waits on a token, retry_ms then saying how long until one has one
+	 */
+
+	bool pop(uint64_t now_ms, T *x, uint64_t *retry_ms) {
+
+		size_t skipped = 0;
+
+		*retry_ms = 0;
+
+		while(not ring.empty() and skipped < ring.size()) {
+
+			flow& f = *flows.find(ring.front());
+
+			refill(f, now_ms);
+
+			if(rate > 0 and f.tokens < 1) {
+
+				const uint64_t wait_ms = (uint64_t)((1 - f.tokens) * 1000 / rate) + 1;
+
+				if(*retry_ms == 0 or wait_ms < *retry_ms)
+					*retry_ms = wait_ms;
+
+				f.turn = false;
+				ring.push_back(ring.front());
+				ring.pop_front();
+				f.waited = true;
+				skipped++;
+				continue;
+			}
+
+			if(not f.turn) {
+				f.deficit += quantum;
+				f.turn = true;
+			}
+
+			const size_t cost = f.items.front().second;
+
+			if(f.deficit < cost) {
+				f.turn = false;
+				ring.push_back(ring.front());
+				ring.pop_front();
+				skipped = 0;
+				continue;
+			}
+
+			f.deficit -= cost;
+			f.tokens -= 1;
+
+			if(f.waited) {
+				f.waited = false;
+				throttled++;
+			}
+
+			*x = f.items.front().first;
+			f.items.pop_front();
+			count--;
+
+			if(f.items.empty()) {
+
+				ring.pop_front();
+
+				f.deficit = 0;
+				f.turn = false;
+
+				if(rate <= 0 or f.tokens >= burst)
+					flows.erase(f.key);
+			}
+
+			*retry_ms = 0;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	/*
+	 * drop flows idle long enough for their buckets to be full again
+	 */
+
+	void forget_idle(uint64_t now_ms) {
+
+		std::vector<uint32_t> idle;
+
+		flows.for_each([&](flow& f) {
+			refill(f, now_ms);
+			if(f.items.empty() and f.tokens >= burst)
+				idle.push_back(f.key);
+		});
+
+		for(uint32_t key : idle)
+			flows.erase(key);
+	}
+
+	/*
+	 * drop every item queued
+	 */
+
+	void clear() {
+
+		for(uint32_t key : ring)
+			flows.erase(key);
+
+		ring.clear();
+		count = 0;
+	}
+
+	/*
+	 * f on every item queued
+	 */
+
+	template <typename F> void for_each(F f) {
+
+		for(uint32_t key : ring)
+			for(auto& x : flows.find(key)->items)
+				f(x.first);
+	}
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+/*
+ * forward error correction over blocks of equal-size chunks
+ *
+ * a systematic Reed-Solomon erasure code over GF(2^8) built on a Cauchy
+ * matrix: repair chunk r of a block of width k is
+ *
+ *    repair[r] = sum over i of data[i] / ((k + r) ^ i)
+ *
+ * so any k of the data and repair chunks rebuild the rest. a block may hold
+ * fewer than width chunks (the last one of a response), the chunks past its
+ * end count as absent from every equation.
+ *
+ */
+
+#define FEC_SYMBOLS_MAX 256
+
+void fec_encode(size_t width, const uint8_t *const *data, size_t count, size_t index, size_t sz, uint8_t *repair);
+
+int fec_decode(size_t width, uint8_t *const *data, const bool *present, size_t count,
+		const uint8_t *const *repairs, const size_t *indexes, size_t nrepairs, size_t sz);
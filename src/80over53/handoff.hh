@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+/*
+ * process handoff
+ *
+ * a binary upgrade without dropping queries: the new server, started with
+ * the same -H path as the running one, connects to it there before binding
+ * anything. the old server stops taking new requests, lets those in flight
+ * finish, then sends its bound sockets (SCM_RIGHTS) and its sessions
+ * serialized over the connection, and exits once the new one acks. the
+ * sockets being the very same, queries queued in them meanwhile are read by
+ * the new server.
+ *
+ * a message is a header, magic, version and size, then that much state. the
+ * state is fixed size integers in host order (both ends are on one host) and
+ * strings prefixed with their size, read back with a handoff_reader that
+ * fails, for good, at the first that would overrun it.
+ *
+ */
+
+#define HANDOFF_MAGIC    0x3335484f /* "OH53" */
+#define HANDOFF_VERSION  2
+#define HANDOFF_FDS_MAX  4
+#define HANDOFF_STATE_MAX (1ul << 30)
+#define HANDOFF_ACK_MS   5000
+#define HANDOFF_WAIT_MS  30000
+
+struct handoff_writer {
+
+	std::string out;
+
+	void u8(uint8_t);
+	void u16(uint16_t);
+	void u32(uint32_t);
+	void u64(uint64_t);
+	void str(const std::string&);
+};
+
+struct handoff_reader {
+
+	const std::string& in;
+	size_t at = 0;
+	bool failed = false;
+
+	handoff_reader(const std::string& s) : in(s) {}
+
+	uint8_t u8();
+	uint16_t u16();
+	uint32_t u32();
+	uint64_t u64();
+	std::string str();
+
+	bool done() const {
+		return failed or at == in.size();
+	}
+
+	bool take(void *, size_t);
+};
+
+int handoff_listen(const char *);
+int handoff_connect(const char *);
+
+int handoff_send(int, const int *, size_t, const std::string&);
+ssize_t handoff_receive(int, int *, size_t, std::string *);
+
+int handoff_ack(int);
+int handoff_wait_ack(int, unsigned);
@@ -1,9 +1,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <strings.h>
 
 #include <map>
 #include <list>
 #include <string>
+#include <vector>
 
 #include <80over53/dns.hh>
 
@@ -14,9 +18,20 @@ enum struct http_method { GET, HEAD, POST, PUT, DELETE, TRACE, CONNECT };
 const char *http_method_str(http_method);
 
 #define HTTP_PATH_MAX_SZ 512
+#define HTTP_HEAD_MAX_SZ (64 << 10)
+
+/*
+ * header names are case-insensitive (RFC 9110), so are the headers' keys
+ */
+
+struct http_name_less {
+	bool operator()(const std::string& a, const std::string& b) const {
+		return strcasecmp(a.c_str(), b.c_str()) < 0;
+	}
+};
 
 using http_form = std::map<std::string, std::string>;
-using http_headers = std::map<std::string, std::string>;
+using http_headers = std::map<std::string, std::string, http_name_less>;
 
 struct http_request {
 
@@ -27,14 +42,19 @@ struct http_request {
 	uint16_t port;
 	http_headers headers;
 	http_form form;
+	std::string body;
 
 	http_request();
 	http_request(http_method, const char *, const char *,  bool, uint16_t);
 	http_request(http_method, const char *, const char *,  bool);
 
 	sockaddr *get_sockaddr(sockaddr *, socklen_t) const;
+	int get_addresses(std::vector<sockaddr_in> *) const;
+
+	int parse(const char *, size_t);
+	int parse_url(const char *);
 
-	int parse(const dns_question&, const char *);
+	ssize_t parse_message(const char *, size_t);
 
 	std::string url() const;
 	std::string content() const;
@@ -42,7 +62,53 @@ struct http_request {
 	std::string form_string() const;
 	std::string headers_string() const;
 
+	bool has_form_body() const;
+	void set_body(const std::string&);
+
 	std::string to_s();
+
+	std::string serialize() const;
+};
+
+http_form parse_form(const std::string&);
+
+bool http_response_compressible(const char *, size_t);
+
+/*
+ * where an upstream response ends, so its connection can carry the next
+ * request. fed the response as it arrives, it takes what belongs to it and
+ * is done() after the body: Content-Length bytes, the last chunk and the
+ * trailers when chunked, nothing for HEAD, 204 and 304. a body with neither
+ * runs to EOF. reusable() once done unless either side closes (HTTP/1.0, or
+ * Connection: close). status is the final status once the head is in.
+ */
+
+struct http_response_end {
+
+	enum struct part : uint8_t { HEAD, BODY, CHUNK_SIZE, CHUNK, CHUNK_END, TRAILER, UNTIL_EOF, DONE };
+
+	part at = part::HEAD;
+
+	int status = 0;
+
+	bool head_only = false;
+	bool keep_alive = false;
+
+	uint64_t left = 0;
+
+	std::string line;
+
+	size_t feed(const char *, size_t);
+
+	bool done() const {
+		return at == part::DONE;
+	}
+
+	bool reusable() const {
+		return done() and keep_alive;
+	}
+
+	void begin_body();
 };
 
 namespace defaults {
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+/*
+ * memory accounting
+ *
+ * what the server holds is charged against one budget by category. a record
+ * holding memory embeds a memory_charge and sets how much it holds in each
+ * category as that changes, the charge following the record: destroying it
+ * gives everything back. when the budget is over its limit the owner evicts,
+ * least recently used first from an lru_list, an intrusive list of the
+ * records that can be evicted, each link unlinking itself when destroyed.
+ *
+ */
+
+enum struct memory_category : uint8_t {
+	SESSIONS  = 0,
+	FRAGMENTS = 1,
+	RESPONSES = 2,
+	QUEUE     = 3,
+	CODING    = 4,
+	POOLS     = 5,
+	CACHE     = 6
+};
+
+#define MEMORY_CATEGORIES 7
+
+const char *memory_category_str(memory_category);
+
+size_t memory_parse_size(const char *);
+
+struct memory_budget {
+
+	size_t limit = 0;
+
+	size_t used[MEMORY_CATEGORIES] = {};
+	size_t total = 0;
+	size_t peak = 0;
+
+	void charge(memory_category, size_t);
+	void release(memory_category, size_t);
+
+	bool over() const {
+		return limit != 0 and total > limit;
+	}
+
+	int sprint(char *, size_t) const;
+};
+
+struct memory_charge {
+
+	memory_budget *budget = nullptr;
+
+	size_t bytes[MEMORY_CATEGORIES] = {};
+
+	memory_charge() {}
+	memory_charge(const memory_charge&) = delete;
+	memory_charge& operator=(const memory_charge&) = delete;
+
+	~memory_charge() {
+		clear();
+	}
+
+	size_t total() const;
+
+	void set(memory_budget *, memory_category, size_t);
+	void clear();
+};
+
+struct lru_link {
+
+	lru_link *prev = nullptr;
+	lru_link *next = nullptr;
+
+	void *owner = nullptr;
+
+	lru_link() {}
+	lru_link(const lru_link&) = delete;
+	lru_link& operator=(const lru_link&) = delete;
+
+	~lru_link() {
+		unlink();
+	}
+
+	bool linked() const {
+		return prev != nullptr;
+	}
+
+	void unlink();
+};
+
+struct lru_list {
+
+	lru_link head;
+
+	lru_list() {
+		head.prev = &head;
+		head.next = &head;
+	}
+
+	~lru_list();
+
+	lru_list(const lru_list&) = delete;
+	lru_list& operator=(const lru_list&) = delete;
+
+	void touch(lru_link *);
+
+	lru_link *oldest() {
+		return head.next == &head ? nullptr : head.next;
+	}
+
+	lru_link *newer(lru_link *x) {
+		return x->next == &head ? nullptr : x->next;
+	}
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*
+ * upstream backend pools
+ *
+ * a pool holds the addresses the requests for one zone or host may go to.
+ * pick() chooses a backend for each request and done() gives it back with
+ * how it went. by default pick() takes the backend with the fewest
+ * outstanding requests. with pool_policy::TWO_CHOICES it takes the less
+ * loaded of two picked at random. load is outstanding requests over weight.
+ * a backend back from ejection, or newly resolved, starts at a tenth of the
+ * weight and grows to full weight over POOL_SLOW_START_MS. that way it takes
+ * a growing share of requests rather than all of them at once.
+ *
+ * health is checked passively. after POOL_EJECT_FAILURES failures in a row
+ * a backend is ejected; a failure is a connect that fails or times out, a
+ * failed handshake, or a 5xx. the first ejection lasts POOL_EJECT_MIN_MS and
+ * each one after it doubles, up to POOL_EJECT_MAX_MS. a backend is ejected
+ * only if some other backend can carry its share. when all of them are out,
+ * the pool picks among all of them anyway.
+ *
+ */
+
+#define POOL_BACKENDS_MAX   64
+#define POOL_EJECT_FAILURES 5
+#define POOL_EJECT_MIN_MS   10000
+#define POOL_EJECT_MAX_MS   300000
+#define POOL_SLOW_START_MS  30000
+#define POOL_WEIGHT_MIN     0.1
+
+enum struct pool_policy : uint8_t {
+	LEAST,
+	TWO_CHOICES
+};
+
+const char *pool_policy_str(pool_policy);
+
+enum struct pool_outcome : uint8_t {
+	NONE,
+	OK,
+	FAILED
+};
+
+struct backend {
+
+	sockaddr_in address;
+
+	bool listed = true;
+
+	size_t outstanding = 0;
+
+	unsigned failures = 0;
+	unsigned ejections = 0;
+	uint64_t ejected_until_ms = 0;
+	uint64_t warming_ms = 0;
+
+	size_t requests = 0;
+	size_t failed = 0;
+	size_t ejected = 0;
+
+	bool usable(uint64_t now_ms) const {
+		return listed and ejected_until_ms <= now_ms;
+	}
+
+	double weight(uint64_t) const;
+
+	double load(uint64_t now_ms) const {
+		return (outstanding + 1) / weight(now_ms);
+	}
+
+	int sprint(char *, size_t, uint64_t) const;
+};
+
+struct backend_pool {
+
+	std::vector<backend> backends;
+
+	pool_policy policy = pool_policy::LEAST;
+
+	size_t outstanding = 0;
+
+	uint64_t resolved_ms = 0;
+	uint64_t used_ms = 0;
+
+	std::minstd_rand rng;
+
+	backend_pool() : rng(std::random_device()()) {}
+
+	void assign(const std::vector<sockaddr_in>&, uint64_t);
+
+	int pick(uint64_t);
+	bool done(int, pool_outcome, uint64_t);
+
+	size_t ejected(uint64_t) const;
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <sys/types.h>
+
+/*
+ * bounded lock-free rings between pipeline stages
+ *
+ * both hold a power of two of preallocated cells and fail a push when full
+ * rather than block or allocate, the producer deciding what to drop. the
+ * spsc_ring is a plain head/tail pair, each written by one side only. the
+ * mpsc_ring lets many producers claim cells with a compare-and-swap on the
+ * tail, each cell carrying a sequence number that says whether it is free
+ * for the producer of this lap or full for the consumer (after Vyukov's
+ * bounded queue). indices are padded a cache line apart so producers and
+ * consumers do not share one, without asking for aligned allocation.
+ *
+ * high is the deepest either has been, updated by producers.
+ *
+ */
+
+#define RING_CACHELINE 64
+
+template <typename T> struct spsc_ring {
+
+	std::vector<T> cells;
+	const size_t mask;
+
+	char before[RING_CACHELINE];
+	std::atomic<size_t> head;
+	char between[RING_CACHELINE];
+	std::atomic<size_t> tail;
+	char after[RING_CACHELINE];
+
+	std::atomic<size_t> high;
+
+	explicit spsc_ring(size_t capacity) : cells(capacity), mask(capacity - 1), head(0), tail(0), high(0) {}
+
+	spsc_ring(const spsc_ring&) = delete;
+	spsc_ring& operator=(const spsc_ring&) = delete;
+
+	size_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	/*
+	 * the cell to fill in before publish(), nullptr when full
+	 */
+
+	T *claim() {
+
+		const size_t t = tail.load(std::memory_order_relaxed);
+
+		if(t - head.load(std::memory_order_acquire) > mask)
+			return nullptr;
+
+		return &cells[t & mask];
+	}
+
+	void publish() {
+
+		const size_t t = tail.load(std::memory_order_relaxed) + 1;
+
+		tail.store(t, std::memory_order_release);
+
+		const size_t depth = t - head.load(std::memory_order_relaxed);
+
+		if(depth > high.load(std::memory_order_relaxed))
+			high.store(depth, std::memory_order_relaxed);
+	}
+
+	/*
+	 * the oldest cell to read before release(), nullptr when empty
+	 */
+
+	T *front() {
+
+		const size_t h = head.load(std::memory_order_relaxed);
+
+		if(h == tail.load(std::memory_order_acquire))
+			return nullptr;
+
+		return &cells[h & mask];
+	}
+
+	void release() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
+
+template <typename T> struct mpsc_ring {
+
+	struct cell {
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	std::vector<cell> cells;
+	const size_t mask;
+
+	char before[RING_CACHELINE];
+	std::atomic<size_t> head;
+	char between[RING_CACHELINE];
+	std::atomic<size_t> tail;
+	char after[RING_CACHELINE];
+
+	std::atomic<size_t> high;
+
+	explicit mpsc_ring(size_t capacity) : cells(capacity), mask(capacity - 1), head(0), tail(0), high(0) {
+		for(size_t i = 0; i < capacity; i++)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	mpsc_ring(const mpsc_ring&) = delete;
+	mpsc_ring& operator=(const mpsc_ring&) = delete;
+
+	size_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	/*
+	 * a cell of this producer's to fill in before publish(c), nullptr when
+	 * full
+	 */
+
+	cell *claim() {
+
+		size_t t = tail.load(std::memory_order_relaxed);
+
+		for(;;) {
+
+			cell *c = &cells[t & mask];
+
+			const intptr_t lap = (intptr_t)c->seq.load(std::memory_order_acquire) - (intptr_t)t;
+
+			if(lap < 0)
+				return nullptr;
+
+			if(lap == 0 and tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) {
+
+				const size_t depth = t + 1 - head.load(std::memory_order_relaxed);
+
+				if(depth > high.load(std::memory_order_relaxed))
+					high.store(depth, std::memory_order_relaxed);
+
+				return c;
+			}
+
+			if(lap > 0)
+				t = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	void publish(cell *c) {
+		c->seq.store(c->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	cell *front() {
+
+		const size_t h = head.load(std::memory_order_relaxed);
+
+		cell *c = &cells[h & mask];
+
+		if(c->seq.load(std::memory_order_acquire) != h + 1)
+			return nullptr;
+
+		return c;
+	}
+
+	void release(cell *c) {
+
+		const size_t h = head.load(std::memory_order_relaxed);
+
+		c->seq.store(h + mask + 1, std::memory_order_release);
+
+		head.store(h + 1, std::memory_order_release);
+	}
+};
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <coroutine>
+#include <random>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <80over53/pool.hh>
+
+struct tls_stream;
+struct chain_slice;
+
+/*
+ * session and upstream connection tables
+ *
+ * session records live in a slab, chunks of records that never move, reused
+ * through a free list. a session id finds its record through a flat
+ * open-addressing table of (id, slot) pairs, linear probing over a hash of
+ * the id keyed with a random seed per table: ids come from clients, who
+ * mustn't be able to pick ids that pile up in one probe run, so every bit of
+ * the id and the seed goes through a 64-bit finalizer. deleting shifts the
+ * probe run back so there are no tombstones. an upstream fd finds the
+ * session, stream and query that opened it through an array indexed by the
+ * fd itself, with the open fds kept dense alongside for walking them.
+ *
+ */
+
+#define SLAB_CHUNK_RECORDS 256
+
+#define SESSION_TABLE_MIN_SZ 64
+
+#define SLOT_NONE UINT32_MAX
+
+template <typename T> struct slab {
+
+	std::vector<T *> chunks;
+	std::vector<bool> live;
+	std::vector<uint32_t> free_slots;
+
+	size_t used = 0;
+
+	slab() {}
+	slab(const slab&) = delete;
+	slab& operator=(const slab&) = delete;
+
+	~slab() {
+
+		for(size_t i = 0; i < live.size(); i++)
+			if(live[i])
+				(*this)[i].~T();
+
+		for(T *chunk : chunks)
+			::operator delete(chunk);
+	}
+
+	T& operator[](uint32_t slot) {
+		return chunks[slot / SLAB_CHUNK_RECORDS][slot % SLAB_CHUNK_RECORDS];
+	}
+
+	uint32_t alloc() {
+
+		if(free_slots.empty()) {
+
+			const uint32_t base = chunks.size() * SLAB_CHUNK_RECORDS;
+
+			chunks.push_back((T *)::operator new(sizeof(T) * SLAB_CHUNK_RECORDS));
+			live.resize(base + SLAB_CHUNK_RECORDS, false);
+
+			for(uint32_t i = SLAB_CHUNK_RECORDS; i-- > 0; )
+				free_slots.push_back(base + i);
+		}
+
+		const uint32_t slot = free_slots.back();
+		free_slots.pop_back();
+
+		new(&(*this)[slot]) T();
+
+		live[slot] = true;
+		used++;
+
+		return slot;
+	}
+
+	void release(uint32_t slot) {
+
+		(*this)[slot].~T();
+
+		live[slot] = false;
+		used--;
+
+		free_slots.push_back(slot);
+	}
+};
+
+template <typename T> struct session_table {
+
+	struct entry {
+		uint32_t id;
+		uint32_t slot = SLOT_NONE;
+	};
+
+	std::vector<entry> entries = std::vector<entry>(SESSION_TABLE_MIN_SZ);
+
+	slab<T> records;
+
+	const uint64_t seed = (uint64_t)std::random_device()() << 32 | std::random_device()();
+
+	size_t size() const {
+		return records.used;
+	}
+
+	size_t home(uint32_t id) const {
+
+		uint64_t h = id ^ seed;
+
+		h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ h >> 27 ^ seed >> 17) * 0x94d049bb133111ebull;
+		h ^= h >> 31;
+
+		return h & (entries.size() - 1);
+	}
+
+	size_t probe(uint32_t id) const {
+
+		size_t i = home(id);
+
+		while(entries[i].slot != SLOT_NONE and entries[i].id != id)
+			i = (i + 1) & (entries.size() - 1);
+
+		return i;
+	}
+
+	T *find(uint32_t id) {
+
+		const entry& e = entries[probe(id)];
+
+		return e.slot == SLOT_NONE ? nullptr : &records[e.slot];
+	}
+
+	/*
+	 * the record for id, a new one when there is none yet
+	 */
+
+	T& insert(uint32_t id) {
+
+		size_t i = probe(id);
+
+		if(entries[i].slot != SLOT_NONE)
+			return records[entries[i].slot];
+
+		if(2 * (records.used + 1) > entries.size()) {
+			grow();
+			i = probe(id);
+		}
+
+		entries[i].id = id;
+		entries[i].slot = records.alloc();
+
+		return records[entries[i].slot];
+	}
+
+	void erase(uint32_t id) {
+
+		const size_t mask = entries.size() - 1;
+
+		size_t i = probe(id);
+
+		if(entries[i].slot == SLOT_NONE)
+			return;
+
+		records.release(entries[i].slot);
+
+		/*
+		 * shift back every later entry of the run whose home is at or before
+		 * the hole, so probes never stop short of it
+		 */
+
+		for(size_t j = (i + 1) & mask; entries[j].slot != SLOT_NONE; j = (j + 1) & mask) {
+
+			const size_t k = home(entries[j].id);
+
+			if(((j - k) & mask) >= ((j - i) & mask)) {
+				entries[i] = entries[j];
+				i = j;
+			}
+		}
+
+		entries[i].slot = SLOT_NONE;
+	}
+
+	void grow() {
+
+		std::vector<entry> old(entries.size() * 2);
+
+		old.swap(entries);
+
+		for(const entry& e : old)
+			if(e.slot != SLOT_NONE)
+				entries[probe(e.id)] = e;
+	}
+
+	template <typename F> void for_each(F f) {
+		for(const entry& e : entries)
+			if(e.slot != SLOT_NONE)
+				f(records[e.slot]);
+	}
+};
+
+/*
+ * what the coroutine handling an upstream is suspended on
+ */
+
+enum struct upstream_wait : uint8_t {
+	NONE,
+	CONNECT,
+	SEND,
+	RECV
+};
+
+/*
+ * what an upstream fd was opened for: the session and stream it carries the
+ * response of and the client and query whose PUT started it. out is the part
+ * of the request not sent yet, connecting while the connect is in progress
+ * to the upstream at to. handler is the coroutine driving it, resumed with
+ * result (and data for a recv, with the chain segment slice it is in when
+ * it was read into one) once what it awaits is done. tls carries the
+ * request over TLS, backend names where it went for reusing the connection,
+ * whole once the response's framing says it ended (or it runs to EOF).
+ * under io_uring a send may be in flight (sending) and a recv armed
+ * (receiving), what it received while the coroutine waited on something
+ * else kept in, with in_status the EOF (0) or -errno that ended it. member
+ * is the backend of pool it went to, given back with outcome when it ends.
+ */
+
+struct upstream_ref {
+
+	uint32_t session = 0;
+	uint16_t stream = 0;
+
+	sockaddr_storage peer;
+	uint16_t query_id = 0;
+
+	bool connecting = false;
+	sockaddr_in to;
+	std::string out;
+
+	std::coroutine_handle<> handler;
+	upstream_wait awaiting = upstream_wait::NONE;
+	ssize_t result = 0;
+	const uint8_t *data = nullptr;
+	const chain_slice *slice = nullptr;
+
+	tls_stream *tls = nullptr;
+	std::string backend;
+	bool reusable = false;
+	bool whole = false;
+
+	backend_pool *pool = nullptr;
+	int member = -1;
+	pool_outcome outcome = pool_outcome::NONE;
+
+	bool sending = false;
+	bool receiving = false;
+	std::string in;
+	std::string held;
+	ssize_t in_status = 1;
+
+	int32_t pos = -1;
+
+	int sprint(char *s, size_t sz) const {
+
+		char addr[INET6_ADDRSTRLEN] = "?";
+		uint16_t port = 0;
+
+		if(peer.ss_family == AF_INET) {
+			inet_ntop(AF_INET, &((const sockaddr_in *)&peer)->sin_addr, addr, sizeof(addr));
+			port = ntohs(((const sockaddr_in *)&peer)->sin_port);
+		} else if(peer.ss_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((const sockaddr_in6 *)&peer)->sin6_addr, addr, sizeof(addr));
+			port = ntohs(((const sockaddr_in6 *)&peer)->sin6_port);
+		}
+
+		return snprintf(s, sz, "session %08x stream %u (query id %u from %s:%u)", session, stream, query_id, addr, port);
+	}
+};
+
+struct upstream_table {
+
+	std::vector<upstream_ref> by_fd;
+	std::vector<int> fds;
+
+	size_t size() const {
+		return fds.size();
+	}
+
+	bool empty() const {
+		return fds.empty();
+	}
+
+	upstream_ref *find(int fd) {
+		return fd >= 0 and (size_t)fd < by_fd.size() and by_fd[fd].pos != -1 ? &by_fd[fd] : nullptr;
+	}
+
+	void insert(int fd, const upstream_ref& ref) {
+
+		if((size_t)fd >= by_fd.size())
+			by_fd.resize(fd + 1);
+
+		by_fd[fd] = ref;
+		by_fd[fd].pos = fds.size();
+
+		fds.push_back(fd);
+	}
+
+	void erase(int fd) {
+
+		upstream_ref *ref = find(fd);
+		if(ref == nullptr)
+			return;
+
+		const int last = fds.back();
+
+		fds[ref->pos] = last;
+		by_fd[last].pos = ref->pos;
+
+		fds.pop_back();
+
+		ref->pos = -1;
+	}
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include <80over53/chain.hh>
+
+/*
+ * persistent cache store
+ *
+ * the http cache's entries written through to a memory-mapped file, so a
+ * restarted server starts warm. the file is a header page then a circular
+ * log of records, each a fixed header then the entry's key, url, validators
+ * and raw response:
+ *
+ *    +--------------+----------+-----------------+------+-----+----------+
+ *    | store_header | record   | record          | free | ... | record   |
+ *    +--------------+----------+-----------------+------+-----+----------+
+ *                   ^ head % capacity            ^ tail % capacity
+ *
+ * offsets are logical, growing past capacity and never reused, a record
+ * found at offset % capacity. one never straddles the end of the log: what
+ * is left there is skipped with a STORE_WRAP record, or with nothing if less
+ * than a record header is left. appending past capacity overwrites the
+ * oldest records, whose offsets are handed back so the cache drops them.
+ * a record let go is marked dead in place.
+ *
+ * the header and every record header carry a crc32 of themselves and a
+ * record one of its data. a header that doesn't check, from another version
+ * or sized for another capacity, starts the file over empty. opening walks
+ * the record headers only, from head to tail, stopping at the first that
+ * doesn't check. the data stays unread (the mapping advised random, so
+ * nothing is read ahead) until an entry is loaded on first use, its crc32
+ * checked then.
+ *
+ * the file is locked while open, a second server can't share it.
+ *
+ */
+
+#define STORE_VERSION   1
+#define STORE_HEADER_SZ 4096
+#define STORE_ALIGN     8
+
+#define STORE_RECORD_MAGIC 0x31524353 /* "SCR1" */
+#define STORE_WRAP_MAGIC   0x31505257 /* "WRP1" */
+
+#define STORE_DEAD         0x1
+#define STORE_COMPRESSIBLE 0x2
+#define STORE_NO_CACHE     0x4
+
+struct store_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_sz;
+	uint64_t capacity;
+	uint64_t head;
+	uint64_t tail;
+	uint32_t reserved;
+	uint32_t checksum;
+};
+
+struct store_record {
+	uint32_t magic;
+	uint32_t flags;
+	int64_t fresh_until;
+	uint32_t key_sz;
+	uint32_t url_sz;
+	uint32_t etag_sz;
+	uint32_t last_modified_sz;
+	uint64_t raw_sz;
+	uint32_t data_checksum;
+	uint32_t checksum;
+};
+
+/*
+ * what opening found of a live record: all of it but the raw response
+ */
+
+struct store_item {
+	uint64_t offset;
+	uint32_t flags;
+	time_t fresh_until;
+	std::string key;
+	std::string url;
+	std::string etag;
+	std::string last_modified;
+	uint64_t raw_sz;
+};
+
+struct store_stats {
+	size_t found = 0;
+	size_t written = 0;
+	size_t overwritten = 0;
+	size_t loaded = 0;
+	size_t corrupt = 0;
+	bool started_over = false;
+};
+
+struct cache_store {
+
+	const char *path = nullptr;
+
+	int fd = -1;
+
+	uint8_t *data = nullptr;
+	size_t data_sz = 0;
+
+	uint64_t capacity = 0;
+
+	store_stats stats;
+
+	cache_store() {}
+	cache_store(const cache_store&) = delete;
+	cache_store& operator=(const cache_store&) = delete;
+
+	~cache_store() {
+		close();
+	}
+
+	bool opened() const {
+		return data != nullptr;
+	}
+
+	int open(const char *, uint64_t, std::vector<store_item> *);
+	void close();
+
+	int64_t append(const store_item&, const buffer_chain&, std::vector<uint64_t> *);
+
+	int load(uint64_t, buffer_chain *);
+
+	void kill(uint64_t);
+	void freshen(uint64_t, time_t);
+
+	bool holds(uint64_t) const;
+
+	uint64_t used() const;
+
+	store_header *header() const {
+		return (store_header *)data;
+	}
+
+	store_record *record(uint64_t) const;
+
+	void start_over();
+	void seal_header();
+	void seal_record(store_record *);
+
+	bool record_valid(uint64_t) const;
+	uint64_t next(uint64_t) const;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+/*
+ * hashed hierarchical timer wheel
+ *
+ * TIMER_LEVELS wheels of TIMER_SLOTS slots each, a slot of level l covering
+ * TIMER_SLOTS^l ticks of TIMER_TICK_MS. a timer goes into the lowest level
+ * whose span covers its delay and is cascaded down a level each time the
+ * level below wraps around to its slot, firing from level 0. slots are
+ * intrusive doubly linked lists, so arming and cancelling are O(1), and a
+ * tick costs the slot it fires plus one cascaded slot per wrapped level
+ * whatever the number of timers pending.
+ *
+ * a timer unlinks itself when destroyed, so the records it is embedded in
+ * can be freed while it is armed. fire gets the timer (owner says whose it
+ * is) and the context given to advance(), and may arm or destroy any timer,
+ * the fired one included.
+ *
+ */
+
+#define TIMER_TICK_MS   10
+#define TIMER_LEVELS    4
+#define TIMER_SLOT_BITS 8
+#define TIMER_SLOTS     (1 << TIMER_SLOT_BITS)
+
+struct timer_wheel;
+
+struct timer_link {
+	timer_link *prev = nullptr;
+	timer_link *next = nullptr;
+};
+
+struct timer : timer_link {
+
+	uint64_t expires = 0;
+
+	timer_wheel *wheel = nullptr;
+
+	void (*fire)(timer *, void *) = nullptr;
+	void *owner = nullptr;
+
+	timer() {}
+	timer(const timer&) = delete;
+	timer& operator=(const timer&) = delete;
+
+	~timer() {
+		cancel();
+	}
+
+	bool pending() const {
+		return prev != nullptr;
+	}
+
+	void cancel();
+};
+
+struct timer_wheel {
+
+	timer_link slots[TIMER_LEVELS][TIMER_SLOTS];
+
+	uint64_t now = 0;
+
+	size_t count = 0;
+
+	timer_wheel();
+	timer_wheel(const timer_wheel&) = delete;
+	timer_wheel& operator=(const timer_wheel&) = delete;
+
+	~timer_wheel();
+
+	void start(uint64_t);
+
+	void add(timer *, uint64_t);
+	void advance(uint64_t, void *);
+
+	int64_t next_ms() const;
+
+	void place(timer *);
+};
+
+uint64_t timer_clock_ms();
+uint64_t timer_clock_ns();
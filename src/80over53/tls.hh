@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+#include <openssl/ssl.h>
+
+#include <80over53/memory.hh>
+
+/*
+ * TLS for upstream connections
+ *
+ * a tls_stream runs OpenSSL over a pair of memory BIOs rather than the
+ * socket, so whichever loop moves the bytes (select or io_uring) moves only
+ * ciphertext: what arrives is fed in, what OpenSSL has to send is drained
+ * out and sent like any request bytes. handshake() steps the handshake as
+ * far as what was fed allows.
+ *
+ * streams come from one tls_context, the client SSL_CTX with the CA
+ * certificates upstreams are verified against, remembering the last session
+ * (ID or ticket) each backend gave, so after a backend's first connection
+ * every handshake to it is an abbreviated one. past TLS_SESSIONS_MAX
+ * backends the one resumed least recently is let go.
+ *
+ */
+
+#define TLS_SESSIONS_MAX 1024
+
+struct tls_stats {
+	size_t handshakes = 0;
+	size_t resumed = 0;
+	size_t failed = 0;
+	size_t tickets = 0;
+};
+
+struct tls_session {
+	SSL_SESSION *session = nullptr;
+	lru_link lru;
+};
+
+struct tls_context {
+
+	SSL_CTX *ctx = nullptr;
+
+	std::map<std::string, tls_session> sessions;
+	lru_list lru;
+
+	tls_stats stats;
+
+	tls_context() {}
+	tls_context(const tls_context&) = delete;
+	tls_context& operator=(const tls_context&) = delete;
+
+	~tls_context() {
+		teardown();
+	}
+
+	int setup(const char *);
+	void teardown();
+
+	SSL_SESSION *recall(const std::string&);
+	void remember(const std::string&, SSL_SESSION *);
+	void forget(const std::string&);
+};
+
+struct tls_stream {
+
+	tls_context *context = nullptr;
+
+	SSL *ssl = nullptr;
+	BIO *in = nullptr;
+	BIO *out = nullptr;
+
+	std::string backend;
+
+	bool counted = false;
+
+	tls_stream() {}
+	tls_stream(const tls_stream&) = delete;
+	tls_stream& operator=(const tls_stream&) = delete;
+
+	~tls_stream();
+
+	int start(tls_context *, const char *, const std::string&);
+
+	bool established() const {
+		return ssl != nullptr and SSL_is_init_finished(ssl);
+	}
+
+	bool resumed() const {
+		return ssl != nullptr and SSL_session_reused(ssl);
+	}
+
+	int handshake();
+
+	void feed(const void *, size_t);
+	void drain(std::string *);
+
+	int write(const void *, size_t);
+	ssize_t read(void *, size_t);
+};
+
+const char *tls_error_str();
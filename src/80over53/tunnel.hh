@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+#include <80over53/dns.hh>
+#include <80over53/fec.hh>
+#include <80over53/compress.hh>
+
+/*
+ * 80over53 tunnel protocol
+ * ========================
+ *
+ * queries carry a binary message base32 encoded into the labels in front
+ * of the tunnel zone, so 0x20 case randomization by resolvers is harmless.
+ *
+ *    <base32 labels>.<zone>  TXT, NULL or AAAA IN
+ *
+ * query message (network order)
+ *
+ *    op      : 8   PUT, GET, REPAIR or CLOSE
+ *    session : 32  chosen by the client
+ *    stream  : 16  one per request multiplexed over the session
+ *    nonce   : 16  defeats resolver caching of retransmissions
+ *    seq     : 32  PUT: byte offset of the fragment, GET: chunk number,
+ *                  REPAIR: block number (24) repair index (8)
+ *    arg     : 16  PUT: flags (FIN, and the codings accepted for the response),
+ *                  GET and REPAIR: chunk size in bytes
+ *    data    : *   PUT: request fragment
+ *
+ * each stream's request is uploaded as PUT fragments of the serialized
+ * http_request, the last one flagged FIN. the upstream response, compressed
+ * as one stream with a coding the PUTs accept unless its head shows it is
+ * compressed already (see compress.hh), is then
+ * fetched as fixed-size chunks, chunk n covering [n * size, (n + 1) * size),
+ * size at most what tunnel_reply::capacity() allows for the query type.
+ * REPAIR fetches a forward error correction chunk (see fec.hh) computed over
+ * the block of TUNNEL_FEC_WIDTH chunks numbered [block * width, (block + 1)
+ * * width), the last chunk zero-padded to full size, so a client rebuilds
+ * lost chunks from any width of a block's chunks instead of asking again.
+ * CLOSE forgets a stream, and the session with its last stream.
+ *
+ * reply message (payload)
+ *
+ *    status  : 8   ACK, DATA, PENDING, ERROR, and on DATA the response coding
+ *    total   : 32  response size once known, TUNNEL_TOTAL_UNKNOWN before
+ *    data    : *   GET: chunk bytes, REPAIR: repair chunk bytes
+ *
+ * the payload is packed as densely as the query type allows into a reply of
+ * at most DNS_MSG_MAX_SZ octets
+ *
+ *    TXT  : one RR, the payload split over as many 255-octet strings as needed
+ *    NULL : one RR, the payload as raw rdata
+ *    AAAA : a set of RRs, each prefix (3 bits, TUNNEL_AAAA_PREFIX) index (5)
+ *           then 15 octets of the payload preceded by its 16-bit size, so the
+ *           set survives resolvers reordering it
+ *
+ */
+
+#define TUNNEL_QUERY_HEADER_SZ 15
+#define TUNNEL_REPLY_HEADER_SZ 5
+
+#define TUNNEL_TOTAL_UNKNOWN 0xffffffff
+
+#define TUNNEL_FLAG_FIN     0x0001
+#define TUNNEL_FLAG_DEFLATE 0x0002
+#define TUNNEL_FLAG_ZSTD    0x0004
+
+#define TUNNEL_FEC_WIDTH 16
+#define TUNNEL_FEC_REPAIRS_MAX (FEC_SYMBOLS_MAX - TUNNEL_FEC_WIDTH)
+
+#define TUNNEL_STATUS_ACK     0x01
+#define TUNNEL_STATUS_DATA    0x02
+#define TUNNEL_STATUS_PENDING 0x04
+#define TUNNEL_STATUS_ERROR   0x08
+#define TUNNEL_STATUS_DEFLATE 0x10
+#define TUNNEL_STATUS_ZSTD    0x20
+
+#define TUNNEL_TXT_STRING_MAX_SZ 255
+
+#define TUNNEL_AAAA_PREFIX  0x20
+#define TUNNEL_AAAA_DATA_SZ 15
+
+#define TUNNEL_ANSWERS_MAX 32
+
+enum struct tunnel_op : uint8_t { PUT = 1, GET = 2, CLOSE = 3, REPAIR = 4 };
+
+const char *tunnel_op_str(tunnel_op);
+
+struct tunnel_query {
+
+	tunnel_op op = tunnel_op::GET;
+
+	dns_type qtype = dns_type::TXT;
+
+	uint32_t session = 0;
+	uint16_t stream = 0;
+	uint16_t nonce = 0;
+	uint32_t seq = 0;
+	uint16_t arg = 0;
+
+	uint8_t data[DNS_NAME_MAX_SZ];
+	size_t data_sz = 0;
+
+	int parse(const dns_question&, const char *);
+
+	ssize_t write(char *, size_t, const char *) const;
+
+	int sprint(char *, size_t) const;
+
+	static size_t capacity(const char *);
+};
+
+struct tunnel_reply {
+
+	uint8_t status = 0;
+	uint32_t total = TUNNEL_TOTAL_UNKNOWN;
+
+	const uint8_t *data = nullptr;
+	size_t data_sz = 0;
+
+	int parse(const void *, size_t);
+
+	ssize_t write(void *, size_t) const;
+
+	ssize_t pack(dns_type, dns_rr *, size_t) const;
+	int unpack(dns_type, const dns_rr *, size_t, void *, size_t);
+
+	static size_t capacity(dns_type, size_t);
+};
+
+bool tunnel_qtype(dns_type);
+
+uint16_t tunnel_coding_flag(coding);
+uint8_t tunnel_coding_status(coding);
+coding tunnel_status_coding(uint8_t);
+
+size_t base32_encoded_sz(size_t);
+size_t base32_decoded_sz(size_t);
+
+size_t base32_encode(const void *, size_t, char *);
+ssize_t base32_decode(const char *, size_t, void *, size_t);
+
+const char *tunnel_zone(const char *);
+
+int tunnel_peek_session(const void *, size_t, uint32_t *);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring over the raw system calls
+ *
+ * uring maps a ring pair: sqe() hands out a zeroed submission entry filled in
+ * by the caller, and submit() publishes every entry queued since (the tail
+ * stored once, after they are filled), passes them to the kernel and waits
+ * for completions in the same io_uring_enter, so a loop turn costs one
+ * system call however much it queued. completions are read in order with
+ * peek() and seen().
+ *
+ * entries linked into a chain go to the kernel together: reserve() makes
+ * room for the whole chain before its first entry, and a ring found full
+ * with a chain open isn't submitted, which would split it.
+ *
+ * uring_buffers is a provided buffer ring: count buffers of sz bytes the
+ * kernel picks from for receives flagged IOSQE_BUFFER_SELECT with its group,
+ * naming the one it used in the completion flags. a buffer is the caller's
+ * until recycled.
+ *
+ * setup() fails with -1 (errno set) on kernels without io_uring, or without
+ * what is used here: extended enter arguments and buffer rings (5.19).
+ *
+ */
+
+#define URING_NO_TIMEOUT -1
+
+struct uring {
+
+	int fd = -1;
+
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned *sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	unsigned tail = 0;
+
+	io_uring_sqe *sqes = nullptr;
+
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	unsigned cq_mask = 0;
+
+	io_uring_cqe *cqes = nullptr;
+
+	void *sq_ring = nullptr;
+	void *cq_ring = nullptr;
+	size_t sq_ring_sz = 0;
+	size_t cq_ring_sz = 0;
+	size_t sqes_sz = 0;
+
+	size_t enters = 0;
+	size_t submitted = 0;
+	size_t completed = 0;
+
+	uring() {}
+	uring(const uring&) = delete;
+	uring& operator=(const uring&) = delete;
+
+	~uring() {
+		teardown();
+	}
+
+	int setup(unsigned, unsigned);
+	void teardown();
+
+	io_uring_sqe *sqe(uint8_t, int, uint64_t);
+
+	unsigned space();
+	bool chained();
+	bool reserve(unsigned);
+
+	int submit(unsigned, int64_t);
+
+	io_uring_cqe *peek();
+	void seen();
+};
+
+struct uring_buffers {
+
+	uring *ring = nullptr;
+
+	io_uring_buf_ring *br = nullptr;
+	uint8_t *data = nullptr;
+
+	unsigned count = 0;
+	unsigned sz = 0;
+	uint16_t group = 0;
+
+	uring_buffers() {}
+	uring_buffers(const uring_buffers&) = delete;
+	uring_buffers& operator=(const uring_buffers&) = delete;
+
+	~uring_buffers() {
+		teardown();
+	}
+
+	int setup(uring *, uint16_t, unsigned, unsigned);
+	void teardown();
+
+	uint8_t *buffer(uint16_t id) {
+		return data + (size_t)id * sz;
+	}
+
+	void recycle(uint16_t);
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/*
+ * tunnel zones matched on wire-format names
+ *
+ * the zones are kept label-reversed in a trie of flat arrays, "t.256.bz" as
+ * bz -> 256 -> t, each node's children a sibling list. a question's name is
+ * walked once to find where its labels are, then matched from its last label
+ * towards its first without expanding or copying it, so a name under none of
+ * the zones is turned away after a few byte compares. where zones nest the
+ * deepest one wins.
+ *
+ */
+
+#define ZONE_NONE       -1
+#define ZONE_LABELS_MAX 128
+
+struct zone_trie {
+
+	struct node {
+		uint32_t label = 0;
+		int32_t child = -1;
+		int32_t sibling = -1;
+		int zone = ZONE_NONE;
+	};
+
+	/*
+	 * nodes[0] is the root, a node's label is at labels[label], its size
+	 * byte then the label in lower case
+	 */
+
+	std::vector<node> nodes = std::vector<node>(1);
+	std::string labels;
+
+	int add(const char *, int);
+
+	int match(size_t, const void *, size_t, ssize_t *) const;
+};
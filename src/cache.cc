@@ -0,0 +1,718 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <strings.h>
+
+#include <algorithm>
+
+#include <80over53/cache.hh>
+
+#define dfprintf(...)
+
+/*
+ * what a response head says about keeping it
+ */
+
+struct response_policy {
+
+	int status = 0;
+
+	bool no_store = false;
+	bool no_cache = false;
+	bool shared = true;
+	bool set_cookie = false;
+
+	long max_age = -1;
+	long s_maxage = -1;
+	long age = 0;
+
+	time_t date = 0;
+	time_t expires = 0;
+	bool has_expires = false;
+
+	std::string etag;
+	std::string last_modified;
+
+	std::vector<std::string> vary;
+	bool vary_any = false;
+
+	int parse(const char *, size_t);
+
+	bool explicit_lifetime() const {
+		return s_maxage >= 0 or max_age >= 0 or has_expires;
+	}
+
+	long lifetime(time_t) const;
+};
+
+/*
+ * an HTTP-date, 0 if it isn't one
+ */
+
+static time_t http_date(const std::string& s) {
+
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+
+	const char *end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	return end != nullptr ? timegm(&tm) : 0;
+}
+
+static std::string trim(const std::string& s) {
+
+	const size_t start = s.find_first_not_of(" \t");
+
+	if(start == std::string::npos)
+		return "";
+
+	return s.substr(start, s.find_last_not_of(" \t") + 1 - start);
+}
+
+/*
+ * the comma separated items of a header value, trimmed
+ */
+
+static std::vector<std::string> header_items(const std::string& value) {
+
+	std::vector<std::string> items;
+
+	for(size_t i = 0; i <= value.size(); ) {
+
+		size_t comma = value.find(',', i);
+
+		if(comma == std::string::npos)
+			comma = value.size();
+
+		std::string item = trim(value.substr(i, comma - i));
+
+		if(not item.empty())
+			items.push_back(item);
+
+		i = comma + 1;
+	}
+
+	return items;
+}
+
+static bool header_find(const http_headers& headers, const char *name, std::string *value) {
+
+	for(const auto& x : headers) {
+		if(strcasecmp(x.first.c_str(), name) == 0) {
+			if(value != nullptr)
+				*value = x.second;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static long directive_seconds(const std::string& item, const char *name) {
+
+	const size_t n = strlen(name);
+
+	if(strncasecmp(item.c_str(), name, n) != 0 or item[n] != '=')
+		return -2;
+
+	const char *value = item.c_str() + n + 1;
+
+	if(*value == '"')
+		value++;
+
+	return isdigit((unsigned char)*value) ? strtol(value, nullptr, 10) : -2;
+}
+
+int response_policy::parse(const char *data, size_t data_sz) {
+
+	std::string s(data, data_sz);
+
+	size_t head_end = s.find("\r\n\r\n");
+
+	if(head_end == std::string::npos)
+		head_end = s.size();
+
+	status = s.size() > 12 ? atoi(s.c_str() + 9) : 0;
+
+	for(size_t i = s.find("\r\n"); i < head_end; ) {
+
+		i += 2;
+
+		size_t eol = std::min(s.find("\r\n", i), head_end);
+
+		std::string line = s.substr(i, eol - i);
+
+		i = eol;
+
+		size_t colon = line.find(':');
+		if(colon == std::string::npos)
+			continue;
+
+		std::string name = line.substr(0, colon);
+		std::string value = trim(line.substr(colon + 1));
+
+		if(strcasecmp(name.c_str(), "Cache-Control") == 0) {
+
+			for(const std::string& item : header_items(value)) {
+
+				long seconds;
+
+				if(strncasecmp(item.c_str(), "no-store", 8) == 0)
+					no_store = true;
+				else if(strncasecmp(item.c_str(), "no-cache", 8) == 0)
+					no_cache = true;
+				else if(strncasecmp(item.c_str(), "private", 7) == 0)
+					shared = false;
+				else if((seconds = directive_seconds(item, "s-maxage")) != -2)
+					s_maxage = seconds;
+				else if((seconds = directive_seconds(item, "max-age")) != -2)
+					max_age = seconds;
+			}
+
+		} else if(strcasecmp(name.c_str(), "Pragma") == 0) {
+			no_cache = no_cache or strcasestr(value.c_str(), "no-cache") != nullptr;
+		} else if(strcasecmp(name.c_str(), "Expires") == 0) {
+			expires = http_date(value);
+			has_expires = true;
+		} else if(strcasecmp(name.c_str(), "Date") == 0) {
+			date = http_date(value);
+		} else if(strcasecmp(name.c_str(), "Age") == 0) {
+			age = strtol(value.c_str(), nullptr, 10);
+		} else if(strcasecmp(name.c_str(), "ETag") == 0) {
+			etag = value;
+		} else if(strcasecmp(name.c_str(), "Last-Modified") == 0) {
+			last_modified = value;
+		} else if(strcasecmp(name.c_str(), "Set-Cookie") == 0) {
+			set_cookie = true;
+		} else if(strcasecmp(name.c_str(), "Vary") == 0) {
+			for(const std::string& item : header_items(value)) {
+				if(item == "*")
+					vary_any = true;
+				else
+					vary.push_back(item);
+			}
+		}
+	}
+
+	return status;
+}
+
+/*
+ * seconds fresh from now, 0 or less for stale already
+ */
+
+long response_policy::lifetime(time_t now) const {
+
+	long seconds = 0;
+
+	const time_t origin = date != 0 ? date : now;
+
+	if(s_maxage >= 0)
+		seconds = s_maxage;
+	else if(max_age >= 0)
+		seconds = max_age;
+	else if(has_expires)
+		seconds = expires != 0 ? (long)(expires - origin) : 0;
+	else if(time_t modified = last_modified.empty() ? 0 : http_date(last_modified))
+		seconds = modified < origin ? std::min((long)(origin - modified) / 10, (long)CACHE_HEURISTIC_MAX_S) : 0;
+
+	return seconds - age;
+}
+
+/*
+ * the key of the variant of url these request headers select
+ */
+
+static std::string cache_key(const std::vector<std::string> *vary, const std::string& url, const http_headers& headers) {
+
+	std::string key = url;
+
+	if(vary == nullptr)
+		return key;
+
+	for(const std::string& name : *vary) {
+
+		std::string value;
+
+		header_find(headers, name.c_str(), &value);
+
+		key += '\n';
+		for(char c : name)
+			key += tolower((unsigned char)c);
+		key += ": ";
+		key += value;
+	}
+
+	return key;
+}
+
+size_t cache_entry::footprint() const {
+
+	size_t sz = sizeof(*this) + key.capacity() + url.capacity() + raw.footprint() + etag.capacity() + last_modified.capacity();
+
+	for(const buffer_chain& x : coded)
+		sz += x.footprint();
+
+	return sz;
+}
+
+/*
+ * where request stands with the cache at now: gone around it, a miss, a
+ * fresh entry to answer with, or a stale one to revalidate. fill is what
+ * the fetch for a miss or a stale entry is to keep.
+ */
+
+cache_lookup http_cache::lookup(const http_request& request, time_t now, cache_entry **found, cache_fill *fill) {
+
+	static const char *bypassing[] = {
+		"Authorization", "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since", "If-Range", "Range"
+	};
+
+	const std::string url = request.url();
+
+	std::string value;
+
+	*found = nullptr;
+
+	if(request.method == http_method::POST or request.method == http_method::PUT or request.method == http_method::DELETE) {
+		invalidate(url);
+		return cache_lookup::BYPASS;
+	}
+
+	bool bypass = request.method != http_method::GET;
+
+	for(const char *name : bypassing)
+		bypass = bypass or header_find(request.headers, name, nullptr);
+
+	bool revalidate = false;
+
+	if(header_find(request.headers, "Cache-Control", &value)) {
+		for(const std::string& item : header_items(value)) {
+			bypass = bypass or strcasecmp(item.c_str(), "no-store") == 0;
+			revalidate = revalidate or strcasecmp(item.c_str(), "no-cache") == 0 or directive_seconds(item, "max-age") == 0;
+		}
+	}
+
+	if(header_find(request.headers, "Pragma", &value))
+		revalidate = revalidate or strcasestr(value.c_str(), "no-cache") != nullptr;
+
+	if(bypass) {
+		stats.bypassed++;
+		return cache_lookup::BYPASS;
+	}
+
+	fill->url = url;
+	fill->headers = request.headers;
+	fill->revalidating.clear();
+
+	auto v = vary.find(url);
+
+	auto x = entries.find(cache_key(v != vary.end() ? &v->second : nullptr, url, request.headers));
+
+	if(x == entries.end()) {
+		stats.misses++;
+		return cache_lookup::MISS;
+	}
+
+	cache_entry& entry = x->second;
+
+	if(not load(&entry)) {
+		stats.misses++;
+		return cache_lookup::MISS;
+	}
+
+	if(not revalidate and not entry.no_cache and now < entry.fresh_until) {
+
+		stats.hits++;
+		entry.hits++;
+
+		lru.touch(&entry.lru);
+
+		*found = &entry;
+
+		return cache_lookup::FRESH;
+	}
+
+	if(entry.etag.empty() and entry.last_modified.empty()) {
+		stats.misses++;
+		return cache_lookup::MISS;
+	}
+
+	fill->revalidating = entry.key;
+
+	*found = &entry;
+
+	return cache_lookup::STALE;
+}
+
+/*
+ * make request conditional on the entry it revalidates
+ */
+
+void http_cache::ask(const cache_entry& entry, http_request *request) const {
+
+	if(not entry.etag.empty())
+		request->headers["If-None-Match"] = entry.etag;
+
+	if(not entry.last_modified.empty())
+		request->headers["If-Modified-Since"] = entry.last_modified;
+}
+
+/*
+ * the entry coded for the tunnel with method, coded now if it wasn't yet,
+ * nullptr if that fails
+ */
+
+const buffer_chain *http_cache::coded(cache_entry& entry, coding method) {
+
+	if(method == coding::IDENTITY)
+		return &entry.raw;
+
+	if((int)method >= CACHE_CODINGS)
+		return nullptr;
+
+	buffer_chain& out = entry.coded[(int)method];
+
+	if(not out.empty())
+		return &out;
+
+	compressor z;
+
+	int result = z.begin(method);
+
+	for(size_t offset = 0; result != -1; ) {
+
+		const chain_slice s = entry.raw.slice(offset);
+
+		offset += s.sz;
+
+		result = z.update(s.segment != nullptr ? s.data() : nullptr, s.sz, &out, offset == entry.raw.size());
+
+		if(offset == entry.raw.size())
+			break;
+	}
+
+	if(result == -1) {
+		out.clear();
+		return nullptr;
+	}
+
+	charge(&entry);
+
+	return &out;
+}
+
+/*
+ * keep the raw response fetched for fill (taken from raw) if it may be
+ * kept, in place of the entry it revalidated or another of its variant
+ */
+
+cache_entry *http_cache::store(const cache_fill& fill, buffer_chain& raw, time_t now) {
+
+	response_policy policy;
+
+	const std::string head = raw.str(0, HTTP_HEAD_MAX_SZ);
+
+	policy.parse(head.data(), head.size());
+
+	static const int cacheable_statuses[] = { 200, 203, 300, 301, 308, 404, 410 };
+
+	const bool status_ok = std::find(std::begin(cacheable_statuses), std::end(cacheable_statuses), policy.status) != std::end(cacheable_statuses);
+
+	const long lifetime = policy.lifetime(now);
+
+	if(not fill.revalidating.empty()) {
+
+		auto x = entries.find(fill.revalidating);
+
+		if(x != entries.end()) {
+			stats.changed++;
+			forget(&x->second);
+		}
+	}
+
+	if(not status_ok or policy.no_store or not policy.shared or policy.set_cookie or policy.vary_any
+			or (lifetime <= 0 and policy.etag.empty() and policy.last_modified.empty())
+			or raw.size() > limit / CACHE_ENTRY_SHARE) {
+		stats.uncacheable++;
+		return nullptr;
+	}
+
+	std::vector<std::string>& names = vary[fill.url];
+
+	names = policy.vary;
+
+	const std::string key = cache_key(&names, fill.url, fill.headers);
+
+	auto x = entries.find(key);
+
+	if(x != entries.end())
+		forget(&x->second);
+
+	cache_entry& entry = entries[key];
+
+	entry.key = key;
+	entry.url = fill.url;
+	entry.raw.swap(raw);
+	entry.compressible = http_response_compressible(head.data(), head.size());
+	entry.fresh_until = now + std::max(lifetime, 0L);
+	entry.no_cache = policy.no_cache;
+	entry.etag = policy.etag;
+	entry.last_modified = policy.last_modified;
+
+	entry.lru.owner = &entry;
+	lru.touch(&entry.lru);
+
+	charge(&entry);
+	write(&entry);
+
+	stats.stored++;
+
+	dfprintf(stderr, "cache: stored %s (%ld bytes, fresh %lds)\n", key.c_str(), (long)entry.raw.size(), lifetime);
+
+	while(size > limit and evict())
+		;
+
+	return entries.find(key) != entries.end() ? &entries[key] : nullptr;
+}
+
+/*
+ * the 304 head in data freshens the entry under key, nullptr if it is gone
+ */
+
+cache_entry *http_cache::refresh(const std::string& key, const char *data, size_t data_sz, time_t now) {
+
+	auto x = entries.find(key);
+
+	if(x == entries.end())
+		return nullptr;
+
+	cache_entry& entry = x->second;
+
+	if(not load(&entry))
+		return nullptr;
+
+	response_policy policy;
+
+	policy.parse(data, data_sz);
+
+	if(policy.explicit_lifetime()) {
+		entry.fresh_until = now + std::max(policy.lifetime(now), 0L);
+		disk.freshen(entry.offset, entry.fresh_until);
+	}
+
+	entry.no_cache = entry.no_cache or policy.no_cache;
+
+	if(not policy.etag.empty())
+		entry.etag = policy.etag;
+
+	stats.revalidated++;
+	entry.hits++;
+
+	lru.touch(&entry.lru);
+
+	return &entry;
+}
+
+/*
+ * drop every variant kept for url
+ */
+
+void http_cache::invalidate(const std::string& url) {
+
+	for(auto x = entries.lower_bound(url); x != entries.end() and x->first.compare(0, url.size(), url) == 0; ) {
+
+		cache_entry& entry = x->second;
+
+		x++;
+
+		if(entry.url == url)
+			forget(&entry);
+	}
+}
+
+void http_cache::forget(cache_entry *entry) {
+
+	size -= entry->memory.total();
+
+	if(entry->offset != -1) {
+		disk.kill(entry->offset);
+		persisted.erase(entry->offset);
+	}
+
+	entries.erase(entry->key);
+}
+
+/*
+ * let the least recently used entry go from memory, false if there is none.
+ * one the file still holds is only unloaded.
+ */
+
+bool http_cache::evict() {
+
+	lru_link *x = lru.oldest();
+
+	if(x == nullptr)
+		return false;
+
+	cache_entry *entry = (cache_entry *)x->owner;
+
+	if(entry->offset == -1) {
+		stats.evicted++;
+		forget(entry);
+		return true;
+	}
+
+	entry->raw.clear();
+
+	for(buffer_chain& coded : entry->coded)
+		coded.clear();
+
+	entry->loaded = false;
+	entry->lru.unlink();
+
+	charge(entry);
+
+	stats.unloaded++;
+
+	return true;
+}
+
+/*
+ * open path as the cache's file, taking in the entries it holds (unloaded),
+ * the later of two under one key winning
+ */
+
+int http_cache::persist(const char *path) {
+
+	std::vector<store_item> items;
+
+	if(disk.open(path, limit, &items) == -1)
+		return -1;
+
+	for(const store_item& item : items) {
+
+		auto x = entries.find(item.key);
+
+		if(x != entries.end())
+			forget(&x->second);
+
+		cache_entry& entry = entries[item.key];
+
+		entry.key = item.key;
+		entry.url = item.url;
+		entry.compressible = item.flags & STORE_COMPRESSIBLE;
+		entry.fresh_until = item.fresh_until;
+		entry.no_cache = item.flags & STORE_NO_CACHE;
+		entry.etag = item.etag;
+		entry.last_modified = item.last_modified;
+		entry.offset = item.offset;
+		entry.loaded = false;
+		entry.lru.owner = &entry;
+
+		persisted[item.offset] = item.key;
+
+		/*
+		 * the names the url varies on are those the key has lines for
+		 */
+
+		std::vector<std::string>& names = vary[item.url];
+
+		names.clear();
+
+		for(size_t i = item.key.find('\n'); i != std::string::npos; i = item.key.find('\n', i + 1))
+			names.push_back(item.key.substr(i + 1, item.key.find(':', i) - i - 1));
+
+		charge(&entry);
+
+		stats.restored++;
+	}
+
+	return 0;
+}
+
+/*
+ * bring an entry's raw response in from the file if it isn't in memory,
+ * false (and the entry gone) if the file no longer has it whole
+ */
+
+bool http_cache::load(cache_entry *entry) {
+
+	if(entry->loaded)
+		return true;
+
+	if(disk.load(entry->offset, &entry->raw) == -1) {
+		forget(entry);
+		return false;
+	}
+
+	entry->loaded = true;
+
+	lru.touch(&entry->lru);
+
+	charge(entry);
+
+	while(size > limit and lru.oldest() != &entry->lru and evict())
+		;
+
+	return true;
+}
+
+/*
+ * write an entry through to the file, the entries whose records that
+ * overwrites dropped unless in memory
+ */
+
+void http_cache::write(cache_entry *entry) {
+
+	if(not disk.opened())
+		return;
+
+	store_item item;
+
+	item.flags = (entry->compressible ? STORE_COMPRESSIBLE : 0) | (entry->no_cache ? STORE_NO_CACHE : 0);
+	item.fresh_until = entry->fresh_until;
+	item.key = entry->key;
+	item.url = entry->url;
+	item.etag = entry->etag;
+	item.last_modified = entry->last_modified;
+
+	std::vector<uint64_t> dropped;
+
+	entry->offset = disk.append(item, entry->raw, &dropped);
+
+	if(entry->offset != -1)
+		persisted[entry->offset] = entry->key;
+
+	for(uint64_t offset : dropped) {
+
+		auto x = persisted.find(offset);
+
+		if(x == persisted.end())
+			continue;
+
+		auto y = entries.find(x->second);
+
+		persisted.erase(x);
+
+		if(y == entries.end() or y->second.offset != (int64_t)offset)
+			continue;
+
+		y->second.offset = -1;
+
+		if(not y->second.loaded)
+			forget(&y->second);
+	}
+}
+
+void http_cache::charge(cache_entry *entry) {
+
+	size -= entry->memory.total();
+
+	entry->memory.set(budget, memory_category::CACHE, entry->footprint());
+
+	size += entry->memory.total();
+}
@@ -0,0 +1,343 @@
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <80over53/dns.hh>
+#include <80over53/capture.hh>
+
+#define dfprintf(...)
+
+#define PCAP_FILE_HEADER_SZ   24
+#define PCAP_RECORD_HEADER_SZ 16
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+
+#define IPPROTO_UDP_ 17
+
+const char *capture_format_str(capture_format x) {
+	switch(x) {
+		case capture_format::RAW:    return "RAW";
+		case capture_format::FRAMED: return "FRAMED";
+		case capture_format::PCAP:   return "PCAP";
+	}
+
+	return nullptr;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t *p, bool swapped) {
+
+	uint32_t x;
+
+	memcpy(&x, p, sizeof(x));
+
+	return swapped ? __builtin_bswap32(x) : x;
+}
+
+/*
+ * a RAW file is FRAMED only if the 16-bit length prefixes tile the whole file
+ */
+
+static bool is_framed(const uint8_t *data, size_t data_sz) {
+
+	size_t offset = 0;
+
+	while(offset + 2 <= data_sz) {
+
+		size_t sz = get_u16(data + offset);
+
+		if(sz < sizeof(dns_header))
+			return false;
+
+		offset += 2 + sz;
+	}
+
+	return offset == data_sz;
+}
+
+int capture_file::open(const char *my_path) {
+
+	struct stat st;
+
+	path = my_path;
+
+	fd = ::open(path, O_RDONLY);
+	if(fd == -1)
+		return -1;
+
+	if(fstat(fd, &st) == -1) {
+		close();
+		return -1;
+	}
+
+	data_sz = st.st_size;
+
+	if(data_sz == 0) {
+		errno = ENODATA;
+		close();
+		return -1;
+	}
+
+	void *p = mmap(nullptr, data_sz, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if(p == MAP_FAILED) {
+		data = nullptr;
+		close();
+		return -1;
+	}
+
+	data = (const uint8_t *)p;
+
+	madvise(p, data_sz, MADV_SEQUENTIAL);
+
+	if(data_sz >= PCAP_FILE_HEADER_SZ) {
+
+		uint32_t magic;
+
+		memcpy(&magic, data, sizeof(magic));
+
+		if(magic == PCAP_MAGIC or magic == PCAP_MAGIC_NSEC) {
+			format = capture_format::PCAP;
+			swapped = false;
+			nsec = (magic == PCAP_MAGIC_NSEC);
+		} else if(magic == __builtin_bswap32(PCAP_MAGIC) or magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+			format = capture_format::PCAP;
+			swapped = true;
+			nsec = (magic == __builtin_bswap32(PCAP_MAGIC_NSEC));
+		}
+
+		if(format == capture_format::PCAP) {
+			linktype = get_u32(data + 20, swapped) & 0x0fffffff;
+			return 0;
+		}
+	}
+
+	format = is_framed(data, data_sz) ? capture_format::FRAMED : capture_format::RAW;
+
+	return 0;
+}
+
+void capture_file::close() {
+
+	if(data != nullptr) {
+		munmap((void *)data, data_sz);
+		data = nullptr;
+	}
+
+	if(fd != -1) {
+		::close(fd);
+		fd = -1;
+	}
+
+	data_sz = 0;
+}
+
+size_t capture_file::begin() const {
+	return format == capture_format::PCAP ? PCAP_FILE_HEADER_SZ : 0;
+}
+
+/*
+ * strip link, network and transport headers from a captured frame, leaving
+ * packet->data pointing at the UDP payload. non-UDP frames yield no data.
+ * an IPv4 total length of 0, as segmentation offload leaves it, takes the
+ * captured size.
+ */
+
+static void decapsulate(uint32_t linktype, const uint8_t *p, size_t sz, capture_packet *packet) {
+
+	uint16_t ethertype;
+
+	switch(linktype) {
+
+		case PCAP_LINKTYPE_NULL:
+
+			if(sz < 4)
+				return;
+
+			ethertype = (p[0] == 2 or p[3] == 2) ? ETHERTYPE_IPV4 : ETHERTYPE_IPV6;
+			p += 4;
+			sz -= 4;
+			break;
+
+		case PCAP_LINKTYPE_EN10MB:
+
+			if(sz < 14)
+				return;
+
+			ethertype = get_u16(p + 12);
+			p += 14;
+			sz -= 14;
+
+			while(ethertype == ETHERTYPE_VLAN and sz >= 4) {
+				ethertype = get_u16(p + 2);
+				p += 4;
+				sz -= 4;
+			}
+			break;
+
+		case PCAP_LINKTYPE_LINUX_SLL:
+
+			if(sz < 16)
+				return;
+
+			ethertype = get_u16(p + 14);
+			p += 16;
+			sz -= 16;
+			break;
+
+		case PCAP_LINKTYPE_RAW:
+
+			if(sz < 1)
+				return;
+
+			ethertype = (p[0] >> 4) == 4 ? ETHERTYPE_IPV4 : ETHERTYPE_IPV6;
+			break;
+
+		default:
+
+			return;
+	}
+
+	memset(&packet->from, 0, sizeof(packet->from));
+
+	if(ethertype == ETHERTYPE_IPV4) {
+
+		if(sz < 20 or (p[0] >> 4) != 4)
+			return;
+
+		size_t ihl = (p[0] & 0x0f) * 4;
+
+		if(ihl < 20 or sz < ihl or p[9] != IPPROTO_UDP_)
+			return;
+
+		if((get_u16(p + 6) & 0x3fff) != 0)
+			return;
+
+		sockaddr_in *sin = (sockaddr_in *)&packet->from;
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, p + 12, 4);
+
+		const size_t total_sz = get_u16(p + 2);
+
+		if(total_sz != 0) {
+
+			if(total_sz < ihl)
+				return;
+
+			sz = std::min(sz, total_sz);
+		}
+
+		p += ihl;
+		sz -= ihl;
+
+	} else if(ethertype == ETHERTYPE_IPV6) {
+
+		if(sz < 40 or (p[0] >> 4) != 6 or p[6] != IPPROTO_UDP_)
+			return;
+
+		sockaddr_in6 *sin6 = (sockaddr_in6 *)&packet->from;
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, p + 8, 16);
+
+		sz = std::min(sz - 40, (size_t)get_u16(p + 4));
+
+		p += 40;
+
+	} else {
+
+		return;
+	}
+
+	if(sz < 8)
+		return;
+
+	uint16_t sport = get_u16(p);
+	size_t udp_sz = get_u16(p + 4);
+
+	if(udp_sz < 8 or udp_sz > sz)
+		return;
+
+	if(packet->from.ss_family == AF_INET)
+		((sockaddr_in *)&packet->from)->sin_port = htons(sport);
+	else
+		((sockaddr_in6 *)&packet->from)->sin6_port = htons(sport);
+
+	packet->dport = get_u16(p + 2);
+	packet->data = p + 8;
+	packet->data_sz = udp_sz - 8;
+}
+
+/*
+ * read the record at offset into packet, returning the offset of the record
+ * that follows or -1 if the file is truncated. packet->data is nullptr for
+ * records that do not carry a UDP payload.
+ */
+
+ssize_t capture_file::next(size_t offset, capture_packet *packet) const {
+
+	packet->data = nullptr;
+	packet->data_sz = 0;
+	packet->dport = 0;
+
+	switch(format) {
+
+		case capture_format::RAW:
+
+			if(offset != 0)
+				return -1;
+
+			packet->data = data;
+			packet->data_sz = data_sz;
+
+			return data_sz;
+
+		case capture_format::FRAMED:
+
+			if(offset + 2 > data_sz)
+				return -1;
+
+			packet->data_sz = get_u16(data + offset);
+			packet->data = data + offset + 2;
+
+			if(offset + 2 + packet->data_sz > data_sz)
+				return -1;
+
+			return offset + 2 + packet->data_sz;
+
+		case capture_format::PCAP:
+
+			if(offset + PCAP_RECORD_HEADER_SZ > data_sz)
+				return -1;
+
+			const uint8_t *record = data + offset;
+
+			size_t incl_len = get_u32(record + 8, swapped);
+
+			if(offset + PCAP_RECORD_HEADER_SZ + incl_len > data_sz)
+				return -1;
+
+			packet->ts.tv_sec = get_u32(record, swapped);
+			packet->ts.tv_usec = get_u32(record + 4, swapped) / (nsec ? 1000 : 1);
+
+			decapsulate(linktype, record + PCAP_RECORD_HEADER_SZ, incl_len, packet);
+
+			dfprintf(stderr, "pcap record @ %d (%d) udp payload (%d)\n", (int)offset, (int)incl_len, (int)packet->data_sz);
+
+			return offset + PCAP_RECORD_HEADER_SZ + incl_len;
+	}
+
+	return -1;
+}
@@ -0,0 +1,493 @@
+#include <cstring>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <80over53/chain.hh>
+
+#define dfprintf(...)
+
+struct chain_pool;
+
+struct chain_slab {
+	chain_pool *pool;
+	chain_segment segments[CHAIN_SLAB_SEGMENTS];
+};
+
+/*
+ * a thread's segments: the free ones, those other threads let go of
+ * meanwhile, and the open one writes are carved out of, held by the pool
+ * while open. out counts those taken and not back yet, the pool deleted
+ * once its thread is gone and out comes down to 0.
+ */
+
+struct chain_pool {
+
+	chain_segment *free = nullptr;
+	size_t free_count = 0;
+
+	chain_segment *open = nullptr;
+
+	std::mutex lock;
+	chain_segment *returned = nullptr;
+	size_t out = 0;
+	bool exited = false;
+
+	chain_segment *take();
+	void give(chain_segment *);
+	void give_back(chain_segment *);
+	void reclaim();
+	void trim();
+	void exit();
+};
+
+struct chain_pool_owner {
+
+	chain_pool *pool = nullptr;
+
+	chain_pool& get() {
+		if(pool == nullptr)
+			pool = new chain_pool;
+		return *pool;
+	}
+
+	~chain_pool_owner() {
+		if(pool != nullptr) {
+			chain_pool *p = pool;
+			pool = nullptr;
+			p->exit();
+		}
+	}
+};
+
+static thread_local chain_pool_owner owner;
+
+chain_segment *chain_pool::take() {
+
+	if(free == nullptr)
+		reclaim();
+
+	if(free == nullptr) {
+
+		chain_slab *slab = new chain_slab;
+
+		slab->pool = this;
+
+		for(chain_segment& s : slab->segments) {
+			s.slab = slab;
+			s.next_free = free;
+			free = &s;
+		}
+
+		free_count += CHAIN_SLAB_SEGMENTS;
+
+		dfprintf(stderr, "chain: new slab %p\n", (void *)slab);
+	}
+
+	chain_segment *s = free;
+
+	free = s->next_free;
+	free_count--;
+
+	s->next_free = nullptr;
+	s->refs.store(1, std::memory_order_relaxed);
+	s->used = 0;
+
+	std::lock_guard<std::mutex> guard(lock);
+	out++;
+
+	return s;
+}
+
+/*
+ * a segment let go of on the pool's own thread
+ */
+
+void chain_pool::give(chain_segment *s) {
+
+	s->next_free = free;
+	free = s;
+	free_count++;
+
+	std::lock_guard<std::mutex> guard(lock);
+	out--;
+}
+
+/*
+ * a segment let go of on another thread, the pool deleted with it if it was
+ * the last one its gone thread left out
+ */
+
+void chain_pool::give_back(chain_segment *s) {
+
+	bool last;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		s->next_free = returned;
+		returned = s;
+
+		last = --out == 0 and exited;
+	}
+
+	if(last) {
+		reclaim();
+		trim();
+		delete this;
+	}
+}
+
+/*
+ * take the segments other threads gave back into the free list
+ */
+
+void chain_pool::reclaim() {
+
+	chain_segment *s;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		s = returned;
+		returned = nullptr;
+	}
+
+	while(s != nullptr) {
+		chain_segment *next = s->next_free;
+		s->next_free = free;
+		free = s;
+		free_count++;
+		s = next;
+	}
+}
+
+/*
+ * free the slabs whose segments are all on the free list
+ */
+
+void chain_pool::trim() {
+
+	reclaim();
+
+	std::map<chain_slab *, size_t> counts;
+
+	for(chain_segment *s = free; s != nullptr; s = s->next_free)
+		counts[s->slab]++;
+
+	chain_segment **p = &free;
+
+	while(*p != nullptr) {
+		if(counts[(*p)->slab] == CHAIN_SLAB_SEGMENTS) {
+			*p = (*p)->next_free;
+			free_count--;
+		} else {
+			p = &(*p)->next_free;
+		}
+	}
+
+	for(const auto& x : counts)
+		if(x.second == CHAIN_SLAB_SEGMENTS)
+			delete x.first;
+}
+
+/*
+ * the pool's thread is gone: free what can be, the rest when it comes back
+ */
+
+void chain_pool::exit() {
+
+	if(open != nullptr) {
+		chain_segment *s = open;
+		open = nullptr;
+		chain_release(s);
+	}
+
+	trim();
+
+	bool last;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		exited = true;
+		last = out == 0;
+	}
+
+	if(last) {
+		trim();
+		delete this;
+	}
+}
+
+/*
+ * room for at least min bytes, CHAIN_SEGMENT_SZ at most: what is left of the
+ * thread's open segment, or a new one opened. the slice returned holds the
+ * segment, all of its room until chain_wrote says how much of it was
+ * written, which must come before room is asked for again.
+ */
+
+chain_slice chain_room(size_t min) {
+
+	chain_pool& pool = owner.get();
+
+	min = std::min(min, (size_t)CHAIN_SEGMENT_SZ);
+
+	if(pool.open != nullptr and CHAIN_SEGMENT_SZ - pool.open->used < min) {
+		chain_segment *s = pool.open;
+		pool.open = nullptr;
+		chain_release(s);
+	}
+
+	if(pool.open == nullptr)
+		pool.open = pool.take();
+
+	chain_hold(pool.open);
+
+	chain_slice room;
+
+	room.segment = pool.open;
+	room.offset = pool.open->used;
+	room.sz = CHAIN_SEGMENT_SZ - pool.open->used;
+
+	return room;
+}
+
+void chain_wrote(chain_slice *room, size_t sz) {
+	room->sz = std::min(sz, (size_t)room->sz);
+	room->segment->used = room->offset + room->sz;
+}
+
+void chain_hold(chain_segment *s) {
+	s->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void chain_release(chain_segment *s) {
+
+	if(s->refs.fetch_sub(1, std::memory_order_acq_rel) > 1)
+		return;
+
+	chain_pool *pool = s->slab->pool;
+
+	if(pool == owner.pool)
+		pool->give(s);
+	else
+		pool->give_back(s);
+}
+
+size_t chain_pool_footprint() {
+	return owner.pool == nullptr ? 0 : owner.pool->free_count * sizeof(chain_segment);
+}
+
+void chain_pool_trim() {
+	if(owner.pool != nullptr)
+		owner.pool->trim();
+}
+
+buffer_chain::buffer_chain(const buffer_chain& other) {
+	*this = other;
+}
+
+/*
+ * share other's segments
+ */
+
+buffer_chain& buffer_chain::operator=(const buffer_chain& other) {
+
+	if(this == &other)
+		return *this;
+
+	clear();
+
+	for(const chain_slice& s : other.slices)
+		chain_hold(s.segment);
+
+	slices = other.slices;
+	ends = other.ends;
+	sz = other.sz;
+
+	return *this;
+}
+
+void buffer_chain::clear() {
+
+	for(const chain_slice& s : slices)
+		chain_release(s.segment);
+
+	std::vector<chain_slice>().swap(slices);
+	std::vector<size_t>().swap(ends);
+
+	sz = 0;
+}
+
+void buffer_chain::swap(buffer_chain& other) {
+	slices.swap(other.slices);
+	ends.swap(other.ends);
+	std::swap(sz, other.sz);
+}
+
+/*
+ * append s by reference, extending the last slice if s follows it
+ */
+
+void buffer_chain::append(const chain_slice& s) {
+
+	if(s.sz == 0)
+		return;
+
+	sz += s.sz;
+
+	if(not slices.empty()) {
+
+		chain_slice& last = slices.back();
+
+		if(last.segment == s.segment and last.offset + last.sz == s.offset) {
+			last.sz += s.sz;
+			ends.back() = sz;
+			return;
+		}
+	}
+
+	chain_hold(s.segment);
+
+	slices.push_back(s);
+	ends.push_back(sz);
+}
+
+/*
+ * append a copy of data
+ */
+
+void buffer_chain::append(const void *data, size_t data_sz) {
+
+	const uint8_t *p = (const uint8_t *)data;
+
+	while(data_sz > 0) {
+
+		chain_slice room = chain_room(std::min(data_sz, (size_t)CHAIN_ROOM_MIN));
+
+		const size_t n = std::min(data_sz, (size_t)room.sz);
+
+		memcpy(room.data(), p, n);
+		chain_wrote(&room, n);
+
+		append(room);
+		chain_release(room.segment);
+
+		p += n;
+		data_sz -= n;
+	}
+}
+
+/*
+ * append the n bytes of other at offset, by reference
+ */
+
+void buffer_chain::append(const buffer_chain& other, size_t offset, size_t n) {
+
+	while(n > 0) {
+
+		chain_slice s = other.slice(offset);
+
+		if(s.segment == nullptr)
+			return;
+
+		s.sz = std::min(n, (size_t)s.sz);
+
+		append(s);
+
+		offset += s.sz;
+		n -= s.sz;
+	}
+}
+
+/*
+ * the index of the slice holding offset, the count of slices past the end
+ */
+
+size_t buffer_chain::find(size_t offset) const {
+	return std::upper_bound(ends.begin(), ends.end(), offset) - ends.begin();
+}
+
+/*
+ * the rest of the slice holding offset, from offset, empty past the end
+ */
+
+chain_slice buffer_chain::slice(size_t offset) const {
+
+	const size_t i = find(offset);
+
+	if(i == slices.size())
+		return chain_slice();
+
+	chain_slice s = slices[i];
+
+	const size_t skip = offset - (ends[i] - s.sz);
+
+	s.offset += skip;
+	s.sz -= skip;
+
+	return s;
+}
+
+/*
+ * the sz bytes at offset in place when they lie in one slice, nullptr when
+ * they don't
+ */
+
+const uint8_t *buffer_chain::contiguous(size_t offset, size_t n) const {
+
+	const chain_slice s = slice(offset);
+
+	if(s.segment == nullptr or n > s.sz)
+		return nullptr;
+
+	return s.data();
+}
+
+/*
+ * copy the n bytes at offset out to p
+ */
+
+void buffer_chain::copy(size_t offset, size_t n, void *p) const {
+
+	uint8_t *out = (uint8_t *)p;
+
+	while(n > 0) {
+
+		const chain_slice s = slice(offset);
+
+		if(s.segment == nullptr)
+			return;
+
+		const size_t m = std::min(n, (size_t)s.sz);
+
+		memcpy(out, s.data(), m);
+
+		out += m;
+		offset += m;
+		n -= m;
+	}
+}
+
+std::string buffer_chain::str(size_t offset, size_t n) const {
+
+	if(offset >= sz)
+		return std::string();
+
+	n = std::min(n, sz - offset);
+
+	std::string s(n, '\0');
+
+	copy(offset, n, &s[0]);
+
+	return s;
+}
+
+/*
+ * what the chain holds for the memory budget: its bytes, however much of
+ * their segments they share
+ */
+
+size_t buffer_chain::footprint() const {
+	return sz + slices.capacity() * sizeof(chain_slice) + ends.capacity() * sizeof(size_t);
+}
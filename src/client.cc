@@ -0,0 +1,1933 @@
+/*
+ * 80over53-client - HTTP-over-DNS Client
+ *
+ * Copyright(c) 2015 256 LLC
+ * Written by Christopher Abad
+ * 20 GOTO 10
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstdint>
+
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <climits>
+#include <cmath>
+
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include <80over53/dns.hh>
+#include <80over53/http.hh>
+#include <80over53/tunnel.hh>
+
+/*
+ * 80over53-client program logic
+ * =============================
+ *
+ * request : url + options -> http_request -> serialize -> PUT fragments
+ *
+ * (or with -l, a local http proxy where each accepted connection's request
+ *  becomes one more stream of the session, every stream sharing the window
+ *  round robin)
+ *
+ * while transfers not done and not stop
+ *
+ *    expire queries older than their resolver's RTO : loss -> requeue,
+ *       shrink that resolver's window, quarantine it after repeated losses
+ *
+ *    while some resolver has room in its window
+ *       pick one, weighted by its RTT and loss estimates
+ *       send it the next work of the next transfer (retransmit, pending retry, PUT,
+ *          REPAIR for a block whose GETs are all out, GET)
+ *
+ *    select on dns-fd until the next deadline
+ *
+ *    foreach reply, from whichever resolver (late ones for retransmitted work too)
+ *       ACK     : fragment uploaded
+ *       DATA    : chunk -> reorder -> write output (or connection) in order
+ *       REPAIR  : fec repair chunk -> rebuild lost chunks of its block
+ *       PENDING : retry the chunk shortly
+ *       grow that resolver's window
+ *
+ * CLOSE each stream as its transfer finishes
+ *
+ * exit
+ *
+ */
+
+void eprintf(int, const char *, ...);
+
+struct configuration {
+	bool verbose = false;
+	std::vector<sockaddr_in> resolvers;
+	const char *domain = "$.256.bz";
+	http_method method = http_method::GET;
+	http_headers headers;
+	http_form form;
+	unsigned initial_window = 4;
+	unsigned max_window = 64;
+	unsigned min_rto_ms = 100;
+	unsigned max_tries = 20;
+	uint16_t listen_port = 0;
+	dns_type qtype = dns_type::TXT;
+	double fec_ratio = 0;
+	uint16_t codings = TUNNEL_FLAG_DEFLATE | (coding_available(coding::ZSTD) ? TUNNEL_FLAG_ZSTD : 0);
+	FILE *fp = stderr;
+	FILE *out = stdout;
+};
+
+configuration default_config = configuration();
+
+const char *default_action(int default_value) {
+    return default_value ? "disable" : "enable";
+}
+
+void usage_print(const char *option_str, const char *action, const char *option_desc) {
+
+    const int option_width = -13;
+
+    fprintf(stderr, "\t%*s%s %s\n", option_width, option_str, action, option_desc);
+}
+
+void usage(const char *arg0) {
+
+    fprintf(stderr, "\nusage: %s [options] url\n       %s [options] -l port\n\n", arg0, arg0);
+
+	char window_string[40];
+	char rto_string[20];
+
+	snprintf(window_string, sizeof(window_string), "%u, max %u", default_config.initial_window, default_config.max_window);
+	snprintf(rto_string, sizeof(rto_string), "%ums", default_config.min_rto_ms);
+
+    usage_print("-h", "show", "this help");
+    usage_print("-v", default_action(default_config.verbose), "verbose output");
+	usage_print("-r ip:port", "add a", "resolver, repeat to fan out, default: 127.0.0.1:53");
+    usage_print("-d domain", "domain name, default:", default_config.domain);
+	usage_print("-X method", "http", "method, default: GET");
+	usage_print("-H header", "add", "\"Name: value\" request header");
+	usage_print("-F field", "add", "name=value form field");
+	usage_print("-w window", "initial query window, default:", window_string);
+	usage_print("-W window", "maximum", "query window");
+	usage_print("-t ms", "minimum retransmit timeout, default:", rto_string);
+	usage_print("-o file", "write", "response to file instead of stdout");
+	usage_print("-q type", "query", "type, TXT, NULL or AAAA, default: TXT");
+	usage_print("-f ratio", "fetch", "at least ratio fec repair chunks per chunk, more on loss, default: 0 (off)");
+	usage_print("-z codings", "accept", "response codings, comma separated deflate, zstd or none, default: all built");
+	usage_print("-l port", "serve", "a local http proxy on 127.0.0.1:port");
+
+    fputc('\n', stderr);
+}
+
+int cliconfig(configuration * config, int argc, char **argv) {
+
+    int opt;
+
+    *config = default_config;
+
+    opterr = 0;
+
+	sockaddr_in sin;
+	char *colon;
+	bool found;
+
+	static const http_method methods[] = {
+		http_method::GET, http_method::HEAD, http_method::POST, http_method::PUT,
+		http_method::DELETE, http_method::TRACE, http_method::CONNECT
+	};
+
+	while ((opt = getopt(argc, argv, "hvr:d:X:H:F:w:W:t:o:l:q:f:z:")) != -1) {
+
+		switch (opt) {
+
+			case 'v':
+
+				config->verbose = !default_config.verbose;
+				break;
+
+			case 'r':
+
+				memset(&sin, 0, sizeof(sin));
+				sin.sin_family = AF_INET;
+				sin.sin_port = htons(53);
+
+				colon = strchr(optarg, ':');
+				if(colon != nullptr) {
+					*colon = '\0';
+					sin.sin_port = htons(strtoul(colon + 1, nullptr, 0));
+				}
+				if(inet_pton(AF_INET, optarg, &sin.sin_addr) != 1) {
+					fprintf(stderr, "invalid address: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				config->resolvers.push_back(sin);
+				break;
+
+			case 'd':
+
+				config->domain = optarg;
+				break;
+
+			case 'X':
+
+				found = false;
+
+				for(http_method m : methods) {
+					if(strcasecmp(optarg, http_method_str(m)) == 0) {
+						config->method = m;
+						found = true;
+					}
+				}
+
+				if(not found) {
+					fprintf(stderr, "unknown method: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'H':
+
+				colon = strchr(optarg, ':');
+				if(colon == nullptr) {
+					fprintf(stderr, "invalid header: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				*colon++ = '\0';
+				while(*colon == ' ')
+					colon++;
+				config->headers[optarg] = colon;
+				break;
+
+			case 'F':
+
+				colon = strchr(optarg, '=');
+				if(colon == nullptr) {
+					config->form[optarg] = "";
+				} else {
+					*colon = '\0';
+					config->form[optarg] = colon + 1;
+				}
+				break;
+
+			case 'w':
+
+				config->initial_window = std::max(1UL, strtoul(optarg, nullptr, 0));
+				break;
+
+			case 'W':
+
+				config->max_window = std::max(1UL, strtoul(optarg, nullptr, 0));
+				break;
+
+			case 't':
+
+				config->min_rto_ms = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'o':
+
+				config->out = fopen(optarg, "w");
+				if(config->out == nullptr) {
+					eprintf(errno, "couldn't open %s", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'f':
+
+				config->fec_ratio = strtod(optarg, nullptr);
+				break;
+
+			case 'q':
+
+				found = false;
+				for(dns_type qtype : { dns_type::TXT, dns_type::NULL_, dns_type::AAAA }) {
+					if(strcasecmp(optarg, dns_type_str(qtype)) == 0) {
+						config->qtype = qtype;
+						found = true;
+					}
+				}
+				if(not found) {
+					fprintf(stderr, "unsupported query type: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'z':
+
+				config->codings = 0;
+				for(const char *p = optarg; *p != '\0'; ) {
+
+					size_t n = strcspn(p, ",");
+
+					found = n == 4 and strncasecmp(p, "none", n) == 0;
+
+					for(coding x : { coding::DEFLATE, coding::ZSTD }) {
+						if(strlen(coding_str(x)) == n and strncasecmp(p, coding_str(x), n) == 0 and coding_available(x)) {
+							config->codings |= tunnel_coding_flag(x);
+							found = true;
+						}
+					}
+
+					if(not found) {
+						fprintf(stderr, "unsupported coding: %.*s\n", (int)n, p);
+						exit(EXIT_FAILURE);
+					}
+
+					p += p[n] == ',' ? n + 1 : n;
+				}
+				break;
+
+			case 'l':
+
+				config->listen_port = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'h':
+
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+
+			case '?':
+
+				fprintf(stderr, "unknown option: -%c\n", optopt);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+
+			default:
+
+				fprintf(stderr, "unimplemented option: -%c\n", opt);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	config->initial_window = std::min(config->initial_window, config->max_window);
+
+	return optind;
+}
+
+sig_atomic_t stop = 0;
+
+void sighandler_stop(int signo) {
+	signal(signo, SIG_IGN);
+	stop = signo;
+	fprintf(stderr, "caught signal #%d (%s), stopping client...\n", signo, strsignal(signo));
+}
+
+#define DATA_SZ 4096
+
+#define RTO_INITIAL_USEC 1000000
+#define RTO_MAX_USEC     5000000
+
+#define CWND_DECREASE 0.7
+
+#define LOSS_EWMA_WEIGHT 0.1
+
+#define FEC_LOSS_FACTOR 1.5
+#define FEC_RATIO_MAX   1.0
+
+#define QUARANTINE_FAILURES 8
+#define QUARANTINE_MIN_USEC 1000000
+#define QUARANTINE_MAX_USEC 60000000
+
+#define BUSY_BACKOFF_MIN_USEC 50000
+#define BUSY_BACKOFF_MAX_USEC 2000000
+#define BUSY_TRIES_MAX        32
+
+uint64_t now_usec() {
+
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int write_all(int fd, const void *data, size_t data_sz) {
+
+	for(size_t n = 0; n < data_sz; ) {
+
+		ssize_t sz = write(fd, (const char *)data + n, data_sz - n);
+
+		if(sz == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		n += sz;
+	}
+
+	return 0;
+}
+
+struct transfer;
+
+/*
+ * one query worth of work, retransmitted as is until it gets an answer
+ */
+
+struct work {
+
+	transfer *owner = nullptr;
+
+	tunnel_op op = tunnel_op::GET;
+	uint16_t stream = 0;
+	uint32_t seq = 0;
+	uint16_t arg = 0;
+
+	std::string data;
+
+	unsigned tries = 0;
+	unsigned busy = 0;
+};
+
+/*
+ * one http request: its fragments going up and its chunks coming down
+ */
+
+struct transfer {
+
+	uint16_t stream = 0;
+
+	std::vector<work> fragments;
+	std::vector<bool> acked;
+	size_t acked_count = 0;
+	size_t next_put = 0;
+
+	uint16_t chunk_sz = 0;
+	uint32_t next_fetch = 0;
+	uint32_t stalled = UINT32_MAX;
+	uint64_t total = TUNNEL_TOTAL_UNKNOWN;
+
+	std::map<uint32_t, std::string> chunks;
+	uint32_t next_write = 0;
+	uint64_t written = 0;
+
+	bool decoding = false;
+	decompressor unz;
+	uint64_t delivered = 0;
+
+	std::map<uint32_t, std::map<size_t, std::string>> repairs;
+	uint32_t repair_block = 0;
+	size_t repair_next = 0;
+	size_t repairs_due = 0;
+	bool fec = false;
+
+	std::map<uint32_t, size_t> repairs_outstanding;
+	std::multimap<uint32_t, work> parked;
+
+	size_t repairs_sent = 0;
+	size_t recovered = 0;
+
+	std::deque<work> ready;
+	std::multimap<uint64_t, work> delayed;
+
+	int out = -1;
+
+	bool done = false;
+	bool failed = false;
+
+	int init(uint16_t, const std::string&, size_t, int, uint16_t);
+
+	bool next_work(uint64_t, work *, double);
+	uint64_t next_due() const;
+
+	void on_reply(const work&, const tunnel_reply&, uint64_t, uint64_t);
+	void on_loss(const work&);
+
+	size_t block_count(uint32_t) const;
+	bool repairs_coming(uint32_t) const;
+	void repair_done(uint32_t);
+	void recover(uint32_t);
+	void flush();
+
+	bool uploaded() const {
+		return acked_count == fragments.size();
+	}
+
+	bool have_chunk(uint32_t n) const {
+		return n < next_write or chunks.find(n) != chunks.end();
+	}
+
+	bool obsolete(const work& w) const {
+		return w.op == tunnel_op::GET and have_chunk(w.seq);
+	}
+};
+
+int transfer::init(uint16_t my_stream, const std::string& request, size_t fragment_sz, int my_out, uint16_t codings) {
+
+	stream = my_stream;
+	out = my_out;
+
+	for(size_t offset = 0; offset < request.size(); offset += fragment_sz) {
+
+		work w;
+
+		w.owner = this;
+		w.op = tunnel_op::PUT;
+		w.stream = stream;
+		w.seq = offset;
+		w.data = request.substr(offset, fragment_sz);
+		w.arg = codings | (offset + fragment_sz >= request.size() ? TUNNEL_FLAG_FIN : 0);
+
+		fragments.push_back(w);
+	}
+
+	acked.assign(fragments.size(), false);
+
+	return fragments.empty() ? -1 : 0;
+}
+
+/*
+ * the next query to send, with repair chunks at redundancy per data chunk
+ * of each block requested once all of the block's GETs are out
+ */
+
+bool transfer::next_work(uint64_t now, work *w, double redundancy) {
+
+	if(done or failed)
+		return false;
+
+	while(not ready.empty()) {
+
+		*w = ready.front();
+		ready.pop_front();
+
+		if(not obsolete(*w))
+			return true;
+	}
+
+	while(not delayed.empty() and delayed.begin()->first <= now) {
+
+		*w = delayed.begin()->second;
+		delayed.erase(delayed.begin());
+
+		if(not obsolete(*w))
+			return true;
+	}
+
+	if(next_put < fragments.size()) {
+		*w = fragments[next_put++];
+		return true;
+	}
+
+	if(not uploaded())
+		return false;
+
+	if(repairs_due > 0) {
+
+		w->owner = this;
+		w->op = tunnel_op::REPAIR;
+		w->stream = stream;
+		w->seq = (repair_block << 8) | repair_next++;
+		w->arg = chunk_sz;
+		w->data.clear();
+		w->tries = 0;
+
+		repairs_due--;
+		repairs_sent++;
+
+		repairs_outstanding[repair_block]++;
+
+		return true;
+	}
+
+	if(total != TUNNEL_TOTAL_UNKNOWN and (uint64_t)next_fetch * chunk_sz >= total)
+		return false;
+
+	/*
+	 * once a chunk comes back pending there is no point asking for the
+	 * ones after it until it arrives
+	 */
+
+	if(next_fetch > stalled)
+		return false;
+
+	w->owner = this;
+	w->op = tunnel_op::GET;
+	w->stream = stream;
+	w->seq = next_fetch++;
+	w->arg = chunk_sz;
+	w->data.clear();
+	w->tries = 0;
+
+	const bool last = total != TUNNEL_TOTAL_UNKNOWN and (uint64_t)next_fetch * chunk_sz >= total;
+
+	fec = redundancy > 0;
+
+	if(fec and (next_fetch % TUNNEL_FEC_WIDTH == 0 or last)) {
+		repair_block = w->seq / TUNNEL_FEC_WIDTH;
+		repair_next = 0;
+		repairs_due = std::min((size_t)ceil(redundancy * block_count(repair_block)), (size_t)TUNNEL_FEC_REPAIRS_MAX);
+	}
+
+	return true;
+}
+
+/*
+ * how many chunks block holds, all of them unless it is the last
+ */
+
+size_t transfer::block_count(uint32_t block) const {
+
+	if(total == TUNNEL_TOTAL_UNKNOWN)
+		return TUNNEL_FEC_WIDTH;
+
+	const uint64_t n = (total + chunk_sz - 1) / chunk_sz;
+	const uint64_t first = (uint64_t)block * TUNNEL_FEC_WIDTH;
+
+	return first >= n ? 0 : std::min(n - first, (uint64_t)TUNNEL_FEC_WIDTH);
+}
+
+/*
+ * whether repairs for block are yet to be sent or answered
+ */
+
+bool transfer::repairs_coming(uint32_t block) const {
+
+	if(not fec)
+		return false;
+
+	if((uint64_t)block * TUNNEL_FEC_WIDTH + block_count(block) > next_fetch or (block == repair_block and repairs_due > 0))
+		return true;
+
+	auto iter = repairs_outstanding.find(block);
+
+	return iter != repairs_outstanding.end() and iter->second > 0;
+}
+
+/*
+ * a repair for block was answered or lost: once none is left to come, the
+ * lost chunks parked waiting on them are asked again after all
+ */
+
+void transfer::repair_done(uint32_t block) {
+
+	auto iter = repairs_outstanding.find(block);
+
+	if(iter != repairs_outstanding.end() and iter->second > 0)
+		iter->second--;
+
+	if(repairs_coming(block))
+		return;
+
+	auto range = parked.equal_range(block);
+
+	for(auto p = range.first; p != range.second; p++)
+		if(not obsolete(p->second))
+			ready.push_back(p->second);
+
+	parked.erase(range.first, range.second);
+}
+
+/*
+ * rebuild the chunks of block still missing once the chunks and repairs in
+ * hand are enough
+ */
+
+void transfer::recover(uint32_t block) {
+
+	auto r = repairs.find(block);
+	if(r == repairs.end())
+		return;
+
+	const size_t count = block_count(block);
+	const uint32_t first = block * TUNNEL_FEC_WIDTH;
+
+	std::string buf[TUNNEL_FEC_WIDTH];
+	uint8_t *data[TUNNEL_FEC_WIDTH];
+	bool present[TUNNEL_FEC_WIDTH];
+
+	size_t missing = 0;
+
+	for(size_t i = 0; i < count; i++) {
+
+		auto iter = chunks.find(first + i);
+
+		present[i] = iter != chunks.end();
+
+		if(present[i])
+			buf[i] = iter->second;
+		else
+			missing++;
+
+		buf[i].resize(chunk_sz, 0);
+		data[i] = (uint8_t *)&buf[i][0];
+	}
+
+	if(missing == 0 or missing > r->second.size())
+		return;
+
+	const uint8_t *repair_data[TUNNEL_FEC_WIDTH];
+	size_t indexes[TUNNEL_FEC_WIDTH];
+	size_t nrepairs = 0;
+
+	for(auto iter = r->second.begin(); iter != r->second.end() and nrepairs < missing; iter++) {
+		repair_data[nrepairs] = (const uint8_t *)iter->second.data();
+		indexes[nrepairs++] = iter->first;
+	}
+
+	if(fec_decode(TUNNEL_FEC_WIDTH, data, present, count, repair_data, indexes, nrepairs, chunk_sz) == -1)
+		return;
+
+	for(size_t i = 0; i < count; i++) {
+
+		if(present[i])
+			continue;
+
+		const uint64_t offset = (uint64_t)(first + i) * chunk_sz;
+
+		if(total != TUNNEL_TOTAL_UNKNOWN)
+			buf[i].resize(std::min((uint64_t)chunk_sz, total - offset));
+
+		chunks[first + i] = buf[i];
+		recovered++;
+	}
+
+	repairs.erase(r);
+}
+
+uint64_t transfer::next_due() const {
+	return delayed.empty() ? UINT64_MAX : delayed.begin()->first;
+}
+
+void transfer::on_reply(const work& w, const tunnel_reply& reply, uint64_t now, uint64_t retry_usec) {
+
+	if(reply.status & TUNNEL_STATUS_ERROR) {
+
+		/*
+		 * a repair asked for past the end when the total wasn't known yet
+		 */
+
+		if(w.op == tunnel_op::REPAIR) {
+			repair_done(w.seq >> 8);
+			return;
+		}
+
+		fprintf(stderr, "stream %u: server error on %s seq %u\n", stream, tunnel_op_str(w.op), w.seq);
+		failed = true;
+		return;
+	}
+
+	if(reply.status & TUNNEL_STATUS_PENDING) {
+		if(w.op == tunnel_op::GET)
+			stalled = std::min(stalled, w.seq);
+		delayed.insert(std::make_pair(now + retry_usec, w));
+		return;
+	}
+
+	if(w.op == tunnel_op::PUT) {
+
+		size_t i = std::find_if(fragments.begin(), fragments.end(), [&w](const work& x) { return x.seq == w.seq; }) - fragments.begin();
+
+		if(i < fragments.size() and not acked[i]) {
+			acked[i] = true;
+			acked_count++;
+		}
+
+		return;
+	}
+
+	if(not (reply.status & TUNNEL_STATUS_DATA))
+		return;
+
+	if(reply.total != TUNNEL_TOTAL_UNKNOWN)
+		total = reply.total;
+
+	if(not decoding) {
+
+		const coding method = tunnel_status_coding(reply.status);
+
+		if(unz.begin(method) == -1) {
+			fprintf(stderr, "stream %u: can't decode %s response\n", stream, coding_str(method));
+			failed = true;
+			return;
+		}
+
+		decoding = true;
+	}
+
+	if(w.op == tunnel_op::REPAIR) {
+
+		const uint32_t block = w.seq >> 8;
+
+		if(block >= next_write / TUNNEL_FEC_WIDTH and reply.data_sz == chunk_sz) {
+			repairs[block][w.seq & 0xff] = std::string((const char *)reply.data, reply.data_sz);
+			recover(block);
+		}
+
+		repair_done(block);
+
+	} else if(w.op == tunnel_op::GET) {
+
+		if(w.seq >= stalled)
+			stalled = UINT32_MAX;
+
+		if(not have_chunk(w.seq)) {
+			chunks[w.seq] = std::string((const char *)reply.data, reply.data_sz);
+			recover(w.seq / TUNNEL_FEC_WIDTH);
+		}
+	}
+
+	flush();
+}
+
+/*
+ * decode and write out the chunks now in order. a block's chunks are kept
+ * until all of it is written, recovering its lost ones may need them.
+ */
+
+void transfer::flush() {
+
+	std::string plain;
+
+	for(auto iter = chunks.find(next_write); iter != chunks.end() and iter->first == next_write; iter++) {
+
+		plain.clear();
+
+		if(unz.update(iter->second.data(), iter->second.size(), &plain) == -1) {
+			fprintf(stderr, "stream %u: corrupt %s response at chunk %u\n", stream, coding_str(unz.method), next_write);
+			failed = true;
+			return;
+		}
+
+		if(write_all(out, plain.data(), plain.size()) == -1) {
+			perror("write()");
+			failed = true;
+			return;
+		}
+
+		written += iter->second.size();
+		delivered += plain.size();
+		next_write++;
+	}
+
+	const uint32_t block = next_write / TUNNEL_FEC_WIDTH;
+
+	chunks.erase(chunks.begin(), chunks.lower_bound(block * TUNNEL_FEC_WIDTH));
+	repairs.erase(repairs.begin(), repairs.lower_bound(block));
+	repairs_outstanding.erase(repairs_outstanding.begin(), repairs_outstanding.lower_bound(block));
+	parked.erase(parked.begin(), parked.lower_bound(block));
+
+	if(total != TUNNEL_TOTAL_UNKNOWN and written >= total)
+		done = true;
+}
+
+/*
+ * lost repairs are not asked again, nor chunks rebuilt since, and lost
+ * chunks wait for their block's repairs before they are
+ */
+
+void transfer::on_loss(const work& w) {
+
+	if(w.op == tunnel_op::REPAIR) {
+		repair_done(w.seq >> 8);
+		return;
+	}
+
+	if(obsolete(w))
+		return;
+
+	if(w.op == tunnel_op::GET and repairs_coming(w.seq / TUNNEL_FEC_WIDTH)) {
+		parked.insert(std::make_pair(w.seq / TUNNEL_FEC_WIDTH, w));
+		return;
+	}
+
+	ready.push_front(w);
+}
+
+/*
+ * AIMD window over in-flight queries: slow start then additive increase on
+ * answers, multiplicative decrease at most once per round trip on loss (by
+ * 0.7 rather than 0.5, resolver paths lose queries without congestion), and
+ * no growth while the smoothed RTT shows queueing well above the minimum
+ */
+
+struct congestion {
+
+	double cwnd;
+	double ssthresh;
+	double max_window;
+
+	uint64_t srtt = 0;
+	uint64_t rttvar = 0;
+	uint64_t min_rtt = UINT64_MAX;
+	uint64_t min_rto;
+
+	unsigned backoff = 0;
+
+	uint64_t recovery = 0;
+
+	congestion(unsigned initial, unsigned maximum, uint64_t my_min_rto)
+	: cwnd(initial), ssthresh(maximum), max_window(maximum), min_rto(my_min_rto)
+	{
+	}
+
+	uint64_t rto() const {
+
+		uint64_t x = srtt == 0 ? RTO_INITIAL_USEC : srtt + 4 * rttvar;
+
+		x = std::max(x, min_rto) << std::min(backoff, 6U);
+
+		return std::min(x, (uint64_t)RTO_MAX_USEC);
+	}
+
+	size_t window() const {
+		return std::max(1, (int)cwnd);
+	}
+
+	void on_answer(uint64_t sample, bool retransmitted) {
+
+		backoff = 0;
+
+		if(not retransmitted) {
+
+			if(srtt == 0) {
+				srtt = sample;
+				rttvar = sample / 2;
+			} else {
+				uint64_t delta = sample > srtt ? sample - srtt : srtt - sample;
+				rttvar = (3 * rttvar + delta) / 4;
+				srtt = (7 * srtt + sample) / 8;
+			}
+
+			min_rtt = std::min(min_rtt, sample);
+		}
+
+		if(cwnd < ssthresh)
+			cwnd += 1;
+		else if(srtt < 2 * min_rtt + 20000)
+			cwnd += 1 / cwnd;
+
+		cwnd = std::min(cwnd, max_window);
+	}
+
+	void on_loss(uint64_t t_sent, uint64_t now) {
+
+		if(t_sent < recovery)
+			return;
+
+		ssthresh = std::max(cwnd * CWND_DECREASE, 1.0);
+		cwnd = ssthresh;
+
+		backoff++;
+
+		recovery = now;
+	}
+};
+
+/*
+ * one recursive resolver we fan out to: its own congestion window and RTT,
+ * a smoothed loss rate, and a quarantine it is put in after a run of losses
+ * so its share moves to the others
+ */
+
+struct resolver {
+
+	sockaddr_in address;
+
+	congestion cc;
+
+	size_t outstanding = 0;
+
+	double loss = 0;
+	unsigned failures = 0;
+
+	unsigned quarantines = 0;
+	uint64_t quarantined_until = 0;
+
+	size_t queries = 0;
+	size_t answers = 0;
+	size_t lost = 0;
+
+	resolver(const sockaddr_in& my_address, const configuration *config)
+	: address(my_address),
+	  cc(config->initial_window, config->max_window, (uint64_t)config->min_rto_ms * 1000)
+	{
+	}
+
+	bool usable(uint64_t now) const {
+		return quarantined_until <= now;
+	}
+
+	bool has_room(uint64_t now) const {
+		return usable(now) and outstanding < cc.window();
+	}
+
+	double weight() const {
+
+		const double rtt = cc.srtt == 0 ? RTO_INITIAL_USEC : cc.srtt;
+
+		return std::max((1 - loss) * (1 - loss), 0.01) * 1e6 / rtt;
+	}
+
+	void on_answer(uint64_t sample, bool retransmitted) {
+
+		answers++;
+
+		loss *= 1 - LOSS_EWMA_WEIGHT;
+		failures = 0;
+		quarantines = 0;
+
+		cc.on_answer(sample, retransmitted);
+	}
+
+	void on_loss(uint64_t t_sent, uint64_t now, bool congestion) {
+
+		lost++;
+
+		loss = loss * (1 - LOSS_EWMA_WEIGHT) + LOSS_EWMA_WEIGHT;
+		failures++;
+
+		if(congestion)
+			cc.on_loss(t_sent, now);
+	}
+
+	void quarantine(uint64_t now) {
+
+		quarantined_until = now + std::min((uint64_t)QUARANTINE_MIN_USEC << std::min(quarantines, 6U), (uint64_t)QUARANTINE_MAX_USEC);
+
+		quarantines++;
+		failures = 0;
+
+		/*
+		 * come back probing with a single query
+		 */
+
+		cc.cwnd = 1;
+		cc.backoff = 0;
+	}
+
+	int sprint(char *, size_t) const;
+};
+
+int resolver::sprint(char *s, size_t sz) const {
+
+	char addr[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &address.sin_addr, addr, sizeof(addr));
+
+	return snprintf(s, sz, "%s:%d queries %zu answers %zu lost %zu loss %.1f%% srtt %.1fms window %.1f quarantined %u",
+			addr, ntohs(address.sin_port), queries, answers, lost, loss * 100, cc.srtt / 1000.0, cc.cwnd, quarantines);
+}
+
+struct inflight_query {
+	work w;
+	size_t resolver;
+	uint64_t t_sent;
+	bool lost = false;
+	char qname[DNS_NAME_MAX_SZ + 1];
+};
+
+struct statistics {
+	size_t queries = 0;
+	size_t answers = 0;
+	size_t retransmits = 0;
+	size_t pending = 0;
+	size_t late = 0;
+	size_t stray = 0;
+	size_t busy = 0;
+	size_t data_replies = 0;
+	size_t data_bytes = 0;
+};
+
+struct tunnel_client {
+
+	configuration *config;
+
+	const char *zone;
+
+	int fd = -1;
+
+	std::mt19937 rng;
+
+	uint32_t session;
+
+	uint16_t chunk_sz = 0;
+
+	double loss = 0;
+
+	std::vector<resolver> resolvers;
+
+	std::map<uint16_t, inflight_query> inflight;
+
+	std::deque<transfer *> transfers;
+
+	statistics stats;
+
+	tunnel_client(configuration *my_config)
+	: config(my_config),
+	  zone(tunnel_zone(my_config->domain)),
+	  rng(std::random_device()()),
+	  session(rng())
+	{
+	}
+
+	int open();
+
+	void add(transfer *);
+	void remove(transfer *);
+
+	bool next_work(uint64_t, work *);
+
+	double redundancy() const;
+
+	size_t pick(uint64_t, bool);
+	void on_resolver_loss(size_t, const work&, uint64_t, uint64_t);
+	void on_work_loss(work&);
+
+	int send_work(const work&, size_t, uint64_t);
+	void receive(uint64_t);
+	void expire(uint64_t);
+
+	int step(uint64_t);
+	uint64_t deadline(uint64_t) const;
+
+	int run(transfer&);
+};
+
+int tunnel_client::open() {
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+
+	if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		perror("fcntl()");
+		return -1;
+	}
+
+	if(config->resolvers.empty()) {
+
+		sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(53);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		config->resolvers.push_back(sin);
+	}
+
+	for(const sockaddr_in& sin : config->resolvers)
+		resolvers.push_back(resolver(sin, config));
+
+	/*
+	 * GETs carry no data, so their questions are all the size of this one
+	 * and the chunk size is whatever the rest of a reply can carry
+	 */
+
+	tunnel_query query;
+	char qname[DNS_NAME_MAX_SZ + 1];
+
+	ssize_t qname_sz = query.write(qname, sizeof(qname), zone);
+
+	if(qname_sz != -1)
+		chunk_sz = tunnel_reply::capacity(config->qtype, sizeof(dns_header) + qname_sz + 2 + 4);
+
+	if(chunk_sz == 0) {
+		fprintf(stderr, "no room for %s replies under %s\n", dns_type_str(config->qtype), zone);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * weighted random choice among the resolvers with room in their window (or
+ * merely out of quarantine when room doesn't matter), favouring low RTT and
+ * low loss. SIZE_MAX if there is none.
+ */
+
+size_t tunnel_client::pick(uint64_t now, bool need_room) {
+
+	double sum = 0;
+
+	for(const resolver& r : resolvers)
+		if(need_room ? r.has_room(now) : r.usable(now))
+			sum += r.weight();
+
+	if(sum == 0)
+		return SIZE_MAX;
+
+	double x = std::uniform_real_distribution<double>(0, sum)(rng);
+
+	size_t last = SIZE_MAX;
+
+	for(size_t i = 0; i < resolvers.size(); i++) {
+
+		if(not (need_room ? resolvers[i].has_room(now) : resolvers[i].usable(now)))
+			continue;
+
+		last = i;
+		x -= resolvers[i].weight();
+
+		if(x < 0)
+			break;
+	}
+
+	return last;
+}
+
+/*
+ * a resolver lost a query (no answer in time, or a SERVFAIL other than a
+ * busy server's, REFUSED or truncated one): quarantine it after too many in
+ * a row, as long as some other resolver remains to carry the traffic. with
+ * fec on, lost chunks are mostly rebuilt rather than asked again, so up to
+ * the loss it is sized for their loss is taken for the path's and not
+ * congestion.
+ */
+
+void tunnel_client::on_resolver_loss(size_t i, const work& w, uint64_t t_sent, uint64_t now) {
+
+	resolver& r = resolvers[i];
+
+	const bool covered = redundancy() > 0 and loss <= 0.5 and (w.op == tunnel_op::GET or w.op == tunnel_op::REPAIR);
+
+	r.on_loss(t_sent, now, not covered);
+
+	loss = loss * (1 - LOSS_EWMA_WEIGHT) + LOSS_EWMA_WEIGHT;
+
+	if(r.failures < QUARANTINE_FAILURES)
+		return;
+
+	for(size_t j = 0; j < resolvers.size(); j++) {
+
+		if(j == i or not resolvers[j].usable(now))
+			continue;
+
+		r.quarantine(now);
+
+		if(config->verbose) {
+			char r_str[256];
+			r.sprint(r_str, sizeof(r_str));
+			fprintf(config->fp, "quarantine %s for %.1fs\n", r_str, (r.quarantined_until - now) / 1e6);
+		}
+
+		return;
+	}
+}
+
+void tunnel_client::on_work_loss(work& w) {
+
+	w.tries++;
+
+	if(w.tries >= config->max_tries) {
+		fprintf(stderr, "stream %u: giving up on %s seq %u after %u tries\n",
+				w.stream, tunnel_op_str(w.op), w.seq, w.tries);
+		w.owner->failed = true;
+	} else {
+		w.owner->on_loss(w);
+	}
+}
+
+int tunnel_client::send_work(const work& w, size_t i, uint64_t now) {
+
+	resolver& r = resolvers[i];
+
+
+	tunnel_query query;
+	dns_question question;
+	dns_header header;
+
+	uint8_t packet[DNS_MSG_MAX_SZ];
+
+	uint16_t id;
+
+	do {
+		id = rng();
+	} while(inflight.find(id) != inflight.end());
+
+	query.op = w.op;
+	query.session = session;
+	query.stream = w.stream;
+	query.nonce = rng();
+	query.seq = w.seq;
+	query.arg = w.arg;
+	query.data_sz = w.data.size();
+	memcpy(query.data, w.data.data(), w.data.size());
+
+	if(query.write(question.qname, sizeof(question.qname), zone) == -1) {
+		fprintf(stderr, "couldn't encode %s seq %u under %s\n", tunnel_op_str(w.op), w.seq, zone);
+		return -1;
+	}
+
+	question.qtype = config->qtype;
+	question.qclass = dns_class::IN;
+
+	memset(&header, 0, sizeof(header));
+	header.id = id;
+	header.rd = 1;
+	header.qdcount = 1;
+
+	ssize_t n = header.write(packet, sizeof(packet));
+	if(n != -1)
+		n = question.write(n, packet, sizeof(packet));
+
+	if(n == -1) {
+		fprintf(stderr, "couldn't build query for %s seq %u\n", tunnel_op_str(w.op), w.seq);
+		return -1;
+	}
+
+	if(sendto(fd, packet, n, 0, (const sockaddr *)&r.address, sizeof(r.address)) == -1) {
+		if(errno != EAGAIN and errno != ENOBUFS) {
+			perror("sendto()");
+			return -1;
+		}
+	}
+
+	inflight_query& q = inflight[id];
+
+	q.w = w;
+	q.resolver = i;
+	q.t_sent = now;
+	strcpy(q.qname, question.qname);
+
+	r.outstanding++;
+	r.queries++;
+
+	stats.queries++;
+
+	if(w.tries > 0)
+		stats.retransmits++;
+
+	if(config->verbose) {
+		char q_str[256];
+		query.sprint(q_str, sizeof(q_str));
+		fprintf(config->fp, "-> id %5u %s resolver %zu (window %zu/%.1f rto %llums)\n",
+				id, q_str, i, r.outstanding, r.cc.cwnd, (unsigned long long)r.cc.rto() / 1000);
+	}
+
+	return 0;
+}
+
+void tunnel_client::receive(uint64_t now) {
+
+	uint8_t packet[DATA_SZ];
+	uint8_t payload[DATA_SZ];
+
+	while(true) {
+
+		ssize_t sz = recv(fd, packet, sizeof(packet), 0);
+
+		if(sz == -1) {
+			if(errno != EAGAIN and errno != EWOULDBLOCK and errno != ECONNREFUSED)
+				perror("recv()");
+			return;
+		}
+
+		dns_header header;
+		dns_question question;
+		dns_rr answers[TUNNEL_ANSWERS_MAX];
+		size_t count = 0;
+		tunnel_reply reply;
+
+		ssize_t n = header.parse(packet, sz);
+		if(n == -1 or not header.is_response() or header.qdcount != 1) {
+			stats.stray++;
+			continue;
+		}
+
+		auto iter = inflight.find(header.id);
+		if(iter == inflight.end()) {
+			stats.stray++;
+			continue;
+		}
+
+		n = question.parse(n, packet, sz);
+		if(n == -1 or strncasecmp(question.qname, iter->second.qname, strlen(iter->second.qname)) != 0) {
+			stats.stray++;
+			continue;
+		}
+
+		inflight_query q = iter->second;
+
+		inflight.erase(iter);
+
+		resolver& r = resolvers[q.resolver];
+
+		if(not q.lost)
+			r.outstanding--;
+
+		if(q.w.owner == nullptr)
+			continue;
+
+		if((dns_rcode)header.rcode == dns_rcode::NXDOMAIN) {
+			fprintf(stderr, "stream %u: no such name under %s\n", q.w.stream, zone);
+			q.w.owner->failed = true;
+			continue;
+		}
+
+		/*
+		 * a SERVFAIL to a PUT is the server turning the request away while
+		 * its upstream queue is full: no fault of the resolver's, the
+		 * request waits a little longer each time before going again
+		 */
+
+		if((dns_rcode)header.rcode == dns_rcode::SERVFAIL and q.w.op == tunnel_op::PUT and not q.lost) {
+
+			stats.busy++;
+
+			work w = q.w;
+
+			if(++w.busy >= BUSY_TRIES_MAX) {
+				fprintf(stderr, "stream %u: giving up, server busy after %u tries\n", w.stream, w.busy);
+				w.owner->failed = true;
+				continue;
+			}
+
+			const uint64_t backoff = std::min((uint64_t)BUSY_BACKOFF_MIN_USEC << std::min(w.busy, 8U), (uint64_t)BUSY_BACKOFF_MAX_USEC);
+
+			w.owner->delayed.insert(std::make_pair(now + backoff, w));
+			continue;
+		}
+
+		if(not header.tc and (dns_rcode)header.rcode == dns_rcode::NOERROR) {
+			for(; count < header.ancount and count < TUNNEL_ANSWERS_MAX; count++)
+				if((n = answers[count].parse(n, packet, sz)) == -1)
+					break;
+		}
+
+		if(n == -1 or count == 0 or reply.unpack(config->qtype, answers, count, payload, sizeof(payload)) == -1) {
+
+			if(not q.lost) {
+				on_resolver_loss(q.resolver, q.w, q.t_sent, now);
+				on_work_loss(q.w);
+			}
+
+			continue;
+		}
+
+		/*
+		 * an answer to a query already given up on and sent again: its data
+		 * is as good as any, the pending and error verdicts are stale
+		 */
+
+		if(q.lost) {
+
+			if(reply.status & (TUNNEL_STATUS_PENDING | TUNNEL_STATUS_ERROR))
+				continue;
+
+			stats.late++;
+
+			q.w.owner->on_reply(q.w, reply, now, 0);
+			continue;
+		}
+
+		stats.answers++;
+
+		if(reply.status & TUNNEL_STATUS_PENDING)
+			stats.pending++;
+
+		if(reply.status & TUNNEL_STATUS_DATA) {
+			stats.data_replies++;
+			stats.data_bytes += reply.data_sz;
+		}
+
+		r.on_answer(now - q.t_sent, q.w.tries > 0);
+
+		loss *= 1 - LOSS_EWMA_WEIGHT;
+
+		if(config->verbose) {
+			fprintf(config->fp, "<- id %5u %s seq %u status %02x total %ld data (%d) rtt %.1fms resolver %zu\n",
+					header.id, tunnel_op_str(q.w.op), q.w.seq, reply.status,
+					reply.total == TUNNEL_TOTAL_UNKNOWN ? -1L : (long)reply.total,
+					(int)reply.data_sz, (now - q.t_sent) / 1000.0, q.resolver);
+		}
+
+		q.w.owner->on_reply(q.w, reply, now, std::max(r.cc.srtt / 2, (uint64_t)10000));
+	}
+}
+
+/*
+ * a query past its resolver's RTO is lost and its work sent again, but the
+ * entry lingers until RTO_MAX_USEC so a late answer still counts
+ */
+
+void tunnel_client::expire(uint64_t now) {
+
+	for(auto iter = inflight.begin(); iter != inflight.end(); ) {
+
+		inflight_query& q = iter->second;
+
+		if(q.lost) {
+
+			if(now - q.t_sent >= RTO_MAX_USEC)
+				iter = inflight.erase(iter);
+			else
+				iter++;
+
+			continue;
+		}
+
+		resolver& r = resolvers[q.resolver];
+
+		if(now - q.t_sent < r.cc.rto()) {
+			iter++;
+			continue;
+		}
+
+		r.outstanding--;
+
+		if(q.w.owner == nullptr) {
+			iter = inflight.erase(iter);
+			continue;
+		}
+
+		on_resolver_loss(q.resolver, q.w, q.t_sent, now);
+		on_work_loss(q.w);
+
+		q.lost = true;
+		iter++;
+	}
+}
+
+void tunnel_client::add(transfer *t) {
+
+	t->chunk_sz = chunk_sz;
+
+	transfers.push_back(t);
+}
+
+/*
+ * forget a finished transfer: whatever of it is still in flight is orphaned
+ * and its stream closed on the server, best effort
+ */
+
+void tunnel_client::remove(transfer *t) {
+
+	work w;
+
+	transfers.erase(std::remove(transfers.begin(), transfers.end(), t), transfers.end());
+
+	for(auto& q : inflight)
+		if(q.second.w.owner == t)
+			q.second.w.owner = nullptr;
+
+	w.op = tunnel_op::CLOSE;
+	w.stream = t->stream;
+
+	const uint64_t now = now_usec();
+	const size_t i = pick(now, false);
+
+	if(i != SIZE_MAX)
+		send_work(w, i, now);
+}
+
+/*
+ * round robin over the transfers so concurrent streams share the window
+ */
+
+bool tunnel_client::next_work(uint64_t now, work *w) {
+
+	for(size_t i = 0; i < transfers.size(); i++) {
+
+		transfer *t = transfers.front();
+
+		transfers.pop_front();
+		transfers.push_back(t);
+
+		if(t->next_work(now, w, redundancy()))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * repair chunks per data chunk: losing a fraction loss of a block's k + r
+ * chunks leaves k when r / k >= loss / (1 - loss), with some margin
+ */
+
+double tunnel_client::redundancy() const {
+
+	if(config->fec_ratio <= 0)
+		return 0;
+
+	const double p = std::min(loss, 0.5);
+
+	return std::max(config->fec_ratio, std::min(FEC_LOSS_FACTOR * p / (1 - p), FEC_RATIO_MAX));
+}
+
+int tunnel_client::step(uint64_t now) {
+
+	work w;
+
+	expire(now);
+
+	for(size_t i; (i = pick(now, true)) != SIZE_MAX and next_work(now, &w); )
+		if(send_work(w, i, now) == -1)
+			return -1;
+
+	return 0;
+}
+
+uint64_t tunnel_client::deadline(uint64_t now) const {
+
+	uint64_t t = now + RTO_MAX_USEC;
+
+	for(const transfer *x : transfers)
+		t = std::min(t, x->next_due());
+
+	for(const auto& q : inflight)
+		if(not q.second.lost)
+			t = std::min(t, q.second.t_sent + resolvers[q.second.resolver].cc.rto());
+
+	for(const resolver& r : resolvers)
+		if(r.quarantined_until > now)
+			t = std::min(t, r.quarantined_until);
+
+	return t;
+}
+
+int tunnel_client::run(transfer& t) {
+
+	add(&t);
+
+	while(not t.done and not t.failed and not stop) {
+
+		uint64_t now = now_usec();
+
+		if(step(now) == -1)
+			break;
+
+		uint64_t due = deadline(now);
+		uint64_t wait = due > now ? due - now : 0;
+
+		fd_set rfds;
+		timeval tv;
+
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+
+		int left = select(fd + 1, &rfds, nullptr, nullptr, &tv);
+
+		if(left == -1) {
+
+			if(errno == EINTR)
+				continue;
+
+			perror("select()");
+			break;
+		}
+
+		if(left > 0)
+			receive(now_usec());
+	}
+
+	remove(&t);
+
+	return t.done ? 0 : -1;
+}
+
+/*
+ * local http proxy: a connection is read until a whole request is in, which
+ * then becomes a stream whose response is written straight back to it
+ */
+
+struct proxy_connection {
+	int fd = -1;
+	std::string buf;
+	transfer *t = nullptr;
+};
+
+void proxy_reply(int fd, const char *status) {
+
+	std::string s = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+	write_all(fd, s.data(), s.size());
+}
+
+void proxy_close(tunnel_client& client, proxy_connection& c) {
+
+	if(c.t != nullptr) {
+
+		if(c.t->failed and c.t->written == 0)
+			proxy_reply(c.fd, "502 Bad Gateway");
+
+		client.remove(c.t);
+
+		delete c.t;
+		c.t = nullptr;
+	}
+
+	close(c.fd);
+	c.fd = -1;
+}
+
+void proxy_read(configuration *config, tunnel_client& client, proxy_connection& c, uint16_t *next_stream) {
+
+	char data[DATA_SZ];
+	http_request request;
+
+	ssize_t sz = read(c.fd, data, sizeof(data));
+
+	if(sz <= 0) {
+		proxy_close(client, c);
+		return;
+	}
+
+	c.buf.append(data, sz);
+
+	ssize_t n = request.parse_message(c.buf.data(), c.buf.size());
+
+	if(n == 0)
+		return;
+
+	if(n == -1) {
+		proxy_reply(c.fd, "501 Not Implemented");
+		proxy_close(client, c);
+		return;
+	}
+
+	if(config->verbose)
+		fprintf(config->fp, "stream %u: %s %s\n", *next_stream, http_method_str(request.method), request.url().c_str());
+
+	c.t = new transfer;
+
+	if(c.t->init((*next_stream)++, request.serialize(), tunnel_query::capacity(client.zone), c.fd, config->codings) == -1) {
+		delete c.t;
+		c.t = nullptr;
+		proxy_reply(c.fd, "500 Internal Server Error");
+		proxy_close(client, c);
+		return;
+	}
+
+	client.add(c.t);
+}
+
+int proxy(configuration *config, tunnel_client& client) {
+
+	sockaddr_in sin;
+
+	std::map<int, proxy_connection> connections;
+
+	uint16_t next_stream = 0;
+
+	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(listenfd == -1) {
+		perror("socket()");
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(config->listen_port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(bind(listenfd, (const sockaddr *)&sin, sizeof(sin)) == -1) {
+		perror("bind()");
+		return -1;
+	}
+
+	if(listen(listenfd, SOMAXCONN) == -1) {
+		perror("listen()");
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if(config->verbose)
+		fprintf(config->fp, "proxy on 127.0.0.1:%u, session %08x\n", config->listen_port, client.session);
+
+	while(not stop) {
+
+		uint64_t now = now_usec();
+
+		if(client.step(now) == -1)
+			break;
+
+		fd_set rfds;
+		timeval tv;
+
+		FD_ZERO(&rfds);
+		FD_SET(client.fd, &rfds);
+		FD_SET(listenfd, &rfds);
+
+		int maxfd = std::max(client.fd, listenfd);
+
+		for(const auto& c : connections) {
+			if(c.second.t == nullptr) {
+				FD_SET(c.first, &rfds);
+				maxfd = std::max(maxfd, c.first);
+			}
+		}
+
+		uint64_t due = client.deadline(now);
+		uint64_t wait = due > now ? due - now : 0;
+
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+
+		int left = select(maxfd + 1, &rfds, nullptr, nullptr, &tv);
+
+		if(left == -1) {
+
+			if(errno == EINTR)
+				continue;
+
+			perror("select()");
+			break;
+		}
+
+		if(left > 0 and FD_ISSET(client.fd, &rfds))
+			client.receive(now_usec());
+
+		if(left > 0 and FD_ISSET(listenfd, &rfds)) {
+
+			int fd = accept(listenfd, nullptr, nullptr);
+
+			if(fd == -1)
+				perror("accept()");
+			else if(fd >= FD_SETSIZE)
+				close(fd);
+			else
+				connections[fd].fd = fd;
+		}
+
+		for(auto iter = connections.begin(); iter != connections.end(); ) {
+
+			proxy_connection& c = iter->second;
+
+			if(c.t == nullptr and left > 0 and FD_ISSET(c.fd, &rfds))
+				proxy_read(config, client, c, &next_stream);
+			else if(c.t != nullptr and (c.t->done or c.t->failed))
+				proxy_close(client, c);
+
+			if(c.fd == -1)
+				iter = connections.erase(iter);
+			else
+				iter++;
+		}
+	}
+
+	for(auto& c : connections)
+		proxy_close(client, c.second);
+
+	close(listenfd);
+
+	return 0;
+}
+
+void eprintf(int errnum, const char *format, ...) {
+
+    va_list ap;
+    char eb[256];
+    char s[256];
+
+    va_start(ap, format);
+    vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+
+    fprintf(stderr, "%s: %s\n", s, strerror_r(errnum, eb, sizeof(eb)));
+}
+
+int main(int argc, char **argv) {
+
+	configuration config;
+
+	http_request request;
+
+	int lastopt = cliconfig(&config, argc, argv);
+
+	if (argc - lastopt != (config.listen_port == 0 ? 1 : 0)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, sighandler_stop);
+	signal(SIGTERM, sighandler_stop);
+
+	tunnel_client client(&config);
+
+	if(client.open() == -1)
+		exit(EXIT_FAILURE);
+
+	if(config.listen_port != 0)
+		exit(proxy(&config, client) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if(request.parse_url(argv[lastopt]) == -1) {
+		fprintf(stderr, "invalid url: %s\n", argv[lastopt]);
+		exit(EXIT_FAILURE);
+	}
+
+	request.method = config.method;
+	request.headers = config.headers;
+
+	for(const auto& field : config.form)
+		request.form[field.first] = field.second;
+
+	transfer t;
+
+	const size_t fragment_sz = tunnel_query::capacity(client.zone);
+
+	if(t.init(0, request.serialize(), fragment_sz, fileno(config.out), config.codings) == -1) {
+		fprintf(stderr, "couldn't fragment request under %s\n", client.zone);
+		exit(EXIT_FAILURE);
+	}
+
+	const uint64_t t0 = now_usec();
+
+	int result = client.run(t);
+
+	const double secs = (now_usec() - t0) / 1e6;
+
+	if(config.verbose or result == -1) {
+		fprintf(config.fp, "session %08x: %s %ld bytes in %.3fs (%.0f bytes/s)\n",
+				client.session, result == 0 ? "received" : "failed after",
+				(long)t.delivered, secs, secs > 0 ? t.delivered / secs : 0.0);
+		if(t.unz.method != coding::IDENTITY or t.written != t.delivered)
+			fprintf(config.fp, "coding: %s %ld bytes tunneled (%.1f%%)\n", coding_str(t.unz.method),
+					(long)t.written, t.delivered > 0 ? 100.0 * t.written / t.delivered : 0.0);
+		fprintf(config.fp, "queries: %ld answers: %ld retransmits: %ld pending: %ld late: %ld stray: %ld busy: %ld\n",
+				(long)client.stats.queries, (long)client.stats.answers, (long)client.stats.retransmits,
+				(long)client.stats.pending, (long)client.stats.late, (long)client.stats.stray, (long)client.stats.busy);
+		fprintf(config.fp, "encoding: %s chunk: %u bytes, %.1f data bytes/reply\n",
+				dns_type_str(config.qtype), client.chunk_sz,
+				client.stats.data_replies > 0 ? (double)client.stats.data_bytes / client.stats.data_replies : 0.0);
+		fprintf(config.fp, "fec: repairs: %ld recovered: %ld chunks, redundancy %.2f at %.1f%% loss\n",
+				(long)t.repairs_sent, (long)t.recovered, client.redundancy(), client.loss * 100);
+
+		for(const resolver& r : client.resolvers) {
+			char r_str[256];
+			r.sprint(r_str, sizeof(r_str));
+			fprintf(config.fp, "resolver %s\n", r_str);
+		}
+	}
+
+	if(config.out != stdout)
+		fclose(config.out);
+
+	exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
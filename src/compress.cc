@@ -0,0 +1,539 @@
+#include <cstring>
+
+#include <vector>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <80over53/compress.hh>
+
+#define dfprintf(...)
+
+#define DEFLATE_LEVEL 6
+#define ZSTD_LEVEL    3
+
+/*
+ * deflate holds (1 << (windowBits + 2)) + (1 << (memLevel + 9)) and inflate
+ * its window, zstd at level 3 about a 2MB window and tables compressing and
+ * its window decompressing, each plus the state around them
+ */
+
+#define DEFLATE_FOOTPRINT  ((256 << 10) + (8 << 10))
+#define INFLATE_FOOTPRINT  ((32 << 10) + (8 << 10))
+#define ZSTD_C_FOOTPRINT   (1300 << 10)
+#define ZSTD_D_FOOTPRINT   ((2 << 20) + (160 << 10))
+
+const char *coding_str(coding x) {
+	switch(x) {
+		case coding::IDENTITY: return "identity";
+		case coding::DEFLATE:  return "deflate";
+		case coding::ZSTD:     return "zstd";
+	}
+
+	return nullptr;
+}
+
+bool coding_available(coding x) {
+	switch(x) {
+		case coding::IDENTITY:
+		case coding::DEFLATE:
+			return true;
+		case coding::ZSTD:
+#ifdef HAVE_ZSTD
+			return true;
+#else
+			return false;
+#endif
+	}
+
+	return false;
+}
+
+size_t compress_footprint(coding x) {
+	switch(x) {
+		case coding::IDENTITY: return 0;
+		case coding::DEFLATE:  return DEFLATE_FOOTPRINT;
+		case coding::ZSTD:     return ZSTD_C_FOOTPRINT;
+	}
+
+	return 0;
+}
+
+size_t decompress_footprint(coding x) {
+	switch(x) {
+		case coding::IDENTITY: return 0;
+		case coding::DEFLATE:  return INFLATE_FOOTPRINT;
+		case coding::ZSTD:     return ZSTD_D_FOOTPRINT;
+	}
+
+	return 0;
+}
+
+/*
+ * idle contexts of one kind kept by each thread, destroyed with it
+ */
+
+template <typename T> struct context_pool {
+
+	std::vector<T *> idle;
+
+	void (*destroy)(T *);
+
+	context_pool(void (*my_destroy)(T *)) : destroy(my_destroy) {}
+
+	~context_pool() {
+		for(T *x : idle)
+			destroy(x);
+	}
+
+	T *take() {
+
+		if(idle.empty())
+			return nullptr;
+
+		T *x = idle.back();
+		idle.pop_back();
+
+		return x;
+	}
+
+	void give(T *x) {
+
+		if(idle.size() < COMPRESS_POOL_MAX)
+			idle.push_back(x);
+		else
+			destroy(x);
+	}
+
+	void trim() {
+
+		for(T *x : idle)
+			destroy(x);
+
+		idle.clear();
+	}
+};
+
+static void deflate_destroy(z_stream *z) {
+	deflateEnd(z);
+	delete z;
+}
+
+static void inflate_destroy(z_stream *z) {
+	inflateEnd(z);
+	delete z;
+}
+
+static thread_local context_pool<z_stream> deflate_pool(deflate_destroy);
+static thread_local context_pool<z_stream> inflate_pool(inflate_destroy);
+
+#ifdef HAVE_ZSTD
+
+static void zstd_cctx_destroy(ZSTD_CCtx *x) {
+	ZSTD_freeCCtx(x);
+}
+
+static void zstd_dctx_destroy(ZSTD_DCtx *x) {
+	ZSTD_freeDCtx(x);
+}
+
+static thread_local context_pool<ZSTD_CCtx> zstd_cctx_pool(zstd_cctx_destroy);
+static thread_local context_pool<ZSTD_DCtx> zstd_dctx_pool(zstd_dctx_destroy);
+
+#endif
+
+static thread_local uint8_t scratch[COMPRESS_SCRATCH_SZ];
+
+/*
+ * what this thread's idle contexts hold, and freeing them
+ */
+
+size_t compress_pools_footprint() {
+
+	size_t sz = deflate_pool.idle.size() * DEFLATE_FOOTPRINT + inflate_pool.idle.size() * INFLATE_FOOTPRINT;
+
+#ifdef HAVE_ZSTD
+	sz += zstd_cctx_pool.idle.size() * ZSTD_C_FOOTPRINT + zstd_dctx_pool.idle.size() * ZSTD_D_FOOTPRINT;
+#endif
+
+	return sz;
+}
+
+void compress_pools_trim() {
+
+	deflate_pool.trim();
+	inflate_pool.trim();
+
+#ifdef HAVE_ZSTD
+	zstd_cctx_pool.trim();
+	zstd_dctx_pool.trim();
+#endif
+}
+
+int compressor::begin(coding my_method) {
+
+	end();
+
+	method = my_method;
+
+	switch(method) {
+
+		case coding::IDENTITY:
+
+			return 0;
+
+		case coding::DEFLATE: {
+
+			z_stream *z = deflate_pool.take();
+
+			if(z != nullptr) {
+				deflateReset(z);
+			} else {
+				z = new z_stream;
+				memset(z, 0, sizeof(*z));
+				if(deflateInit(z, DEFLATE_LEVEL) != Z_OK) {
+					delete z;
+					break;
+				}
+			}
+
+			ctx = z;
+			return 0;
+		}
+
+		case coding::ZSTD: {
+
+#ifdef HAVE_ZSTD
+			ZSTD_CCtx *z = zstd_cctx_pool.take();
+
+			if(z != nullptr)
+				ZSTD_CCtx_reset(z, ZSTD_reset_session_only);
+			else if((z = ZSTD_createCCtx()) == nullptr)
+				break;
+
+			ZSTD_CCtx_setParameter(z, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+
+			ctx = z;
+			return 0;
+#else
+			break;
+#endif
+		}
+	}
+
+	method = coding::IDENTITY;
+
+	return -1;
+}
+
+/*
+ * where compressor output goes: room() is where the next of it is written,
+ * wrote() takes what was, through the scratch buffer onto a string or
+ * straight into a buffer chain's segments
+ */
+
+struct string_output {
+
+	std::string *out;
+
+	void copy(const void *data, size_t sz) {
+		out->append((const char *)data, sz);
+	}
+
+	uint8_t *room(size_t *sz) {
+		*sz = sizeof(scratch);
+		return scratch;
+	}
+
+	void wrote(size_t sz) {
+		out->append((const char *)scratch, sz);
+	}
+};
+
+struct chain_output {
+
+	buffer_chain *out;
+	chain_slice written;
+
+	void copy(const void *data, size_t sz) {
+		out->append(data, sz);
+	}
+
+	uint8_t *room(size_t *sz) {
+		written = chain_room(CHAIN_ROOM_MIN);
+		*sz = written.sz;
+		return written.data();
+	}
+
+	void wrote(size_t sz) {
+		chain_wrote(&written, sz);
+		out->append(written);
+		chain_release(written.segment);
+	}
+};
+
+/*
+ * compress data_sz bytes of data onto out, flushing everything out at finish
+ */
+
+template<typename output>
+static int compress_update(compressor *c, const void *data, size_t data_sz, output& out, bool finish) {
+
+	switch(c->method) {
+
+		case coding::IDENTITY:
+
+			out.copy(data, data_sz);
+			return 0;
+
+		case coding::DEFLATE: {
+
+			z_stream *z = (z_stream *)c->ctx;
+
+			z->next_in = (Bytef *)data;
+			z->avail_in = data_sz;
+
+			int result;
+
+			do {
+				size_t room_sz;
+
+				z->next_out = out.room(&room_sz);
+				z->avail_out = room_sz;
+
+				result = deflate(z, finish ? Z_FINISH : Z_NO_FLUSH);
+
+				out.wrote(result == Z_STREAM_ERROR ? 0 : room_sz - z->avail_out);
+
+				if(result == Z_STREAM_ERROR)
+					return -1;
+
+			} while(z->avail_out == 0 or (finish and result != Z_STREAM_END));
+
+			return 0;
+		}
+
+		case coding::ZSTD: {
+
+#ifdef HAVE_ZSTD
+			ZSTD_CCtx *z = (ZSTD_CCtx *)c->ctx;
+
+			ZSTD_inBuffer in = { data, data_sz, 0 };
+
+			size_t left;
+
+			do {
+				size_t room_sz;
+
+				ZSTD_outBuffer o;
+
+				o.dst = out.room(&room_sz);
+				o.size = room_sz;
+				o.pos = 0;
+
+				left = ZSTD_compressStream2(z, &o, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+
+				out.wrote(ZSTD_isError(left) ? 0 : o.pos);
+
+				if(ZSTD_isError(left))
+					return -1;
+
+			} while(finish ? left != 0 : in.pos < in.size);
+
+			return 0;
+#else
+			return -1;
+#endif
+		}
+	}
+
+	return -1;
+}
+
+int compressor::update(const void *data, size_t data_sz, std::string *out, bool finish) {
+
+	string_output o = { out };
+
+	return compress_update(this, data, data_sz, o, finish);
+}
+
+int compressor::update(const void *data, size_t data_sz, buffer_chain *out, bool finish) {
+
+	chain_output o = { out, chain_slice() };
+
+	return compress_update(this, data, data_sz, o, finish);
+}
+
+void compressor::end() {
+
+	if(ctx != nullptr) {
+
+		switch(method) {
+
+			case coding::DEFLATE:
+				deflate_pool.give((z_stream *)ctx);
+				break;
+
+#ifdef HAVE_ZSTD
+			case coding::ZSTD:
+				zstd_cctx_pool.give((ZSTD_CCtx *)ctx);
+				break;
+#endif
+
+			default:
+				break;
+		}
+	}
+
+	ctx = nullptr;
+	method = coding::IDENTITY;
+}
+
+int decompressor::begin(coding my_method) {
+
+	end();
+
+	method = my_method;
+
+	switch(method) {
+
+		case coding::IDENTITY:
+
+			return 0;
+
+		case coding::DEFLATE: {
+
+			z_stream *z = inflate_pool.take();
+
+			if(z != nullptr) {
+				inflateReset(z);
+			} else {
+				z = new z_stream;
+				memset(z, 0, sizeof(*z));
+				if(inflateInit(z) != Z_OK) {
+					delete z;
+					break;
+				}
+			}
+
+			ctx = z;
+			return 0;
+		}
+
+		case coding::ZSTD: {
+
+#ifdef HAVE_ZSTD
+			ZSTD_DCtx *z = zstd_dctx_pool.take();
+
+			if(z != nullptr)
+				ZSTD_DCtx_reset(z, ZSTD_reset_session_only);
+			else if((z = ZSTD_createDCtx()) == nullptr)
+				break;
+
+			ctx = z;
+			return 0;
+#else
+			break;
+#endif
+		}
+	}
+
+	method = coding::IDENTITY;
+
+	return -1;
+}
+
+/*
+ * decompress data_sz bytes of data onto out, -1 if they are corrupt
+ */
+
+int decompressor::update(const void *data, size_t data_sz, std::string *out) {
+
+	switch(method) {
+
+		case coding::IDENTITY:
+
+			out->append((const char *)data, data_sz);
+			return 0;
+
+		case coding::DEFLATE: {
+
+			z_stream *z = (z_stream *)ctx;
+
+			z->next_in = (Bytef *)data;
+			z->avail_in = data_sz;
+
+			do {
+				z->next_out = scratch;
+				z->avail_out = sizeof(scratch);
+
+				int result = inflate(z, Z_NO_FLUSH);
+
+				if(result != Z_OK and result != Z_STREAM_END and result != Z_BUF_ERROR)
+					return -1;
+
+				out->append((const char *)scratch, sizeof(scratch) - z->avail_out);
+
+				if(result == Z_STREAM_END)
+					break;
+
+			} while(z->avail_in > 0 or z->avail_out == 0);
+
+			return 0;
+		}
+
+		case coding::ZSTD: {
+
+#ifdef HAVE_ZSTD
+			ZSTD_DCtx *z = (ZSTD_DCtx *)ctx;
+
+			ZSTD_inBuffer in = { data, data_sz, 0 };
+			ZSTD_outBuffer o;
+
+			do {
+				o = { scratch, sizeof(scratch), 0 };
+
+				if(ZSTD_isError(ZSTD_decompressStream(z, &o, &in)))
+					return -1;
+
+				out->append((const char *)scratch, o.pos);
+
+			} while(in.pos < in.size or o.pos == o.size);
+
+			return 0;
+#else
+			return -1;
+#endif
+		}
+	}
+
+	return -1;
+}
+
+void decompressor::end() {
+
+	if(ctx != nullptr) {
+
+		switch(method) {
+
+			case coding::DEFLATE:
+				inflate_pool.give((z_stream *)ctx);
+				break;
+
+#ifdef HAVE_ZSTD
+			case coding::ZSTD:
+				zstd_dctx_pool.give((ZSTD_DCtx *)ctx);
+				break;
+#endif
+
+			default:
+				break;
+		}
+	}
+
+	ctx = nullptr;
+	method = coding::IDENTITY;
+}
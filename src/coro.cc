@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <new>
+#include <vector>
+
+#include <80over53/coro.hh>
+
+#define dfprintf(...)
+
+/*
+ * free frames of each size class, class i holding frames of up to
+ * (i + 1) * CORO_FRAME_ALIGN bytes
+ */
+
+struct coro_frame_pool {
+
+	std::vector<void *> free[CORO_FRAME_CLASSES];
+
+	coro_frame_stats stats;
+
+	~coro_frame_pool() {
+		trim();
+	}
+
+	void trim() {
+
+		for(int i = 0; i < CORO_FRAME_CLASSES; i++) {
+			for(void *p : free[i])
+				::operator delete(p);
+			std::vector<void *>().swap(free[i]);
+		}
+
+		stats.pooled = 0;
+	}
+};
+
+static thread_local coro_frame_pool pool;
+
+static size_t frame_class(size_t sz) {
+	return (sz + CORO_FRAME_ALIGN - 1) / CORO_FRAME_ALIGN - 1;
+}
+
+void *coro_frame_alloc(size_t sz) {
+
+	const size_t i = frame_class(sz);
+
+	pool.stats.live++;
+
+	if(i >= CORO_FRAME_CLASSES)
+		return ::operator new(sz);
+
+	if(not pool.free[i].empty()) {
+
+		void *p = pool.free[i].back();
+
+		pool.free[i].pop_back();
+
+		pool.stats.reused++;
+		pool.stats.pooled -= (i + 1) * CORO_FRAME_ALIGN;
+
+		return p;
+	}
+
+	pool.stats.allocated++;
+
+	dfprintf(stderr, "coroutine frame: %ld bytes, class %ld\n", (long)sz, (long)i);
+
+	return ::operator new((i + 1) * CORO_FRAME_ALIGN);
+}
+
+void coro_frame_free(void *p, size_t sz) {
+
+	const size_t i = frame_class(sz);
+
+	pool.stats.live--;
+
+	if(i >= CORO_FRAME_CLASSES) {
+		::operator delete(p);
+		return;
+	}
+
+	pool.free[i].push_back(p);
+
+	pool.stats.pooled += (i + 1) * CORO_FRAME_ALIGN;
+}
+
+const coro_frame_stats& coro_frames() {
+	return pool.stats;
+}
+
+size_t coro_frames_footprint() {
+	return pool.stats.pooled;
+}
+
+void coro_frames_trim() {
+	pool.trim();
+}
@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
 #include <arpa/inet.h>
 
 #include <80over53/dns.hh>
@@ -48,6 +49,8 @@ const char *dns_type_str(dns_type x) {
 		case dns_type::NSEC: return "NSEC";
 		case dns_type::NSEC3: return "NSEC3";
 		case dns_type::NSEC3PARAM: return "NSEC3PARAM";
+		case dns_type::NULL_: return "NULL";
+		case dns_type::OPT: return "OPT";
 		case dns_type::PTR: return "PTR";
 		case dns_type::RRSIG: return "RRSIG";
 		case dns_type::RP: return "RP";
@@ -94,20 +97,83 @@ ssize_t dns_header::parse(const void *data, size_t data_sz) {
 	return sizeof(dns_header);
 }
 
+ssize_t dns_header::write(void *data, size_t data_sz) const {
+
+	if(data_sz < sizeof(dns_header))
+		return -1;
+
+	dns_header *h = (dns_header *)data;
+
+	memcpy(h, this, sizeof(dns_header));
+
+	h->id = htons(id);
+	h->qdcount = htons(qdcount);
+	h->ancount = htons(ancount);
+	h->nscount = htons(nscount);
+	h->arcount = htons(arcount);
+
+	return sizeof(dns_header);
+}
+
 ssize_t dns_rr::parse(size_t offset, const void *data, size_t data_sz) {
 
 	ssize_t n = this->dns_question::parse(offset, data, data_sz);
-	if(n == -1)
+	if(n == -1 or (size_t)n + 6 > data_sz)
+		return -1;
+
+	const uint8_t *p = (const uint8_t *)data + n;
+
+	ttl = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	rdata_sz = ((size_t)p[4] << 8) | p[5];
+
+	if(rdata_sz > sizeof(rdata) or (size_t)n + 6 + rdata_sz > data_sz)
+		return -1;
+
+	memcpy(rdata, p + 6, rdata_sz);
+
+	return n + 6 + rdata_sz;
+}
+
+ssize_t dns_rr::write(size_t offset, void *data, size_t data_sz) const {
+
+	ssize_t n;
+
+	if(name_offset != 0) {
+
+		if(offset + 2 > data_sz)
+			return -1;
+
+		uint16_t pointer = htons(DNS_NAME_FORMAT_POINTER << 8 | name_offset);
+		memcpy((uint8_t *)data + offset, &pointer, sizeof(pointer));
+
+		n = offset + 2;
+
+	} else {
+
+		n = encode_name(offset, data, data_sz, qname);
+		if(n == -1)
+			return -1;
+	}
+
+	if((size_t)n + 10 + rdata_sz > data_sz)
 		return -1;
 
-	uint16_t *u16s = (uint16_t *)((uint8_t *)data + n);
+	uint8_t *p = (uint8_t *)data + n;
 
-	ttl = ntohs(u16s[0]);
-	rdata_sz = ntohs(u16s[1]);
+	p[0] = (uint16_t)qtype >> 8;
+	p[1] = (uint16_t)qtype & 0xff;
+	p[2] = (uint16_t)qclass >> 8;
+	p[3] = (uint16_t)qclass & 0xff;
+	p[4] = ttl >> 24;
+	p[5] = ttl >> 16;
+	p[6] = ttl >> 8;
+	p[7] = ttl;
+	p[8] = rdata_sz >> 8;
+	p[9] = rdata_sz & 0xff;
 
-	memcpy(rdata, u16s + 2, rdata_sz);
+	memcpy(p + 10, rdata, rdata_sz);
 
-	return n + 4 + rdata_sz;
+	return n + 10 + rdata_sz;
 }
 
 int dns_rr::sprint(char *s, size_t sz) {
@@ -123,16 +189,225 @@ int dns_rr::sprint(char *s, size_t sz) {
 }
 
 
+ssize_t dns_rr_view::parse(size_t offset, const void *data, size_t data_sz) {
+
+	ssize_t n = skip_name(offset, data, data_sz);
+	if(n == -1 or (size_t)n + 10 > data_sz)
+		return -1;
+
+	const uint8_t *p = (const uint8_t *)data + n;
+
+	name_offset = offset;
+
+	type = (dns_type)((p[0] << 8) | p[1]);
+	rclass = (p[2] << 8) | p[3];
+	ttl = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+
+	rdata_offset = n + 10;
+	rdata_sz = ((size_t)p[8] << 8) | p[9];
+
+	if(rdata_offset + rdata_sz > data_sz)
+		return -1;
+
+	return rdata_offset + rdata_sz;
+}
+
+int dns_rr_view::sprint(char *s, size_t sz, const void *data, size_t data_sz) const {
+
+	char name[DNS_NAME_MAX_SZ + 1];
+	size_t name_sz;
+
+	if(expand_name(name_offset, data, data_sz, name, &name_sz) == -1)
+		name_sz = 0;
+
+	char type_str[16];
+	char class_str[16];
+
+	if(dns_type_str(type) != nullptr)
+		snprintf(type_str, sizeof(type_str), "%s", dns_type_str(type));
+	else
+		snprintf(type_str, sizeof(type_str), "TYPE%d", (int)type);
+
+	if(type != dns_type::OPT and dns_class_str((dns_class)rclass) != nullptr)
+		snprintf(class_str, sizeof(class_str), "%s", dns_class_str((dns_class)rclass));
+	else
+		snprintf(class_str, sizeof(class_str), "CLASS%d", (int)rclass);
+
+	return snprintf(s, sz, "%s %s (%d) \"%.*s\" ttl %d rdata (%d)",
+			type_str,
+			class_str,
+			(int)name_sz,
+			(int)name_sz,
+			name,
+			(int)ttl,
+			(int)rdata_sz);
+}
+
+/*
+ * the decoders, by kind. each gets the whole packet, a CNAME's name may
+ * point back into it, and returns -1 for rdata that isn't well formed.
+ */
+
+typedef int (*dns_rdata_decoder)(const dns_rr_view&, const uint8_t *, size_t, dns_rdata *);
+
+static int decode_opt(const dns_rr_view& rr, const uint8_t *data, size_t, dns_rdata *x) {
+
+	const uint8_t *p = data + rr.rdata_offset;
+
+	x->opt.udp_sz = rr.rclass;
+	x->opt.extended_rcode = rr.ttl >> 24;
+	x->opt.version = rr.ttl >> 16;
+	x->opt.dnssec_ok = rr.ttl & 0x8000;
+	x->opt.options = 0;
+
+	for(size_t i = 0; i < rr.rdata_sz; x->opt.options++) {
+
+		if(i + 4 > rr.rdata_sz)
+			return -1;
+
+		i += 4 + (((size_t)p[i + 2] << 8) | p[i + 3]);
+
+		if(i > rr.rdata_sz)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int decode_txt(const dns_rr_view& rr, const uint8_t *data, size_t, dns_rdata *x) {
+
+	const uint8_t *p = data + rr.rdata_offset;
+
+	x->txt.strings = 0;
+	x->txt.data_sz = 0;
+	x->txt.first = nullptr;
+	x->txt.first_sz = 0;
+
+	for(size_t i = 0; i < rr.rdata_sz; x->txt.strings++) {
+
+		const size_t sz = p[i++];
+
+		if(i + sz > rr.rdata_sz)
+			return -1;
+
+		if(x->txt.strings == 0) {
+			x->txt.first = p + i;
+			x->txt.first_sz = sz;
+		}
+
+		x->txt.data_sz += sz;
+
+		i += sz;
+	}
+
+	return x->txt.strings > 0 ? 0 : -1;
+}
+
+static int decode_null(const dns_rr_view& rr, const uint8_t *data, size_t, dns_rdata *x) {
+
+	x->null.data = data + rr.rdata_offset;
+	x->null.data_sz = rr.rdata_sz;
+
+	return 0;
+}
+
+static int decode_aaaa(const dns_rr_view& rr, const uint8_t *data, size_t, dns_rdata *x) {
+
+	if(rr.rdata_sz != sizeof(x->aaaa.address))
+		return -1;
+
+	memcpy(x->aaaa.address, data + rr.rdata_offset, sizeof(x->aaaa.address));
+
+	return 0;
+}
+
+static int decode_cname(const dns_rr_view& rr, const uint8_t *data, size_t data_sz, dns_rdata *x) {
+
+	ssize_t n = expand_name(rr.rdata_offset, data, data_sz, x->cname.name, &x->cname.name_sz);
+
+	return n == -1 or (size_t)n != rr.rdata_offset + rr.rdata_sz ? -1 : 0;
+}
+
+static const dns_rdata_decoder dns_rdata_decoders[DNS_RDATA_KINDS] = {
+	nullptr,
+	decode_opt,
+	decode_txt,
+	decode_null,
+	decode_aaaa,
+	decode_cname
+};
+
+static_assert((size_t)dns_rdata_kind::CNAME + 1 == DNS_RDATA_KINDS, "a decoder for every kind");
+
+/*
+ * decode the rdata of rr in data, 0 if it has no kind (nothing decoded) or
+ * is well formed, -1 if not
+ */
+
+int dns_rdata::decode(const dns_rr_view& rr, const void *data, size_t data_sz) {
+
+	kind = dns_rdata_kind_of(rr.type);
+
+	if(kind == dns_rdata_kind::NONE)
+		return 0;
+
+	return dns_rdata_decoders[(size_t)kind](rr, (const uint8_t *)data, data_sz, this);
+}
+
+int dns_rdata::sprint(char *s, size_t sz) const {
+
+	char address[INET6_ADDRSTRLEN];
+
+	switch(kind) {
+
+		case dns_rdata_kind::OPT:
+			return snprintf(s, sz, "udp %u version %u%s options %ld",
+					opt.udp_sz, opt.version, opt.dnssec_ok ? " do" : "", (long)opt.options);
+
+		case dns_rdata_kind::TXT:
+			return snprintf(s, sz, "%ld strings %ld bytes \"%.*s\"",
+					(long)txt.strings, (long)txt.data_sz, (int)std::min(txt.first_sz, (size_t)32), (const char *)txt.first);
+
+		case dns_rdata_kind::NULL_:
+			return snprintf(s, sz, "%ld bytes", (long)null.data_sz);
+
+		case dns_rdata_kind::AAAA:
+			return snprintf(s, sz, "%s", inet_ntop(AF_INET6, aaaa.address, address, sizeof(address)));
+
+		case dns_rdata_kind::CNAME:
+			return snprintf(s, sz, "\"%.*s\"", (int)cname.name_sz, cname.name);
+
+		default:
+			return snprintf(s, sz, "...");
+	}
+}
+
 ssize_t dns_question::parse(size_t offset, const void *data, size_t data_sz) {
 
 	ssize_t n = expand_name(offset, data, data_sz, qname, &qname_sz);
-	if(n == -1)
+	if(n == -1 or (size_t)n + 4 > data_sz)
+		return -1;
+
+	const uint8_t *p = (const uint8_t *)data + n;
+
+	qtype = (dns_type)((p[0] << 8) | p[1]);
+	qclass = (dns_class)((p[2] << 8) | p[3]);
+
+	return n + 4;
+}
+
+ssize_t dns_question::write(size_t offset, void *data, size_t data_sz) const {
+
+	ssize_t n = encode_name(offset, data, data_sz, qname);
+	if(n == -1 or (size_t)n + 4 > data_sz)
 		return -1;
 
-	uint16_t *u16s = (uint16_t *)((uint8_t *)data + n);
+	uint8_t *p = (uint8_t *)data + n;
 
-	qtype = (dns_type)ntohs(u16s[0]);
-	qclass = (dns_class)ntohs(u16s[1]);
+	p[0] = (uint16_t)qtype >> 8;
+	p[1] = (uint16_t)qtype & 0xff;
+	p[2] = (uint16_t)qclass >> 8;
+	p[3] = (uint16_t)qclass & 0xff;
 
 	return n + 4;
 }
@@ -168,46 +443,134 @@ int dns_header::sprint(char *s, size_t sz) {
 			arcount);
 }
 
-ssize_t expand_name(size_t offset, const void *data, size_t data_sz, char *name, size_t *name_sz) {
+/*
+ * expand the name at offset into dotted text (with a trailing dot), following
+ * compression pointers only backwards so hostile packets can't loop
+ */
 
-	ssize_t n;
+ssize_t expand_name(size_t offset, const void *data, size_t data_sz, char *name, size_t *name_sz) {
 
-	char *tail = name;
+	size_t end = 0;
 
 	*name_sz = 0;
 
-	do {
+	while(offset < data_sz) {
+
+		if(is_name_pointer(offset, data)) {
+
+			if(offset + 2 > data_sz)
+				return -1;
+
+			const size_t pointer_offset = get_pointer_offset(offset, data);
+
+			dfprintf(stderr, "follow pointer @ %d -> %d\n", (int)offset, (int)pointer_offset);
+
+			if(pointer_offset >= offset)
+				return -1;
+
+			if(end == 0)
+				end = offset + 2;
+
+			offset = pointer_offset;
+
+			continue;
+		}
 
 		size_t label_sz;
 
-		n = expand_label(offset, data, data_sz, tail, &label_sz);
+		if(*name_sz + get_label_sz(offset, data) + 1 > DNS_NAME_MAX_SZ)
+			return -1;
+
+		ssize_t n = expand_label(offset, data, data_sz, name + *name_sz, &label_sz);
 		if(n == -1)
 			return -1;
 
 		offset += n;
 
+		if(label_sz == 0) {
+			name[*name_sz] = '\0';
+			return end != 0 ? end : offset;
+		}
+
 		*name_sz += label_sz;
+		name[(*name_sz)++] = '.';
+	}
 
-		tail += label_sz;
-		
-		*tail++ = label_sz ? '.' : '\0';
+	return -1;
+}
+
+/*
+ * encode dotted text as an uncompressed name at offset
+ */
+
+ssize_t encode_name(size_t offset, void *data, size_t data_sz, const char *name) {
+
+	uint8_t *p = (uint8_t *)data;
+
+	while(*name != '\0') {
 
-		if(label_sz)
-			(*name_sz)++;
+		const char *dot = strchr(name, '.');
+		size_t label_sz = dot == nullptr ? strlen(name) : dot - name;
 
-	} while(n != 1 && offset < data_sz);
+		if(label_sz == 0 or label_sz > DNS_LABEL_MAX_SZ or offset + 1 + label_sz > data_sz)
+			return -1;
+
+		p[offset++] = label_sz;
+		memcpy(p + offset, name, label_sz);
+		offset += label_sz;
+
+		name += label_sz;
+		if(*name == '.')
+			name++;
+	}
+
+	if(offset + 1 > data_sz)
+		return -1;
+
+	p[offset++] = 0;
 
 	return offset;
 }
 
+/*
+ * return the offset following the name at offset without expanding it
+ */
+
+ssize_t skip_name(size_t offset, const void *data, size_t data_sz) {
+
+	while(offset < data_sz) {
+
+		if(is_name_pointer(offset, data))
+			return offset + 2 <= data_sz ? (ssize_t)offset + 2 : -1;
+
+		if(not is_name_label(offset, data))
+			return -1;
+
+		size_t label_sz = get_label_sz(offset, data);
+
+		offset += label_sz + 1;
+
+		if(label_sz == 0)
+			return offset;
+	}
+
+	return -1;
+}
 
 ssize_t expand_label(size_t offset, const void *data, size_t data_sz, char *label, size_t *label_sz) {
 
 	dfprintf(stderr, "expanding label @ %d\n", (int)offset);
 
+	if(offset >= data_sz)
+		return -1;
+
 	if(is_name_label(offset, data)) {
 
 		*label_sz = get_label_sz(offset, data);
+
+		if(offset + 1 + *label_sz > data_sz)
+			return -1;
+
 		const char *label_ptr = (const char *)data + offset + 1;
 
 		dfprintf(stderr, "copy label @ %d (%d) \"%.*s\"\n", (int)offset, (int)*label_sz, (int)*label_sz, label_ptr);
@@ -222,6 +585,9 @@ ssize_t expand_label(size_t offset, const void *data, size_t data_sz, char *labe
 
 		dfprintf(stderr, "follow pointer @ %d -> %d\n", (int)offset, (int)pointer_offset);
 
+		if(offset + 2 > data_sz or pointer_offset >= offset)
+			return -1;
+
 		if(expand_label(pointer_offset, data, data_sz, label, label_sz) == -1)
 			return -1;
 
@@ -0,0 +1,180 @@
+#include <cstring>
+
+#include <vector>
+#include <algorithm>
+
+#include <80over53/fec.hh>
+
+#define dfprintf(...)
+
+#define GF_POLY 0x11d
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+/*
+ * build the tables once, on first use from whichever thread
+ */
+
+static bool gf_build() {
+
+	unsigned x = 1;
+
+	for(int i = 0; i < 255; i++) {
+
+		gf_exp[i] = x;
+		gf_log[x] = i;
+
+		x <<= 1;
+		if(x & 0x100)
+			x ^= GF_POLY;
+	}
+
+	for(int i = 255; i < 512; i++)
+		gf_exp[i] = gf_exp[i - 255];
+
+	return true;
+}
+
+static void gf_init() {
+
+	static const bool initialized = gf_build();
+
+	(void)initialized;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+	return a == 0 or b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+	return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * y ^= c * x over sz bytes
+ */
+
+static void gf_addmul(uint8_t *y, const uint8_t *x, uint8_t c, size_t sz) {
+
+	if(c == 0)
+		return;
+
+	const unsigned log_c = gf_log[c];
+
+	for(size_t i = 0; i < sz; i++)
+		if(x[i] != 0)
+			y[i] ^= gf_exp[log_c + gf_log[x[i]]];
+}
+
+static uint8_t cauchy(size_t width, size_t r, size_t i) {
+	return gf_inv((uint8_t)((width + r) ^ i));
+}
+
+/*
+ * repair chunk index of the count data chunks of a width block
+ */
+
+void fec_encode(size_t width, const uint8_t *const *data, size_t count, size_t index, size_t sz, uint8_t *repair) {
+
+	gf_init();
+
+	memset(repair, 0, sz);
+
+	for(size_t i = 0; i < count; i++)
+		gf_addmul(repair, data[i], cauchy(width, index, i), sz);
+}
+
+/*
+ * rebuild the data chunks not present (their buffers are written) from the
+ * present ones and nrepairs repair chunks, returning -1 when there are too
+ * few of them
+ */
+
+int fec_decode(size_t width, uint8_t *const *data, const bool *present, size_t count,
+		const uint8_t *const *repairs, const size_t *indexes, size_t nrepairs, size_t sz) {
+
+	std::vector<size_t> missing;
+
+	gf_init();
+
+	for(size_t i = 0; i < count; i++)
+		if(not present[i])
+			missing.push_back(i);
+
+	const size_t m = missing.size();
+
+	if(m == 0)
+		return 0;
+
+	if(m > nrepairs)
+		return -1;
+
+	for(size_t j = 0; j < m; j++)
+		if(width + indexes[j] >= FEC_SYMBOLS_MAX)
+			return -1;
+
+	/*
+	 * syndromes: the first m repairs less what the present chunks put in
+	 */
+
+	std::vector<std::vector<uint8_t>> s(m, std::vector<uint8_t>(sz));
+	std::vector<std::vector<uint8_t>> a(m, std::vector<uint8_t>(m));
+
+	for(size_t j = 0; j < m; j++) {
+
+		memcpy(s[j].data(), repairs[j], sz);
+
+		for(size_t i = 0; i < count; i++)
+			if(present[i])
+				gf_addmul(s[j].data(), data[i], cauchy(width, indexes[j], i), sz);
+
+		for(size_t t = 0; t < m; t++)
+			a[j][t] = cauchy(width, indexes[j], missing[t]);
+	}
+
+	/*
+	 * gauss-jordan on a, applying the same row operations to s. every square
+	 * submatrix of a Cauchy matrix is invertible, so a pivot always exists.
+	 */
+
+	for(size_t col = 0; col < m; col++) {
+
+		size_t pivot = col;
+
+		while(pivot < m and a[pivot][col] == 0)
+			pivot++;
+
+		if(pivot == m)
+			return -1;
+
+		std::swap(a[col], a[pivot]);
+		std::swap(s[col], s[pivot]);
+
+		const uint8_t inv = gf_inv(a[col][col]);
+
+		for(size_t t = 0; t < m; t++)
+			a[col][t] = gf_mul(a[col][t], inv);
+
+		for(size_t i = 0; i < sz; i++)
+			s[col][i] = gf_mul(s[col][i], inv);
+
+		for(size_t row = 0; row < m; row++) {
+
+			const uint8_t c = a[row][col];
+
+			if(row == col or c == 0)
+				continue;
+
+			for(size_t t = 0; t < m; t++)
+				a[row][t] ^= gf_mul(c, a[col][t]);
+
+			gf_addmul(s[row].data(), s[col].data(), c, sz);
+		}
+	}
+
+	for(size_t t = 0; t < m; t++)
+		memcpy(data[missing[t]], s[t].data(), sz);
+
+	return 0;
+}
@@ -0,0 +1,387 @@
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <80over53/handoff.hh>
+
+#define dfprintf(...)
+
+#define HANDOFF_ACK 'k'
+
+struct handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+};
+
+void handoff_writer::u8(uint8_t x) {
+	out.append((const char *)&x, sizeof(x));
+}
+
+void handoff_writer::u16(uint16_t x) {
+	out.append((const char *)&x, sizeof(x));
+}
+
+void handoff_writer::u32(uint32_t x) {
+	out.append((const char *)&x, sizeof(x));
+}
+
+void handoff_writer::u64(uint64_t x) {
+	out.append((const char *)&x, sizeof(x));
+}
+
+void handoff_writer::str(const std::string& s) {
+	u64(s.size());
+	out += s;
+}
+
+bool handoff_reader::take(void *p, size_t sz) {
+
+	if(failed or in.size() - at < sz) {
+		failed = true;
+		memset(p, 0, sz);
+		return false;
+	}
+
+	memcpy(p, in.data() + at, sz);
+	at += sz;
+
+	return true;
+}
+
+uint8_t handoff_reader::u8() {
+	uint8_t x;
+	take(&x, sizeof(x));
+	return x;
+}
+
+uint16_t handoff_reader::u16() {
+	uint16_t x;
+	take(&x, sizeof(x));
+	return x;
+}
+
+uint32_t handoff_reader::u32() {
+	uint32_t x;
+	take(&x, sizeof(x));
+	return x;
+}
+
+uint64_t handoff_reader::u64() {
+	uint64_t x;
+	take(&x, sizeof(x));
+	return x;
+}
+
+std::string handoff_reader::str() {
+
+	const uint64_t sz = u64();
+
+	if(failed or in.size() - at < sz) {
+		failed = true;
+		return std::string();
+	}
+
+	std::string s = in.substr(at, sz);
+	at += sz;
+
+	return s;
+}
+
+static int handoff_address(const char *path, sockaddr_un *sun) {
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+
+	if(strlen(path) >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(sun->sun_path, path);
+
+	return 0;
+}
+
+/*
+ * listen for the next server at path, replacing what is there, -1 with
+ * errno set if it can't. the listener doesn't block.
+ */
+
+int handoff_listen(const char *path) {
+
+	sockaddr_un sun;
+
+	if(handoff_address(path, &sun) == -1)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return -1;
+
+	unlink(path);
+
+	if(bind(fd, (const sockaddr *)&sun, sizeof(sun)) == -1 or listen(fd, 1) == -1) {
+		const int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * connect to the server running at path, -1 with errno set if there is
+ * none. receiving from it waits HANDOFF_WAIT_MS at most.
+ */
+
+int handoff_connect(const char *path) {
+
+	sockaddr_un sun;
+
+	if(handoff_address(path, &sun) == -1)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return -1;
+
+	timeval tv;
+
+	tv.tv_sec = HANDOFF_WAIT_MS / 1000;
+	tv.tv_usec = HANDOFF_WAIT_MS % 1000 * 1000;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+			or connect(fd, (const sockaddr *)&sun, sizeof(sun)) == -1) {
+		const int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const char *p, size_t sz) {
+
+	while(sz > 0) {
+
+		ssize_t n = write(fd, p, sz);
+
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += n;
+		sz -= n;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, char *p, size_t sz) {
+
+	while(sz > 0) {
+
+		ssize_t n = read(fd, p, sz);
+
+		if(n == 0)
+			errno = ECONNRESET;
+
+		if(n <= 0) {
+			if(n == -1 and errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += n;
+		sz -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * send fd_count fds with the state over the connection fd, -1 with errno
+ * set if it fails
+ */
+
+int handoff_send(int fd, const int *fds, size_t fd_count, const std::string& state) {
+
+	if(fd_count == 0 or fd_count > HANDOFF_FDS_MAX or state.size() > HANDOFF_STATE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	handoff_header header = { HANDOFF_MAGIC, HANDOFF_VERSION, state.size() };
+
+	iovec iov = { &header, sizeof(header) };
+
+	union {
+		cmsghdr align;
+		char data[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+	} control;
+
+	memset(&control, 0, sizeof(control));
+
+	msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+	cmsghdr *c = CMSG_FIRSTHDR(&msg);
+
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+
+	memcpy(CMSG_DATA(c), fds, sizeof(int) * fd_count);
+
+	ssize_t n;
+
+	while((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 and errno == EINTR)
+		;
+
+	if(n == -1)
+		return -1;
+
+	if((size_t)n < sizeof(header) and write_all(fd, (const char *)&header + n, sizeof(header) - n) == -1)
+		return -1;
+
+	dfprintf(stderr, "handoff: sent %ld fds and %ld bytes\n", (long)fd_count, (long)state.size());
+
+	return write_all(fd, state.data(), state.size());
+}
+
+/*
+ * receive at most fd_max fds into fds and the state with them, returning how
+ * many fds came, -1 with errno set if the server sent nothing usable
+ */
+
+ssize_t handoff_receive(int fd, int *fds, size_t fd_max, std::string *state) {
+
+	handoff_header header;
+
+	iovec iov = { &header, sizeof(header) };
+
+	union {
+		cmsghdr align;
+		char data[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+	} control;
+
+	msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
+
+	ssize_t n;
+
+	while((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 and errno == EINTR)
+		;
+
+	if(n == 0)
+		errno = ECONNRESET;
+
+	if(n <= 0)
+		return -1;
+
+	size_t fd_count = 0;
+
+	for(cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+
+		if(c->cmsg_level != SOL_SOCKET or c->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		const size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int *received = (const int *)CMSG_DATA(c);
+
+		for(size_t i = 0; i < count; i++) {
+			if(fd_count < fd_max)
+				fds[fd_count++] = received[i];
+			else
+				close(received[i]);
+		}
+	}
+
+	if((size_t)n < sizeof(header) and read_all(fd, (char *)&header + n, sizeof(header) - n) == -1)
+		goto fail;
+
+	if(header.magic != HANDOFF_MAGIC or header.version != HANDOFF_VERSION or header.size > HANDOFF_STATE_MAX or fd_count == 0) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	state->resize(header.size);
+
+	if(read_all(fd, &(*state)[0], header.size) == -1)
+		goto fail;
+
+	return fd_count;
+
+fail:
+	const int e = errno;
+
+	for(size_t i = 0; i < fd_count; i++)
+		close(fds[i]);
+
+	errno = e;
+
+	return -1;
+}
+
+/*
+ * tell the old server what it sent is taken over
+ */
+
+int handoff_ack(int fd) {
+
+	const char ack = HANDOFF_ACK;
+
+	return write_all(fd, &ack, 1);
+}
+
+/*
+ * wait ms at most for the new server's ack, -1 if it doesn't come
+ */
+
+int handoff_wait_ack(int fd, unsigned ms) {
+
+	pollfd p = { fd, POLLIN, 0 };
+
+	int n;
+
+	while((n = poll(&p, 1, ms)) == -1 and errno == EINTR)
+		;
+
+	if(n <= 0) {
+		if(n == 0)
+			errno = ETIMEDOUT;
+		return -1;
+	}
+
+	char ack;
+
+	if(read_all(fd, &ack, 1) == -1)
+		return -1;
+
+	if(ack != HANDOFF_ACK) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
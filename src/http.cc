@@ -1,4 +1,7 @@
+#include <cerrno>
 #include <cstring>
+#include <cstdlib>
+#include <strings.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -6,6 +9,7 @@
 
 #include <string>
 #include <sstream>
+#include <algorithm>
 
 #include <80over53/http.hh>
 
@@ -64,6 +68,43 @@ sockaddr *http_request::get_sockaddr(sockaddr *sa, socklen_t sa_sz) const {
 	return sa;
 }
 
+/*
+ * every IPv4 address the host resolves to, the count of them or -1 with
+ * errno set
+ */
+
+int http_request::get_addresses(std::vector<sockaddr_in> *addresses) const {
+
+	addrinfo hints;
+	addrinfo *result;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	const int error = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+
+	if(error != 0) {
+		errno = error == EAI_SYSTEM ? errno : ENOENT;
+		return -1;
+	}
+
+	addresses->clear();
+
+	for(addrinfo *x = result; x != nullptr; x = x->ai_next) {
+
+		sockaddr_in sin = *(sockaddr_in *)x->ai_addr;
+
+		sin.sin_port = htons(port);
+
+		addresses->push_back(sin);
+	}
+
+	freeaddrinfo(result);
+
+	return addresses->size();
+}
+
 const char *http_method_str(http_method x) {
 	switch(x) {
 		case http_method::GET:     return "GET";
@@ -101,13 +142,43 @@ std::string http_request::headers_string() const {
 	return ss.str();
 }
 
+/*
+ * whether a POST body is form fields: it is when it says so or says
+ * nothing, anything else passes through as it is
+ */
+
+bool http_request::has_form_body() const {
+
+	auto iter = headers.find("Content-Type");
+
+	if(iter == headers.end())
+		return true;
+
+	const std::string& type = iter->second;
+
+	const size_t end = type.find_first_of("; \t");
+
+	return strcasecmp(type.substr(0, end).c_str(), "application/x-www-form-urlencoded") == 0;
+}
+
+void http_request::set_body(const std::string& s) {
+
+	form.clear();
+	body.clear();
+
+	if(has_form_body())
+		form = parse_form(s);
+	else
+		body = s;
+}
+
 std::string http_request::content() const {
 
 	switch(method) {
 
 		case http_method::POST:
 
-			return form_string();
+			return has_form_body() ? form_string() : body;
 
 		case http_method::GET:
 		case http_method::HEAD:
@@ -128,7 +199,7 @@ std::string http_request::url() const {
 
 	ss << "http" << (ssl ? "s" : "" ) << "://" << host;
 
-	if((ssl and port == 443) or (not ssl and port == 80))
+	if(not ((ssl and port == 443) or (not ssl and port == 80)))
 		ss << ':' << std::dec << port;
 
 	ss << path;
@@ -169,10 +240,518 @@ std::string http_request::to_s() {
 	return ss.str();
 }
 
-int http_request::parse(const dns_question& question, const char *domain) {
+/*
+ * the tunnel form of a request, the method and url on the first line then
+ * the headers and a blank line, then the form string (or the body as it is,
+ * if it isn't a form) as the body
+ *
+ *    POST https://host:8443/path\r\n
+ *    Header: value\r\n
+ *    \r\n
+ *    name=value&name=value
+ */
 
-	if(question.qtype != dns_type::TXT or question.qclass != dns_class::IN)
+std::string http_request::serialize() const {
+
+	std::stringstream ss;
+
+	ss << http_method_str(method) << ' ' << url() << "\r\n";
+
+	ss << headers_string() << "\r\n";
+
+	if(method == http_method::POST)
+		ss << content();
+
+	return ss.str();
+}
+
+http_form parse_form(const std::string& s) {
+
+	http_form form;
+
+	size_t i = 0;
+
+	while(i < s.size()) {
+
+		size_t amp = s.find('&', i);
+		if(amp == std::string::npos)
+			amp = s.size();
+
+		std::string pair = s.substr(i, amp - i);
+
+		size_t eq = pair.find('=');
+
+		if(not pair.empty()) {
+			if(eq == std::string::npos)
+				form[pair] = "";
+			else
+				form[pair.substr(0, eq)] = pair.substr(eq + 1);
+		}
+
+		i = amp + 1;
+	}
+
+	return form;
+}
+
+int http_request::parse_url(const char *s) {
+
+	std::string u(s);
+
+	size_t i;
+
+	if(u.compare(0, 7, "http://") == 0) {
+		ssl = false;
+		i = 7;
+	} else if(u.compare(0, 8, "https://") == 0) {
+		ssl = true;
+		i = 8;
+	} else {
+		return -1;
+	}
+
+	size_t slash = u.find('/', i);
+	if(slash == std::string::npos)
+		slash = u.size();
+
+	std::string authority = u.substr(i, slash - i);
+
+	size_t colon = authority.rfind(':');
+
+	if(colon != std::string::npos) {
+
+		char *end;
+		unsigned long p = strtoul(authority.c_str() + colon + 1, &end, 10);
+
+		if(*end != '\0' or p == 0 or p > 65535)
+			return -1;
+
+		port = p;
+		host = authority.substr(0, colon);
+
+	} else {
+
+		port = ssl ? 443 : 80;
+		host = authority;
+	}
+
+	if(host.empty())
+		return -1;
+
+	path = slash < u.size() ? u.substr(slash) : "/";
+
+	size_t query = path.find('?');
+
+	if(query != std::string::npos) {
+		form = parse_form(path.substr(query + 1));
+		path.erase(query);
+	}
+
+	if(path.size() > HTTP_PATH_MAX_SZ)
 		return -1;
 
 	return 0;
 }
+
+int http_request::parse(const char *data, size_t data_sz) {
+
+	std::string s(data, data_sz);
+
+	size_t eol = s.find("\r\n");
+	if(eol == std::string::npos)
+		return -1;
+
+	std::string line = s.substr(0, eol);
+
+	size_t sp = line.find(' ');
+	if(sp == std::string::npos)
+		return -1;
+
+	std::string method_name = line.substr(0, sp);
+
+	static const http_method methods[] = {
+		http_method::GET, http_method::HEAD, http_method::POST, http_method::PUT,
+		http_method::DELETE, http_method::TRACE, http_method::CONNECT
+	};
+
+	bool found = false;
+
+	for(http_method m : methods) {
+		if(method_name == http_method_str(m)) {
+			method = m;
+			found = true;
+		}
+	}
+
+	if(not found)
+		return -1;
+
+	form.clear();
+	body.clear();
+	headers.clear();
+
+	if(parse_url(line.c_str() + sp + 1) == -1)
+		return -1;
+
+	size_t i = eol + 2;
+
+	while(true) {
+
+		eol = s.find("\r\n", i);
+		if(eol == std::string::npos)
+			return -1;
+
+		if(eol == i)
+			break;
+
+		line = s.substr(i, eol - i);
+
+		size_t colon = line.find(": ");
+		if(colon == std::string::npos)
+			return -1;
+
+		headers[line.substr(0, colon)] = line.substr(colon + 2);
+
+		i = eol + 2;
+	}
+
+	if(method == http_method::POST and eol + 2 < s.size())
+		set_body(s.substr(eol + 2));
+
+	return 0;
+}
+
+static bool is_hop_by_hop(const std::string& name) {
+
+	static const char *names[] = {
+		"Connection", "Proxy-Connection", "Keep-Alive", "Proxy-Authorization",
+		"Proxy-Authenticate", "TE", "Trailer", "Transfer-Encoding", "Upgrade"
+	};
+
+	for(const char *x : names)
+		if(strcasecmp(name.c_str(), x) == 0)
+			return true;
+
+	return false;
+}
+
+/*
+ * parse an HTTP/1.x request as a proxy receives it, with either an absolute
+ * target or an origin target and a Host header. returns the bytes consumed,
+ * zero when more are needed or -1 if it can't be tunneled. hop-by-hop
+ * headers are dropped and only POST bodies survive, as form fields when
+ * they are urlencoded forms.
+ */
+
+ssize_t http_request::parse_message(const char *data, size_t data_sz) {
+
+	std::string s(data, data_sz);
+
+	size_t head_end = s.find("\r\n\r\n");
+
+	if(head_end == std::string::npos)
+		return data_sz > HTTP_HEAD_MAX_SZ ? -1 : 0;
+
+	size_t eol = s.find("\r\n");
+
+	std::string line = s.substr(0, eol);
+
+	size_t sp1 = line.find(' ');
+	size_t sp2 = line.rfind(' ');
+
+	if(sp1 == std::string::npos or sp2 == sp1 or line.compare(sp2 + 1, 5, "HTTP/") != 0)
+		return -1;
+
+	std::string method_name = line.substr(0, sp1);
+	std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+	static const http_method methods[] = {
+		http_method::GET, http_method::HEAD, http_method::POST, http_method::PUT,
+		http_method::DELETE, http_method::TRACE
+	};
+
+	bool found = false;
+
+	for(http_method m : methods) {
+		if(method_name == http_method_str(m)) {
+			method = m;
+			found = true;
+		}
+	}
+
+	if(not found)
+		return -1;
+
+	form.clear();
+	body.clear();
+	headers.clear();
+
+	size_t content_length = 0;
+
+	for(size_t i = eol + 2; i < head_end + 2; i = eol + 2) {
+
+		eol = s.find("\r\n", i);
+		line = s.substr(i, eol - i);
+
+		size_t colon = line.find(':');
+		if(colon == std::string::npos)
+			return -1;
+
+		std::string name = line.substr(0, colon);
+		size_t value_start = line.find_first_not_of(" \t", colon + 1);
+		std::string value = value_start == std::string::npos ? "" : line.substr(value_start);
+
+		if(strcasecmp(name.c_str(), "Content-Length") == 0)
+			content_length = strtoul(value.c_str(), nullptr, 10);
+		else if(strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+			return -1;
+
+		if(not is_hop_by_hop(name) and strcasecmp(name.c_str(), "Content-Length") != 0)
+			headers[name] = value;
+	}
+
+	if(target.compare(0, 1, "/") == 0) {
+
+		auto host_iter = headers.find("Host");
+		if(host_iter == headers.end())
+			return -1;
+
+		target = "http://" + host_iter->second + target;
+	}
+
+	if(parse_url(target.c_str()) == -1)
+		return -1;
+
+	const size_t body_start = head_end + 4;
+
+	if(data_sz < body_start + content_length)
+		return 0;
+
+	if(method == http_method::POST and content_length > 0)
+		set_body(s.substr(body_start, content_length));
+
+	return body_start + content_length;
+}
+
+/*
+ * whether a response, from the head of it in data, is worth compressing: not
+ * if it is content-encoded already or its type is a compressed format
+ */
+
+bool http_response_compressible(const char *data, size_t data_sz) {
+
+	static const char *compressed_types[] = {
+		"image/", "audio/", "video/", "font/woff",
+		"application/zip", "application/gzip", "application/x-gzip", "application/x-bzip2",
+		"application/x-xz", "application/x-7z-compressed", "application/x-rar-compressed",
+		"application/zstd", "application/pdf", "application/octet-stream"
+	};
+
+	std::string s(data, data_sz);
+
+	size_t head_end = s.find("\r\n\r\n");
+
+	if(head_end == std::string::npos)
+		head_end = s.size();
+
+	for(size_t i = s.find("\r\n"); i < head_end; ) {
+
+		i += 2;
+
+		size_t eol = std::min(s.find("\r\n", i), head_end);
+
+		std::string line = s.substr(i, eol - i);
+
+		i = eol;
+
+		size_t colon = line.find(':');
+		if(colon == std::string::npos)
+			continue;
+
+		std::string name = line.substr(0, colon);
+		size_t value_start = line.find_first_not_of(" \t", colon + 1);
+		std::string value = value_start == std::string::npos ? "" : line.substr(value_start);
+
+		if(strcasecmp(name.c_str(), "Content-Encoding") == 0 and strcasecmp(value.c_str(), "identity") != 0)
+			return false;
+
+		if(strcasecmp(name.c_str(), "Content-Type") != 0)
+			continue;
+
+		if(strncasecmp(value.c_str(), "image/svg", 9) == 0)
+			continue;
+
+		for(const char *type : compressed_types)
+			if(strncasecmp(value.c_str(), type, strlen(type)) == 0)
+				return false;
+	}
+
+	return true;
+}
+
+/*
+ * the head in line is complete: what the response says about its body and
+ * its connection
+ */
+
+void http_response_end::begin_body() {
+
+	const size_t head_end = line.find("\r\n\r\n");
+
+	size_t eol = line.find("\r\n");
+
+	const int code = line.size() > 12 ? atoi(line.c_str() + 9) : 0;
+
+	keep_alive = line.compare(0, 8, "HTTP/1.1") == 0;
+
+	bool chunked = false;
+	bool sized = false;
+
+	left = 0;
+
+	for(size_t i = eol; i < head_end; ) {
+
+		i += 2;
+
+		eol = std::min(line.find("\r\n", i), head_end);
+
+		std::string header = line.substr(i, eol - i);
+
+		i = eol;
+
+		size_t colon = header.find(':');
+		if(colon == std::string::npos)
+			continue;
+
+		std::string name = header.substr(0, colon);
+		size_t value_start = header.find_first_not_of(" \t", colon + 1);
+		std::string value = value_start == std::string::npos ? "" : header.substr(value_start);
+
+		if(strcasecmp(name.c_str(), "Content-Length") == 0) {
+			left = strtoull(value.c_str(), nullptr, 10);
+			sized = true;
+		} else if(strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+			chunked = strcasestr(value.c_str(), "chunked") != nullptr;
+		} else if(strcasecmp(name.c_str(), "Connection") == 0) {
+			if(strcasestr(value.c_str(), "close") != nullptr)
+				keep_alive = false;
+			else if(strcasestr(value.c_str(), "keep-alive") != nullptr)
+				keep_alive = true;
+		}
+	}
+
+	line.clear();
+
+	if(code >= 100 and code < 200 and code != 101)
+		return;
+
+	status = code;
+
+	if(head_only or status == 204 or status == 304)
+		at = part::DONE;
+	else if(chunked)
+		at = part::CHUNK_SIZE;
+	else if(sized)
+		at = left > 0 ? part::BODY : part::DONE;
+	else
+		at = part::UNTIL_EOF;
+
+	if(at == part::UNTIL_EOF)
+		keep_alive = false;
+}
+
+/*
+ * feed sz more bytes of the response, returning how many belong to it
+ */
+
+size_t http_response_end::feed(const char *data, size_t sz) {
+
+	size_t i = 0;
+
+	while(i < sz and at != part::DONE and at != part::UNTIL_EOF) {
+
+		size_t n;
+
+		switch(at) {
+
+			case part::HEAD: {
+
+				const size_t before = line.size();
+
+				line.append(data + i, sz - i);
+
+				const size_t end = line.find("\r\n\r\n", before >= 3 ? before - 3 : 0);
+
+				if(end == std::string::npos) {
+					if(line.size() > HTTP_HEAD_MAX_SZ)
+						at = part::UNTIL_EOF;
+					i = sz;
+					break;
+				}
+
+				line.resize(end + 4);
+
+				i += end + 4 - before;
+
+				begin_body();
+				break;
+			}
+
+			case part::BODY:
+			case part::CHUNK:
+
+				n = std::min(left, (uint64_t)(sz - i));
+
+				i += n;
+				left -= n;
+
+				if(left == 0)
+					at = at == part::BODY ? part::DONE : part::CHUNK_END;
+				break;
+
+			default: {
+
+				const char *nl = (const char *)memchr(data + i, '\n', sz - i);
+
+				n = nl != nullptr ? nl - (data + i) + 1 : sz - i;
+
+				line.append(data + i, n);
+
+				i += n;
+
+				if(nl == nullptr) {
+					if(line.size() > HTTP_PATH_MAX_SZ)
+						at = part::UNTIL_EOF;
+					break;
+				}
+
+				if(at == part::CHUNK_SIZE) {
+
+					char *end;
+
+					left = strtoull(line.c_str(), &end, 16);
+
+					if(end == line.c_str())
+						at = part::UNTIL_EOF;
+					else
+						at = left > 0 ? part::CHUNK : part::TRAILER;
+
+				} else if(at == part::CHUNK_END) {
+					at = part::CHUNK_SIZE;
+				} else if(line == "\r\n" or line == "\n") {
+					at = part::DONE;
+				}
+
+				line.clear();
+				break;
+			}
+		}
+	}
+
+	if(at == part::UNTIL_EOF) {
+		keep_alive = false;
+		return sz;
+	}
+
+	return i;
+}
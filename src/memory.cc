@@ -0,0 +1,151 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+
+#include <80over53/memory.hh>
+
+#define dfprintf(...)
+
+const char *memory_category_str(memory_category x) {
+	switch(x) {
+		case memory_category::SESSIONS:  return "sessions";
+		case memory_category::FRAGMENTS: return "fragments";
+		case memory_category::RESPONSES: return "responses";
+		case memory_category::QUEUE:     return "queue";
+		case memory_category::CODING:    return "coding";
+		case memory_category::POOLS:     return "pools";
+		case memory_category::CACHE:     return "cache";
+	}
+
+	return nullptr;
+}
+
+/*
+ * a size in bytes with an optional k, m or g suffix, 0 if it is invalid
+ */
+
+size_t memory_parse_size(const char *s) {
+
+	char *end;
+
+	double x = strtod(s, &end);
+
+	switch(*end) {
+		case 'g': case 'G': x *= 1024;
+		/* fall through */
+		case 'm': case 'M': x *= 1024;
+		/* fall through */
+		case 'k': case 'K': x *= 1024;
+		/* fall through */
+		case '\0':
+			break;
+		default:
+			return 0;
+	}
+
+	return x > 0 ? (size_t)x : 0;
+}
+
+void memory_budget::charge(memory_category x, size_t sz) {
+
+	used[(int)x] += sz;
+	total += sz;
+
+	peak = std::max(peak, total);
+}
+
+void memory_budget::release(memory_category x, size_t sz) {
+
+	used[(int)x] -= sz;
+	total -= sz;
+}
+
+int memory_budget::sprint(char *s, size_t sz) const {
+
+	int n = snprintf(s, sz, "%.1fM", total / 1048576.0);
+
+	if(limit != 0)
+		n += snprintf(s + n, sz > (size_t)n ? sz - n : 0, " of %.1fM", limit / 1048576.0);
+
+	n += snprintf(s + n, sz > (size_t)n ? sz - n : 0, " (peak %.1fM)", peak / 1048576.0);
+
+	for(int i = 0; i < MEMORY_CATEGORIES; i++)
+		n += snprintf(s + n, sz > (size_t)n ? sz - n : 0, " %s: %.1fK", memory_category_str((memory_category)i), used[i] / 1024.0);
+
+	return n;
+}
+
+size_t memory_charge::total() const {
+
+	size_t sum = 0;
+
+	for(int i = 0; i < MEMORY_CATEGORIES; i++)
+		sum += bytes[i];
+
+	return sum;
+}
+
+/*
+ * hold sz bytes of category x against budget, instead of what was held
+ */
+
+void memory_charge::set(memory_budget *my_budget, memory_category x, size_t sz) {
+
+	if(budget != my_budget)
+		clear();
+
+	budget = my_budget;
+
+	size_t& held = bytes[(int)x];
+
+	if(sz > held)
+		budget->charge(x, sz - held);
+	else
+		budget->release(x, held - sz);
+
+	held = sz;
+}
+
+void memory_charge::clear() {
+
+	if(budget != nullptr)
+		for(int i = 0; i < MEMORY_CATEGORIES; i++)
+			budget->release((memory_category)i, bytes[i]);
+
+	for(int i = 0; i < MEMORY_CATEGORIES; i++)
+		bytes[i] = 0;
+
+	budget = nullptr;
+}
+
+void lru_link::unlink() {
+
+	if(not linked())
+		return;
+
+	prev->next = next;
+	next->prev = prev;
+
+	prev = nullptr;
+	next = nullptr;
+}
+
+lru_list::~lru_list() {
+	while(head.next != &head)
+		head.next->unlink();
+}
+
+/*
+ * make x the most recently used, linking it if it is not yet
+ */
+
+void lru_list::touch(lru_link *x) {
+
+	x->unlink();
+
+	x->prev = head.prev;
+	x->next = &head;
+	head.prev->next = x;
+	head.prev = x;
+}
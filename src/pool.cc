@@ -0,0 +1,223 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <arpa/inet.h>
+
+#include <80over53/pool.hh>
+
+#define dfprintf(...)
+
+const char *pool_policy_str(pool_policy policy) {
+
+	switch(policy) {
+		case pool_policy::LEAST:       return "least outstanding";
+		case pool_policy::TWO_CHOICES: return "power of two choices";
+	}
+
+	return "?";
+}
+
+/*
+ * full weight, or the share of it a warming backend has grown to
+ */
+
+double backend::weight(uint64_t now_ms) const {
+
+	if(warming_ms == 0 or now_ms >= warming_ms + POOL_SLOW_START_MS)
+		return 1.0;
+
+	if(now_ms <= warming_ms)
+		return POOL_WEIGHT_MIN;
+
+	return std::max((double)(now_ms - warming_ms) / POOL_SLOW_START_MS, POOL_WEIGHT_MIN);
+}
+
+int backend::sprint(char *s, size_t sz, uint64_t now_ms) const {
+
+	char addr[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &address.sin_addr, addr, sizeof(addr));
+
+	int n = snprintf(s, sz, "%s:%d outstanding %zu requests %zu failed %zu ejected %zu",
+			addr, ntohs(address.sin_port), outstanding, requests, failed, ejected);
+
+	if(n < 0 or (size_t)n >= sz)
+		return n;
+
+	if(not listed)
+		n += snprintf(s + n, sz - n, " (gone)");
+	else if(ejected_until_ms > now_ms)
+		n += snprintf(s + n, sz - n, " (out for %.1fs)", (ejected_until_ms - now_ms) / 1e3);
+	else if(weight(now_ms) < 1.0)
+		n += snprintf(s + n, sz - n, " (warming, %.0f%%)", weight(now_ms) * 100);
+
+	return n;
+}
+
+static bool same_address(const sockaddr_in& a, const sockaddr_in& b) {
+	return a.sin_addr.s_addr == b.sin_addr.s_addr and a.sin_port == b.sin_port;
+}
+
+/*
+ * the pool's backends are now addresses: those already there stay as they
+ * are, new ones warm up unless the pool is new, the rest are no longer
+ * picked but kept for the requests they carry. a new one takes over the
+ * slot of one gone with nothing outstanding, past POOL_BACKENDS_MAX it is
+ * left out.
+ */
+
+void backend_pool::assign(const std::vector<sockaddr_in>& addresses, uint64_t now_ms) {
+
+	const bool first = backends.empty();
+
+	for(backend& b : backends) {
+		b.listed = false;
+		for(const sockaddr_in& address : addresses)
+			b.listed = b.listed or same_address(b.address, address);
+	}
+
+	for(const sockaddr_in& address : addresses) {
+
+		size_t at = SIZE_MAX;
+		bool known = false;
+
+		for(size_t i = 0; i < backends.size() and not known; i++) {
+			known = same_address(backends[i].address, address);
+			if(at == SIZE_MAX and not backends[i].listed and backends[i].outstanding == 0)
+				at = i;
+		}
+
+		if(known)
+			continue;
+
+		backend b;
+
+		b.address = address;
+		b.warming_ms = first ? 0 : now_ms;
+
+		if(at != SIZE_MAX)
+			backends[at] = b;
+		else if(backends.size() < POOL_BACKENDS_MAX)
+			backends.push_back(b);
+	}
+
+	resolved_ms = now_ms;
+}
+
+/*
+ * the backend for a request, its outstanding count taken, -1 with none
+ */
+
+int backend_pool::pick(uint64_t now_ms) {
+
+	int candidates[POOL_BACKENDS_MAX];
+	int count = 0;
+
+	for(int pass = 0; pass < 2 and count == 0; pass++)
+		for(size_t i = 0; i < backends.size(); i++)
+			if(pass == 0 ? backends[i].usable(now_ms) : backends[i].listed)
+				candidates[count++] = i;
+
+	if(count == 0)
+		return -1;
+
+	int at;
+
+	if(policy == pool_policy::TWO_CHOICES and count > 1) {
+
+		const int a = rng() % count;
+		int b = rng() % (count - 1);
+
+		if(b >= a)
+			b++;
+
+		at = backends[candidates[a]].load(now_ms) <= backends[candidates[b]].load(now_ms) ? candidates[a] : candidates[b];
+
+	} else {
+
+		/*
+		 * ties go round from a random start
+		 */
+
+		const int start = rng() % count;
+
+		at = candidates[start];
+
+		for(int j = 1; j < count; j++) {
+			const int i = candidates[(start + j) % count];
+			if(backends[i].load(now_ms) < backends[at].load(now_ms))
+				at = i;
+		}
+	}
+
+	backend& b = backends[at];
+
+	b.outstanding++;
+	b.requests++;
+
+	outstanding++;
+	used_ms = now_ms;
+
+	dfprintf(stderr, "pool: picked #%d of %d (load %.2f)\n", at, count, b.load(now_ms));
+
+	return at;
+}
+
+/*
+ * a request to backend i is over, true if that got it ejected
+ */
+
+bool backend_pool::done(int i, pool_outcome outcome, uint64_t now_ms) {
+
+	if(i < 0 or (size_t)i >= backends.size())
+		return false;
+
+	backend& b = backends[i];
+
+	b.outstanding--;
+	outstanding--;
+
+	if(outcome == pool_outcome::OK) {
+		b.failures = 0;
+		b.ejections = 0;
+		return false;
+	}
+
+	if(outcome != pool_outcome::FAILED)
+		return false;
+
+	b.failed++;
+
+	if(++b.failures < POOL_EJECT_FAILURES or not b.usable(now_ms))
+		return false;
+
+	bool others = false;
+
+	for(size_t j = 0; j < backends.size() and not others; j++)
+		others = j != (size_t)i and backends[j].usable(now_ms);
+
+	if(not others)
+		return false;
+
+	b.ejected_until_ms = now_ms + std::min((uint64_t)POOL_EJECT_MIN_MS << std::min(b.ejections, 5U), (uint64_t)POOL_EJECT_MAX_MS);
+	b.warming_ms = b.ejected_until_ms;
+
+	b.ejections++;
+	b.ejected++;
+	b.failures = 0;
+
+	return true;
+}
+
+size_t backend_pool::ejected(uint64_t now_ms) const {
+
+	size_t n = 0;
+
+	for(const backend& b : backends)
+		if(b.listed and not b.usable(now_ms))
+			n++;
+
+	return n;
+}
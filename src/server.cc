@@ -16,6 +16,8 @@
 #include <cerrno>
 #include <ctime>
 #include <climits>
+#include <cctype>
+#include <strings.h>
 
 #include <clocale>
 #include <cwchar>
@@ -25,18 +27,45 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
-
-#include <set>
+#include <sys/eventfd.h>
+
+#include <map>
+#include <string>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
 
 #include <80over53/dns.hh>
 #include <80over53/http.hh>
+#include <80over53/tunnel.hh>
+#include <80over53/capture.hh>
+#include <80over53/zone.hh>
+#include <80over53/session.hh>
+#include <80over53/timer.hh>
+#include <80over53/fair.hh>
+#include <80over53/memory.hh>
+#include <80over53/uring.hh>
+#include <80over53/ring.hh>
+#include <80over53/coro.hh>
+#include <80over53/tls.hh>
+#include <80over53/pool.hh>
+#include <80over53/cache.hh>
+#include <80over53/handoff.hh>
+#include <80over53/chain.hh>
 
 /*
  * 80over53-server program logic
@@ -44,27 +73,97 @@
  *
  * register signal handlers
  *    TERM,INT,QUIT : stop
- *    HUP,USR1      : reload configuration
- *    USR2          : report status
+ *    HUP,USR1      : reload configuration (command line and options file,
+ *                    taken between turns, zones' sessions and queued
+ *                    requests following them by domain)
+ *    USR2          : report status (packing efficiency per encoding)
  *    
  *
  * register atexit handler
  *    no-op
  *
- * dns-fd : socket-open-udp -> bind-port-53
+ * if a server runs at the handoff path : take over its dns-fd and sessions
+ * else dns-fd : socket-open-udp -> bind-port-53
+ * listen at the handoff path for the next server
+ *
+ * if workers asked for                        : worker pipeline (below)
+ * if io_uring asked for and the kernel has it : io_uring loop (below)
  *
  * insert dns-fd into rfd-set
  *
  * while select on rfd-set and not stop
  *
  *    if dns-fd ready in rfd-set
- *       request : read-dns-fd -> transform -> send-http-fd
- *       insert http-fd into rfd-set
+ *       query : read-dns-fd -> match qname zone (NXDOMAIN if none)
+ *               -> tunnel-query -> session stream
+ *          PUT   : store fragment -> ack (REFUSED for a new session past the cap)
+ *                  if request complete : transform
+ *                     fresh in cache : response from cache
+ *                     else           : (conditional if stale in cache) admit
+ *                     client's share of queue left : queue it (per client)
+ *                     else                         : SERVFAIL, the client retries
+ *          GET   : response chunk (or pending, copied only when it straddles
+ *                  segments) -> pack for qtype -> send-dns-fd
+ *                  (prepared ahead : answers copied as they are)
+ *                  past the highest chunk asked for : queue stream for prefetch
+ *          REPAIR: fec repair chunk over a block of response chunks (or pending)
+ *          CLOSE : forget stream (and session with its last) -> ack
+ *       re-arm session idle timer
+ *
+ *    while http-fd ready in wfd-set (connecting, request not all sent)
+ *       connected : send rest of request -> arm upstream idle timer
+ *       failed    : close http-fd -> 502
  *
  *    while http-fd ready in rfd-set
- *       response : read-http-fd -> transform -> send-dns-fd
- *       delete http-fd from rfd-set
- *       close http-fd
+ *       https    : tls handshake (resuming the backend's last session)
+ *                  -> then the request, the rest decrypted into segments
+ *       response : read-http-fd into a chain segment -> append to session
+ *                  (by reference when identity-coded) -> re-arm idle timer
+ *       if EOF
+ *          delete http-fd from rfd-set
+ *          close http-fd
+ *       if the response ends (its length, last chunk) and keep-alive
+ *          park http-fd idle for the next request to the backend
+ *       if the response may be cached : store it (304 : freshen, response
+ *                                        from cache), written through to the
+ *                                        cache file if there is one
+ *
+ *    (each http-fd is driven by a coroutine, connect -> send -> recv until
+ *     EOF or the response's end, resumed with what the loop did for it;
+ *     closing it destroys it)
+ *
+ *    (an http-fd closing gives its backend back, failed if it got no
+ *     connection, handshake or response or a 5xx; too many in a row eject
+ *     the backend)
+ *
+ *    while memory over budget : free idle coding contexts, then let cached
+ *                               responses go, then evict sessions least
+ *                               recently used, those without open http-fds
+ *                               first
+ *
+ *    admit queued requests while under the upstream cap, clients in deficit
+ *    round robin, each within its rate if one is set (503 if queued too long)
+ *       pick backend from the zone's pool or the url host's (all its
+ *       addresses), least outstanding or the better of two at random,
+ *       ejected ones left out until they are back and warmed up
+ *       send-http-fd (backend, an idle one to it if parked)
+ *          -> insert http-fd into rfd-set
+ *
+ *    advance timer wheel
+ *       connect timeout : close http-fd -> 504
+ *       upstream idle   : close http-fd (response ends there)
+ *       session idle    : close its http-fds -> forget session
+ *       admission       : a rate limited client has a token again
+ *
+ *    close http-fds parked idle past the upstream idle timeout
+ *
+ *    foreach stream queued for prefetch (PREFETCH_TURN_REPLIES at most)
+ *       encode the replies to the next -a chunks, as far as the response is
+ *       in, for the last GET's chunk size and qtype
+ *
+ *    if the next server connected at the handoff path
+ *       SERVFAIL new requests until drained (upstreams and queue done, 503
+ *       past the drain timeout) -> send dns-fd and sessions -> ack : exit
  *
  * foreach fd in rfd-set
  *    delete fd from rfd-set
@@ -72,17 +171,193 @@
  *
  * exit
  *
+ *
+ * io_uring loop
+ * =============
+ *
+ * multishot recvmsg on dns-fd into provided buffers
+ *
+ * while not stop
+ *
+ *    admit, evict, report as above, queueing operations
+ *       new upstream : socket -> connect => send (linked)
+ *       closed http-fd : cancel its operations => close (hard linked)
+ *       parked http-fd : cancel its operations
+ *
+ *    io_uring_enter : submit all queued, wait for completions or next timer
+ *    advance timer wheel
+ *
+ *    foreach completion
+ *       dns query    : process as above -> sendmsg reply (queued)
+ *       connect      : arm upstream idle timer (failed : 502)
+ *       send         : send rest, or resume the coroutine (which arms a
+ *                      multishot recv into provided buffers when it reads)
+ *       recv         : append to session as above (EOF : close http-fd),
+ *                      kept for the coroutine if it waits on a send
+ *
+ *    streams queued for prefetch : submit the replies -> prefetch as above
+ *
+ *
+ * worker pipeline
+ * ===============
+ *
+ * start workers, each with its share of the caps and memory budget
+ *
+ * while poll on dns-fd and reply-eventfd and not stop
+ *
+ *    if dns-fd ready
+ *       recvmmsg a batch -> foreach query : peek session -> worker's ring
+ *                                           (dropped when full)
+ *       wake each worker given queries
+ *    sendmmsg replies from the reply ring in batches
+ *
+ * stop workers
+ *
+ * each worker, while not stopped, runs the select loop above on its own
+ * upstreams, queries coming off its ring instead of dns-fd and replies going
+ * to the reply ring (waking the I/O thread) instead of send-dns-fd
+ *
+ *
+ * offline batch mode (any [file] arguments)
+ * =========================================
+ *
+ * foreach file
+ *    memory-map file -> foreach captured dns query
+ *       request : transform -> stub-http-fd
+ *       response : read-stub-http-fd (recorded response or nothing)
+ *
+ * report totals
+ *
+ * exit
+ *
  */
 
 void eprintf(int, const char *, ...);
 
+#define DEFAULT_DOMAIN "$.256.bz"
+
+/*
+ * a client's requests may hold at most 1/FAIR_FLOW_SHARE of the queue. each
+ * costs a turn plus one per FAIR_TURN_SZ bytes, so clients uploading large
+ * bodies are held to their share of the tunnel rather than of requests
+ */
+
+#define FAIR_FLOW_SHARE 4
+#define FAIR_TURN_SZ    4096
+
+/*
+ * the staged pipeline (-w): rings of queries to each worker and of replies
+ * back, and how many datagrams go through one recvmmsg or sendmmsg
+ */
+
+#define PIPELINE_WORKERS_MAX 64
+#define PIPELINE_QUERIES     1024
+#define PIPELINE_REPLIES     4096
+#define PIPELINE_BATCH       32
+
+/*
+ * handing off to a new server (-H) waits HANDOFF_DRAIN_MS at most for the
+ * upstreams in flight to finish, turns taking HANDOFF_TURN_MS at most
+ * meanwhile
+ */
+
+#define HANDOFF_DRAIN_MS 10000
+#define HANDOFF_TURN_MS  100
+
+/*
+ * GET replies encoded ahead (-a), PREFETCH_CHUNKS_MAX at most per stream and
+ * PREFETCH_TURN_REPLIES a turn, so a stream with a long response doesn't
+ * hold up the queries behind it
+ */
+
+#define PREFETCH_CHUNKS_MAX   64
+#define PREFETCH_TURN_REPLIES 64
+
+/*
+ * a binary upgrade (-H). the old server listens at the path for the next,
+ * which takes over its dns-fd and sessions once it connects:
+ *
+ *    old                                   new
+ *    ---                                   ---
+ *                                          connect path
+ *    accept : SERVFAIL requests until
+ *             done, the clients retrying
+ *    drain  : upstreams and queue finish
+ *             (503 past HANDOFF_DRAIN_MS)
+ *    stop receiving
+ *    send dns-fd, sessions           ->    receive
+ *                                    <-    ack
+ *    exit                                  wait for the old to be gone
+ *                                          (its cache file unlocked)
+ *                                          serve dns-fd, sessions restored
+ *                                          listen at path for the next
+ *
+ * there is no tcp listener, the udp socket is the one passed. only sessions
+ * travel, not upstreams: draining leaves each stream either complete or
+ * still being uploaded.
+ */
+
+struct handoff_state {
+	int listener = -1;
+	int peer = -1;
+	uint64_t deadline_ms = 0;
+	bool given = false;
+	std::string taken;
+};
+
+/*
+ * what queued requests are grouped by for fair queuing: the client address
+ * (all the sessions behind one resolver together) or the session
+ */
+
+enum struct fairness {
+	ADDRESS,
+	SESSION
+};
+
+/*
+ * a zone served and where requests tunneled under it go: the host of each
+ * request's url or, given upstreams, always to one of them. it owns copies
+ * of what -d gave, argv being parsed again on reload.
+ */
+
+struct zone_policy {
+	std::string domain;
+	std::string upstream;
+	std::vector<sockaddr_in> upstreams;
+};
+
 struct configuration {
 	bool verbose = false;
     const char *locale = "";
 	uint32_t address = INADDR_ANY;
-	const char *domain = "$.256.bz";
+	std::vector<zone_policy> zones;
+	zone_trie zone_index;
 	uint16_t port = 53;
+	unsigned connect_timeout_ms = 5000;
+	unsigned upstream_idle_ms = 30000;
+	unsigned session_idle_ms = 120000;
+	size_t max_upstreams = FD_SETSIZE - 64;
+	size_t max_pending = 256;
+	size_t max_sessions = 65536;
+	fairness fair_by = fairness::ADDRESS;
+	pool_policy balance = pool_policy::LEAST;
+	double rate = 0;
+	double burst = 0;
+	size_t memory_limit = 0;
+	size_t cache_size = 0;
+	const char *cache_file = nullptr;
+	bool uring = false;
+	unsigned workers = 0;
+	size_t keep_alive = 4;
+	size_t prefetch = 8;
+	const char *ca_file = nullptr;
+	const char *options_file = nullptr;
+	std::shared_ptr<std::string> options;
+	const char *handoff_path = nullptr;
 	FILE *fp = stdout;
+	bool batch = false;
+	const char *replay = nullptr;
 };
 
 configuration default_config = configuration();
@@ -104,6 +379,18 @@ void usage(const char *arg0) {
 
 	char ip_string[20];
 	char port_string[20];
+	char connect_string[20];
+	char idle_string[20];
+	char session_string[20];
+	char upstreams_string[20];
+	char pending_string[20];
+	char sessions_string[20];
+	char rate_string[40];
+	char memory_string[40];
+	char cache_string[40];
+	char workers_string[20];
+	char keep_alive_string[20];
+	char prefetch_string[20];
 
 	if(inet_ntop(AF_INET, &default_config.address, ip_string, sizeof(ip_string)) == nullptr) {
 		perror("inet_ntop()");
@@ -111,29 +398,85 @@ void usage(const char *arg0) {
 	}
 
 	snprintf(port_string, sizeof(port_string), "%d", default_config.port);
+	snprintf(connect_string, sizeof(connect_string), "%us", default_config.connect_timeout_ms / 1000);
+	snprintf(idle_string, sizeof(idle_string), "%us", default_config.upstream_idle_ms / 1000);
+	snprintf(session_string, sizeof(session_string), "%us", default_config.session_idle_ms / 1000);
+	snprintf(upstreams_string, sizeof(upstreams_string), "%ld", (long)default_config.max_upstreams);
+	snprintf(pending_string, sizeof(pending_string), "%ld", (long)default_config.max_pending);
+	snprintf(sessions_string, sizeof(sessions_string), "%ld", (long)default_config.max_sessions);
+
+	if(default_config.rate > 0)
+		snprintf(rate_string, sizeof(rate_string), "%g/%g", default_config.rate, default_config.burst);
+	else
+		snprintf(rate_string, sizeof(rate_string), "unlimited");
+
+	if(default_config.memory_limit > 0)
+		snprintf(memory_string, sizeof(memory_string), "%ldK", (long)(default_config.memory_limit >> 10));
+	else
+		snprintf(memory_string, sizeof(memory_string), "unlimited");
+
+	if(default_config.cache_size > 0)
+		snprintf(cache_string, sizeof(cache_string), "%ldK", (long)(default_config.cache_size >> 10));
+	else
+		snprintf(cache_string, sizeof(cache_string), "none");
+
+	snprintf(keep_alive_string, sizeof(keep_alive_string), "%ld", (long)default_config.keep_alive);
+	snprintf(prefetch_string, sizeof(prefetch_string), "%ld", (long)default_config.prefetch);
+
+	if(default_config.workers > 0)
+		snprintf(workers_string, sizeof(workers_string), "%u", default_config.workers);
+	else
+		snprintf(workers_string, sizeof(workers_string), "none");
 
     usage_print("-h", "show", "this help");
     usage_print("-v", default_action(default_config.verbose), "verbose output");
 	usage_print("-4 ip", "IPv4 bind address, default:", ip_string);
 	usage_print("-p port", "UDP bind port, default:", port_string);
     usage_print("-l locale", "use", "specified locale string");
-    usage_print("-d domain", "domain name, default:", default_config.domain);
+    usage_print("-d domain", "add a", "zone, repeatable, \"domain=ip:port,...\" sends all its requests to those backends, default: " DEFAULT_DOMAIN);
+	usage_print("-c secs", "upstream connect timeout, default:", connect_string);
+	usage_print("-i secs", "upstream idle timeout, default:", idle_string);
+	usage_print("-s secs", "session idle timeout, default:", session_string);
+	usage_print("-u count", "upstream connections open at once, default:", upstreams_string);
+	usage_print("-q count", "requests queued for an upstream, default:", pending_string);
+	usage_print("-m count", "sessions at once, default:", sessions_string);
+	usage_print("-g group", "queue requests fairly per", "\"address\" or \"session\", default: address");
+	usage_print("-b policy", "pick backends by", "\"least\" outstanding requests or \"two\" random choices, default: least");
+	usage_print("-r rate", "requests a second admitted per client, \"rate/burst\" to allow bursts, default:", rate_string);
+	usage_print("-U", default_action(default_config.uring), "io_uring socket I/O, select when the kernel lacks it");
+	usage_print("-M size", "memory budget for sessions, queue, coding and cache, k, m or g suffix, default:", memory_string);
+	usage_print("-K size", "cache upstream responses up to size, k, m or g suffix, within the memory budget, default:", cache_string);
+	usage_print("-F file", "keep the cache in", "file across restarts, one per worker with -w (file.0, file.1, ...)");
+	usage_print("-k count", "idle connections kept per upstream for the next request, 0 to close each, default:", keep_alive_string);
+	usage_print("-a count", "chunks of a response encoded ahead of the client's GETs per stream, 0 for none, default:", prefetch_string);
+	usage_print("-C file", "verify https upstreams against", "the CA certificates in file, default: the system's");
+	usage_print("-w count", "worker threads behind one I/O thread, the caps and budget shared out, default:", workers_string);
+	usage_print("-f file", "read options from", "file as well, those given here taking precedence, read again on reload (HUP)");
+	usage_print("-H path", "hand off to", "a new server started with the same path, its sockets and sessions passed over the unix socket at path");
+    usage_print("-R file", "replay", "recorded http response as the upstream in batch mode");
 
     fputc('\n', stderr);
 }
 
-int cliconfig(configuration * config, int argc, char **argv) {
+/*
+ * the options in argv into config, returning the index of the first
+ * argument past them, -1 if one is invalid
+ */
 
-    int opt;
+int parse_options(configuration * config, int argc, char **argv) {
 
-    *config = default_config;
+    int opt;
 
     opterr = 0;
+    optind = 0;
 
 	struct in_addr addr;
 	unsigned long port;
 
-	while ((opt = getopt(argc, argv, "hv4:p:l:")) != -1) {
+	zone_policy zone;
+	char *slash;
+
+	while ((opt = getopt(argc, argv, "hv4:p:l:d:c:i:s:u:q:m:g:b:r:M:K:F:Uw:k:a:C:f:H:R:")) != -1) {
 
 		switch (opt) {
 
@@ -146,7 +489,7 @@ int cliconfig(configuration * config, int argc, char **argv) {
 
 				if(inet_pton(AF_INET, optarg, &addr) == -1) {
 					perror("inet_pton()");
-					exit(EXIT_FAILURE);
+					return -1;
 				}
 				config->address = addr.s_addr;
 				break;
@@ -156,7 +499,7 @@ int cliconfig(configuration * config, int argc, char **argv) {
 				port = strtoul(optarg, nullptr, 0);
 				if(port == ULONG_MAX && errno == ERANGE) {
 					perror("strtoul()");
-					exit(EXIT_FAILURE);
+					return -1;
 				}
 				config->port = port;
 				break;
@@ -166,236 +509,4841 @@ int cliconfig(configuration * config, int argc, char **argv) {
 				config->locale = optarg;
 				break;
 
-			case 'd':
-				
-				config->domain = optarg;
-				break;
+			case 'd': {
+
+				const std::string spec = optarg;
+				const size_t equals = spec.find('=');
+
+				zone.domain = spec.substr(0, equals);
+				zone.upstream = equals != std::string::npos ? spec.substr(equals + 1) : "";
+				zone.upstreams.clear();
+
+				for(size_t i = 0; equals != std::string::npos and i <= zone.upstream.size(); ) {
+
+					size_t comma = zone.upstream.find(',', i);
+
+					if(comma == std::string::npos)
+						comma = zone.upstream.size();
+
+					std::string backend = zone.upstream.substr(i, comma - i);
+
+					i = comma + 1;
+
+					sockaddr_in sin_upstream;
+
+					memset(&sin_upstream, 0, sizeof(sin_upstream));
+					sin_upstream.sin_family = AF_INET;
+					sin_upstream.sin_port = htons(80);
+
+					const size_t colon = backend.find(':');
+
+					if(colon != std::string::npos)
+						sin_upstream.sin_port = htons(strtoul(backend.c_str() + colon + 1, nullptr, 0));
+
+					if(inet_pton(AF_INET, backend.substr(0, colon).c_str(), &sin_upstream.sin_addr) != 1 or zone.upstreams.size() == POOL_BACKENDS_MAX) {
+						fprintf(stderr, "invalid upstream address: %s\n", backend.c_str());
+						return -1;
+					}
+
+					zone.upstreams.push_back(sin_upstream);
+				}
+
+				if(config->zone_index.add(tunnel_zone(zone.domain.c_str()), config->zones.size()) == -1) {
+					fprintf(stderr, "invalid or repeated zone: %s\n", zone.domain.c_str());
+					return -1;
+				}
+
+				config->zones.push_back(zone);
+				break;
+			}
+
+			case 'c':
+
+				config->connect_timeout_ms = strtod(optarg, nullptr) * 1000;
+				break;
+
+			case 'i':
+
+				config->upstream_idle_ms = strtod(optarg, nullptr) * 1000;
+				break;
+
+			case 's':
+
+				config->session_idle_ms = strtod(optarg, nullptr) * 1000;
+				break;
+
+			case 'u':
+
+				config->max_upstreams = std::min(strtoul(optarg, nullptr, 0), (unsigned long)default_config.max_upstreams);
+				break;
+
+			case 'q':
+
+				config->max_pending = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'm':
+
+				config->max_sessions = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'g':
+
+				if(strcmp(optarg, "address") == 0)
+					config->fair_by = fairness::ADDRESS;
+				else if(strcmp(optarg, "session") == 0)
+					config->fair_by = fairness::SESSION;
+				else {
+					fprintf(stderr, "invalid fair queuing group: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'b':
+
+				if(strcmp(optarg, "least") == 0)
+					config->balance = pool_policy::LEAST;
+				else if(strcmp(optarg, "two") == 0)
+					config->balance = pool_policy::TWO_CHOICES;
+				else {
+					fprintf(stderr, "invalid backend policy: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'r':
+
+				config->rate = strtod(optarg, &slash);
+				config->burst = *slash == '/' ? strtod(slash + 1, nullptr) : 0;
+
+				if(config->rate < 0 or config->burst < 0) {
+					fprintf(stderr, "invalid rate: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'M':
+
+				if((config->memory_limit = memory_parse_size(optarg)) == 0) {
+					fprintf(stderr, "invalid memory budget: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'K':
+
+				if((config->cache_size = memory_parse_size(optarg)) == 0 and strcmp(optarg, "0") != 0) {
+					fprintf(stderr, "invalid cache size: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'F':
+
+				config->cache_file = optarg;
+				break;
+
+			case 'U':
+
+				config->uring = !default_config.uring;
+				break;
+
+			case 'w':
+
+				config->workers = strtoul(optarg, nullptr, 0);
+
+				if(config->workers > PIPELINE_WORKERS_MAX) {
+					fprintf(stderr, "invalid worker count: %s (at most %d)\n", optarg, PIPELINE_WORKERS_MAX);
+					return -1;
+				}
+				break;
+
+			case 'k':
+
+				config->keep_alive = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'a':
+
+				config->prefetch = strtoul(optarg, nullptr, 0);
+
+				if(config->prefetch > PREFETCH_CHUNKS_MAX) {
+					fprintf(stderr, "invalid prefetch count: %s (at most %d)\n", optarg, PREFETCH_CHUNKS_MAX);
+					return -1;
+				}
+				break;
+
+			case 'C':
+
+				config->ca_file = optarg;
+				break;
+
+			case 'f':
+
+				config->options_file = optarg;
+				break;
+
+			case 'H':
+
+				config->handoff_path = optarg;
+				break;
+
+			case 'R':
+
+				config->replay = optarg;
+				break;
+
+			case 'h':
+
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+
+			case '?':
+
+				fprintf(stderr, "unknown option: -%c\n", optopt);
+				usage(argv[0]);
+				return -1;
+
+			default:
+
+				fprintf(stderr, "unimplemented option: -%c\n", opt);
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	return optind;
+}
+
+/*
+ * the options in config->options_file, whitespace separated as on the
+ * command line, a # commenting out the rest of its line. the file's text is
+ * kept with config, the options pointing into it.
+ */
+
+int read_options(configuration *config) {
+
+	const char *path = config->options_file;
+
+	FILE *f = fopen(path, "r");
+
+	if(f == nullptr) {
+		eprintf(errno, "couldn't open options file %s", path);
+		return -1;
+	}
+
+	std::shared_ptr<std::string> text = std::make_shared<std::string>();
+
+	char buf[4096];
+	size_t n;
+
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		text->append(buf, n);
+
+	fclose(f);
+
+	std::vector<char *> args;
+
+	args.push_back((char *)path);
+
+	bool comment = false;
+
+	for(size_t i = 0; i < text->size(); i++) {
+
+		char& c = (*text)[i];
+
+		if(c == '#')
+			comment = true;
+		else if(c == '\n')
+			comment = false;
+
+		if(comment or isspace((unsigned char)c)) {
+			c = '\0';
+			continue;
+		}
+
+		if(i == 0 or (*text)[i - 1] == '\0')
+			args.push_back(&c);
+	}
+
+	const int argc = args.size();
+
+	args.push_back(nullptr);
+
+	const int lastopt = parse_options(config, argc, args.data());
+
+	if(lastopt == -1)
+		return -1;
+
+	if(lastopt != argc or config->options_file != path) {
+		fprintf(stderr, "%s: only options, and no -f, go in an options file\n", path);
+		return -1;
+	}
+
+	config->options = text;
+
+	return 0;
+}
+
+/*
+ * the configuration argv gives: the options file's options if it names one,
+ * those on the command line after them. returns the index of the first
+ * argument past the options, -1 if one is invalid.
+ */
+
+int cliconfig(configuration * config, int argc, char **argv) {
+
+	*config = default_config;
+
+	int lastopt = parse_options(config, argc, argv);
+
+	if(lastopt != -1 and config->options_file != nullptr) {
+
+		const char *path = config->options_file;
+
+		*config = default_config;
+		config->options_file = path;
+
+		if(read_options(config) == -1)
+			return -1;
+
+		lastopt = parse_options(config, argc, argv);
+	}
+
+	if(lastopt == -1)
+		return -1;
+
+	config->burst = std::max(config->burst, 1.0);
+
+	if(config->zones.empty()) {
+		zone_policy zone;
+		zone.domain = DEFAULT_DOMAIN;
+		config->zone_index.add(tunnel_zone(zone.domain.c_str()), 0);
+		config->zones.push_back(zone);
+	}
+
+	return lastopt;
+}
+
+/*
+ * the command line, read again on reload
+ */
+
+int config_argc = 0;
+char **config_argv = nullptr;
+
+
+sig_atomic_t stop = 0;
+
+void sighandler_stop(int signo) {
+	signal(signo, SIG_IGN);
+	stop = signo;
+	fprintf(stderr, "caught signal #%d (%s), stopping server...\n", signo, strsignal(signo));
+}
+
+sig_atomic_t report = 0;
+
+void sighandler_report(int signo) {
+	signal(signo, SIG_IGN);
+	report = signo;
+	fprintf(stderr, "caught signal #%d (%s), reporting status...\n", signo, strsignal(signo));
+}
+
+sig_atomic_t reload = 0;
+
+void sighandler_reload(int signo) {
+	signal(signo, SIG_IGN);
+	reload = signo;
+	fprintf(stderr, "caught signal #%d (%s), reloading configuration...\n", signo, strsignal(signo));
+}
+
+#define DATA_SZ 2048
+
+#define SESSION_RESPONSE_MAX_SZ (64 << 20)
+
+ssize_t recvfrom_fd_data(configuration * config, int fd, void *data, size_t data_sz, struct sockaddr_in *p_sin) {
+
+
+	socklen_t addrlen;
+	ssize_t n;
+
+	addrlen = sizeof(*p_sin);
+
+	n = recvfrom(fd, data, data_sz, 0, (struct sockaddr *)p_sin, &addrlen);
+	if(n == -1)
+		return -1;
+
+	if(config->verbose) {
+
+		char buf[20];
+
+		if(inet_ntop(AF_INET, &(p_sin->sin_addr), buf, sizeof(buf)) == nullptr) {
+			perror("inet_ntop()");
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(config->fp, "fd #%d data ready : read %ld bytes from %s:%d\n", fd, (long)n, buf, ntohs(p_sin->sin_port));
+	}
+
+	return n;
+}
+
+/*
+ * a GET reply encoded ahead of its query: the answers for chunk seq of
+ * chunk_sz, packed for qtype and written after a question of question_sz,
+ * as they follow the query's header and question. it stays good while the
+ * stream's total and status are what they were.
+ */
+
+struct prepared_reply {
+	bool ready = false;
+	bool hit = false;
+	uint32_t seq = 0;
+	uint16_t chunk_sz = 0;
+	dns_type qtype = dns_type::TXT;
+	size_t question_sz = 0;
+	uint32_t total = TUNNEL_TOTAL_UNKNOWN;
+	uint8_t status = 0;
+	uint16_t ancount = 0;
+	std::string answers;
+};
+
+/*
+ * a tunnel session is one client, each of its streams one http request
+ * uploaded in PUT fragments and the upstream response fetched back in GET
+ * chunks. the response is held as coded for the tunnel in a buffer chain,
+ * identity-coded upstream data as the segments it was read into and a
+ * cached response as the cache's segments: until its head is in and the
+ * coding decided the upstream data collects in head. the replies to
+ * the chunks past the highest asked for are prepared ahead, in the chunk
+ * size and qtype of the last GET, each in slot seq % -a. what each holds is
+ * charged to the memory budget, sessions kept in least recently used order
+ * for eviction.
+ */
+
+struct tunnel_stream {
+
+	std::map<uint32_t, std::string> fragments;
+	ssize_t request_sz = -1;
+
+	bool requested = false;
+
+	int fd = -1;
+
+	uint16_t codings = 0;
+
+	std::string head;
+	size_t raw_sz = 0;
+
+	bool coded = false;
+	coding method = coding::IDENTITY;
+	compressor z;
+
+	buffer_chain response;
+	bool complete = false;
+	bool broken = false;
+
+	int64_t asked = -1;
+	uint16_t chunk_sz = 0;
+	dns_type qtype = dns_type::TXT;
+	size_t question_sz = 0;
+	std::vector<prepared_reply> prepared;
+
+	timer deadline;
+
+	memory_charge memory;
+};
+
+struct tunnel_session {
+
+	uint32_t id = 0;
+
+	int zone = ZONE_NONE;
+
+	timer idle;
+
+	memory_charge memory;
+	lru_link lru;
+
+	std::map<uint16_t, tunnel_stream> streams;
+};
+
+struct stream_ref {
+	uint32_t session;
+	uint16_t stream;
+};
+
+/*
+ * replies sent per encoding (qtype), to measure how much chunk data each
+ * carries per reply and per octet on the wire
+ */
+
+struct packing_stats {
+	size_t replies = 0;
+	size_t data_bytes = 0;
+	size_t wire_bytes = 0;
+};
+
+/*
+ * responses per coding, raw upstream bytes against what went into chunks
+ */
+
+struct coding_stats {
+	size_t responses = 0;
+	size_t raw_bytes = 0;
+	size_t coded_bytes = 0;
+};
+
+/*
+ * a complete request waiting for an upstream connection
+ */
+
+struct pending_request {
+	uint32_t session;
+	uint16_t stream;
+	int zone;
+	http_request request;
+	sockaddr_storage peer;
+	uint16_t query_id;
+	uint64_t queued_ms;
+	size_t sz;
+	cache_fill cache;
+};
+
+/*
+ * what became of requests under the upstream cap: opened, queued, turned
+ * away with SERVFAIL while the queue or the client's share of it was full, or
+ * dropped after waiting in it too long, and new sessions REFUSED past the cap
+ */
+
+struct admission_stats {
+	size_t admitted = 0;
+	size_t queued = 0;
+	size_t rejected = 0;
+	size_t over_share = 0;
+	size_t shed = 0;
+	size_t refused = 0;
+	size_t queue_max = 0;
+	size_t flows_max = 0;
+};
+
+/*
+ * queries with an OPT, the largest udp payload one advertised, and OPTs that
+ * didn't decode
+ */
+
+struct edns_stats {
+	size_t queries = 0;
+	size_t udp_sz_max = 0;
+	size_t malformed = 0;
+};
+
+/*
+ * GET replies prepared ahead, those a query found ready, and those replaced
+ * or let go unused
+ */
+
+struct prefetch_stats {
+	size_t prepared = 0;
+	size_t hits = 0;
+	size_t wasted = 0;
+};
+
+/*
+ * the io_uring loop's rings and what its operations in flight point at.
+ * completions are told apart by the op and, for upstreams, the fd and a
+ * generation bumped each time the fd is opened or closed, so completions of
+ * operations on an fd closed since are recognised and dropped. the ring goes
+ * before what its operations point at.
+ */
+
+#define URING_ENTRIES            256
+#define URING_CQ_ENTRIES         4096
+#define URING_DNS_BUFFERS        64
+#define URING_UPSTREAM_BUFFERS   256
+#define URING_UPSTREAM_BUFFER_SZ (16 << 10)
+
+#define URING_DNS_GROUP      0
+#define URING_UPSTREAM_GROUP 1
+
+enum struct uring_op : uint8_t {
+	DNS_RECV = 1,
+	DNS_SEND = 2,
+	CONNECT  = 3,
+	SEND     = 4,
+	RECV     = 5,
+	CANCEL   = 6,
+	CLOSE    = 7,
+	HANDOFF  = 8
+};
+
+/*
+ * a reply being sent, and an upstream's address and unsent request
+ */
+
+struct uring_reply {
+	msghdr msg;
+	iovec iov;
+	sockaddr_in to;
+	uint8_t data[DNS_MSG_MAX_SZ];
+};
+
+struct uring_upstream {
+	sockaddr_in to;
+	std::string out;
+};
+
+struct uring_server {
+
+	msghdr dns_msg;
+
+	std::vector<uint32_t> generation;
+
+	std::map<uint64_t, uring_upstream> sending;
+
+	std::vector<std::unique_ptr<uring_reply>> replies;
+	std::vector<uint32_t> free_replies;
+
+	uring ring;
+	uring_buffers dns_buffers;
+	uring_buffers upstream_buffers;
+
+	size_t dns_packets = 0;
+	size_t upstream_reads = 0;
+	size_t upstreams = 0;
+};
+
+uint64_t uring_tag(uring_op op, uint32_t generation, uint32_t index) {
+	return (uint64_t)op << 56 | (uint64_t)(generation & 0xffffff) << 32 | index;
+}
+
+uring_op uring_tag_op(uint64_t tag) {
+	return (uring_op)(tag >> 56);
+}
+
+uint32_t uring_tag_index(uint64_t tag) {
+	return (uint32_t)tag;
+}
+
+/*
+ * the tag without its op, naming one opening of an fd
+ */
+
+uint64_t uring_tag_key(uint64_t tag) {
+	return tag & (((uint64_t)1 << 56) - 1);
+}
+
+uint32_t uring_generation(uring_server& u, int fd) {
+
+	if((size_t)fd >= u.generation.size())
+		u.generation.resize(fd + 1, 0);
+
+	return u.generation[fd] & 0xffffff;
+}
+
+bool uring_current(uring_server& u, uint64_t tag) {
+	return uring_generation(u, uring_tag_index(tag)) == (uint32_t)(tag >> 32 & 0xffffff);
+}
+
+void uring_arm_dns(uring_server& u, int dnsfd) {
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_RECVMSG, dnsfd, uring_tag(uring_op::DNS_RECV, 0, dnsfd));
+
+	if(e == nullptr)
+		return;
+
+	e->addr = (uint64_t)(uintptr_t)&u.dns_msg;
+	e->ioprio = IORING_RECV_MULTISHOT;
+	e->flags = IOSQE_BUFFER_SELECT;
+	e->buf_group = URING_DNS_GROUP;
+}
+
+/*
+ * wake for the next server connecting to hand off to
+ */
+
+void uring_await_handoff(uring_server& u, const handoff_state& h) {
+
+	if(h.listener == -1)
+		return;
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_POLL_ADD, h.listener, uring_tag(uring_op::HANDOFF, 0, h.listener));
+
+	if(e != nullptr)
+		e->poll32_events = POLLIN;
+}
+
+/*
+ * the upstream recv, send and connect entries: false when the ring stays
+ * full, nothing queued, for the caller to fail what waits on them
+ */
+
+bool uring_arm_recv(uring_server& u, int fd) {
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_RECV, fd, uring_tag(uring_op::RECV, uring_generation(u, fd), fd));
+
+	if(e == nullptr)
+		return false;
+
+	e->ioprio = IORING_RECV_MULTISHOT;
+	e->flags = IOSQE_BUFFER_SELECT;
+	e->buf_group = URING_UPSTREAM_GROUP;
+
+	return true;
+}
+
+bool uring_send_upstream(uring_server& u, int fd, uint64_t key, unsigned flags) {
+
+	uring_upstream& io = u.sending[key];
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_SEND, fd, uring_tag(uring_op::SEND, uring_generation(u, fd), fd));
+
+	if(e == nullptr)
+		return false;
+
+	e->addr = (uint64_t)(uintptr_t)io.out.data();
+	e->len = io.out.size();
+	e->msg_flags = MSG_NOSIGNAL;
+	e->flags = flags;
+
+	return true;
+}
+
+/*
+ * send what is left in ref->out, left there if the send can't be queued
+ */
+
+bool uring_send_out(uring_server& u, int fd, upstream_ref *ref, unsigned flags) {
+
+	const uint64_t key = uring_tag_key(uring_tag(uring_op::SEND, uring_generation(u, fd), fd));
+
+	u.sending[key].out.swap(ref->out);
+	ref->out.clear();
+
+	if(not uring_send_upstream(u, fd, key, flags)) {
+		ref->out.swap(u.sending[key].out);
+		u.sending.erase(key);
+		return false;
+	}
+
+	ref->sending = true;
+
+	return true;
+}
+
+/*
+ * connect a new upstream and send it what is ready, the request or the
+ * ClientHello, linked so the send waits for the connect and is cancelled if
+ * it fails. the connect address lives with the send.
+ */
+
+bool uring_open_upstream(uring_server& u, int fd, upstream_ref *ref) {
+
+	if(not u.ring.reserve(2))
+		return false;
+
+	uring_generation(u, fd);
+
+	const uint32_t generation = ++u.generation[fd];
+
+	const uint64_t key = uring_tag_key(uring_tag(uring_op::SEND, generation, fd));
+
+	uring_upstream& io = u.sending[key];
+
+	io.to = ref->to;
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_CONNECT, fd, uring_tag(uring_op::CONNECT, generation, fd));
+
+	e->addr = (uint64_t)(uintptr_t)&io.to;
+	e->off = sizeof(io.to);
+	e->flags = IOSQE_IO_LINK;
+
+	uring_send_out(u, fd, ref, 0);
+
+	u.upstreams++;
+
+	return true;
+}
+
+/*
+ * stop what is in flight on an upstream fd kept open, its completions
+ * dropped as of an earlier opening. false if the cancel can't be queued, the
+ * fd not to be kept then.
+ */
+
+bool uring_cancel_upstream(uring_server& u, int fd) {
+
+	if(not u.ring.reserve(1))
+		return false;
+
+	uring_generation(u, fd);
+
+	u.generation[fd]++;
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_ASYNC_CANCEL, fd, uring_tag(uring_op::CANCEL, 0, fd));
+
+	e->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+
+	u.ring.submit(0, 0);
+
+	return true;
+}
+
+/*
+ * cancel what is in flight on an upstream fd, then close it. the close is
+ * hard linked so it happens however the cancel turns out, and until then
+ * the fd number cannot be reused.
+ */
+
+void uring_close_upstream(uring_server& u, int fd) {
+
+	uring_generation(u, fd);
+
+	u.generation[fd]++;
+
+	if(not u.ring.reserve(2)) {
+		close(fd);
+		return;
+	}
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_ASYNC_CANCEL, fd, uring_tag(uring_op::CANCEL, 0, fd));
+
+	e->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	e->flags = IOSQE_IO_HARDLINK;
+
+	u.ring.sqe(IORING_OP_CLOSE, fd, uring_tag(uring_op::CLOSE, 0, fd));
+}
+
+/*
+ * connections kept open after a response for the next request to the same
+ * backend, at most keep_alive a backend and UPSTREAM_IDLE_MAX in all, the
+ * most recently parked taken first. one found closed when taken is stale.
+ */
+
+#define UPSTREAM_IDLE_MAX 32
+
+struct idle_upstream {
+	int fd;
+	tls_stream *tls;
+	uint64_t parked_ms;
+};
+
+struct keep_alive_stats {
+	size_t parked = 0;
+	size_t reused = 0;
+	size_t stale = 0;
+	size_t expired = 0;
+};
+
+/*
+ * peer and query_id are those of the query being processed. the budget and
+ * lru list outlive the sessions and cache entries charged to and linked into
+ * them, the tls context the streams made from it.
+ */
+
+struct server_state {
+	memory_budget memory;
+	memory_charge pools;
+	lru_list lru;
+	size_t evicted_sessions = 0;
+	size_t evicted_bytes = 0;
+	tls_context tls;
+	http_cache cache;
+	std::map<std::string, backend_pool> zone_pools;
+	std::map<std::string, backend_pool> host_pools;
+	size_t unresolved = 0;
+	session_table<tunnel_session> sessions;
+	upstream_table upstreams;
+	std::map<std::string, std::deque<idle_upstream>> idle;
+	size_t idle_count = 0;
+	keep_alive_stats keep_alive;
+	uring_server *uring = nullptr;
+	sockaddr_storage peer;
+	uint16_t query_id = 0;
+	timer_wheel timers;
+	fair_queue<pending_request> pending;
+	timer admit;
+	admission_stats admission;
+	size_t connect_timeouts = 0;
+	size_t idle_timeouts = 0;
+	size_t expired_sessions = 0;
+	std::map<dns_type, packing_stats> packing;
+	std::map<coding, coding_stats> codings;
+	size_t incompressible = 0;
+	size_t out_of_zone = 0;
+	edns_stats edns;
+	std::deque<stream_ref> prefetching;
+	prefetch_stats prefetch;
+	bool handing_off = false;
+};
+
+struct batch_stats {
+	size_t files = 0;
+	size_t records = 0;
+	size_t packets = 0;
+	size_t packet_bytes = 0;
+	size_t replies = 0;
+	size_t reply_bytes = 0;
+	size_t requests = 0;
+	size_t request_bytes = 0;
+	size_t response_bytes = 0;
+};
+
+batch_stats batch_totals = batch_stats();
+
+/*
+ * an idle connection to backend still open, taken out of the pool with its
+ * tls stream, -1 if there is none
+ */
+
+int reuse_upstream(server_state& state, const std::string& backend, tls_stream **tls) {
+
+	auto x = state.idle.find(backend);
+
+	if(x == state.idle.end())
+		return -1;
+
+	int fd = -1;
+
+	while(fd == -1 and not x->second.empty()) {
+
+		const idle_upstream idle = x->second.back();
+
+		x->second.pop_back();
+		state.idle_count--;
+
+		char c;
+
+		if(recv(idle.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 and errno == EAGAIN) {
+			fd = idle.fd;
+			*tls = idle.tls;
+			state.keep_alive.reused++;
+		} else {
+			state.keep_alive.stale++;
+			close(idle.fd);
+			delete idle.tls;
+		}
+	}
+
+	if(x->second.empty())
+		state.idle.erase(x);
+
+	return fd;
+}
+
+/*
+ * backends for requests to a host: the pool of the addresses it resolves
+ * to, resolved again past POOL_RESOLVE_MS (the addresses had kept if that
+ * fails), nullptr if it can't be. past POOL_HOSTS_MAX hosts the least
+ * recently used with nothing outstanding is let go.
+ */
+
+#define POOL_RESOLVE_MS 60000
+#define POOL_HOSTS_MAX  256
+
+backend_pool *host_pool(configuration *config, server_state& state, const http_request& request) {
+
+	const uint64_t now_ms = timer_clock_ms();
+
+	const std::string host = request.host + ':' + std::to_string(request.port);
+
+	auto x = state.host_pools.find(host);
+
+	if(x != state.host_pools.end() and x->second.resolved_ms + POOL_RESOLVE_MS > now_ms)
+		return &x->second;
+
+	std::vector<sockaddr_in> addresses;
+
+	if(request.get_addresses(&addresses) <= 0) {
+
+		state.unresolved++;
+
+		if(x == state.host_pools.end())
+			return nullptr;
+
+		x->second.resolved_ms = now_ms;
+
+		return &x->second;
+	}
+
+	if(x == state.host_pools.end()) {
+
+		if(state.host_pools.size() >= POOL_HOSTS_MAX) {
+
+			auto oldest = state.host_pools.end();
+
+			for(auto y = state.host_pools.begin(); y != state.host_pools.end(); y++)
+				if(y->second.outstanding == 0 and (oldest == state.host_pools.end() or y->second.used_ms < oldest->second.used_ms))
+					oldest = y;
+
+			if(oldest != state.host_pools.end())
+				state.host_pools.erase(oldest);
+		}
+
+		x = state.host_pools.emplace(host, backend_pool()).first;
+
+		x->second.policy = config->balance;
+	}
+
+	x->second.assign(addresses, now_ms);
+
+	return &x->second;
+}
+
+/*
+ * give an upstream's backend back to its pool with how its request went
+ */
+
+void release_backend(upstream_ref *ref) {
+
+	if(ref->pool == nullptr)
+		return;
+
+	const uint64_t now_ms = timer_clock_ms();
+
+	if(ref->pool->done(ref->member, ref->outcome, now_ms)) {
+		char backend_str[256];
+		ref->pool->backends[ref->member].sprint(backend_str, sizeof(backend_str), now_ms);
+		fprintf(stderr, "backend %s: ejected after %d failures in a row\n", backend_str, POOL_EJECT_FAILURES);
+	}
+
+	ref->pool = nullptr;
+}
+
+/*
+ * an upstream that couldn't be opened lets go of what it took
+ */
+
+void abandon_upstream(upstream_ref *ref) {
+
+	release_backend(ref);
+
+	delete ref->tls;
+	ref->tls = nullptr;
+}
+
+/*
+ * start the upstream http connection for request, returning the fd the
+ * response is read from with the request left in ref to send once it is
+ * connected, and the connect itself too with defer_connect. the backend is
+ * the one its pool picks, the zone's or the request host's. an idle
+ * connection to it is taken over if there is one, and https gets a tls
+ * stream with its ClientHello ready. in batch mode the upstream is a stub
+ * that is either nothing or the recorded response file
+ */
+
+int open_upstream(configuration *config, server_state& state, http_request& request, int zone, upstream_ref *ref, bool defer_connect) {
+
+	struct sockaddr_in sin_to;
+
+	int fd;
+
+	std::string s = request.to_s();
+
+	if(config->batch) {
+
+		batch_totals.requests++;
+		batch_totals.request_bytes += s.size();
+
+		if(config->replay == nullptr)
+			return -1;
+
+		fd = open(config->replay, O_RDONLY);
+		if(fd == -1)
+			perror("open()");
+
+		return fd;
+	}
+
+	if(zone == ZONE_NONE) {
+		fprintf(stderr, "%s: its zone is no longer served\n", request.host.c_str());
+		return -1;
+	}
+
+	backend_pool *pool = config->zones[zone].upstreams.empty() ? host_pool(config, state, request) : &state.zone_pools[config->zones[zone].domain];
+
+	if(pool == nullptr) {
+		fprintf(stderr, "couldn't resolve %s\n", request.host.c_str());
+		return -1;
+	}
+
+	if((ref->member = pool->pick(timer_clock_ms())) == -1)
+		return -1;
+
+	ref->pool = pool;
+
+	sin_to = pool->backends[ref->member].address;
+
+	char addr[INET_ADDRSTRLEN] = "?";
+	inet_ntop(AF_INET, &sin_to.sin_addr, addr, sizeof(addr));
+
+	ref->to = sin_to;
+	ref->out = s;
+	ref->backend = std::string(request.ssl ? "https://" : "http://") + request.host + ':' + std::to_string(request.port)
+			+ " at " + addr + ':' + std::to_string(ntohs(sin_to.sin_port));
+
+	if(config->keep_alive > 0 and (fd = reuse_upstream(state, ref->backend, &ref->tls)) != -1)
+		return fd;
+
+	if(request.ssl) {
+
+		ref->tls = new tls_stream();
+
+		if(state.tls.ctx == nullptr or ref->tls->start(&state.tls, request.host.c_str(), ref->backend) == -1) {
+			fprintf(stderr, "%s: couldn't start tls: %s\n", ref->backend.c_str(), tls_error_str());
+			abandon_upstream(ref);
+			return -1;
+		}
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd == -1) {
+		perror("socket()");
+		abandon_upstream(ref);
+		return -1;
+	}
+
+	if(defer_connect) {
+		ref->connecting = true;
+		return fd;
+	}
+
+	if(connect(fd, (sockaddr *)&sin_to, sizeof(sin_to)) == -1) {
+
+		if(errno != EINPROGRESS) {
+			perror("connect()");
+			ref->outcome = pool_outcome::FAILED;
+			abandon_upstream(ref);
+			close(fd);
+			return -1;
+		}
+
+		ref->connecting = true;
+	}
+
+	return fd;
+}
+
+tunnel_stream *find_stream(server_state& state, uint32_t session, uint16_t stream) {
+
+	tunnel_session *s = state.sessions.find(session);
+	if(s == nullptr)
+		return nullptr;
+
+	auto s_iter = s->streams.find(stream);
+	if(s_iter == s->streams.end())
+		return nullptr;
+
+	return &s_iter->second;
+}
+
+/*
+ * charge what a stream holds to the memory budget
+ */
+
+void account_stream(server_state& state, tunnel_stream& stream) {
+
+	size_t fragments = 0;
+
+	for(const auto& fragment : stream.fragments)
+		fragments += fragment.second.capacity();
+
+	stream.memory.set(&state.memory, memory_category::SESSIONS, sizeof(tunnel_stream));
+	stream.memory.set(&state.memory, memory_category::FRAGMENTS, fragments);
+	size_t prepared = 0;
+
+	for(const auto& p : stream.prepared)
+		prepared += sizeof(p) + p.answers.capacity();
+
+	stream.memory.set(&state.memory, memory_category::RESPONSES, stream.head.capacity() + stream.response.footprint() + prepared);
+	stream.memory.set(&state.memory, memory_category::CODING, stream.z.ctx != nullptr ? compress_footprint(stream.z.method) : 0);
+}
+
+/*
+ * the best coding the client accepts for a response, none if it isn't worth
+ * compressing
+ */
+
+coding choose_coding(server_state& state, const tunnel_stream& stream, bool compressible) {
+
+	if(not compressible) {
+		if(stream.codings != 0)
+			state.incompressible++;
+		return coding::IDENTITY;
+	}
+
+	if((stream.codings & TUNNEL_FLAG_ZSTD) and coding_available(coding::ZSTD))
+		return coding::ZSTD;
+
+	if(stream.codings & TUNNEL_FLAG_DEFLATE)
+		return coding::DEFLATE;
+
+	return coding::IDENTITY;
+}
+
+/*
+ * code sz bytes of upstream data onto the response. the coding is the best
+ * the client accepts once the head shows the content is worth compressing,
+ * decided when the head is complete, too long or the upstream ended. data
+ * in a chain segment (from) goes onto an identity-coded response as is, by
+ * reference.
+ */
+
+int code_response(server_state& state, tunnel_stream& stream, const char *data, size_t sz, bool finish, const chain_slice *from) {
+
+	stream.raw_sz += sz;
+
+	if(not stream.coded) {
+
+		stream.head.append(data, sz);
+
+		if(stream.head.find("\r\n\r\n") == std::string::npos and stream.head.size() < HTTP_HEAD_MAX_SZ and not finish)
+			return 0;
+
+		stream.method = choose_coding(state, stream, http_response_compressible(stream.head.data(), stream.head.size()));
+
+		if(stream.z.begin(stream.method) == -1) {
+			stream.method = coding::IDENTITY;
+			stream.z.begin(stream.method);
+		}
+
+		stream.coded = true;
+
+		state.codings[stream.method].responses++;
+
+		data = stream.head.data();
+		sz = stream.head.size();
+		from = nullptr;
+	}
+
+	coding_stats& stats = state.codings[stream.method];
+
+	const size_t before = stream.response.size();
+
+	int result = 0;
+
+	if(from != nullptr and stream.method == coding::IDENTITY)
+		stream.response.append(*from);
+	else
+		result = stream.z.update(data, sz, &stream.response, finish);
+
+	stats.raw_bytes += sz;
+	stats.coded_bytes += stream.response.size() - before;
+
+	if(not stream.head.empty())
+		std::string().swap(stream.head);
+
+	if(finish)
+		stream.z.end();
+
+	account_stream(state, stream);
+
+	return result;
+}
+
+/*
+ * answer a stream with a cached response, in the coding it would have had
+ * from the backend, its segments shared
+ */
+
+void serve_cached(server_state& state, tunnel_stream& stream, cache_entry& entry) {
+
+	stream.z.end();
+
+	stream.method = choose_coding(state, stream, entry.compressible);
+
+	const buffer_chain *response = state.cache.coded(entry, stream.method);
+
+	if(response == nullptr) {
+		stream.method = coding::IDENTITY;
+		response = &entry.raw;
+	}
+
+	coding_stats& stats = state.codings[stream.method];
+
+	stats.responses++;
+	stats.raw_bytes += entry.raw.size();
+	stats.coded_bytes += response->size();
+
+	stream.coded = true;
+	stream.response = *response;
+	stream.raw_sz = entry.raw.size();
+	stream.complete = true;
+
+	account_stream(state, stream);
+}
+
+/*
+ * sz bytes of a response from offset in one piece: in place when they lie in
+ * one segment, copied out to buf when they straddle two
+ */
+
+const uint8_t *response_chunk(const buffer_chain& response, size_t offset, size_t sz, uint8_t *buf) {
+
+	const uint8_t *p = response.contiguous(offset, sz);
+
+	if(p != nullptr)
+		return p;
+
+	response.copy(offset, sz, buf);
+
+	return buf;
+}
+
+/*
+ * the status and total a GET reply on stream carries now
+ */
+
+uint8_t stream_status(const tunnel_stream& stream) {
+	return TUNNEL_STATUS_DATA | tunnel_coding_status(stream.method);
+}
+
+uint32_t stream_total(const tunnel_stream& stream) {
+	return stream.complete ? stream.response.size() : TUNNEL_TOTAL_UNKNOWN;
+}
+
+bool prepared_for(const prepared_reply& p, uint32_t seq, uint16_t chunk_sz, dns_type qtype, size_t question_sz, const tunnel_stream& stream) {
+	return p.ready
+		and p.seq == seq
+		and p.chunk_sz == chunk_sz
+		and p.qtype == qtype
+		and p.question_sz == question_sz
+		and p.total == stream_total(stream)
+		and p.status == stream_status(stream);
+}
+
+/*
+ * the reply prepared for a GET, nullptr if there is none still good
+ */
+
+const prepared_reply *find_prepared(tunnel_stream& stream, const tunnel_query& query, size_t question_sz) {
+
+	if(stream.prepared.empty())
+		return nullptr;
+
+	prepared_reply& p = stream.prepared[query.seq % stream.prepared.size()];
+
+	if(not prepared_for(p, query.seq, query.arg, query.qtype, question_sz, stream))
+		return nullptr;
+
+	p.hit = true;
+
+	return &p;
+}
+
+/*
+ * encode the reply to chunk seq into p the way process_dns_packet would,
+ * false if it doesn't fit a reply
+ */
+
+bool prepare_reply(const tunnel_stream& stream, uint32_t seq, prepared_reply& p) {
+
+	static thread_local dns_rr answers[TUNNEL_ANSWERS_MAX];
+	static thread_local uint8_t buf[DNS_MSG_MAX_SZ];
+
+	tunnel_reply reply;
+
+	const uint64_t start = (uint64_t)seq * stream.chunk_sz;
+
+	static thread_local uint8_t straddling[DNS_MSG_MAX_SZ];
+
+	reply.status = stream_status(stream);
+	reply.total = stream_total(stream);
+	reply.data_sz = std::min(start + stream.chunk_sz, (uint64_t)stream.response.size()) - start;
+	reply.data = response_chunk(stream.response, start, reply.data_sz, straddling);
+
+	ssize_t count = reply.pack(stream.qtype, answers, TUNNEL_ANSWERS_MAX);
+	if(count == -1)
+		return false;
+
+	ssize_t n = stream.question_sz;
+
+	for(ssize_t i = 0; i < count and n != -1; i++) {
+		answers[i].qtype = stream.qtype;
+		answers[i].qclass = dns_class::IN;
+		answers[i].name_offset = sizeof(dns_header);
+		answers[i].ttl = 0;
+		n = answers[i].write(n, buf, sizeof(buf));
+	}
+
+	if(n == -1)
+		return false;
+
+	p.ready = true;
+	p.hit = false;
+	p.seq = seq;
+	p.chunk_sz = stream.chunk_sz;
+	p.qtype = stream.qtype;
+	p.question_sz = stream.question_sz;
+	p.total = reply.total;
+	p.status = reply.status;
+	p.ancount = count;
+	p.answers.assign((const char *)buf + stream.question_sz, n - stream.question_sz);
+
+	return true;
+}
+
+/*
+ * a GET asked for query.seq: past the highest chunk asked for so far, the
+ * stream is queued to have the chunks after it prepared
+ */
+
+void note_get(configuration *config, server_state& state, const stream_ref& ref, tunnel_stream& stream, const tunnel_query& query, size_t question_sz) {
+
+	stream.chunk_sz = query.arg;
+	stream.qtype = query.qtype;
+	stream.question_sz = question_sz;
+
+	if((int64_t)query.seq <= stream.asked)
+		return;
+
+	stream.asked = query.seq;
+
+	if(config->prefetch > 0)
+		state.prefetching.push_back(ref);
+}
+
+/*
+ * prepare the replies to the GETs each queued stream is expected to get
+ * next, the -a chunks after the highest asked for, as far as the response
+ * is in. those prepared for chunks the client went past are replaced, wasted
+ * if no query found them.
+ */
+
+void prefetch_replies(configuration *config, server_state& state) {
+
+	size_t left = PREFETCH_TURN_REPLIES;
+
+	while(not state.prefetching.empty()) {
+
+		const stream_ref ref = state.prefetching.front();
+
+		tunnel_stream *stream = find_stream(state, ref.session, ref.stream);
+
+		if(stream == nullptr or stream->broken or config->prefetch == 0 or not stream->coded) {
+			state.prefetching.pop_front();
+			continue;
+		}
+
+		if(stream->prepared.size() != config->prefetch) {
+			stream->prepared.clear();
+			stream->prepared.resize(config->prefetch);
+		}
+
+		const uint64_t size = stream->response.size();
+
+		bool done = true;
+
+		for(uint64_t seq = stream->asked + 1; seq <= (uint64_t)stream->asked + config->prefetch and seq <= UINT32_MAX; seq++) {
+
+			const uint64_t start = seq * stream->chunk_sz;
+
+			if(start >= size or (start + stream->chunk_sz > size and not stream->complete))
+				break;
+
+			prepared_reply& p = stream->prepared[seq % stream->prepared.size()];
+
+			if(prepared_for(p, seq, stream->chunk_sz, stream->qtype, stream->question_sz, *stream))
+				continue;
+
+			if(left == 0) {
+				done = false;
+				break;
+			}
+
+			if(p.ready and not p.hit)
+				state.prefetch.wasted++;
+
+			p.ready = false;
+
+			if(prepare_reply(*stream, seq, p)) {
+				state.prefetch.prepared++;
+				left--;
+			}
+		}
+
+		account_stream(state, *stream);
+
+		if(not done)
+			break;
+
+		state.prefetching.pop_front();
+	}
+}
+
+/*
+ * let every prepared reply go, for the memory
+ */
+
+void drop_prepared(server_state& state) {
+
+	for(lru_link *x = state.lru.oldest(); x != nullptr; x = state.lru.newer(x)) {
+
+		tunnel_session& session = *(tunnel_session *)x->owner;
+
+		for(auto& y : session.streams) {
+
+			tunnel_stream& stream = y.second;
+
+			if(stream.prepared.empty())
+				continue;
+
+			for(const auto& p : stream.prepared)
+				if(p.ready and not p.hit)
+					state.prefetch.wasted++;
+
+			std::vector<prepared_reply>().swap(stream.prepared);
+
+			account_stream(state, stream);
+		}
+	}
+
+	state.prefetching.clear();
+}
+
+void fail_stream(tunnel_stream& stream, const char *status) {
+
+	stream.z.end();
+	stream.coded = true;
+	stream.method = coding::IDENTITY;
+	const std::string response = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+	stream.response.clear();
+	stream.response.append(response.data(), response.size());
+	stream.complete = true;
+}
+
+/*
+ * a stream whose upstream ended before its response did: answered with
+ * status if none of the response went out yet, otherwise broken, so the
+ * client is told of an error rather than take a short body for the whole
+ */
+
+void cut_stream(tunnel_stream& stream, const char *status) {
+
+	if(stream.asked == -1) {
+		fail_stream(stream, status);
+		return;
+	}
+
+	stream.broken = true;
+	stream.complete = true;
+	stream.prepared.clear();
+}
+
+/*
+ * an upstream's response is over: finish coding it and let the upstream go
+ * with its coroutine, its tls stream handed to tls when the connection is
+ * kept and freed when not
+ */
+
+void finish_upstream(server_state& state, int fd, tls_stream **tls) {
+
+	upstream_ref *ref = state.upstreams.find(fd);
+
+	if(ref != nullptr) {
+
+		tunnel_stream *stream = find_stream(state, ref->session, ref->stream);
+
+		if(stream != nullptr) {
+
+			if(not stream->complete and not ref->whole) {
+				cut_stream(*stream, "502 Bad Gateway");
+				ref->outcome = pool_outcome::FAILED;
+			}
+
+			if(code_response(state, *stream, nullptr, 0, true, nullptr) == -1)
+				fprintf(stderr, "session %08x stream %u: couldn't finish %s response\n",
+						ref->session, ref->stream, coding_str(stream->method));
+
+			stream->fd = -1;
+			stream->complete = true;
+			stream->deadline.cancel();
+		}
+
+		if(ref->handler) {
+			ref->handler.destroy();
+			ref->handler = nullptr;
+		}
+
+		if(tls != nullptr)
+			*tls = ref->tls;
+		else
+			delete ref->tls;
+
+		ref->tls = nullptr;
+
+		release_backend(ref);
+
+		state.upstreams.erase(fd);
+	}
+}
+
+void close_upstream(server_state& state, int fd) {
+
+	finish_upstream(state, fd, nullptr);
+
+	if(state.uring != nullptr)
+		uring_close_upstream(*state.uring, fd);
+	else
+		close(fd);
+}
+
+void close_idle(server_state& state, std::deque<idle_upstream>& pool) {
+
+	const idle_upstream& idle = pool.front();
+
+	close(idle.fd);
+	delete idle.tls;
+
+	pool.pop_front();
+	state.idle_count--;
+}
+
+/*
+ * keep an upstream's connection for the next request to its backend once
+ * the response it carried is over, closing the oldest kept past the limits
+ */
+
+void park_upstream(configuration *config, server_state& state, int fd) {
+
+	const std::string backend = state.upstreams.find(fd)->backend;
+
+	idle_upstream idle;
+
+	idle.fd = fd;
+	idle.parked_ms = timer_clock_ms();
+
+	finish_upstream(state, fd, &idle.tls);
+
+	if(state.uring != nullptr and not uring_cancel_upstream(*state.uring, fd)) {
+		uring_close_upstream(*state.uring, fd);
+		delete idle.tls;
+		return;
+	}
+
+	std::deque<idle_upstream>& pool = state.idle[backend];
+
+	pool.push_back(idle);
+
+	state.idle_count++;
+	state.keep_alive.parked++;
+
+	if(pool.size() > config->keep_alive)
+		close_idle(state, pool);
+
+	while(state.idle_count > UPSTREAM_IDLE_MAX) {
+
+		auto oldest = state.idle.end();
+
+		for(auto x = state.idle.begin(); x != state.idle.end(); x++)
+			if(not x->second.empty() and (oldest == state.idle.end() or x->second.front().parked_ms < oldest->second.front().parked_ms))
+				oldest = x;
+
+		close_idle(state, oldest->second);
+	}
+}
+
+/*
+ * close what was kept idle longer than the upstream idle timeout, or all of
+ * it with idle_ms 0
+ */
+
+void expire_idle(server_state& state, uint64_t idle_ms) {
+
+	const uint64_t now_ms = timer_clock_ms();
+
+	for(auto x = state.idle.begin(); x != state.idle.end(); ) {
+
+		while(not x->second.empty() and (idle_ms == 0 or x->second.front().parked_ms + idle_ms <= now_ms)) {
+			close_idle(state, x->second);
+			state.keep_alive.expired++;
+		}
+
+		if(x->second.empty())
+			x = state.idle.erase(x);
+		else
+			x++;
+	}
+}
+
+/*
+ * a stream's upstream took too long to connect or went quiet, a session had
+ * no queries for too long
+ */
+
+void upstream_expired(timer *t, void *ctx) {
+
+	server_state& state = *(server_state *)ctx;
+	tunnel_stream& stream = *(tunnel_stream *)t->owner;
+
+	upstream_ref *ref = state.upstreams.find(stream.fd);
+
+	if(ref == nullptr)
+		return;
+
+	const bool connecting = ref->connecting;
+
+	char ref_str[128];
+	ref->sprint(ref_str, sizeof(ref_str));
+	fprintf(stderr, "%s: upstream %s timed out, closing http-fd #%d\n", ref_str, connecting ? "connect" : "idle", stream.fd);
+
+	if(connecting) {
+		fail_stream(stream, "504 Gateway Timeout");
+		ref->outcome = pool_outcome::FAILED;
+		state.connect_timeouts++;
+	} else {
+		if(not ref->whole) {
+			cut_stream(stream, "504 Gateway Timeout");
+			ref->outcome = pool_outcome::FAILED;
+		}
+		state.idle_timeouts++;
+	}
+
+	close_upstream(state, stream.fd);
+}
+
+void forget_session(server_state& state, tunnel_session& session) {
+
+	for(auto& x : session.streams)
+		if(x.second.fd != -1)
+			close_upstream(state, x.second.fd);
+
+	state.sessions.erase(session.id);
+}
+
+void session_expired(timer *t, void *ctx) {
+
+	server_state& state = *(server_state *)ctx;
+
+	state.expired_sessions++;
+
+	forget_session(state, *(tunnel_session *)t->owner);
+}
+
+/*
+ * what a session holds, its streams included
+ */
+
+size_t session_footprint(const tunnel_session& session) {
+
+	size_t sz = session.memory.total();
+
+	for(const auto& x : session.streams)
+		sz += x.second.memory.total();
+
+	return sz;
+}
+
+/*
+ * bring memory back under budget: free the idle coding contexts, let cached
+ * responses go, then evict sessions least recently used first, passing over
+ * those with upstreams still open (work in progress) until there are no
+ * others
+ */
+
+void enforce_budget(configuration *config, server_state& state) {
+
+	state.pools.set(&state.memory, memory_category::POOLS, compress_pools_footprint() + coro_frames_footprint() + chain_pool_footprint());
+
+	if(not state.memory.over())
+		return;
+
+	compress_pools_trim();
+	coro_frames_trim();
+	chain_pool_trim();
+	state.pools.set(&state.memory, memory_category::POOLS, compress_pools_footprint() + coro_frames_footprint() + chain_pool_footprint());
+
+	while(state.memory.over() and state.cache.evict())
+		;
+
+	if(state.memory.over())
+		drop_prepared(state);
+
+	for(int pass = 0; pass < 2 and state.memory.over(); pass++) {
+
+		lru_link *next;
+
+		for(lru_link *x = state.lru.oldest(); x != nullptr and state.memory.over(); x = next) {
+
+			next = state.lru.newer(x);
+
+			tunnel_session& session = *(tunnel_session *)x->owner;
+
+			if(pass == 0 and std::any_of(session.streams.begin(), session.streams.end(),
+					[](const std::pair<const uint16_t, tunnel_stream>& y) { return y.second.fd != -1; }))
+				continue;
+
+			const size_t sz = session_footprint(session);
+
+			if(config->verbose)
+				fprintf(config->fp, "session %08x: evicted over memory budget, freeing %ld bytes\n", session.id, (long)sz);
+
+			state.evicted_sessions++;
+			state.evicted_bytes += sz;
+
+			forget_session(state, session);
+		}
+	}
+}
+
+/*
+ * (re)arm a stream's upstream deadline, the connect timeout while connecting
+ * and the idle timeout after
+ */
+
+void arm_upstream(configuration *config, server_state& state, tunnel_stream& stream, bool connecting) {
+
+	stream.deadline.fire = upstream_expired;
+	stream.deadline.owner = &stream;
+
+	state.timers.add(&stream.deadline, connecting ? config->connect_timeout_ms : config->upstream_idle_ms);
+}
+
+/*
+ * ask the io_uring loop for what an upstream's coroutine is about to await:
+ * the send of what is in out unless one is in flight, a recv unless one is
+ * armed. the select loop needs nothing, it watches the fd for what is
+ * awaited. -EBUSY if the ring has no room for it.
+ */
+
+int upstream_await(server_state& state, int fd, upstream_wait what) {
+
+	if(state.uring == nullptr)
+		return 0;
+
+	upstream_ref *ref = state.upstreams.find(fd);
+
+	if(what == upstream_wait::SEND and not ref->sending and not ref->out.empty() and not uring_send_out(*state.uring, fd, ref, 0))
+		return -EBUSY;
+
+	if(what == upstream_wait::RECV and not ref->receiving) {
+		if(not uring_arm_recv(*state.uring, fd))
+			return -EBUSY;
+		ref->receiving = true;
+	}
+
+	return 0;
+}
+
+/*
+ * each upstream is driven by a coroutine, fetch_upstream, awaiting the
+ * operations of an upstream_io. whichever loop is serving does the I/O and
+ * resumes it with the outcome: connect() and send() give 0 or -errno once
+ * connected or out is all sent, recv() the bytes read into data(), 0 at EOF
+ * or -errno. what is done already (a connect that finished at once, nothing
+ * to send, data io_uring received meanwhile) does not suspend.
+ */
+
+struct upstream_awaiter {
+
+	server_state& state;
+	int fd;
+	upstream_wait what;
+
+	bool await_ready() {
+
+		const upstream_ref *ref = state.upstreams.find(fd);
+
+		switch(what) {
+			case upstream_wait::CONNECT:
+				return not ref->connecting;
+			case upstream_wait::SEND:
+				return ref->out.empty() and not ref->sending;
+			case upstream_wait::RECV:
+				return not ref->in.empty() or ref->in_status <= 0;
+			default:
+				return true;
+		}
+	}
+
+	bool await_suspend(std::coroutine_handle<> h) {
+
+		upstream_ref *ref = state.upstreams.find(fd);
+
+		ref->handler = h;
+		ref->awaiting = what;
+
+		return (ref->result = upstream_await(state, fd, what)) == 0;
+	}
+
+	ssize_t await_resume() {
+
+		upstream_ref *ref = state.upstreams.find(fd);
+
+		if(ref->awaiting == upstream_wait::NONE) {
+
+			if(what != upstream_wait::RECV)
+				return 0;
+
+			if(ref->in.empty())
+				return ref->in_status;
+
+			ref->held.swap(ref->in);
+			ref->in.clear();
+			ref->data = (const uint8_t *)ref->held.data();
+			ref->slice = nullptr;
+
+			return ref->held.size();
+		}
+
+		ref->awaiting = upstream_wait::NONE;
+
+		return ref->result;
+	}
+};
+
+struct upstream_io {
+
+	server_state& state;
+	int fd;
+
+	upstream_ref& ref() {
+		return *state.upstreams.find(fd);
+	}
+
+	tunnel_stream *stream() {
+		return find_stream(state, ref().session, ref().stream);
+	}
+
+	const uint8_t *data() {
+		return ref().data;
+	}
+
+	const chain_slice *slice() {
+		return ref().slice;
+	}
+
+	upstream_awaiter connect() {
+		return upstream_awaiter{state, fd, upstream_wait::CONNECT};
+	}
+
+	upstream_awaiter send() {
+		return upstream_awaiter{state, fd, upstream_wait::SEND};
+	}
+
+	upstream_awaiter recv() {
+		return upstream_awaiter{state, fd, upstream_wait::RECV};
+	}
+};
+
+/*
+ * the plaintext tls has for sz bytes of ciphertext, decrypted straight into
+ * segments of plain: its size, -1 once the backend closed or -2 if it failed
+ */
+
+ssize_t upstream_decrypt(tls_stream *tls, const uint8_t *data, size_t sz, buffer_chain *plain) {
+
+	ssize_t n;
+
+	tls->feed(data, sz);
+
+	plain->clear();
+
+	for(;;) {
+
+		chain_slice room = chain_room(CHAIN_ROOM_MIN);
+
+		n = tls->read(room.data(), room.sz);
+
+		chain_wrote(&room, n > 0 ? n : 0);
+
+		plain->append(room);
+		chain_release(room.segment);
+
+		if(n <= 0)
+			break;
+	}
+
+	return n < 0 and plain->empty() ? n : plain->size();
+}
+
+/*
+ * code the bytes of chain from offset to end onto the stream, a slice at a
+ * time so identity-coded ones are taken by reference
+ */
+
+int code_chain(server_state& state, tunnel_stream& stream, const buffer_chain& chain, size_t offset, size_t end) {
+
+	while(offset < end) {
+
+		chain_slice s = chain.slice(offset);
+
+		s.sz = std::min((size_t)s.sz, end - offset);
+
+		if(code_response(state, stream, (const char *)s.data(), s.sz, false, &s) == -1)
+			return -1;
+
+		offset += s.sz;
+	}
+
+	return 0;
+}
+
+/*
+ * an upstream from connect to the end of the response: over https the
+ * handshake first, the request held back until it is established (or sent
+ * at once on a connection kept from before), then the request and the
+ * response coded onto its stream as it arrives. a failed connect, handshake
+ * or send answers 502. the response's framing says where it ends, the
+ * connection reusable if the backend lets it be. closing or keeping the
+ * upstream is left to whoever sees it done.
+ *
+ * with something to fill the cache with, the response is held until its
+ * status is in: a 304 to a revalidation answers with the entry it freshens
+ * (502 if that was let go meanwhile), anything else is coded as above and
+ * kept whole to be stored once over, unless it grows too large to keep.
+ */
+
+coro_task fetch_upstream(configuration *config, server_state& state, int fd, bool head_only, cache_fill fill) {
+
+	upstream_io upstream{state, fd};
+
+	http_response_end end;
+
+	end.head_only = head_only;
+
+	tls_stream *tls = upstream.ref().tls;
+
+	std::string request;
+
+	buffer_chain in, held;
+	size_t passed = 0;
+
+	char ref_str[128];
+
+	if(tls != nullptr) {
+
+		request.swap(upstream.ref().out);
+
+		if(tls->established()) {
+			tls->write(request.data(), request.size());
+			std::string().swap(request);
+		}
+
+		tls->drain(&upstream.ref().out);
+	}
+
+	ssize_t error = co_await upstream.connect();
+
+	if(error == 0) {
+
+		upstream.ref().connecting = false;
+
+		if(tunnel_stream *stream = upstream.stream())
+			arm_upstream(config, state, *stream, false);
+	}
+
+	while(error == 0 and tls != nullptr and not tls->established()) {
+
+		if((error = co_await upstream.send()) < 0)
+			break;
+
+		ssize_t sz = co_await upstream.recv();
+
+		if(sz <= 0) {
+			error = sz < 0 ? sz : -ECONNRESET;
+			break;
+		}
+
+		tls->feed(upstream.data(), sz);
+
+		const int r = tls->handshake();
+
+		tls->drain(&upstream.ref().out);
+
+		if(r == -1) {
+			upstream.ref().sprint(ref_str, sizeof(ref_str));
+			fprintf(stderr, "%s: tls handshake with %s failed: %s\n", ref_str, upstream.ref().backend.c_str(), tls_error_str());
+			error = -EPROTO;
+		} else if(r == 1) {
+			tls->write(request.data(), request.size());
+			tls->drain(&upstream.ref().out);
+			std::string().swap(request);
+		}
+	}
+
+	if(error == 0)
+		error = co_await upstream.send();
+
+	if(error < 0) {
+
+		upstream.ref().outcome = pool_outcome::FAILED;
+
+		upstream.ref().sprint(ref_str, sizeof(ref_str));
+		eprintf(-error, "%s: upstream failed, closing http-fd #%d", ref_str, fd);
+
+		if(tunnel_stream *stream = upstream.stream())
+			fail_stream(*stream, "502 Bad Gateway");
+
+		co_return;
+	}
+
+	for(;;) {
+
+		ssize_t sz = co_await upstream.recv();
+
+		in.clear();
+
+		if(tls != nullptr and sz > 0) {
+
+			sz = upstream_decrypt(tls, upstream.data(), sz, &in);
+
+			tls->drain(&upstream.ref().out);
+
+			if(not upstream.ref().out.empty() and (error = co_await upstream.send()) < 0) {
+				if(end.status == 0)
+					upstream.ref().outcome = pool_outcome::FAILED;
+				upstream.ref().sprint(ref_str, sizeof(ref_str));
+				eprintf(-error, "%s: send() failed, removing http-fd #%d", ref_str, fd);
+				co_return;
+			}
+
+			if(sz == 0)
+				continue;
+
+			if(sz == -1)
+				sz = 0;
+			else if(sz == -2) {
+				if(end.status == 0)
+					upstream.ref().outcome = pool_outcome::FAILED;
+				upstream.ref().sprint(ref_str, sizeof(ref_str));
+				fprintf(stderr, "%s: tls from %s failed: %s\n", ref_str, upstream.ref().backend.c_str(), tls_error_str());
+				co_return;
+			}
+		} else if(sz > 0) {
+			if(const chain_slice *slice = upstream.slice())
+				in.append(*slice);
+			else
+				in.append(upstream.data(), sz);
+		}
+
+		if(sz <= 0 and end.status == 0)
+			upstream.ref().outcome = pool_outcome::FAILED;
+
+		if(sz < 0) {
+			eprintf(-sz, "read() failed, removing http-fd #%d", fd);
+			co_return;
+		}
+
+		if(sz == 0) {
+			if(config->verbose)
+				fprintf(config->fp, "http connection closed, removing http-fd #%d\n", fd);
+			co_return;
+		}
+
+		tunnel_stream *stream = upstream.stream();
+
+		if(stream == nullptr or stream->response.size() + sz > SESSION_RESPONSE_MAX_SZ) {
+			upstream.ref().sprint(ref_str, sizeof(ref_str));
+			fprintf(stderr, "%s: response too large, closing http-fd #%d\n", ref_str, fd);
+			co_return;
+		}
+
+		size_t used = 0;
+
+		while(used < in.size()) {
+
+			const chain_slice s = in.slice(used);
+			const size_t n = end.feed((const char *)s.data(), s.sz);
+
+			used += n;
+
+			if(n < s.sz)
+				break;
+		}
+
+		upstream.ref().whole = end.done() or end.at == http_response_end::part::UNTIL_EOF;
+
+		if(upstream.ref().outcome == pool_outcome::NONE and end.status != 0)
+			upstream.ref().outcome = end.status >= 500 ? pool_outcome::FAILED : pool_outcome::OK;
+
+		const bool reusable = end.reusable() and used == (size_t)sz and config->keep_alive > 0 and not upstream.ref().backend.empty();
+
+		const buffer_chain *coded = &in;
+		size_t coded_from = 0;
+
+		if(not fill.url.empty()) {
+
+			held.append(in, 0, used);
+
+			if(end.status == 0 and end.at == http_response_end::part::HEAD) {
+				arm_upstream(config, state, *stream, false);
+				continue;
+			}
+
+			if(end.status == 304 and not fill.revalidating.empty()) {
+
+				const std::string head = held.str(0, held.size());
+
+				if(cache_entry *entry = state.cache.refresh(fill.revalidating, head.data(), head.size(), time(nullptr)))
+					serve_cached(state, *stream, *entry);
+				else
+					fail_stream(*stream, "502 Bad Gateway");
+
+				upstream.ref().reusable = reusable;
+				co_return;
+			}
+
+			coded = &held;
+			coded_from = passed;
+			used = held.size();
+			passed = held.size();
+		}
+
+		if(code_chain(state, *stream, *coded, coded_from, used) == -1) {
+			upstream.ref().sprint(ref_str, sizeof(ref_str));
+			fprintf(stderr, "%s: couldn't code response, closing http-fd #%d\n", ref_str, fd);
+			co_return;
+		}
+
+		if(not fill.url.empty() and held.size() > state.cache.limit / CACHE_ENTRY_SHARE) {
+			fill.url.clear();
+			held.clear();
+		}
+
+		arm_upstream(config, state, *stream, false);
+
+		if(end.done()) {
+
+			upstream.ref().reusable = reusable;
+
+			if(not fill.url.empty())
+				state.cache.store(fill, held, time(nullptr));
+
+			co_return;
+		}
+	}
+}
+
+/*
+ * run an upstream's coroutine until it next waits, keeping the connection
+ * or closing the upstream if it is done
+ */
+
+void upstream_run(configuration *config, server_state& state, int fd) {
+
+	upstream_ref *ref = state.upstreams.find(fd);
+
+	ref->handler.resume();
+
+	if((ref = state.upstreams.find(fd)) == nullptr or not ref->handler.done())
+		return;
+
+	if(ref->reusable)
+		park_upstream(config, state, fd);
+	else
+		close_upstream(state, fd);
+}
+
+/*
+ * resume an upstream's coroutine with the outcome of what it waits for
+ */
+
+void upstream_resume(configuration *config, server_state& state, int fd, upstream_wait what, ssize_t result, const uint8_t *data, const chain_slice *slice) {
+
+	upstream_ref *ref = state.upstreams.find(fd);
+
+	if(ref == nullptr or ref->awaiting != what)
+		return;
+
+	ref->result = result;
+	ref->data = data;
+	ref->slice = slice;
+
+	upstream_run(config, state, fd);
+}
+
+/*
+ * send a request upstream for its stream
+ */
+
+void open_request(configuration *config, server_state& state, pending_request& pending, tunnel_stream& stream) {
+
+	upstream_ref upstream;
+
+	stream.fd = open_upstream(config, state, pending.request, pending.zone, &upstream, state.uring != nullptr);
+
+	if(stream.fd == -1) {
+		if(not config->batch or config->replay != nullptr)
+			fail_stream(stream, "502 Bad Gateway");
+		else
+			stream.complete = true;
+		return;
+	}
+
+	upstream.session = pending.session;
+	upstream.stream = pending.stream;
+	upstream.peer = pending.peer;
+	upstream.query_id = pending.query_id;
+
+	state.upstreams.insert(stream.fd, upstream);
+
+	if(config->verbose) {
+		char ref_str[128];
+		upstream.sprint(ref_str, sizeof(ref_str));
+		fprintf(config->fp, "%s: upstream http-fd #%d\n", ref_str, stream.fd);
+	}
+
+	const int fd = stream.fd;
+
+	arm_upstream(config, state, stream, upstream.connecting);
+
+	state.upstreams.find(fd)->handler = fetch_upstream(config, state, fd, pending.request.method == http_method::HEAD, pending.cache).handle;
+
+	upstream_run(config, state, fd);
+
+	upstream_ref *ref = state.upstreams.find(fd);
+
+	if(state.uring != nullptr and ref != nullptr and ref->connecting and not uring_open_upstream(*state.uring, fd, ref))
+		upstream_resume(config, state, fd, upstream_wait::CONNECT, -EBUSY, nullptr, nullptr);
+}
+
+void admit_pending(configuration *, server_state&);
+
+/*
+ * the fair queuing flow the query being processed belongs to
+ */
+
+uint32_t flow_key(configuration *config, const server_state& state, uint32_t session) {
+
+	if(config->fair_by == fairness::SESSION)
+		return session;
+
+	if(state.peer.ss_family == AF_INET6) {
+		const uint32_t *w = (const uint32_t *)&((const sockaddr_in6 *)&state.peer)->sin6_addr;
+		return w[0] ^ w[1] ^ w[2] ^ w[3];
+	}
+
+	return ((const sockaddr_in *)&state.peer)->sin_addr.s_addr;
+}
+
+/*
+ * once every fragment up to the FIN is in, rebuild the http_request and
+ * answer it from the cache if it is fresh there, else queue it under its
+ * client for an upstream connection (conditional if the cache has it stale),
+ * opening what is due. -1 when the queue or the client's share of it is
+ * full, or the server is handing off to another, the fragments are kept for
+ * the client to try again.
+ */
+
+int start_request(configuration *config, const stream_ref& ref, int zone, tunnel_stream& stream, server_state& state) {
+
+	std::string s;
+
+	pending_request pending;
+
+	for(const auto& fragment : stream.fragments) {
+
+		if(fragment.first != s.size())
+			return 0;
+
+		s += fragment.second;
+	}
+
+	if((ssize_t)s.size() != stream.request_sz)
+		return 0;
+
+	const int parsed = pending.request.parse(s.data(), s.size());
+
+	cache_entry *entry = nullptr;
+
+	const cache_lookup cached = parsed != -1 and state.cache.enabled()
+			? state.cache.lookup(pending.request, time(nullptr), &entry, &pending.cache)
+			: cache_lookup::BYPASS;
+
+	if(cached == cache_lookup::FRESH) {
+
+		stream.requested = true;
+		stream.fragments.clear();
+
+		if(config->verbose)
+			fprintf(config->fp, "url: %s (cached)\n", pending.request.url().c_str());
+
+		serve_cached(state, stream, *entry);
+		return 0;
+	}
+
+	if(cached == cache_lookup::STALE)
+		state.cache.ask(*entry, &pending.request);
+
+	if(state.handing_off) {
+		state.admission.rejected++;
+		return -1;
+	}
+
+	const uint32_t key = flow_key(config, state, ref.session);
+
+	const bool waits = state.upstreams.size() >= config->max_upstreams or not state.pending.empty() or config->rate > 0;
+
+	if(waits and state.pending.size() >= config->max_pending) {
+		state.admission.rejected++;
+		return -1;
+	}
+
+	if(waits and state.pending.flow_size(key) >= std::max(config->max_pending / FAIR_FLOW_SHARE, (size_t)1)) {
+		state.admission.over_share++;
+		return -1;
+	}
+
+	stream.requested = true;
+	stream.fragments.clear();
+
+	if(parsed == -1) {
+		fprintf(stderr, "session %08x stream %u: couldn't parse tunneled request\n", ref.session, ref.stream);
+		fail_stream(stream, "400 Bad Request");
+		return 0;
+	}
+
+	pending.request.headers["Connection"] = config->keep_alive > 0 ? "keep-alive" : "close";
+
+	if(config->verbose) {
+		fprintf(config->fp, "url: %s\n", pending.request.url().c_str());
+		fprintf(config->fp, "[request]\n%s\n", pending.request.to_s().c_str());
+	}
+
+	pending.session = ref.session;
+	pending.stream = ref.stream;
+	pending.zone = zone;
+	pending.peer = state.peer;
+	pending.query_id = state.query_id;
+
+	pending.queued_ms = timer_clock_ms();
+	pending.sz = s.size();
+
+	state.memory.charge(memory_category::QUEUE, pending.sz);
+
+	state.pending.push(key, pending, 1 + s.size() / FAIR_TURN_SZ, pending.queued_ms);
+
+	state.admission.queued++;
+	state.admission.queue_max = std::max(state.admission.queue_max, state.pending.size());
+	state.admission.flows_max = std::max(state.admission.flows_max, state.pending.ring.size());
+
+	admit_pending(config, state);
+
+	return 0;
+}
+
+/*
+ * open queued requests as upstream connections free up, clients taking turns.
+ * one that waited past the connect timeout is answered 503 rather than started
+ * late. with every client left rate limited the admit timer wakes the loop
+ * when the first has a token again.
+ */
+
+void admit_pending(configuration *config, server_state& state) {
+
+	pending_request pending;
+
+	uint64_t retry_ms = 0;
+
+	while(state.upstreams.size() < config->max_upstreams) {
+
+		const uint64_t now_ms = timer_clock_ms();
+
+		if(not state.pending.pop(now_ms, &pending, &retry_ms)) {
+			if(retry_ms > 0)
+				state.timers.add(&state.admit, retry_ms);
+			break;
+		}
+
+		state.memory.release(memory_category::QUEUE, pending.sz);
+
+		tunnel_stream *stream = find_stream(state, pending.session, pending.stream);
+
+		if(stream == nullptr or stream->complete)
+			continue;
+
+		if(now_ms - pending.queued_ms > config->connect_timeout_ms) {
+			fail_stream(*stream, "503 Service Unavailable");
+			state.admission.shed++;
+		} else {
+			state.admission.admitted++;
+			open_request(config, state, pending, *stream);
+		}
+
+		account_stream(state, *stream);
+	}
+}
+
+/*
+ * answer a tunnel query, a GET's reply found prepared left in prepared
+ */
+
+tunnel_reply process_tunnel_query(configuration *config, const tunnel_query& query, int zone, size_t question_sz, server_state& state, dns_rcode *rcode, const prepared_reply **prepared) {
+
+	const size_t chunk_max_sz = tunnel_reply::capacity(query.qtype, question_sz);
+
+
+	tunnel_reply reply;
+
+	const stream_ref ref = { query.session, query.stream };
+
+	tunnel_stream *stream = find_stream(state, query.session, query.stream);
+
+	/*
+	 * a session belongs to the zone it was opened under
+	 */
+
+	tunnel_session *session = state.sessions.find(query.session);
+
+	if(session != nullptr and session->zone != zone) {
+		reply.status = TUNNEL_STATUS_ERROR;
+		return reply;
+	}
+
+	switch(query.op) {
+
+		case tunnel_op::PUT:
+
+			if(session == nullptr and state.sessions.size() >= config->max_sessions) {
+				state.admission.refused++;
+				*rcode = dns_rcode::REFUSED;
+				return reply;
+			}
+
+			if(stream == nullptr) {
+				if(session == nullptr) {
+					session = &state.sessions.insert(query.session);
+					session->id = query.session;
+					session->zone = zone;
+					session->lru.owner = session;
+					session->memory.set(&state.memory, memory_category::SESSIONS, sizeof(tunnel_session));
+				}
+				stream = &session->streams[query.stream];
+			}
+
+			reply.status = TUNNEL_STATUS_ACK;
+
+			if(stream->requested)
+				break;
+
+			stream->fragments[query.seq] = std::string((const char *)query.data, query.data_sz);
+
+			stream->codings |= query.arg & (TUNNEL_FLAG_DEFLATE | TUNNEL_FLAG_ZSTD);
+
+			if(query.arg & TUNNEL_FLAG_FIN)
+				stream->request_sz = query.seq + query.data_sz;
+
+			if(stream->request_sz != -1 and start_request(config, ref, zone, *stream, state) == -1)
+				*rcode = dns_rcode::SERVFAIL;
+
+			break;
+
+		case tunnel_op::GET:
+
+			if(stream == nullptr or stream->broken or query.arg == 0 or query.arg > chunk_max_sz) {
+				reply.status = TUNNEL_STATUS_ERROR;
+				break;
+			}
+
+			{
+				const uint64_t start = (uint64_t)query.seq * query.arg;
+				const uint64_t end = start + query.arg;
+
+				if(stream->complete)
+					reply.total = stream->response.size();
+
+				if(end <= stream->response.size() or stream->complete) {
+
+					reply.status = TUNNEL_STATUS_DATA | tunnel_coding_status(stream->method);
+
+					if(start < stream->response.size()) {
+
+						static thread_local uint8_t straddling[DNS_MSG_MAX_SZ];
+
+						reply.data_sz = std::min(end, (uint64_t)stream->response.size()) - start;
+						reply.data = response_chunk(stream->response, start, reply.data_sz, straddling);
+					}
+
+					if((*prepared = find_prepared(*stream, query, question_sz)) != nullptr)
+						state.prefetch.hits++;
+
+				} else {
+
+					reply.status = TUNNEL_STATUS_PENDING;
+				}
+			}
+
+			note_get(config, state, ref, *stream, query, question_sz);
+			break;
+
+		case tunnel_op::REPAIR:
+
+			if(stream == nullptr or stream->broken or query.arg == 0 or query.arg > chunk_max_sz or (query.seq & 0xff) >= TUNNEL_FEC_REPAIRS_MAX) {
+				reply.status = TUNNEL_STATUS_ERROR;
+				break;
+			}
+
+			{
+				const size_t chunk_sz = query.arg;
+				const uint64_t start = (uint64_t)(query.seq >> 8) * TUNNEL_FEC_WIDTH * chunk_sz;
+				const uint64_t end = start + TUNNEL_FEC_WIDTH * chunk_sz;
+
+				if(stream->complete)
+					reply.total = stream->response.size();
+
+				if(end > stream->response.size() and not stream->complete) {
+					reply.status = TUNNEL_STATUS_PENDING;
+					break;
+				}
+
+				if(start >= stream->response.size()) {
+					reply.status = TUNNEL_STATUS_ERROR;
+					break;
+				}
+
+				/*
+				 * the block's chunks in place, but for a short last one
+				 * and those straddling segments
+				 */
+
+				static thread_local uint8_t copied[TUNNEL_FEC_WIDTH][DNS_MSG_MAX_SZ];
+				static thread_local uint8_t repair[DNS_MSG_MAX_SZ];
+
+				const uint8_t *chunks[TUNNEL_FEC_WIDTH];
+				size_t count = 0;
+
+				for(uint64_t offset = start; offset < end and offset < stream->response.size(); offset += chunk_sz) {
+
+					const uint8_t *p;
+
+					if(offset + chunk_sz > stream->response.size()) {
+						memset(copied[count], 0, chunk_sz);
+						stream->response.copy(offset, stream->response.size() - offset, copied[count]);
+						p = copied[count];
+					} else {
+						p = response_chunk(stream->response, offset, chunk_sz, copied[count]);
+					}
+
+					chunks[count++] = p;
+				}
+
+				fec_encode(TUNNEL_FEC_WIDTH, chunks, count, query.seq & 0xff, chunk_sz, repair);
+
+				reply.status = TUNNEL_STATUS_DATA | tunnel_coding_status(stream->method);
+				reply.data = repair;
+				reply.data_sz = chunk_sz;
+			}
+			break;
+
+		case tunnel_op::CLOSE:
+
+			if(stream != nullptr) {
+
+				if(stream->fd != -1)
+					close_upstream(state, stream->fd);
+
+				session->streams.erase(query.stream);
+
+				if(session->streams.empty())
+					state.sessions.erase(query.session);
+			}
+
+			reply.status = TUNNEL_STATUS_ACK;
+			break;
+	}
+
+	if((session = state.sessions.find(query.session)) != nullptr) {
+
+		session->idle.fire = session_expired;
+		session->idle.owner = session;
+		state.timers.add(&session->idle, config->session_idle_ms);
+
+		state.lru.touch(&session->lru);
+
+		if((stream = find_stream(state, query.session, query.stream)) != nullptr)
+			account_stream(state, *stream);
+	}
+
+	return reply;
+}
+
+/*
+ * answer the question at offset, filling up to TUNNEL_ANSWERS_MAX answers
+ * and returning the offset past the question
+ */
+
+ssize_t process_question(configuration *config, size_t offset, const void * data, size_t data_sz, server_state& state, dns_rr *answers, size_t *answer_count, dns_rcode *rcode, const prepared_reply **prepared) {
+
+	dns_question question;
+	tunnel_query query;
+
+	/*
+	 * turn away names under none of the zones before parsing anything
+	 */
+
+	ssize_t name_end;
+
+	const int zone = config->zone_index.match(offset, data, data_sz, &name_end);
+
+	if(name_end == -1 or (size_t)name_end + 4 > data_sz)
+		return -1;
+
+	if(zone == ZONE_NONE) {
+		state.out_of_zone++;
+		*answer_count = 0;
+		*rcode = dns_rcode::NXDOMAIN;
+		return name_end + 4;
+	}
+
+	ssize_t n = question.parse(offset, data, data_sz);
+	if(n == -1)
+		return -1;
+
+	if(config->verbose) {
+		char q_str[DNS_NAME_MAX_SZ * 2];
+		question.sprint(q_str, sizeof(q_str));
+		fprintf(config->fp, "DNS QUESTION :: %s\n", q_str);
+	}
+
+	*answer_count = 0;
+
+	for(size_t i = 0; i < TUNNEL_ANSWERS_MAX; i++) {
+		answers[i].qtype = question.qtype;
+		answers[i].qclass = question.qclass;
+		answers[i].name_offset = offset;
+		answers[i].ttl = 0;
+		answers[i].rdata_sz = 0;
+	}
+
+	if(query.parse(question, tunnel_zone(config->zones[zone].domain.c_str())) == -1) {
+		*rcode = dns_rcode::NXDOMAIN;
+		return n;
+	}
+
+	if(config->verbose) {
+		char q_str[256];
+		query.sprint(q_str, sizeof(q_str));
+		fprintf(config->fp, "TUNNEL QUERY :: %s\n", q_str);
+	}
+
+	*rcode = dns_rcode::NOERROR;
+
+	tunnel_reply reply = process_tunnel_query(config, query, zone, n, state, rcode, prepared);
+
+	if(*rcode != dns_rcode::NOERROR)
+		return n;
+
+	if(*prepared != nullptr) {
+
+		*answer_count = (*prepared)->ancount;
+
+	} else {
+
+		ssize_t m = reply.pack(question.qtype, answers, TUNNEL_ANSWERS_MAX);
+		if(m == -1) {
+			*rcode = dns_rcode::SERVFAIL;
+			return n;
+		}
+
+		*answer_count = m;
+	}
+
+	packing_stats& packing = state.packing[question.qtype];
+
+	packing.replies++;
+	packing.data_bytes += reply.data_sz;
+
+	*rcode = dns_rcode::NOERROR;
+
+	return n;
+}
+
+/*
+ * step over count RRs from offset by their lengths, nothing copied. only an
+ * OPT is decoded, or with verbose whatever has a decoder, to show it.
+ */
+
+ssize_t
+process_rr_section(configuration *config, size_t offset, const void * data, size_t data_sz, size_t count, const char *section_name, server_state& state)
+{
+
+	for(size_t q_n = 1; q_n <= count; q_n++) {
+
+		dns_rr_view rr;
+
+		ssize_t n = rr.parse(offset, data, data_sz);
+		if(n == -1) {
+			fprintf(stderr, "dns %s #%d parse failed...\n", section_name, (int)q_n);
+			return -1;
+		}
+
+		offset = n;
+
+		if(rr.type != dns_type::OPT and not config->verbose)
+			continue;
+
+		dns_rdata rdata;
+
+		const int decoded = rdata.decode(rr, data, data_sz);
+
+		if(rdata.kind == dns_rdata_kind::OPT) {
+			if(decoded == -1) {
+				state.edns.malformed++;
+			} else {
+				state.edns.queries++;
+				state.edns.udp_sz_max = std::max(state.edns.udp_sz_max, (size_t)rdata.opt.udp_sz);
+			}
+		}
+
+		if(config->verbose) {
+
+			char rr_string[DNS_NAME_MAX_SZ * 2];
+			char rdata_string[128];
+
+			rr.sprint(rr_string, sizeof(rr_string), data, data_sz);
+
+			if(decoded == -1)
+				snprintf(rdata_string, sizeof(rdata_string), "malformed");
+			else
+				rdata.sprint(rdata_string, sizeof(rdata_string));
+
+			fprintf(config->fp, "dns %s #%d :: %s %s\n", section_name, (int)q_n, rr_string, rdata_string);
+		}
+	}
+
+	return offset;
+}
+
+/*
+ * process one query and write the reply, returning the reply size or zero
+ * when the packet deserves no reply at all
+ */
+
+ssize_t process_dns_packet(configuration *config, const void *data, ssize_t data_sz, server_state& state, void *reply, size_t reply_sz) {
+
+	ssize_t offset;
+	ssize_t n;
+
+	dns_header header;
+
+	dns_rr answers[TUNNEL_ANSWERS_MAX];
+	size_t answer_count = 0;
+	dns_rcode rcode = dns_rcode::NOERROR;
+
+	const prepared_reply *prepared = nullptr;
+
+	n = header.parse(data, data_sz);
+	if(n == -1) {
+		fprintf(stderr, "dns header parse failed...\n");
+		return 0;
+	}
+
+	state.query_id = header.id;
+
+	offset = n;
+
+	if(config->verbose) {
+		char header_string[256];
+		header.sprint(header_string, sizeof(header_string));
+		fprintf(config->fp, "DNS HEADER :: %s\n", header_string);
+	}
+
+	if(header.is_response()) {
+		fprintf(stderr, "ignoring DNS RESPONSE\n");
+		return 0;
+	}
+
+	if((dns_opcode)header.opcode != dns_opcode::QUERY) {
+		fprintf(stderr, "ignoring DNS OPCODE #%d (%s)\n", header.opcode, dns_opcode_str((dns_opcode)header.opcode));
+		return 0;
+	}
+
+	if(header.qdcount != 1) {
+		fprintf(stderr, "ignoring DNS QUERY with %d questions\n", header.qdcount);
+		return 0;
+	}
+
+	n = process_question(config, offset, data, data_sz, state, answers, &answer_count, &rcode, &prepared);
+	if(n == -1) {
+		fprintf(stderr, "couldn't process DNS QUESTION\n");
+		return 0;
+	}
+
+	const size_t question_end = n;
+
+	offset = n;
+
+	if((offset = process_rr_section(config, offset, data, data_sz, header.ancount, "answer", state)) == -1)
+		return 0;
+
+	if((offset = process_rr_section(config, offset, data, data_sz, header.nscount, "nameservers", state)) == -1)
+		return 0;
+
+	if((offset = process_rr_section(config, offset, data, data_sz, header.arcount, "additional", state)) == -1)
+		return 0;
+
+	/*
+	 * the reply echoes the header and question then carries the answer,
+	 * copied as is when prepared ahead
+	 */
+
+	if(question_end > DNS_MSG_MAX_SZ or question_end > reply_sz)
+		return 0;
+
+	memcpy(reply, data, question_end);
+
+	header.qr = 1;
+	header.aa = 1;
+	header.tc = 0;
+	header.ra = 0;
+	header.z = 0;
+	header.rcode = (uint8_t)rcode;
+	header.ancount = answer_count;
+	header.nscount = 0;
+	header.arcount = 0;
+
+	n = question_end;
+
+	if(prepared != nullptr and question_end + prepared->answers.size() <= std::min(reply_sz, (size_t)DNS_MSG_MAX_SZ)) {
+		memcpy((uint8_t *)reply + question_end, prepared->answers.data(), prepared->answers.size());
+		n += prepared->answers.size();
+	} else {
+		for(size_t i = 0; i < answer_count and n != -1; i++)
+			n = answers[i].write(n, reply, std::min(reply_sz, (size_t)DNS_MSG_MAX_SZ));
+	}
+
+	if(n == -1) {
+		header.tc = 1;
+		header.ancount = 0;
+		n = question_end;
+	}
+
+	if(header.ancount > 0)
+		state.packing[answers[0].qtype].wire_bytes += n;
+
+	header.write(reply, reply_sz);
+
+	return n;
+}
+
+/*
+ * read what an upstream has straight into room in a chain segment, the
+ * slice read into held until released
+ */
+
+ssize_t read_upstream(int fd, chain_slice *in) {
+
+	*in = chain_room(CHAIN_ROOM_MIN);
+
+	ssize_t sz = read(fd, in->data(), in->sz);
+
+	chain_wrote(in, sz > 0 ? sz : 0);
+
+	return sz;
+}
+
+/*
+ * sz bytes read from an upstream into in, 0 at EOF or -1 with errno set, for
+ * the coroutine reading it
+ */
+
+void process_upstream_data(configuration *config, int fd, const chain_slice& in, ssize_t sz, server_state& state) {
+	upstream_resume(config, state, fd, upstream_wait::RECV, sz == -1 ? -errno : sz, in.data(), sz > 0 ? &in : nullptr);
+}
+
+/*
+ * finish connecting an upstream and send it what is left of the request
+ */
+
+void process_upstream_writable(configuration *config, int fd, server_state& state) {
+
+	upstream_ref *ref = state.upstreams.find(fd);
+
+	if(ref == nullptr)
+		return;
+
+	if(ref->awaiting == upstream_wait::CONNECT) {
+
+		int error = 0;
+		socklen_t error_sz = sizeof(error);
+
+		if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_sz) == -1)
+			error = errno;
+
+		upstream_resume(config, state, fd, upstream_wait::CONNECT, -error, nullptr, nullptr);
+
+		if((ref = state.upstreams.find(fd)) == nullptr)
+			return;
+	}
+
+	if(ref->awaiting == upstream_wait::SEND) {
+
+		ssize_t n = send(fd, ref->out.data(), ref->out.size(), MSG_NOSIGNAL);
+
+		if(n == -1 and errno != EAGAIN and errno != EINTR) {
+			upstream_resume(config, state, fd, upstream_wait::SEND, -errno, nullptr, nullptr);
+			return;
+		}
+
+		if(n > 0)
+			ref->out.erase(0, n);
+
+		if(ref->out.empty())
+			upstream_resume(config, state, fd, upstream_wait::SEND, 0, nullptr, nullptr);
+	}
+}
+
+/*
+ * a query received by the multishot recvmsg: the buffer holds the header
+ * io_uring writes, the sender's address and then the payload. the reply
+ * goes out through a queued sendmsg from a reply slot.
+ */
+
+void uring_dns_query(configuration *config, server_state& state, int dnsfd, const uint8_t *buffer, size_t buffer_sz) {
+
+	uring_server& u = *state.uring;
+
+	const io_uring_recvmsg_out *out = (const io_uring_recvmsg_out *)buffer;
+
+	const size_t payload_offset = sizeof(*out) + u.dns_msg.msg_namelen + u.dns_msg.msg_controllen;
+
+	if(buffer_sz < payload_offset or out->namelen < sizeof(sockaddr_in) or (out->flags & MSG_TRUNC))
+		return;
+
+	const sockaddr_in *sin_from = (const sockaddr_in *)(out + 1);
+	const uint8_t *payload = buffer + payload_offset;
+	const size_t payload_sz = std::min((size_t)out->payloadlen, buffer_sz - payload_offset);
+
+	u.dns_packets++;
+
+	if(config->verbose) {
+		char buf[20];
+		inet_ntop(AF_INET, &sin_from->sin_addr, buf, sizeof(buf));
+		fprintf(config->fp, "fd #%d data ready : read %ld bytes from %s:%d\n", dnsfd, (long)payload_sz, buf, ntohs(sin_from->sin_port));
+	}
+
+	memset(&state.peer, 0, sizeof(state.peer));
+	memcpy(&state.peer, sin_from, sizeof(*sin_from));
+
+	if(u.free_replies.empty()) {
+		u.free_replies.push_back(u.replies.size());
+		u.replies.emplace_back(new uring_reply);
+	}
+
+	const uint32_t slot = u.free_replies.back();
+
+	uring_reply& r = *u.replies[slot];
+
+	ssize_t sz = process_dns_packet(config, payload, payload_sz, state, r.data, sizeof(r.data));
+
+	if(sz <= 0)
+		return;
+
+	io_uring_sqe *e = u.ring.sqe(IORING_OP_SENDMSG, dnsfd, uring_tag(uring_op::DNS_SEND, 0, slot));
+
+	if(e == nullptr)
+		return;
+
+	u.free_replies.pop_back();
+
+	r.to = *sin_from;
+	r.iov.iov_base = r.data;
+	r.iov.iov_len = sz;
+
+	memset(&r.msg, 0, sizeof(r.msg));
+	r.msg.msg_name = &r.to;
+	r.msg.msg_namelen = sizeof(r.to);
+	r.msg.msg_iov = &r.iov;
+	r.msg.msg_iovlen = 1;
+
+	e->addr = (uint64_t)(uintptr_t)&r.msg;
+}
+
+/*
+ * an upstream fd's operation completed, ones for an fd closed since dropped
+ */
+
+void uring_upstream_completion(configuration *config, server_state& state, uint64_t tag, int32_t res, uint32_t flags) {
+
+	uring_server& u = *state.uring;
+
+	const int fd = uring_tag_index(tag);
+
+	const bool current = uring_current(u, tag) and state.upstreams.find(fd) != nullptr;
+
+	upstream_ref *ref = current ? state.upstreams.find(fd) : nullptr;
+
+	switch(uring_tag_op(tag)) {
+
+		case uring_op::CONNECT:
+
+			if(ref == nullptr or res == -ECANCELED)
+				break;
+
+			upstream_resume(config, state, fd, upstream_wait::CONNECT, res < 0 ? res : 0, nullptr, nullptr);
+			break;
+
+		case uring_op::SEND: {
+
+			auto io = u.sending.find(uring_tag_key(tag));
+
+			if(io == u.sending.end())
+				break;
+
+			if(ref == nullptr or res == -ECANCELED) {
+				u.sending.erase(io);
+				break;
+			}
+
+			if(res >= 0 and (size_t)res < io->second.out.size()) {
+				io->second.out.erase(0, res);
+				if(uring_send_upstream(u, fd, io->first, 0))
+					break;
+				res = -EBUSY;
+			}
+
+			u.sending.erase(io);
+
+			ref->sending = false;
+
+			upstream_resume(config, state, fd, upstream_wait::SEND, res < 0 ? res : 0, nullptr, nullptr);
+			break;
+		}
+
+		case uring_op::RECV: {
+
+			uring_buffers& buffers = u.upstream_buffers;
+
+			const bool buffered = flags & IORING_CQE_F_BUFFER;
+			const uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if(ref != nullptr and not (flags & IORING_CQE_F_MORE))
+				ref->receiving = false;
+
+			if(ref != nullptr and res == -ENOBUFS and uring_arm_recv(u, fd)) {
+				ref->receiving = true;
+			} else if(ref != nullptr and res != -ECANCELED) {
+
+				if(res > 0)
+					u.upstream_reads++;
+
+				if(ref->awaiting == upstream_wait::RECV)
+					upstream_resume(config, state, fd, upstream_wait::RECV, res, buffered ? buffers.buffer(id) : nullptr, nullptr);
+				else if(res > 0)
+					ref->in.append((const char *)buffers.buffer(id), res);
+				else
+					ref->in_status = res;
+			}
+
+			if(buffered)
+				buffers.recycle(id);
+			break;
+		}
+
+		default:
+			break;
+	}
+}
+
+void report_packing(configuration *config, const server_state& state) {
+
+	for(const auto& x : state.packing) {
+
+		const packing_stats& packing = x.second;
+
+		fprintf(config->fp, "packing %s: replies: %ld data: %ld bytes (%.1f bytes/reply, %.1f%% of %ld wire bytes)\n",
+				dns_type_str(x.first),
+				(long)packing.replies,
+				(long)packing.data_bytes,
+				packing.replies > 0 ? (double)packing.data_bytes / packing.replies : 0.0,
+				packing.wire_bytes > 0 ? 100.0 * packing.data_bytes / packing.wire_bytes : 0.0,
+				(long)packing.wire_bytes);
+	}
+
+	for(const auto& x : state.codings) {
+
+		const coding_stats& stats = x.second;
+
+		fprintf(config->fp, "coding %s: responses: %ld raw: %ld bytes coded: %ld bytes (%.1f%%)\n",
+				coding_str(x.first),
+				(long)stats.responses,
+				(long)stats.raw_bytes,
+				(long)stats.coded_bytes,
+				stats.raw_bytes > 0 ? 100.0 * stats.coded_bytes / stats.raw_bytes : 0.0);
+	}
+
+	fprintf(config->fp, "sessions: %ld upstreams: %ld timers: %ld expired: %ld sessions %ld connects %ld idle upstreams\n",
+			(long)state.sessions.size(),
+			(long)state.upstreams.size(),
+			(long)state.timers.count,
+			(long)state.expired_sessions,
+			(long)state.connect_timeouts,
+			(long)state.idle_timeouts);
+
+	fprintf(config->fp, "admission: admitted: %ld queued: %ld (now %ld, max %ld) servfail: %ld (%ld over client share) shed: %ld refused: %ld\n",
+			(long)state.admission.admitted,
+			(long)state.admission.queued,
+			(long)state.pending.size(),
+			(long)state.admission.queue_max,
+			(long)(state.admission.rejected + state.admission.over_share),
+			(long)state.admission.over_share,
+			(long)state.admission.shed,
+			(long)state.admission.refused);
+
+	fprintf(config->fp, "fair queuing by %s: clients queued: %ld (max %ld) tracked: %ld throttled: %ld\n",
+			config->fair_by == fairness::SESSION ? "session" : "address",
+			(long)state.pending.ring.size(),
+			(long)state.admission.flows_max,
+			(long)state.pending.flows.size(),
+			(long)state.pending.throttled);
+
+	char memory_str[512];
+	state.memory.sprint(memory_str, sizeof(memory_str));
+
+	fprintf(config->fp, "memory: %s evicted: %ld sessions %ld bytes\n",
+			memory_str,
+			(long)state.evicted_sessions,
+			(long)state.evicted_bytes);
+
+	const coro_frame_stats& frames = coro_frames();
+
+	fprintf(config->fp, "coroutines: running: %ld frames: %ld allocated %ld reused (%.1fK pooled)\n",
+			(long)frames.live,
+			(long)frames.allocated,
+			(long)frames.reused,
+			frames.pooled / 1024.0);
+
+	fprintf(config->fp, "tls: handshakes: %ld resumed: %ld failed: %ld tickets: %ld\n",
+			(long)state.tls.stats.handshakes,
+			(long)state.tls.stats.resumed,
+			(long)state.tls.stats.failed,
+			(long)state.tls.stats.tickets);
+
+	const uint64_t now_ms = timer_clock_ms();
+
+	for(const auto& x : state.zone_pools) {
+
+		for(const backend& b : x.second.backends) {
+			char backend_str[256];
+			b.sprint(backend_str, sizeof(backend_str), now_ms);
+			fprintf(config->fp, "backend for %s: %s\n", tunnel_zone(x.first.c_str()), backend_str);
+		}
+	}
+
+	size_t host_backends = 0;
+	size_t host_ejected = 0;
+
+	for(const auto& x : state.host_pools) {
+		host_backends += x.second.backends.size();
+		host_ejected += x.second.ejected(now_ms);
+	}
+
+	fprintf(config->fp, "hosts: %ld pools (%s) backends: %ld ejected: %ld unresolved: %ld\n",
+			(long)state.host_pools.size(),
+			pool_policy_str(config->balance),
+			(long)host_backends,
+			(long)host_ejected,
+			(long)state.unresolved);
+
+	if(state.cache.enabled()) {
+
+		const cache_stats& cache = state.cache.stats;
+
+		fprintf(config->fp, "cache: %ld entries (%.1fK of %.1fK) hits: %ld revalidated: %ld changed: %ld misses: %ld stored: %ld evicted: %ld bypassed: %ld uncacheable: %ld\n",
+				(long)state.cache.entries.size(),
+				state.cache.size / 1024.0,
+				state.cache.limit / 1024.0,
+				(long)cache.hits,
+				(long)cache.revalidated,
+				(long)cache.changed,
+				(long)cache.misses,
+				(long)cache.stored,
+				(long)cache.evicted,
+				(long)cache.bypassed,
+				(long)cache.uncacheable);
+
+		const cache_store& disk = state.cache.disk;
+
+		if(disk.opened())
+			fprintf(config->fp, "cache file %s: %.1fK of %.1fK used, restored: %ld%s loaded: %ld unloaded: %ld written: %ld overwritten: %ld corrupt: %ld\n",
+					disk.path,
+					disk.used() / 1024.0,
+					disk.capacity / 1024.0,
+					(long)cache.restored,
+					disk.stats.started_over ? " (started over)" : "",
+					(long)disk.stats.loaded,
+					(long)cache.unloaded,
+					(long)disk.stats.written,
+					(long)disk.stats.overwritten,
+					(long)disk.stats.corrupt);
+	}
+
+	fprintf(config->fp, "keep-alive: parked: %ld reused: %ld stale: %ld expired: %ld (idle now %ld)\n",
+			(long)state.keep_alive.parked,
+			(long)state.keep_alive.reused,
+			(long)state.keep_alive.stale,
+			(long)state.keep_alive.expired,
+			(long)state.idle_count);
+
+	if(state.uring != nullptr) {
+
+		const uring_server& u = *state.uring;
+
+		fprintf(config->fp, "io_uring: enters: %ld submitted: %ld completed: %ld dns packets: %ld upstreams: %ld reads: %ld (%.2f enters/packet)\n",
+				(long)u.ring.enters,
+				(long)u.ring.submitted,
+				(long)u.ring.completed,
+				(long)u.dns_packets,
+				(long)u.upstreams,
+				(long)u.upstream_reads,
+				u.dns_packets > 0 ? (double)u.ring.enters / u.dns_packets : 0.0);
+	}
+
+	if(state.out_of_zone > 0)
+		fprintf(config->fp, "out of zone: %ld questions\n", (long)state.out_of_zone);
+
+	if(state.prefetch.prepared > 0)
+		fprintf(config->fp, "prefetch: prepared: %ld replies hits: %ld wasted: %ld\n",
+				(long)state.prefetch.prepared,
+				(long)state.prefetch.hits,
+				(long)state.prefetch.wasted);
+
+	if(state.edns.queries + state.edns.malformed > 0)
+		fprintf(config->fp, "edns: %ld queries (udp payload up to %ld) malformed: %ld\n",
+				(long)state.edns.queries,
+				(long)state.edns.udp_sz_max,
+				(long)state.edns.malformed);
+
+	if(state.incompressible > 0)
+		fprintf(config->fp, "coding skipped for %ld incompressible responses\n", (long)state.incompressible);
+
+	fflush(config->fp);
+}
+
+void configure_signal(configuration *config, int signo, sighandler_t handler) {
+
+	if(config->verbose) 
+		fprintf(config->fp, "configuring signal #%d (%s)\n", signo, strsignal(signo));
+
+	if(signal(signo, handler) == SIG_ERR) {
+		perror("signal()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * the zones' backend pools as config has them, keyed by domain so upstreams
+ * keep theirs across a reload. the pool of a zone no longer served goes once
+ * nothing is outstanding on it.
+ */
+
+void assign_pools(configuration *config, server_state& state) {
+
+	const uint64_t now_ms = timer_clock_ms();
+
+	for(const zone_policy& zone : config->zones) {
+
+		auto x = state.zone_pools.find(zone.domain);
+
+		if(x == state.zone_pools.end())
+			x = state.zone_pools.emplace(zone.domain, backend_pool()).first;
+
+		x->second.policy = config->balance;
+		x->second.assign(zone.upstreams, now_ms);
+	}
+
+	for(auto x = state.zone_pools.begin(); x != state.zone_pools.end(); ) {
+
+		bool served = false;
+
+		for(const zone_policy& zone : config->zones)
+			served = served or x->first == zone.domain;
+
+		if(not served and x->second.outstanding == 0)
+			x = state.zone_pools.erase(x);
+		else
+			x++;
+	}
+
+	for(auto& x : state.host_pools)
+		x.second.policy = config->balance;
+}
+
+void setup_tls(configuration *config, server_state& state) {
+
+	state.tls.teardown();
+
+	if(state.tls.setup(config->ca_file) == -1)
+		fprintf(stderr, "couldn't set up tls%s%s: %s, https upstreams will fail\n",
+				config->ca_file != nullptr ? " with " : "",
+				config->ca_file != nullptr ? config->ca_file : "",
+				tls_error_str());
+}
+
+bool same_str(const char *a, const char *b) {
+	return a == b or (a != nullptr and b != nullptr and strcmp(a, b) == 0);
+}
+
+/*
+ * the configuration the command line and options file give now, for a
+ * reload (HUP, USR1). -1 if they no longer parse or change what is only
+ * taken on starting, current staying as it is.
+ */
+
+int reload_config(const configuration *current, configuration *next) {
+
+	if(cliconfig(next, config_argc, config_argv) == -1) {
+		fprintf(stderr, "invalid configuration, not reloaded\n");
+		return -1;
+	}
+
+	if(next->address != current->address
+			or next->port != current->port
+			or next->uring != current->uring
+			or next->workers != current->workers
+			or not same_str(next->locale, current->locale)
+			or not same_str(next->cache_file, current->cache_file)
+			or not same_str(next->handoff_path, current->handoff_path)) {
+		fprintf(stderr, "-4, -p, -l, -U, -w, -F and -H only change on a restart or handoff (-H), not reloaded\n");
+		return -1;
+	}
+
+	next->fp = current->fp;
+
+	return 0;
+}
+
+/*
+ * take next as config, between turns: sessions and queued requests follow
+ * their zone to its index in next, by domain, or to none if it is gone (the
+ * sessions then answered errors, the requests 502), and the rates, budget,
+ * cache size, pools and tls context are set again. config is assigned in
+ * place, the upstreams' coroutines holding it.
+ */
+
+void apply_config(configuration *config, const configuration& next, server_state& state) {
+
+	std::vector<int> zones(config->zones.size(), ZONE_NONE);
+
+	for(size_t i = 0; i < config->zones.size(); i++)
+		for(size_t j = 0; j < next.zones.size(); j++)
+			if(strcasecmp(tunnel_zone(config->zones[i].domain.c_str()), tunnel_zone(next.zones[j].domain.c_str())) == 0)
+				zones[i] = j;
+
+	for(lru_link *x = state.lru.oldest(); x != nullptr; x = state.lru.newer(x)) {
+
+		tunnel_session& session = *(tunnel_session *)x->owner;
+
+		if(session.zone != ZONE_NONE)
+			session.zone = zones[session.zone];
+	}
+
+	state.pending.for_each([&](pending_request& pending) {
+		if(pending.zone != ZONE_NONE)
+			pending.zone = zones[pending.zone];
+	});
+
+	const bool tls = not same_str(config->ca_file, next.ca_file);
+
+	*config = next;
+
+	state.pending.rate = config->rate;
+	state.pending.burst = config->burst;
+
+	state.memory.limit = config->memory_limit;
+
+	state.cache.limit = config->cache_size;
+
+	assign_pools(config, state);
+
+	if(tls)
+		setup_tls(config, state);
+}
+
+/*
+ * a state ready to serve with config: its clock, rates, budget, cache (and
+ * its file, left to the workers' states if there are any), the pools of the
+ * zones' backends and the tls context its https upstreams share
+ */
+
+void start_state(configuration *config, server_state& state) {
+
+	state.timers.start(timer_clock_ms());
+
+	state.pending.rate = config->rate;
+	state.pending.burst = config->burst;
+
+	state.memory.limit = config->memory_limit;
+
+	state.cache.limit = config->cache_size;
+	state.cache.budget = &state.memory;
+
+	if(config->cache_file != nullptr and config->workers == 0 and state.cache.enabled() and state.cache.persist(config->cache_file) == -1)
+		eprintf(errno, "couldn't open cache file %s, caching in memory only", config->cache_file);
+
+	assign_pools(config, state);
+
+	setup_tls(config, state);
+}
+
+/*
+ * what every loop turn starts with for a state: memory, kept connections,
+ * then the queue
+ */
+
+void tend_state(configuration *config, server_state& state) {
+
+	enforce_budget(config, state);
+
+	expire_idle(state, config->upstream_idle_ms);
+
+	admit_pending(config, state);
+}
+
+/*
+ * what every loop turn starts with, whatever the loop
+ */
+
+void serve_turn(configuration *config, server_state& state) {
+
+	if(report != 0) {
+		report_packing(config, state);
+		configure_signal(config, report, sighandler_report);
+		report = 0;
+	}
+
+	if(reload != 0) {
+
+		configuration next;
+
+		if(reload_config(config, &next) == 0) {
+			apply_config(config, next, state);
+			fprintf(stderr, "configuration reloaded, %ld zones\n", (long)config->zones.size());
+		}
+
+		configure_signal(config, reload, sighandler_reload);
+		reload = 0;
+	}
+
+	tend_state(config, state);
+}
+
+/*
+ * how long a loop may sleep: until the next timer is due, nsecs at most,
+ * HANDOFF_TURN_MS while handing off so draining is seen to
+ */
+
+int64_t serve_wait_ms(const server_state& state, int nsecs) {
+
+	int64_t wait_ms = state.timers.next_ms();
+
+	if(wait_ms == -1 or wait_ms > nsecs * 1000)
+		wait_ms = nsecs * 1000;
+
+	if(state.handing_off and wait_ms > HANDOFF_TURN_MS)
+		wait_ms = HANDOFF_TURN_MS;
+
+	return wait_ms;
+}
+
+/*
+ * the upstreams into the sets for select, returning the highest fd
+ */
+
+int upstream_fdset(server_state& state, fd_set *rfds, fd_set *wfds, int maxfd) {
+
+	for(int fd : state.upstreams.fds) {
+		const upstream_ref *ref = state.upstreams.find(fd);
+		if(ref->awaiting == upstream_wait::RECV)
+			FD_SET(fd, rfds);
+		else if(ref->awaiting != upstream_wait::NONE)
+			FD_SET(fd, wfds);
+		if(fd > maxfd)
+			maxfd = fd;
+	}
+
+	return maxfd;
+}
+
+/*
+ * the upstreams select found ready, taken before queries open or close any
+ */
+
+void upstream_ready(const server_state& state, fd_set *rfds, fd_set *wfds, std::vector<int> *ready, std::vector<int> *writable) {
+
+	for(int fd : state.upstreams.fds) {
+		if(FD_ISSET(fd, rfds))
+			ready->push_back(fd);
+		if(FD_ISSET(fd, wfds))
+			writable->push_back(fd);
+	}
+}
+
+void serve_upstreams(configuration *config, server_state& state, const std::vector<int>& ready, const std::vector<int>& writable) {
+
+	for(int fd : writable)
+		process_upstream_writable(config, fd, state);
+
+	for(int fd : ready) {
+
+		if(state.upstreams.find(fd) == nullptr)
+			continue;
+
+		chain_slice in;
+
+		ssize_t sz = read_upstream(fd, &in);
+
+		if(sz != -1 or errno != EAGAIN)
+			process_upstream_data(config, fd, in, sz, state);
+
+		chain_release(in.segment);
+	}
+}
+
+/*
+ * the worker owning a session, its id hashed
+ */
+
+unsigned session_shard(uint32_t key, unsigned n) {
+	return (uint32_t)(key * 2654435769u) * (uint64_t)n >> 32;
+}
+
+int find_zone(configuration *config, const std::string& domain) {
+
+	for(size_t i = 0; i < config->zones.size(); i++)
+		if(strcasecmp(tunnel_zone(config->zones[i].domain.c_str()), domain.c_str()) == 0)
+			return i;
+
+	return ZONE_NONE;
+}
+
+/*
+ * take over from the server running at config->handoff_path, if any: its
+ * dns-fd, or -1 to bind one, its sessions into h.taken
+ */
+
+int handoff_take(configuration *config, handoff_state& h) {
+
+	int from = handoff_connect(config->handoff_path);
+
+	if(from == -1) {
+		if(config->verbose)
+			fprintf(config->fp, "handoff: no server at %s, starting afresh\n", config->handoff_path);
+		return -1;
+	}
+
+	fprintf(stderr, "handoff: taking over from the server at %s...\n", config->handoff_path);
+
+	int fds[HANDOFF_FDS_MAX];
+
+	const ssize_t n = handoff_receive(from, fds, HANDOFF_FDS_MAX, &h.taken);
+
+	if(n == -1 or handoff_ack(from) == -1) {
+		eprintf(errno, "handoff from %s failed", config->handoff_path);
+		if(n > 0)
+			for(ssize_t i = 0; i < n; i++)
+				close(fds[i]);
+		close(from);
+		h.taken.clear();
+		return -1;
+	}
+
+	for(ssize_t i = 1; i < n; i++)
+		close(fds[i]);
+
+	/*
+	 * the old server closes the connection exiting, its cache file and
+	 * port free then
+	 */
+
+	char c;
+	ssize_t r;
+
+	while((r = read(from, &c, 1)) > 0 or (r == -1 and errno == EINTR))
+		;
+
+	close(from);
+
+	sockaddr_in name;
+	socklen_t name_sz = sizeof(name);
+
+	if(getsockname(fds[0], (sockaddr *)&name, &name_sz) == 0 and (name.sin_port != htons(config->port) or name.sin_addr.s_addr != config->address))
+		fprintf(stderr, "handoff: serving on the old server's address, not -4 and -p\n");
+
+	return fds[0];
+}
+
+/*
+ * listen at config->handoff_path for the next server
+ */
+
+void handoff_await(configuration *config, handoff_state& h) {
+
+	if((h.listener = handoff_listen(config->handoff_path)) == -1)
+		eprintf(errno, "couldn't listen for handoffs at %s", config->handoff_path);
+}
+
+/*
+ * the next server connecting, true if it is to be handed off to
+ */
+
+bool handoff_accept(configuration *config, handoff_state& h) {
+
+	if((h.peer = accept4(h.listener, nullptr, nullptr, SOCK_CLOEXEC)) == -1) {
+		if(errno != EAGAIN and errno != EINTR)
+			perror("accept4()");
+		return false;
+	}
+
+	h.deadline_ms = timer_clock_ms() + HANDOFF_DRAIN_MS;
+
+	fprintf(stderr, "handoff: next server connected, draining...\n");
+
+	return true;
+}
+
+/*
+ * whether a state handing off has nothing left in flight. past the deadline
+ * what is left is cut off: queued requests answered 503, upstreams closed, a
+ * response not started 503 too.
+ */
+
+bool handoff_drained(server_state& state, uint64_t deadline_ms) {
+
+	if(state.upstreams.empty() and state.pending.empty())
+		return true;
+
+	if(timer_clock_ms() < deadline_ms)
+		return false;
+
+	fprintf(stderr, "handoff: cutting off %ld upstreams and %ld queued requests\n",
+			(long)state.upstreams.size(), (long)state.pending.size());
+
+	state.pending.for_each([&](pending_request& pending) {
+
+		state.memory.release(memory_category::QUEUE, pending.sz);
+
+		tunnel_stream *stream = find_stream(state, pending.session, pending.stream);
+
+		if(stream != nullptr and not stream->complete) {
+			fail_stream(*stream, "503 Service Unavailable");
+			account_stream(state, *stream);
+			state.admission.shed++;
+		}
+	});
+
+	state.pending.clear();
+
+	while(not state.upstreams.empty()) {
+
+		const int fd = state.upstreams.fds.back();
+		const upstream_ref *ref = state.upstreams.find(fd);
+
+		tunnel_stream *stream = find_stream(state, ref->session, ref->stream);
+
+		if(stream != nullptr and stream->response.empty())
+			fail_stream(*stream, "503 Service Unavailable");
+
+		close_upstream(state, fd);
+	}
+
+	return true;
+}
+
+/*
+ * a state's sessions for the next server, each a record: 1, the id, the
+ * zone's domain and the streams, every one with its fragments, coding and
+ * response. the records end with a 0.
+ */
+
+void save_sessions(configuration *config, server_state& state, handoff_writer& out) {
+
+	for(lru_link *x = state.lru.oldest(); x != nullptr; x = state.lru.newer(x)) {
+
+		const tunnel_session& session = *(const tunnel_session *)x->owner;
+
+		out.u8(1);
+		out.u32(session.id);
+		out.str(session.zone != ZONE_NONE ? tunnel_zone(config->zones[session.zone].domain.c_str()) : "");
+
+		size_t count = 0;
+
+		for(const auto& y : session.streams)
+			count += y.second.fd == -1;
+
+		out.u32(count);
+
+		for(const auto& y : session.streams) {
+
+			const tunnel_stream& stream = y.second;
+
+			if(stream.fd != -1)
+				continue;
+
+			out.u16(y.first);
+			out.u32(stream.fragments.size());
+
+			for(const auto& fragment : stream.fragments) {
+				out.u32(fragment.first);
+				out.str(fragment.second);
+			}
+
+			out.u64(stream.request_sz);
+			out.u8(stream.requested);
+			out.u16(stream.codings);
+			out.u8(stream.coded);
+			out.u8((uint8_t)stream.method);
+			out.u8(stream.complete);
+			out.u8(stream.broken);
+			out.u64(stream.raw_sz);
+			out.str(stream.response.str(0, stream.response.size()));
+		}
+	}
+}
+
+/*
+ * the sessions the old server sent into a state, those of shard when there
+ * are count workers, returning how many. those in zones no longer served are
+ * left out.
+ */
+
+size_t restore_sessions(configuration *config, server_state& state, const std::string& taken, unsigned shard, unsigned count) {
+
+	handoff_reader in(taken);
+
+	size_t restored = 0;
+
+	while(in.u8() == 1) {
+
+		const uint32_t id = in.u32();
+		const int zone = find_zone(config, in.str());
+		const uint32_t streams = in.u32();
+
+		tunnel_session *session = nullptr;
+
+		if(zone != ZONE_NONE and session_shard(id, count) == shard and state.sessions.find(id) == nullptr
+				and state.sessions.size() < config->max_sessions) {
+			session = &state.sessions.insert(id);
+			session->id = id;
+			session->zone = zone;
+			session->lru.owner = session;
+			session->memory.set(&state.memory, memory_category::SESSIONS, sizeof(tunnel_session));
+		}
+
+		for(uint32_t i = 0; i < streams and not in.failed; i++) {
+
+			const uint16_t stream_id = in.u16();
+
+			tunnel_stream discarded;
+			tunnel_stream& stream = session != nullptr ? session->streams[stream_id] : discarded;
+
+			const uint32_t fragments = in.u32();
+
+			for(uint32_t j = 0; j < fragments and not in.failed; j++) {
+				const uint32_t offset = in.u32();
+				stream.fragments[offset] = in.str();
+			}
+
+			stream.request_sz = (ssize_t)in.u64();
+			stream.requested = in.u8();
+			stream.codings = in.u16();
+			stream.coded = in.u8();
+			stream.method = (coding)in.u8();
+			stream.complete = in.u8();
+			stream.broken = in.u8();
+			stream.raw_sz = in.u64();
+			const std::string response = in.str();
+			stream.response.clear();
+			stream.response.append(response.data(), response.size());
+
+			if(session != nullptr)
+				account_stream(state, stream);
+		}
+
+		if(in.failed)
+			break;
+
+		if(session != nullptr) {
+
+			session->idle.fire = session_expired;
+			session->idle.owner = session;
+			state.timers.add(&session->idle, config->session_idle_ms);
+
+			state.lru.touch(&session->lru);
+
+			restored++;
+		}
+	}
+
+	if(in.failed)
+		fprintf(stderr, "handoff: sessions cut short after %ld\n", (long)restored);
+
+	return restored;
+}
+
+/*
+ * give dns-fd and sessions (records from save_sessions, unterminated) to the
+ * next server, true once it has them. if it doesn't take them the server
+ * serves on. the connection stays open until exiting, which tells the next
+ * server it can start.
+ */
+
+bool handoff_give(configuration *config, handoff_state& h, int dnsfd, handoff_writer& sessions) {
+
+	sessions.u8(0);
+
+	if(handoff_send(h.peer, &dnsfd, 1, sessions.out) == -1 or handoff_wait_ack(h.peer, HANDOFF_ACK_MS) == -1) {
+		eprintf(errno, "handoff to the next server failed, serving on");
+		close(h.peer);
+		h.peer = -1;
+		return false;
+	}
+
+	fprintf(stderr, "handoff: next server took over (%ld bytes of sessions), exiting\n", (long)sessions.out.size());
+
+	h.given = true;
+
+	return true;
+}
+
+/*
+ * the io_uring loop, serving until stopped. -1 straight away when the kernel
+ * lacks what it needs, the select loop taking over.
+ */
+
+int serve_uring(configuration *config, server_state& state, int dnsfd, int nsecs, handoff_state& handoff) {
+
+	uring_server u;
+
+	sockaddr_in name;
+
+	if(u.ring.setup(URING_ENTRIES, URING_CQ_ENTRIES) == -1
+			or u.dns_buffers.setup(&u.ring, URING_DNS_GROUP, URING_DNS_BUFFERS, sizeof(io_uring_recvmsg_out) + sizeof(name) + DATA_SZ) == -1
+			or u.upstream_buffers.setup(&u.ring, URING_UPSTREAM_GROUP, URING_UPSTREAM_BUFFERS, URING_UPSTREAM_BUFFER_SZ) == -1) {
+		eprintf(errno, "io_uring unavailable, using select");
+		return -1;
+	}
+
+	memset(&u.dns_msg, 0, sizeof(u.dns_msg));
+	u.dns_msg.msg_namelen = sizeof(name);
+
+	uring_arm_dns(u, dnsfd);
+
+	uring_await_handoff(u, handoff);
+
+	state.uring = &u;
+
+	bool received = false;
+
+	/*
+	 * handing off, the dns recv is cancelled once drained and the sessions
+	 * saved when its last completion is in
+	 */
+
+	bool receiving = true;
+	bool cancelled = false;
+
+	if(config->verbose)
+		fprintf(config->fp, "io_uring: %u entries, %u dns and %u upstream buffers\n",
+				u.ring.sq_entries, URING_DNS_BUFFERS, URING_UPSTREAM_BUFFERS);
+
+	while(not stop) {
+
+		serve_turn(config, state);
+
+		if(handoff.peer != -1 and not receiving) {
+
+			handoff_writer sessions;
+
+			save_sessions(config, state, sessions);
+
+			u.ring.submit(0, 0);
+
+			if(handoff_give(config, handoff, dnsfd, sessions))
+				break;
+
+			state.handing_off = false;
+			receiving = true;
+			cancelled = false;
+
+			uring_arm_dns(u, dnsfd);
+			uring_await_handoff(u, handoff);
+
+		} else if(handoff.peer != -1 and not cancelled and handoff_drained(state, handoff.deadline_ms)) {
+
+			io_uring_sqe *e = u.ring.sqe(IORING_OP_ASYNC_CANCEL, -1, uring_tag(uring_op::CANCEL, 0, dnsfd));
+
+			if(e != nullptr) {
+				e->addr = uring_tag(uring_op::DNS_RECV, 0, dnsfd);
+				cancelled = true;
+			}
+		}
+
+		int n = u.ring.submit(1, serve_wait_ms(state, nsecs));
+
+		if(n == -1 and errno != EINTR and errno != ETIME and errno != EAGAIN and errno != EBUSY) {
+			perror("io_uring_enter()");
+			exit(EXIT_FAILURE);
+		}
+
+		state.timers.advance(timer_clock_ms(), &state);
+
+		io_uring_cqe *cqe;
+
+		while((cqe = u.ring.peek()) != nullptr) {
+
+			const uint64_t tag = cqe->user_data;
+			const int32_t res = cqe->res;
+			const uint32_t flags = cqe->flags;
+
+			u.ring.seen();
+
+			switch(uring_tag_op(tag)) {
+
+				case uring_op::DNS_RECV:
+
+					if(res == -EINVAL and not received) {
+
+						/*
+						 * multishot receive needs 6.0
+						 */
+
+						eprintf(-res, "io_uring multishot recvmsg unavailable, using select");
+						state.uring = nullptr;
+						return -1;
+					}
+
+					if(res >= 0 and (flags & IORING_CQE_F_BUFFER)) {
+						const uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+						received = true;
+						uring_dns_query(config, state, dnsfd, u.dns_buffers.buffer(id), res);
+						u.dns_buffers.recycle(id);
+					} else if(res < 0 and res != -ENOBUFS) {
+						eprintf(-res, "io_uring recvmsg()");
+					}
+
+					if(not (flags & IORING_CQE_F_MORE)) {
+						if(cancelled)
+							receiving = false;
+						else
+							uring_arm_dns(u, dnsfd);
+					}
+					break;
+
+				case uring_op::HANDOFF:
+
+					if(res > 0 and handoff_accept(config, handoff))
+						state.handing_off = true;
+					else if(res < 0 and res != -ECANCELED)
+						eprintf(-res, "io_uring poll of the handoff listener");
+
+					if(handoff.peer == -1)
+						uring_await_handoff(u, handoff);
+					break;
+
+				case uring_op::DNS_SEND:
+
+					if(res < 0)
+						eprintf(-res, "io_uring sendmsg()");
+
+					u.free_replies.push_back(uring_tag_index(tag));
+					break;
+
+				case uring_op::CANCEL:
+					break;
+
+				case uring_op::CLOSE:
+
+					if(res < 0)
+						eprintf(-res, "io_uring close() of fd #%d", uring_tag_index(tag));
+					break;
+
+				default:
+
+					uring_upstream_completion(config, state, tag, res, flags);
+					break;
+			}
+		}
+
+		/*
+		 * the turn's replies go out before preparing the next ones
+		 */
+
+		if(not state.prefetching.empty()) {
+			u.ring.submit(0, 0);
+			prefetch_replies(config, state);
+		}
+	}
+
+	/*
+	 * the upstreams left are closed directly, the ring going with u
+	 */
+
+	state.uring = nullptr;
+
+	return 0;
+}
+
+/*
+ * the staged pipeline (-w)
+ *
+ * one I/O thread receives queries in batches and routes each to the worker
+ * owning its session, workers share nothing, each with its own server_state,
+ * upstreams and share of the caps, processing queries and upstreams in a
+ * select loop of its own. replies come back over one ring the I/O thread
+ * sends from in batches. an eventfd per ring reader wakes it, written once a
+ * batch. what each stage costs is kept for the report.
+ */
+
+struct pipeline_query {
+	sockaddr_in from;
+	uint64_t received_ns;
+	size_t sz;
+	uint8_t data[DATA_SZ];
+};
+
+struct pipeline_reply {
+	sockaddr_in to;
+	uint64_t received_ns;
+	uint64_t processed_ns;
+	size_t sz;
+	uint8_t data[DNS_MSG_MAX_SZ];
+};
+
+/*
+ * latencies through a stage, added by the thread running it and read by the
+ * one reporting
+ */
+
+struct stage_stats {
+
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> total_ns;
+	std::atomic<uint64_t> max_ns;
+
+	stage_stats() : count(0), total_ns(0), max_ns(0) {}
+
+	void add(uint64_t ns) {
+
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		total_ns.store(total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+
+		if(ns > max_ns.load(std::memory_order_relaxed))
+			max_ns.store(ns, std::memory_order_relaxed);
+	}
+
+	int sprint(char *s, size_t sz) const {
+
+		const uint64_t n = count.load(std::memory_order_relaxed);
+
+		return snprintf(s, sz, "%.1fus (max %.1fus)",
+				n > 0 ? total_ns.load(std::memory_order_relaxed) / 1000.0 / n : 0.0,
+				max_ns.load(std::memory_order_relaxed) / 1000.0);
+	}
+};
+
+struct pipeline_worker {
+
+	unsigned index = 0;
+
+	configuration config;
+	server_state state;
+
+	std::string cache_file;
+
+	spsc_ring<pipeline_query> queries;
+
+	int wake = -1;
+
+	std::atomic<bool> report;
+
+	uint64_t generation = 0;
+
+	std::atomic<bool> drained;
+	std::atomic<bool> saved;
+	std::string sessions;
+
+	stage_stats queued;
+	stage_stats worked;
+
+	std::atomic<uint64_t> dropped_replies;
+
+	std::thread thread;
+
+	pipeline_worker() : queries(PIPELINE_QUERIES), report(false), drained(false), saved(false), dropped_replies(0) {}
+};
+
+struct pipeline {
+
+	std::vector<std::unique_ptr<pipeline_worker>> workers;
+	unsigned count = 0;
+
+	mpsc_ring<pipeline_reply> replies;
+
+	int wake = -1;
+
+	std::atomic<bool> running;
+
+	/*
+	 * the configuration the workers take theirs from, replaced whole on
+	 * reload and the generation bumped, each worker taking the new one
+	 * between its turns
+	 */
+
+	std::mutex lock;
+	std::shared_ptr<const configuration> config;
+	std::atomic<uint64_t> generation;
+
+	/*
+	 * handing off: the workers drain, then save their sessions once the
+	 * I/O thread stops receiving
+	 */
+
+	std::atomic<bool> handing_off;
+	std::atomic<bool> saving;
+	uint64_t deadline_ms = 0;
+
+	stage_stats sending;
+	stage_stats total;
+
+	size_t received = 0;
+	size_t receives = 0;
+	size_t dropped = 0;
+	size_t sent = 0;
+	size_t sends = 0;
+
+	pipeline() : replies(PIPELINE_REPLIES), running(true), generation(0), handing_off(false), saving(false) {}
+};
+
+/*
+ * the worker for a query: by session, so every query of one lands on the
+ * worker holding it, or by client for what is no tunnel query
+ */
+
+unsigned pipeline_shard(const pipeline_query& query, unsigned n) {
+
+	uint32_t key;
+
+	if(tunnel_peek_session(query.data, query.sz, &key) == -1)
+		key = query.from.sin_addr.s_addr ^ query.from.sin_port;
+
+	return session_shard(key, n);
+}
+
+void pipeline_wake(int fd) {
+
+	const uint64_t one = 1;
+
+	if(write(fd, &one, sizeof(one)) == -1 and errno != EAGAIN)
+		perror("write() to eventfd");
+}
+
+void pipeline_drain(int fd) {
+
+	uint64_t count;
+
+	if(read(fd, &count, sizeof(count)) == -1 and errno != EAGAIN)
+		perror("read() from eventfd");
+}
+
+/*
+ * a worker's configuration: config with the caps and budget shared out, and
+ * a cache file of its own
+ */
+
+void worker_config(const configuration *config, const pipeline_worker& w, unsigned count, configuration *c) {
+
+	*c = *config;
+
+	c->max_upstreams = std::max(config->max_upstreams / count, (size_t)1);
+	c->max_pending = std::max(config->max_pending / count, (size_t)1);
+	c->max_sessions = std::max(config->max_sessions / count, (size_t)1);
+	c->memory_limit = config->memory_limit / count;
+	c->cache_size = config->cache_size / count;
+	c->workers = 0;
+
+	if(config->cache_file != nullptr)
+		c->cache_file = w.cache_file.c_str();
+}
+
+void serve_worker(pipeline& p, pipeline_worker& w, int nsecs) {
+
+	configuration *config = &w.config;
+	server_state& state = w.state;
+
+	fd_set rfds;
+	fd_set wfds;
+
+	struct timeval tv;
+
+	pipeline_reply dropped;
+
+	while(p.running.load(std::memory_order_acquire)) {
+
+		if(w.report.exchange(false)) {
+			flockfile(config->fp);
+			fprintf(config->fp, "worker %u:\n", w.index);
+			report_packing(config, state);
+			funlockfile(config->fp);
+		}
+
+		if(w.generation != p.generation.load(std::memory_order_acquire)) {
+
+			std::shared_ptr<const configuration> base;
+
+			{
+				std::lock_guard<std::mutex> guard(p.lock);
+				base = p.config;
+				w.generation = p.generation.load(std::memory_order_relaxed);
+			}
+
+			configuration next;
+
+			worker_config(base.get(), w, p.count, &next);
+
+			apply_config(config, next, state);
+		}
+
+		tend_state(config, state);
+
+		state.handing_off = p.handing_off.load(std::memory_order_acquire);
+
+		if(state.handing_off and not w.drained.load(std::memory_order_relaxed) and handoff_drained(state, p.deadline_ms)) {
+			w.drained.store(true, std::memory_order_release);
+			pipeline_wake(p.wake);
+		}
+
+		/*
+		 * saving once the I/O thread stopped receiving, after what it
+		 * queued until then
+		 */
+
+		const bool saving = p.saving.load(std::memory_order_acquire) and not w.saved.load(std::memory_order_relaxed);
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+
+		FD_SET(w.wake, &rfds);
+
+		const int maxfd = upstream_fdset(state, &rfds, &wfds, w.wake);
+
+		const int64_t wait_ms = serve_wait_ms(state, nsecs);
+
+		tv.tv_sec = wait_ms / 1000;
+		tv.tv_usec = wait_ms % 1000 * 1000;
+
+		int left = select(maxfd + 1, &rfds, &wfds, nullptr, &tv);
+
+		state.timers.advance(timer_clock_ms(), &state);
+
+		if(left == -1) {
+
+			if(errno == EINTR)
+				continue;
+
+			perror("select()");
+			exit(EXIT_FAILURE);
+		}
+
+		std::vector<int> ready;
+		std::vector<int> writable;
+
+		upstream_ready(state, &rfds, &wfds, &ready, &writable);
+
+		if(FD_ISSET(w.wake, &rfds))
+			pipeline_drain(w.wake);
+
+		bool replied = false;
+
+		pipeline_query *query;
+
+		while((query = w.queries.front()) != nullptr) {
+
+			const uint64_t started_ns = timer_clock_ns();
+
+			w.queued.add(started_ns - query->received_ns);
+
+			/*
+			 * a full reply ring drops the reply, the client asking again
+			 */
+
+			mpsc_ring<pipeline_reply>::cell *c = p.replies.claim();
+
+			pipeline_reply *reply = c != nullptr ? &c->value : &dropped;
+
+			memset(&state.peer, 0, sizeof(state.peer));
+			memcpy(&state.peer, &query->from, sizeof(query->from));
+
+			ssize_t sz = process_dns_packet(config, query->data, query->sz, state, reply->data, sizeof(reply->data));
+
+			reply->to = query->from;
+			reply->received_ns = query->received_ns;
+			reply->processed_ns = timer_clock_ns();
+			reply->sz = sz > 0 ? sz : 0;
+
+			w.queries.release();
+
+			w.worked.add(reply->processed_ns - started_ns);
+
+			if(c != nullptr) {
+				p.replies.publish(c);
+				replied = true;
+			} else {
+				w.dropped_replies.store(w.dropped_replies.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}
+		}
+
+		if(replied)
+			pipeline_wake(p.wake);
+
+		serve_upstreams(config, state, ready, writable);
+
+		prefetch_replies(config, state);
+
+		if(saving) {
+
+			handoff_writer sessions;
+
+			save_sessions(config, state, sessions);
+
+			w.sessions.swap(sessions.out);
+			w.saved.store(true, std::memory_order_release);
+
+			pipeline_wake(p.wake);
+		}
+	}
+
+	while(not state.upstreams.empty())
+		close_upstream(state, state.upstreams.fds.back());
+
+	expire_idle(state, 0);
+}
+
+/*
+ * queries received in one recvmmsg, handed to their workers
+ */
+
+void pipeline_receive(configuration *config, pipeline& p, int dnsfd) {
+
+	static pipeline_query batch[PIPELINE_BATCH];
+
+	mmsghdr msgs[PIPELINE_BATCH];
+	iovec iovs[PIPELINE_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for(int i = 0; i < PIPELINE_BATCH; i++) {
+		iovs[i].iov_base = batch[i].data;
+		iovs[i].iov_len = sizeof(batch[i].data);
+		msgs[i].msg_hdr.msg_name = &batch[i].from;
+		msgs[i].msg_hdr.msg_namelen = sizeof(batch[i].from);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n = recvmmsg(dnsfd, msgs, PIPELINE_BATCH, MSG_DONTWAIT, nullptr);
+
+	if(n == -1) {
+
+		if(errno != EAGAIN and errno != EINTR) {
+			perror("recvmmsg()");
+			exit(EXIT_FAILURE);
+		}
+
+		return;
+	}
+
+	const uint64_t now_ns = timer_clock_ns();
+
+	const unsigned count = p.workers.size();
+
+	bool woken[PIPELINE_WORKERS_MAX] = {};
+
+	p.receives++;
+	p.received += n;
+
+	for(int i = 0; i < n; i++) {
+
+		batch[i].sz = msgs[i].msg_len;
+
+		if(config->verbose) {
+			char buf[20];
+			inet_ntop(AF_INET, &batch[i].from.sin_addr, buf, sizeof(buf));
+			fprintf(config->fp, "fd #%d data ready : read %ld bytes from %s:%d\n", dnsfd, (long)batch[i].sz, buf, ntohs(batch[i].from.sin_port));
+		}
+
+		const unsigned shard = pipeline_shard(batch[i], count);
+
+		pipeline_worker& w = *p.workers[shard];
+
+		pipeline_query *query = w.queries.claim();
+
+		if(query == nullptr) {
+			p.dropped++;
+			continue;
+		}
+
+		query->from = batch[i].from;
+		query->received_ns = now_ns;
+		query->sz = batch[i].sz;
+		memcpy(query->data, batch[i].data, batch[i].sz);
+
+		w.queries.publish();
+
+		woken[shard] = true;
+	}
+
+	for(unsigned i = 0; i < count; i++)
+		if(woken[i])
+			pipeline_wake(p.workers[i]->wake);
+}
+
+/*
+ * the replies the workers have ready, sent PIPELINE_BATCH to a sendmmsg
+ */
+
+void pipeline_send(pipeline& p, int dnsfd) {
+
+	static pipeline_reply batch[PIPELINE_BATCH];
+
+	mmsghdr msgs[PIPELINE_BATCH];
+	iovec iovs[PIPELINE_BATCH];
+
+	for(;;) {
+
+		int n = 0;
+
+		mpsc_ring<pipeline_reply>::cell *c;
+
+		while(n < PIPELINE_BATCH and (c = p.replies.front()) != nullptr) {
+
+			if(c->value.sz > 0)
+				batch[n++] = c->value;
+
+			p.replies.release(c);
+		}
+
+		if(n == 0)
+			return;
+
+		memset(msgs, 0, sizeof(msgs));
+
+		for(int i = 0; i < n; i++) {
+			iovs[i].iov_base = batch[i].data;
+			iovs[i].iov_len = batch[i].sz;
+			msgs[i].msg_hdr.msg_name = &batch[i].to;
+			msgs[i].msg_hdr.msg_namelen = sizeof(batch[i].to);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		for(int i = 0; i < n; ) {
+
+			int sent = sendmmsg(dnsfd, msgs + i, n - i, 0);
+
+			if(sent == -1) {
+
+				if(errno == EINTR)
+					continue;
+
+				perror("sendmmsg()");
+
+				/*
+				 * the one that failed goes unanswered
+				 */
+
+				sent = 1;
+			} else {
+				p.sent += sent;
+			}
+
+			p.sends++;
+
+			i += sent;
+		}
+
+		const uint64_t now_ns = timer_clock_ns();
+
+		for(int i = 0; i < n; i++) {
+			p.sending.add(now_ns - batch[i].processed_ns);
+			p.total.add(now_ns - batch[i].received_ns);
+		}
+	}
+}
+
+void report_pipeline(configuration *config, const pipeline& p) {
+
+	char queued_str[64];
+	char worked_str[64];
 
-			case 'h':
+	flockfile(config->fp);
 
-				usage(argv[0]);
-				exit(EXIT_SUCCESS);
+	fprintf(config->fp, "pipeline: %ld workers received: %ld (%.1f/recvmmsg) dropped: %ld sent: %ld (%.1f/sendmmsg)\n",
+			(long)p.workers.size(),
+			(long)p.received,
+			p.receives > 0 ? (double)p.received / p.receives : 0.0,
+			(long)p.dropped,
+			(long)p.sent,
+			p.sends > 0 ? (double)p.sent / p.sends : 0.0);
 
-			case '?':
+	for(const auto& x : p.workers) {
 
-				fprintf(stderr, "unknown option: -%c\n", optopt);
-				usage(argv[0]);
-				exit(EXIT_FAILURE);
+		const pipeline_worker& w = *x;
 
-			default:
+		w.queued.sprint(queued_str, sizeof(queued_str));
+		w.worked.sprint(worked_str, sizeof(worked_str));
 
-				fprintf(stderr, "unimplemented option: -%c\n", opt);
-				usage(argv[0]);
-				exit(EXIT_FAILURE);
-		}
+		fprintf(config->fp, "worker %u: queries: %ld queue: %ld (max %ld) waited: %s worked: %s replies dropped: %ld\n",
+				w.index,
+				(long)w.worked.count.load(std::memory_order_relaxed),
+				(long)w.queries.size(),
+				(long)w.queries.high.load(std::memory_order_relaxed),
+				queued_str,
+				worked_str,
+				(long)w.dropped_replies.load(std::memory_order_relaxed));
 	}
 
-	return optind;
-}
+	p.sending.sprint(queued_str, sizeof(queued_str));
+	p.total.sprint(worked_str, sizeof(worked_str));
 
-sig_atomic_t stop = 0;
+	fprintf(config->fp, "replies: queue: %ld (max %ld) waited: %s query to reply: %s\n",
+			(long)p.replies.size(),
+			(long)p.replies.high.load(std::memory_order_relaxed),
+			queued_str,
+			worked_str);
 
-void sighandler_stop(int signo) {
-	signal(signo, SIG_IGN);
-	stop = signo;
-	fprintf(stderr, "caught signal #%d (%s), stopping server...\n", signo, strsignal(signo));
+	fflush(config->fp);
+
+	funlockfile(config->fp);
 }
 
-sig_atomic_t report = 0;
+/*
+ * a handoff's next step once the workers are drained: stop receiving and
+ * have them save their sessions, then once they all have give those to the
+ * next server, true when it took them. failing, serving goes on.
+ */
 
-void sighandler_report(int signo) {
-	signal(signo, SIG_IGN);
-	report = signo;
-	fprintf(stderr, "caught signal #%d (%s), reporting status...\n", signo, strsignal(signo));
-}
+bool pipeline_handoff(configuration *config, pipeline& p, handoff_state& handoff, int dnsfd) {
 
-sig_atomic_t reload = 0;
+	for(const auto& w : p.workers)
+		if(not w->drained.load(std::memory_order_acquire))
+			return false;
 
-void sighandler_reload(int signo) {
-	signal(signo, SIG_IGN);
-	reload = signo;
-	fprintf(stderr, "caught signal #%d (%s), reloading configuration...\n", signo, strsignal(signo));
-}
+	if(not p.saving.load(std::memory_order_relaxed)) {
 
-#define DATA_SZ 2048
+		p.saving.store(true, std::memory_order_release);
 
-ssize_t recvfrom_fd_data(configuration * config, int fd, void *data, size_t data_sz, struct sockaddr_in *p_sin) {
+		for(const auto& w : p.workers)
+			pipeline_wake(w->wake);
 
+		return false;
+	}
 
-	socklen_t addrlen;
-	ssize_t n;
+	for(const auto& w : p.workers)
+		if(not w->saved.load(std::memory_order_acquire))
+			return false;
 
-	addrlen = sizeof(*p_sin);
+	pipeline_send(p, dnsfd);
 
-	n = recvfrom(fd, data, data_sz, 0, (struct sockaddr *)p_sin, &addrlen);
-	if(n == -1)
-		return -1;
+	handoff_writer sessions;
 
-	if(config->verbose) {
+	for(const auto& w : p.workers)
+		sessions.out += w->sessions;
 
-		char buf[20];
+	if(handoff_give(config, handoff, dnsfd, sessions))
+		return true;
 
-		if(inet_ntop(AF_INET, &(p_sin->sin_addr), buf, sizeof(buf)) == nullptr) {
-			perror("inet_ntop()");
-			exit(EXIT_FAILURE);
-		}
+	p.handing_off.store(false, std::memory_order_relaxed);
+	p.saving.store(false, std::memory_order_relaxed);
 
-		fprintf(config->fp, "fd #%d data ready : read %ld bytes from %s:%d\n", fd, (long)n, buf, ntohs(p_sin->sin_port));
+	for(const auto& w : p.workers) {
+		w->drained.store(false, std::memory_order_relaxed);
+		w->saved.store(false, std::memory_order_relaxed);
+		std::string().swap(w->sessions);
+		pipeline_wake(w->wake);
 	}
 
-	return n;
+	return false;
 }
 
-ssize_t process_question(configuration *config, size_t offset, const void * data, size_t data_sz, std::set<int>& fds) {
+/*
+ * the I/O thread, serving with config->workers workers until stopped
+ */
 
-	struct sockaddr_in sin_to;
+void serve_pipeline(configuration *config, int dnsfd, int nsecs, handoff_state& handoff) {
 
-	dns_question question;
-	http_request request;
+	pipeline p;
 
-	int fd;
+	const unsigned count = config->workers;
 
-	ssize_t n = question.parse(offset, data, data_sz);
-	if(n == -1)
-		return -1;
+	p.count = count;
+	p.config = std::make_shared<const configuration>(*config);
 
-	offset = n;
+	size_t restored = 0;
 
-	if(config->verbose) {
-		char q_str[DNS_NAME_MAX_SZ * 2];
-		question.sprint(q_str, sizeof(q_str));
-		fprintf(config->fp, "DNS QUESTION :: %s\n", q_str);
+	if((p.wake = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
 	}
 
-	if(request.parse(question, config->domain) == -1)
-		return -1;
+	/*
+	 * the workers take signals from nobody, their mask inherited from here
+	 */
 
-	if(request.get_sockaddr((sockaddr *)&sin_to, sizeof(sin_to)) == nullptr) {
-		perror("http_request::get_sockaddr()");
-		return -1;
-	}
+	sigset_t all;
+	sigset_t mask;
 
-	request.method = http_method::POST;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &mask);
 
-	request.form["id"] = "16";
-	request.form["username"] = "christopher";
-	request.form["domain"] = "256.bz";
+	for(unsigned i = 0; i < count; i++) {
 
-	if(config->verbose) {
-		fprintf(config->fp, "url: %s\n", request.url().c_str());
-		fprintf(config->fp, "[request]\n%s\n", request.to_s().c_str());
+		p.workers.emplace_back(new pipeline_worker());
+
+		pipeline_worker& w = *p.workers.back();
+
+		w.index = i;
+
+		if(config->cache_file != nullptr)
+			w.cache_file = std::string(config->cache_file) + "." + std::to_string(i);
+
+		worker_config(config, w, count, &w.config);
+
+		start_state(&w.config, w.state);
+
+		if(not handoff.taken.empty())
+			restored += restore_sessions(&w.config, w.state, handoff.taken, i, count);
+
+		if((w.wake = eventfd(0, EFD_NONBLOCK)) == -1) {
+			perror("eventfd()");
+			exit(EXIT_FAILURE);
+		}
+
+		w.thread = std::thread(serve_worker, std::ref(p), std::ref(w), nsecs);
 	}
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
+	pthread_sigmask(SIG_SETMASK, &mask, nullptr);
 
-	if(connect(fd, (sockaddr *)&sin_to, sizeof(sin_to)) == -1) {
-		perror("connect()");
-		close(fd);
-		return offset;
+	if(not handoff.taken.empty()) {
+		fprintf(stderr, "handoff: took over %ld sessions\n", (long)restored);
+		handoff.taken.clear();
 	}
 
-	fds.insert(fd);
+	if(config->verbose)
+		fprintf(config->fp, "pipeline: %u workers, %u queries queued each, %u replies\n",
+				count, PIPELINE_QUERIES, PIPELINE_REPLIES);
 
-	return offset;
-}
+	int flags = fcntl(dnsfd, F_GETFL);
 
-ssize_t
-process_rr_section(configuration *config, size_t offset, const void * data, size_t data_sz, size_t count, const char *section_name)
-{
+	if(flags == -1 or fcntl(dnsfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl()");
+		exit(EXIT_FAILURE);
+	}
 
-	for(size_t q_n = 1; q_n <= count; q_n++) {
+	pollfd fds[3];
 
-		dns_rr rr;
-		char rr_string[DNS_NAME_MAX_SZ * 2];
+	fds[0].fd = dnsfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = p.wake;
+	fds[1].events = POLLIN;
+	fds[2].events = POLLIN;
 
-		ssize_t n = rr.parse(offset, data, data_sz);
-		if(n == -1) {
-			fprintf(stderr, "dns %s #%d parse failed...\n", section_name, (int)q_n);
-			return -1;
-		}
+	while(not stop) {
 
-		offset = n;
+		if(report != 0) {
 
-		if(config->verbose) {
-			rr.sprint(rr_string, sizeof(rr_string));
-			fprintf(config->fp, "dns %s #%d :: %s\n", section_name, (int)q_n, rr_string);
+			report_pipeline(config, p);
+
+			for(const auto& w : p.workers) {
+				w->report.store(true);
+				pipeline_wake(w->wake);
+			}
+
+			configure_signal(config, report, sighandler_report);
+			report = 0;
 		}
-	}
 
-	return offset;
-}
+		if(reload != 0) {
 
-void process_dns_packet(configuration *config, void *data, ssize_t data_sz, std::set<int>& fds) {
+			configuration next;
 
-	ssize_t offset;
-	ssize_t n;
+			if(reload_config(config, &next) == 0) {
 
-	int fd;
+				*config = next;
 
-	dns_question question;
+				{
+					std::lock_guard<std::mutex> guard(p.lock);
+					p.config = std::make_shared<const configuration>(next);
+					p.generation.fetch_add(1, std::memory_order_release);
+				}
 
-	dns_header header;
+				for(const auto& w : p.workers)
+					pipeline_wake(w->wake);
 
-	n = header.parse(data, data_sz);
-	if(n == -1) {
-		fprintf(stderr, "dns header parse failed...\n");
-		return;
-	}
+				fprintf(stderr, "configuration reloaded, %ld zones\n", (long)config->zones.size());
+			}
 
-	offset = n;
+			configure_signal(config, reload, sighandler_reload);
+			reload = 0;
+		}
 
-	if(config->verbose) {
-		char header_string[256];
-		header.sprint(header_string, sizeof(header_string));
-		fprintf(config->fp, "DNS HEADER :: %s\n", header_string);
-	}
+		const bool saving = p.saving.load(std::memory_order_relaxed);
 
-	if(header.is_response()) {
-		fprintf(stderr, "ignoring DNS RESPONSE\n");
-		return;
-	}
+		fds[0].fd = saving ? -1 : dnsfd;
+		fds[2].fd = handoff.peer == -1 ? handoff.listener : -1;
 
-	if((dns_opcode)header.opcode != dns_opcode::QUERY) {
-		fprintf(stderr, "ignoring DNS OPCODE #%d (%s)\n", header.opcode, dns_opcode_str((dns_opcode)header.opcode));
-		return;
-	}
+		int n = poll(fds, 3, nsecs * 1000);
 
-	for(size_t q_n = 1; q_n <= header.qdcount; q_n++) {
-		n = process_question(config, offset, data, data_sz, fds);
 		if(n == -1) {
-			fprintf(stderr, "couldn't process DNS QUESTION #%d\n", (int)q_n);
-			return;
+
+			if(errno == EINTR)
+				continue;
+
+			perror("poll()");
+			exit(EXIT_FAILURE);
 		}
 
-		offset = n;
-	}
+		if(n == 0) {
+			fprintf(config->fp, "%dsec timeout...\n", nsecs);
+			continue;
+		}
 
-	if((offset = process_rr_section(config, offset, data, data_sz, header.ancount, "answer")) == -1)
-		return;
+		if(fds[1].revents & POLLIN)
+			pipeline_drain(p.wake);
 
-	if((offset = process_rr_section(config, offset, data, data_sz, header.nscount, "nameservers")) == -1)
-		return;
+		if(fds[0].revents & POLLIN)
+			pipeline_receive(config, p, dnsfd);
 
-	if((offset = process_rr_section(config, offset, data, data_sz, header.arcount, "additional")) == -1)
-		return;
+		if((fds[2].revents & POLLIN) and handoff_accept(config, handoff)) {
+
+			p.deadline_ms = handoff.deadline_ms;
+			p.handing_off.store(true, std::memory_order_release);
 
-	while(fds.size() >= FD_SETSIZE) {
+			for(const auto& w : p.workers)
+				pipeline_wake(w->wake);
+		}
 
-		fd = *fds.begin();
+		/*
+		 * replies go out every turn, a worker's wake up possibly already
+		 * drained with an earlier batch
+		 */
 
-		fprintf(stderr, "too many http connections open, closing fd #%d...", fd);
+		pipeline_send(p, dnsfd);
 
-		close(fd);
+		if(handoff.peer != -1 and pipeline_handoff(config, p, handoff, dnsfd))
+			break;
+	}
+
+	p.running.store(false, std::memory_order_release);
 
-		fds.erase(fd);
+	for(const auto& w : p.workers) {
+		pipeline_wake(w->wake);
+		w->thread.join();
+		close(w->wake);
 	}
+
+	close(p.wake);
 }
 
 void http_over_dns(configuration * config) {
 
 	struct sockaddr_in sin;
 
-	std::set<int> httpfdset;
+	server_state state;
+
+	handoff_state handoff;
 
 	int dnsfd = -1;
 	int maxfd;
@@ -403,10 +5351,12 @@ void http_over_dns(configuration * config) {
 	const int nsecs = 15;
 
 	fd_set rfds;
+	fd_set wfds;
 
 	struct timeval tv;
 
 	unsigned char data[DATA_SZ];
+	unsigned char reply[DNS_MSG_MAX_SZ];
 
 	if (setlocale(LC_CTYPE, config->locale) == nullptr) {
 		fprintf(stderr, "failed to set locale LC_CTYPE=\"%s\"\n", config->locale);
@@ -427,6 +5377,9 @@ void http_over_dns(configuration * config) {
 		fprintf(config->fp, "address: %s:%d\n", buf, config->port);
 		fprintf(config->fp, "verbose: %s\n", config->verbose ? "true" : "false");
 		fprintf(config->fp, " locale: \"%s\"\n", config->locale);
+		for(const zone_policy& zone : config->zones)
+			fprintf(config->fp, "   zone: \"%s\" upstream: %s\n", tunnel_zone(zone.domain.c_str()),
+					zone.upstream.empty() ? "request host" : zone.upstream.c_str());
 	}
 
 	if(setuid(0) == -1) {
@@ -434,77 +5387,106 @@ void http_over_dns(configuration * config) {
 		exit(EXIT_FAILURE);
 	}
 
-	auto configure_signal = [config](int signo, sighandler_t handler) {
+	configure_signal(config, SIGQUIT, sighandler_stop  );
+	configure_signal(config, SIGTERM, sighandler_stop  );
+	configure_signal(config, SIGINT , sighandler_stop  );
+	configure_signal(config, SIGHUP , sighandler_reload);
+	configure_signal(config, SIGUSR1, sighandler_reload);
+	configure_signal(config, SIGUSR2, sighandler_report);
 
-		if(config->verbose) 
-			fprintf(config->fp, "configuring signal #%d (%s)\n", signo, strsignal(signo));
+	if(config->handoff_path != nullptr)
+		dnsfd = handoff_take(config, handoff);
+
+	if(dnsfd == -1) {
 
-		if(signal(signo, handler) == SIG_ERR) {
-			perror("signal()");
+		dnsfd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(dnsfd == -1) {
+			perror("socket()");
 			exit(EXIT_FAILURE);
 		}
-	};
 
-	configure_signal(SIGQUIT, sighandler_stop  );
-	configure_signal(SIGTERM, sighandler_stop  );
-	configure_signal(SIGINT , sighandler_stop  );
-	configure_signal(SIGHUP , sighandler_reload);
-	configure_signal(SIGUSR1, sighandler_reload);
-	configure_signal(SIGUSR2, sighandler_report);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(config->port);
+		sin.sin_addr.s_addr = config->address;
 
-	dnsfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if(dnsfd == -1) {
-		perror("socket()");
-		exit(EXIT_FAILURE);
+		if(bind(dnsfd, (const struct sockaddr *)&sin, sizeof(sin)) == -1) {
+			perror("bind()");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(config->port);
-	sin.sin_addr.s_addr = config->address;
+	start_state(config, state);
 
-	if(bind(dnsfd, (const struct sockaddr *)&sin, sizeof(sin)) == -1) {
-		perror("bind()");
-		exit(EXIT_FAILURE);
+	if(config->workers == 0 and not handoff.taken.empty()) {
+		fprintf(stderr, "handoff: took over %ld sessions\n", (long)restore_sessions(config, state, handoff.taken, 0, 1));
+		handoff.taken.clear();
 	}
 
-	while(not stop) {
+	if(config->handoff_path != nullptr)
+		handoff_await(config, handoff);
 
-		if(report != 0) {
-			configure_signal(report, sighandler_report);
-			report = 0;
-		}
+	if(config->workers > 0) {
 
-		if(reload != 0) {
-			configure_signal(reload, sighandler_reload);
-			reload = 0;
+		if(config->uring)
+			fprintf(stderr, "io_uring is not used with workers\n");
+
+		serve_pipeline(config, dnsfd, nsecs, handoff);
+
+	} else if(config->uring) {
+
+		serve_uring(config, state, dnsfd, nsecs, handoff);
+	}
+
+	while(not stop and not handoff.given) {
+
+		serve_turn(config, state);
+
+		if(handoff.peer != -1 and handoff_drained(state, handoff.deadline_ms)) {
+
+			handoff_writer sessions;
+
+			save_sessions(config, state, sessions);
+
+			if(handoff_give(config, handoff, dnsfd, sessions))
+				break;
+
+			state.handing_off = false;
 		}
 
 		struct sockaddr_in sin_from;
 		ssize_t sz;
 
 		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
 
 		FD_SET(dnsfd, &rfds);
-		maxfd = dnsfd;
 
-		for(int fd : httpfdset) {
-			FD_SET(fd, &rfds);
-			if(fd > maxfd)
-				maxfd = fd;
-		}
+		if(handoff.listener != -1 and handoff.peer == -1)
+			FD_SET(handoff.listener, &rfds);
+
+		maxfd = upstream_fdset(state, &rfds, &wfds, std::max(dnsfd, handoff.listener));
+
+		/*
+		 * sleep no longer than until the next timer is due
+		 */
+
+		const int64_t wait_ms = serve_wait_ms(state, nsecs);
 
-		tv.tv_sec = nsecs;
-		tv.tv_usec = 0;
+		tv.tv_sec = wait_ms / 1000;
+		tv.tv_usec = wait_ms % 1000 * 1000;
 
 		if(config->verbose) {
-			fprintf(config->fp, "waiting %ds for any files ready for reading (%d/%d descriptors)\n",
-					nsecs,
-					(int)httpfdset.size() + 1,
-					(int)FD_SETSIZE + 1);
+			fprintf(config->fp, "waiting %.2fs for any files ready (%d/%d descriptors, %ld timers)\n",
+					wait_ms / 1000.0,
+					(int)state.upstreams.size() + 1,
+					(int)FD_SETSIZE + 1,
+					(long)state.timers.count);
 		}
 
-		int left = select(maxfd + 1, &rfds, nullptr, nullptr, &tv);
+		int left = select(maxfd + 1, &rfds, &wfds, nullptr, &tv);
+
+		state.timers.advance(timer_clock_ms(), &state);
 
 		if(left == -1) {
 
@@ -516,10 +5498,19 @@ void http_over_dns(configuration * config) {
 		}
 		
 		if(left == 0) {
-			fprintf(config->fp, "%dsec timeout...\n", nsecs);
+			if(wait_ms == nsecs * 1000)
+				fprintf(config->fp, "%dsec timeout...\n", nsecs);
 			continue;
 		}
 
+		std::vector<int> ready;
+		std::vector<int> writable;
+
+		upstream_ready(state, &rfds, &wfds, &ready, &writable);
+
+		if(handoff.listener != -1 and FD_ISSET(handoff.listener, &rfds) and handoff_accept(config, handoff))
+			state.handing_off = true;
+
 		if(left > 0 && FD_ISSET(dnsfd, &rfds)) {
 
 			sz = recvfrom_fd_data(config, dnsfd, data, DATA_SZ, &sin_from);
@@ -533,65 +5524,152 @@ void http_over_dns(configuration * config) {
 				}
 			} else {
 
-				process_dns_packet(config, data, sz, httpfdset);
+				memset(&state.peer, 0, sizeof(state.peer));
+				memcpy(&state.peer, &sin_from, sizeof(sin_from));
+
+				sz = process_dns_packet(config, data, sz, state, reply, sizeof(reply));
+
+				if(sz > 0 and sendto(dnsfd, reply, sz, 0, (sockaddr *)&sin_from, sizeof(sin_from)) == -1)
+					perror("sendto()");
 
 				FD_CLR(dnsfd, &rfds);
 				left--;
 			}
 		}
 
-		for(int fd : httpfdset) {
+		serve_upstreams(config, state, ready, writable);
+
+		prefetch_replies(config, state);
+	}
+
+	fprintf(config->fp, "cleaning up...\n");
+
+	if(dnsfd != -1) {
+		close(dnsfd);
+		dnsfd = -1;
+	}
+
+	if(handoff.listener != -1) {
+		close(handoff.listener);
+		if(not handoff.given)
+			unlink(config->handoff_path);
+	}
+
+	while(not state.upstreams.empty())
+		close_upstream(state, state.upstreams.fds.back());
+
+	expire_idle(state, 0);
+
+	fprintf(config->fp, "goodbye!\n");
+
+	fclose(config->fp);
+}
+
+void http_over_dns_batch(configuration *config, int filec, char **filev) {
+
+	server_state state;
+
+	unsigned char reply[DNS_MSG_MAX_SZ];
+
+	timespec t0;
+	timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for(int i = 0; i < filec; i++) {
+
+		capture_file file;
+		capture_packet packet;
+
+		if(file.open(filev[i]) == -1) {
+			eprintf(errno, "couldn't open capture file %s", filev[i]);
+			exit(EXIT_FAILURE);
+		}
+
+		if(config->verbose) {
+			fprintf(config->fp, "file: %s (%s) %ld bytes\n",
+					file.path, capture_format_str(file.format), (long)file.data_sz);
+		}
+
+		batch_totals.files++;
+
+		for(size_t offset = file.begin(); offset < file.data_sz and not stop; ) {
 
-			if(left > 0 && FD_ISSET(fd, &rfds)) {
+			ssize_t n = file.next(offset, &packet);
+			if(n == -1) {
+				fprintf(stderr, "%s: truncated capture record @ %ld\n", file.path, (long)offset);
+				break;
+			}
 
-				sz = recvfrom_fd_data(config, fd, data, DATA_SZ, &sin_from);
+			offset = n;
 
-				if(sz == -1) {
+			batch_totals.records++;
 
-					if(errno != EAGAIN) {
+			if(packet.data == nullptr)
+				continue;
 
-						eprintf(errno, "recvfrom() failed, removing http-fd #%d", fd);
+			if(file.format == capture_format::PCAP and packet.dport != config->port)
+				continue;
 
-						close(fd);
-						httpfdset.erase(fd);
-					}
+			batch_totals.packets++;
+			batch_totals.packet_bytes += packet.data_sz;
 
-				} else if(sz == 0) {
+			state.peer = packet.from;
 
-					if(config->verbose)
-						fprintf(config->fp, "http connection closed, removing http-fd #%d", fd);
+			ssize_t sz = process_dns_packet(config, packet.data, packet.data_sz, state, reply, sizeof(reply));
 
-					close(fd);
-					httpfdset.erase(fd);
+			if(sz > 0) {
+				batch_totals.replies++;
+				batch_totals.reply_bytes += sz;
+			}
 
-				} else {
+			while(not state.upstreams.empty()) {
 
-					//
-					// process the data
-					//
-				}
+				int fd = state.upstreams.fds.front();
 
-				FD_CLR(fd, &rfds);
-				left--;
+				chain_slice in;
+
+				sz = read_upstream(fd, &in);
+
+				if(sz > 0)
+					batch_totals.response_bytes += sz;
+
+				process_upstream_data(config, fd, in, sz, state);
+
+				chain_release(in.segment);
 			}
+
+			admit_pending(config, state);
 		}
+
+		file.close();
 	}
 
-	fprintf(config->fp, "cleaning up...\n");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
 
-	if(dnsfd != -1) {
-		close(dnsfd);
-		dnsfd = -1;
-	}
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
 
-	for(int fd : httpfdset)
-		close(fd);
+	fprintf(config->fp, "files: %ld records: %ld dns packets: %ld (%ld bytes)\n",
+			(long)batch_totals.files,
+			(long)batch_totals.records,
+			(long)batch_totals.packets,
+			(long)batch_totals.packet_bytes);
 
-	httpfdset.clear();
+	fprintf(config->fp, "dns replies: %ld (%ld bytes) sessions: %ld\n",
+			(long)batch_totals.replies,
+			(long)batch_totals.reply_bytes,
+			(long)state.sessions.size());
 
-	fprintf(config->fp, "goodbye!\n");
+	fprintf(config->fp, "http requests: %ld (%ld bytes) responses: %ld bytes\n",
+			(long)batch_totals.requests,
+			(long)batch_totals.request_bytes,
+			(long)batch_totals.response_bytes);
 
-	fclose(config->fp);
+	report_packing(config, state);
+
+	fprintf(config->fp, "elapsed: %.6fs (%.0f packets/s)\n",
+			secs,
+			secs > 0 ? batch_totals.packets / secs : 0.0);
 }
 
 void eprintf(int errnum, const char *format, ...) {
@@ -611,10 +5689,25 @@ int main(int argc, char **argv) {
 
 	configuration config;
 
+	config_argc = argc;
+	config_argv = argv;
+
 	int lastopt = cliconfig(&config, argc, argv);
 
+	if(lastopt == -1)
+		exit(EXIT_FAILURE);
+
 	if (lastopt != argc) {
-		fprintf(stderr, "too many arguments\n");
+
+		config.batch = true;
+
+		http_over_dns_batch(&config, argc - lastopt, argv + lastopt);
+
+		exit(EXIT_SUCCESS);
+	}
+
+	if(config.replay != nullptr) {
+		fprintf(stderr, "-R is only meaningful in batch mode\n");
 		exit(EXIT_FAILURE);
 	}
 
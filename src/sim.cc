@@ -0,0 +1,906 @@
+/*
+ * 80over53-sim - lossy recursive resolver simulator
+ *
+ * Copyright(c) 2015 256 LLC
+ * Written by Christopher Abad
+ * 20 GOTO 10
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstdint>
+
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <ctime>
+#include <climits>
+
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+#include <80over53/dns.hh>
+
+/*
+ * 80over53-sim program logic
+ * ==========================
+ *
+ * sits between a tunnel client and 80over53-server the way a recursive
+ * resolver would, applying a seeded and therefore repeatable impairment
+ * profile to every packet in both directions.
+ *
+ * client-fd : socket-open-udp -> bind-port
+ * server-fd : socket-open-udp
+ *
+ * while select on client-fd, server-fd (timeout : next-due) and not stop
+ *
+ *    if client-fd ready
+ *       query : impair (0x20, edns, drop, dup, delay, reorder) -> schedule for server
+ *
+ *    if server-fd ready
+ *       answer : match id -> check 0x20 -> restore question -> truncate
+ *              -> impair (drop, dup, delay, reorder) -> schedule for client
+ *
+ *    foreach scheduled packet that is due
+ *       send
+ *
+ * report goodput and latency percentiles
+ *
+ */
+
+struct impairment {
+	const char *name;
+	double drop_query;
+	double drop_reply;
+	double duplicate;
+	double reorder;
+	unsigned delay_ms;
+	unsigned jitter_ms;
+	unsigned reorder_ms;
+	bool randomize_case;
+	int edns_size;
+	size_t max_reply;
+};
+
+/*
+ * edns_size : -1 leaves OPT alone, 0 strips it, otherwise rewrites the UDP size
+ * max_reply : answers larger than this are truncated (TC) as a resolver would
+ */
+
+const impairment profiles[] = {
+	{ "clean",   0.00, 0.00, 0.00, 0.00,   0,   0,   0, false,   -1, 65535 },
+	{ "lossy",   0.05, 0.05, 0.01, 0.02,  30,  20,  50, false,   -1, 65535 },
+	{ "public",  0.01, 0.01, 0.00, 0.01,  20,  10,  30, true,  1232,  1232 },
+	{ "hostile", 0.20, 0.20, 0.05, 0.10,  80, 120, 200, true,   512,   512 },
+};
+
+struct configuration {
+	bool verbose = false;
+	uint32_t address = htonl(INADDR_LOOPBACK);
+	uint16_t port = 5353;
+	uint32_t server_address = htonl(INADDR_LOOPBACK);
+	uint16_t server_port = 53;
+	uint64_t seed = 1;
+	impairment profile = profiles[0];
+	FILE *fp = stdout;
+};
+
+configuration default_config = configuration();
+
+/*
+ * splitmix64, so a given seed replays exactly the same impairments
+ */
+
+struct prng {
+
+	uint64_t state;
+
+	prng(uint64_t seed) : state(seed) {
+	}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	double uniform() {
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	bool chance(double p) {
+		return p > 0 and uniform() < p;
+	}
+};
+
+const char *default_action(int default_value) {
+    return default_value ? "disable" : "enable";
+}
+
+void usage_print(const char *option_str, const char *action, const char *option_desc) {
+
+    const int option_width = -13;
+
+    fprintf(stderr, "\t%*s%s %s\n", option_width, option_str, action, option_desc);
+}
+
+void usage(const char *arg0) {
+
+    fprintf(stderr, "\nusage: %s [options]\n\n", arg0);
+
+	char ip_string[20];
+	char port_string[20];
+	char server_string[40];
+	char profile_string[80] = "";
+
+	if(inet_ntop(AF_INET, &default_config.address, ip_string, sizeof(ip_string)) == nullptr) {
+		perror("inet_ntop()");
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(port_string, sizeof(port_string), "%d", default_config.port);
+
+	inet_ntop(AF_INET, &default_config.server_address, server_string, sizeof(server_string));
+	snprintf(server_string + strlen(server_string), sizeof(server_string) - strlen(server_string), ":%d", default_config.server_port);
+
+	for(const auto& profile : profiles) {
+		strcat(profile_string, " ");
+		strcat(profile_string, profile.name);
+	}
+
+    usage_print("-h", "show", "this help");
+    usage_print("-v", default_action(default_config.verbose), "verbose output");
+	usage_print("-4 ip", "IPv4 bind address, default:", ip_string);
+	usage_print("-p port", "UDP bind port, default:", port_string);
+	usage_print("-S ip:port", "server address, default:", server_string);
+	usage_print("-s seed", "random", "seed, default: 1");
+	usage_print("-P profile", "impairment profile:", profile_string);
+	usage_print("-D percent", "drop", "queries and answers");
+	usage_print("-U percent", "duplicate", "queries and answers");
+	usage_print("-O percent", "reorder", "queries and answers");
+	usage_print("-L ms", "delay", "each direction by ms");
+	usage_print("-J ms", "jitter", "delay by up to ms");
+	usage_print("-0", "toggle", "0x20 query case randomization");
+	usage_print("-E size", "rewrite", "EDNS UDP size (0 strips OPT, -1 leaves it)");
+	usage_print("-T size", "truncate", "answers larger than size");
+
+    fputc('\n', stderr);
+}
+
+double percent_arg(const char *arg) {
+	return strtod(arg, nullptr) / 100.0;
+}
+
+int cliconfig(configuration * config, int argc, char **argv) {
+
+    int opt;
+
+    *config = default_config;
+
+    opterr = 0;
+
+	struct in_addr addr;
+	unsigned long port;
+	char *colon;
+
+	while ((opt = getopt(argc, argv, "hv4:p:S:s:P:D:U:O:L:J:0E:T:")) != -1) {
+
+		switch (opt) {
+
+			case 'v':
+
+				config->verbose = !default_config.verbose;
+				break;
+
+			case '4':
+
+				if(inet_pton(AF_INET, optarg, &addr) != 1) {
+					fprintf(stderr, "invalid address: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				config->address = addr.s_addr;
+				break;
+
+			case 'p':
+
+				port = strtoul(optarg, nullptr, 0);
+				if(port == ULONG_MAX && errno == ERANGE) {
+					perror("strtoul()");
+					exit(EXIT_FAILURE);
+				}
+				config->port = port;
+				break;
+
+			case 'S':
+
+				colon = strchr(optarg, ':');
+				if(colon != nullptr) {
+					*colon = '\0';
+					config->server_port = strtoul(colon + 1, nullptr, 0);
+				}
+				if(inet_pton(AF_INET, optarg, &addr) != 1) {
+					fprintf(stderr, "invalid address: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				config->server_address = addr.s_addr;
+				break;
+
+			case 's':
+
+				config->seed = strtoull(optarg, nullptr, 0);
+				break;
+
+			case 'P':
+
+				{
+					const impairment *found = nullptr;
+
+					for(const auto& profile : profiles)
+						if(strcmp(profile.name, optarg) == 0)
+							found = &profile;
+
+					if(found == nullptr) {
+						fprintf(stderr, "unknown profile: %s\n", optarg);
+						usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+
+					config->profile = *found;
+				}
+				break;
+
+			case 'D':
+
+				config->profile.drop_query = config->profile.drop_reply = percent_arg(optarg);
+				break;
+
+			case 'U':
+
+				config->profile.duplicate = percent_arg(optarg);
+				break;
+
+			case 'O':
+
+				config->profile.reorder = percent_arg(optarg);
+				break;
+
+			case 'L':
+
+				config->profile.delay_ms = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'J':
+
+				config->profile.jitter_ms = strtoul(optarg, nullptr, 0);
+				break;
+
+			case '0':
+
+				config->profile.randomize_case = !config->profile.randomize_case;
+				break;
+
+			case 'E':
+
+				config->profile.edns_size = strtol(optarg, nullptr, 0);
+				break;
+
+			case 'T':
+
+				config->profile.max_reply = strtoul(optarg, nullptr, 0);
+				break;
+
+			case 'h':
+
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+
+			case '?':
+
+				fprintf(stderr, "unknown option: -%c\n", optopt);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+
+			default:
+
+				fprintf(stderr, "unimplemented option: -%c\n", opt);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	return optind;
+}
+
+sig_atomic_t stop = 0;
+
+void sighandler_stop(int signo) {
+	signal(signo, SIG_IGN);
+	stop = signo;
+	fprintf(stderr, "caught signal #%d (%s), stopping simulator...\n", signo, strsignal(signo));
+}
+
+sig_atomic_t report = 0;
+
+void sighandler_report(int signo) {
+	signal(signo, SIG_IGN);
+	report = signo;
+	fprintf(stderr, "caught signal #%d (%s), reporting status...\n", signo, strsignal(signo));
+}
+
+#define DATA_SZ 4096
+
+uint64_t now_usec() {
+
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+enum struct direction { TO_SERVER, TO_CLIENT };
+
+struct scheduled_packet {
+
+	uint64_t due;
+	uint64_t serial;
+
+	direction dir;
+	sockaddr_in to;
+
+	uint64_t t_in;
+
+	std::vector<uint8_t> data;
+
+	bool operator<(const scheduled_packet& x) const {
+		return due != x.due ? due > x.due : serial > x.serial;
+	}
+};
+
+/*
+ * one slot per upstream query id, duplicated queries occupy two slots that
+ * name each other as twins so only the first answer reaches the client
+ */
+
+struct pending_query {
+
+	bool active = false;
+
+	sockaddr_in client;
+	uint16_t client_id = 0;
+
+	uint64_t t_in = 0;
+
+	uint8_t qname[DNS_NAME_MAX_SZ + 1];
+	uint8_t sent_qname[DNS_NAME_MAX_SZ + 1];
+	size_t qname_sz = 0;
+
+	bool has_twin = false;
+	uint16_t twin = 0;
+
+	bool suppress = false;
+};
+
+struct statistics {
+	size_t queries = 0;
+	size_t forwarded = 0;
+	size_t answers = 0;
+	size_t relayed = 0;
+	size_t relayed_bytes = 0;
+	size_t dropped_queries = 0;
+	size_t dropped_answers = 0;
+	size_t duplicated = 0;
+	size_t reordered = 0;
+	size_t truncated = 0;
+	size_t mismatched_case = 0;
+	size_t suppressed = 0;
+	size_t unmatched = 0;
+	size_t malformed = 0;
+	std::vector<uint32_t> latency;
+};
+
+struct simulator {
+
+	configuration *config;
+
+	prng rng;
+
+	int clientfd = -1;
+	int serverfd = -1;
+
+	sockaddr_in server;
+
+	std::priority_queue<scheduled_packet> schedule;
+	uint64_t serial = 0;
+
+	std::vector<pending_query> pending;
+	uint16_t next_id = 0;
+
+	statistics stats;
+
+	uint64_t t_start;
+
+	simulator(configuration *my_config)
+	: config(my_config), rng(my_config->seed), pending(65536), t_start(now_usec())
+	{
+	}
+
+	uint64_t delay(uint64_t t) {
+
+		const impairment& p = config->profile;
+
+		uint64_t d = (uint64_t)p.delay_ms * 1000;
+
+		if(p.jitter_ms > 0)
+			d += rng.next() % ((uint64_t)p.jitter_ms * 1000);
+
+		if(rng.chance(p.reorder)) {
+			d += (uint64_t)p.reorder_ms * 1000;
+			stats.reordered++;
+		}
+
+		return t + d;
+	}
+
+	void enqueue(uint64_t t, direction dir, const sockaddr_in& to, uint64_t t_in, const uint8_t *data, size_t data_sz) {
+
+		scheduled_packet packet;
+
+		packet.due = delay(t);
+		packet.serial = serial++;
+		packet.dir = dir;
+		packet.to = to;
+		packet.t_in = t_in;
+		packet.data.assign(data, data + data_sz);
+
+		schedule.push(packet);
+	}
+
+	void randomize_case(uint8_t *name, size_t name_sz) {
+
+		for(size_t i = 0; i < name_sz; i++)
+			if(isalpha(name[i]) and (rng.next() & 1))
+				name[i] ^= 0x20;
+	}
+
+	ssize_t rewrite_edns(uint8_t *data, size_t data_sz);
+
+	void on_query(uint8_t *data, size_t data_sz, const sockaddr_in& from);
+	void on_answer(uint8_t *data, size_t data_sz);
+
+	void flush(uint64_t t);
+
+	void print_report();
+};
+
+/*
+ * rewrite or strip the OPT pseudo-RR of a query, returning the new size
+ */
+
+ssize_t simulator::rewrite_edns(uint8_t *data, size_t data_sz) {
+
+	dns_header header;
+
+	if(config->profile.edns_size < 0)
+		return data_sz;
+
+	if(header.parse(data, data_sz) == -1)
+		return -1;
+
+	ssize_t offset = sizeof(dns_header);
+
+	for(size_t i = 0; i < header.qdcount; i++) {
+		offset = skip_name(offset, data, data_sz);
+		if(offset == -1 or offset + 4 > (ssize_t)data_sz)
+			return -1;
+		offset += 4;
+	}
+
+	const size_t rr_count = header.ancount + header.nscount + header.arcount;
+
+	for(size_t i = 0; i < rr_count; i++) {
+
+		ssize_t rr_offset = offset;
+
+		offset = skip_name(offset, data, data_sz);
+		if(offset == -1 or offset + 10 > (ssize_t)data_sz)
+			return -1;
+
+		uint16_t type = (data[offset] << 8) | data[offset + 1];
+		size_t rdlength = (data[offset + 8] << 8) | data[offset + 9];
+
+		ssize_t rr_end = offset + 10 + rdlength;
+		if(rr_end > (ssize_t)data_sz)
+			return -1;
+
+		if((dns_type)type == dns_type::OPT) {
+
+			if(config->profile.edns_size > 0) {
+				data[offset + 2] = (uint8_t)(config->profile.edns_size >> 8);
+				data[offset + 3] = (uint8_t)(config->profile.edns_size);
+				return data_sz;
+			}
+
+			memmove(data + rr_offset, data + rr_end, data_sz - rr_end);
+
+			header.arcount--;
+			uint16_t arcount = htons(header.arcount);
+			memcpy(data + 10, &arcount, sizeof(arcount));
+
+			return data_sz - (rr_end - rr_offset);
+		}
+
+		offset = rr_end;
+	}
+
+	return data_sz;
+}
+
+void simulator::on_query(uint8_t *data, size_t data_sz, const sockaddr_in& from) {
+
+	dns_header header;
+
+	const uint64_t t = now_usec();
+
+	stats.queries++;
+
+	if(header.parse(data, data_sz) == -1 or not header.is_query() or header.qdcount != 1) {
+		stats.malformed++;
+		return;
+	}
+
+	ssize_t name_end = skip_name(sizeof(dns_header), data, data_sz);
+	if(name_end == -1) {
+		stats.malformed++;
+		return;
+	}
+
+	const size_t qname_sz = name_end - sizeof(dns_header);
+
+	if(rng.chance(config->profile.drop_query)) {
+		stats.dropped_queries++;
+		return;
+	}
+
+	ssize_t sz = rewrite_edns(data, data_sz);
+	if(sz == -1) {
+		stats.malformed++;
+		return;
+	}
+
+	int copies = rng.chance(config->profile.duplicate) ? 2 : 1;
+
+	uint16_t ids[2];
+
+	for(int i = 0; i < copies; i++) {
+
+		const uint16_t id = next_id++;
+
+		pending_query& pq = pending[id];
+
+		if(pq.active and pq.has_twin)
+			pending[pq.twin].has_twin = false;
+
+		pq.active = true;
+		pq.client = from;
+		pq.client_id = header.id;
+		pq.t_in = t;
+		pq.qname_sz = qname_sz;
+		pq.has_twin = false;
+		pq.suppress = false;
+
+		memcpy(pq.qname, data + sizeof(dns_header), qname_sz);
+		memcpy(pq.sent_qname, pq.qname, qname_sz);
+
+		if(config->profile.randomize_case)
+			randomize_case(pq.sent_qname, qname_sz);
+
+		memcpy(data + sizeof(dns_header), pq.sent_qname, qname_sz);
+
+		uint16_t wire_id = htons(id);
+		memcpy(data, &wire_id, sizeof(wire_id));
+
+		enqueue(t, direction::TO_SERVER, server, 0, data, sz);
+
+		ids[i] = id;
+
+		stats.forwarded++;
+	}
+
+	if(copies == 2) {
+		pending[ids[0]].has_twin = true;
+		pending[ids[0]].twin = ids[1];
+		pending[ids[1]].has_twin = true;
+		pending[ids[1]].twin = ids[0];
+		stats.duplicated++;
+	}
+}
+
+void simulator::on_answer(uint8_t *data, size_t data_sz) {
+
+	dns_header header;
+
+	const uint64_t t = now_usec();
+
+	stats.answers++;
+
+	if(header.parse(data, data_sz) == -1 or not header.is_response()) {
+		stats.malformed++;
+		return;
+	}
+
+	pending_query& pq = pending[header.id];
+
+	if(not pq.active) {
+		stats.unmatched++;
+		return;
+	}
+
+	if(pq.suppress) {
+		pq.active = false;
+		stats.suppressed++;
+		return;
+	}
+
+	if(header.qdcount != 1 or data_sz < sizeof(dns_header) + pq.qname_sz) {
+		stats.malformed++;
+		return;
+	}
+
+	/*
+	 * a 0x20-aware resolver discards answers that do not echo its case
+	 */
+
+	if(memcmp(data + sizeof(dns_header), pq.sent_qname, pq.qname_sz) != 0) {
+		stats.mismatched_case++;
+		return;
+	}
+
+	pq.active = false;
+
+	if(pq.has_twin)
+		pending[pq.twin].suppress = true;
+
+	memcpy(data + sizeof(dns_header), pq.qname, pq.qname_sz);
+
+	uint16_t wire_id = htons(pq.client_id);
+	memcpy(data, &wire_id, sizeof(wire_id));
+
+	if(data_sz > config->profile.max_reply) {
+
+		const size_t question_sz = pq.qname_sz + 4;
+		const uint16_t zero = 0;
+
+		data[2] |= 0x02;
+
+		memcpy(data + 6, &zero, sizeof(zero));
+		memcpy(data + 8, &zero, sizeof(zero));
+		memcpy(data + 10, &zero, sizeof(zero));
+
+		data_sz = std::min(data_sz, sizeof(dns_header) + question_sz);
+
+		stats.truncated++;
+	}
+
+	if(rng.chance(config->profile.drop_reply)) {
+		stats.dropped_answers++;
+		return;
+	}
+
+	int copies = rng.chance(config->profile.duplicate) ? 2 : 1;
+
+	if(copies == 2)
+		stats.duplicated++;
+
+	for(int i = 0; i < copies; i++)
+		enqueue(t, direction::TO_CLIENT, pq.client, i == 0 ? pq.t_in : 0, data, data_sz);
+}
+
+void simulator::flush(uint64_t t) {
+
+	while(not schedule.empty() and schedule.top().due <= t) {
+
+		const scheduled_packet& packet = schedule.top();
+
+		int fd = packet.dir == direction::TO_SERVER ? serverfd : clientfd;
+
+		if(sendto(fd, packet.data.data(), packet.data.size(), 0, (const sockaddr *)&packet.to, sizeof(packet.to)) == -1) {
+			perror("sendto()");
+		} else if(packet.dir == direction::TO_CLIENT) {
+
+			stats.relayed++;
+			stats.relayed_bytes += packet.data.size();
+
+			if(packet.t_in != 0)
+				stats.latency.push_back((uint32_t)std::min<uint64_t>(t - packet.t_in, UINT32_MAX));
+		}
+
+		schedule.pop();
+	}
+}
+
+void simulator::print_report() {
+
+	const double secs = (now_usec() - t_start) / 1e6;
+
+	std::vector<uint32_t> sorted(stats.latency);
+
+	std::sort(sorted.begin(), sorted.end());
+
+	auto percentile = [&sorted](double p) -> double {
+		if(sorted.empty())
+			return 0;
+		size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+		return sorted[i] / 1000.0;
+	};
+
+	fprintf(config->fp, "profile: %s seed: %llu elapsed: %.3fs\n",
+			config->profile.name, (unsigned long long)config->seed, secs);
+
+	fprintf(config->fp, "queries: %ld forwarded: %ld answers: %ld relayed: %ld (%ld bytes, %.0f bytes/s)\n",
+			(long)stats.queries, (long)stats.forwarded, (long)stats.answers, (long)stats.relayed,
+			(long)stats.relayed_bytes, secs > 0 ? stats.relayed_bytes / secs : 0.0);
+
+	fprintf(config->fp, "dropped: %ld queries %ld answers duplicated: %ld reordered: %ld truncated: %ld\n",
+			(long)stats.dropped_queries, (long)stats.dropped_answers,
+			(long)stats.duplicated, (long)stats.reordered, (long)stats.truncated);
+
+	fprintf(config->fp, "0x20 mismatches: %ld suppressed: %ld unmatched: %ld malformed: %ld\n",
+			(long)stats.mismatched_case, (long)stats.suppressed, (long)stats.unmatched, (long)stats.malformed);
+
+	fprintf(config->fp, "latency ms: p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+			percentile(0.50), percentile(0.90), percentile(0.99), percentile(0.999),
+			sorted.empty() ? 0.0 : sorted.back() / 1000.0);
+
+	fflush(config->fp);
+}
+
+void simulate(configuration *config) {
+
+	simulator sim(config);
+
+	sockaddr_in sin;
+
+	unsigned char data[DATA_SZ];
+
+	auto configure_signal = [](int signo, sighandler_t handler) {
+		if(signal(signo, handler) == SIG_ERR) {
+			perror("signal()");
+			exit(EXIT_FAILURE);
+		}
+	};
+
+	configure_signal(SIGQUIT, sighandler_stop  );
+	configure_signal(SIGTERM, sighandler_stop  );
+	configure_signal(SIGINT , sighandler_stop  );
+	configure_signal(SIGUSR2, sighandler_report);
+
+	sim.clientfd = socket(AF_INET, SOCK_DGRAM, 0);
+	sim.serverfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if(sim.clientfd == -1 or sim.serverfd == -1) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(config->port);
+	sin.sin_addr.s_addr = config->address;
+
+	if(bind(sim.clientfd, (const struct sockaddr *)&sin, sizeof(sin)) == -1) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sim.server, 0, sizeof(sim.server));
+	sim.server.sin_family = AF_INET;
+	sim.server.sin_port = htons(config->server_port);
+	sim.server.sin_addr.s_addr = config->server_address;
+
+	if(config->verbose) {
+		const impairment& p = config->profile;
+		fprintf(config->fp, "profile: %s drop %.1f%%/%.1f%% dup %.1f%% reorder %.1f%% (+%ums) delay %ums jitter %ums 0x20 %s edns %d truncate %ld\n",
+				p.name, p.drop_query * 100, p.drop_reply * 100, p.duplicate * 100, p.reorder * 100,
+				p.reorder_ms, p.delay_ms, p.jitter_ms, p.randomize_case ? "on" : "off",
+				p.edns_size, (long)p.max_reply);
+	}
+
+	while(not stop) {
+
+		if(report != 0) {
+			sim.print_report();
+			configure_signal(report, sighandler_report);
+			report = 0;
+		}
+
+		fd_set rfds;
+		timeval tv;
+
+		FD_ZERO(&rfds);
+		FD_SET(sim.clientfd, &rfds);
+		FD_SET(sim.serverfd, &rfds);
+
+		uint64_t t = now_usec();
+		uint64_t wait = 1000000;
+
+		if(not sim.schedule.empty())
+			wait = sim.schedule.top().due > t ? std::min(wait, sim.schedule.top().due - t) : 0;
+
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+
+		int left = select(std::max(sim.clientfd, sim.serverfd) + 1, &rfds, nullptr, nullptr, &tv);
+
+		if(left == -1) {
+
+			if(errno == EINTR)
+				continue;
+
+			perror("select()");
+			exit(EXIT_FAILURE);
+		}
+
+		if(left > 0 and FD_ISSET(sim.clientfd, &rfds)) {
+
+			sockaddr_in from;
+			socklen_t from_sz = sizeof(from);
+
+			ssize_t sz = recvfrom(sim.clientfd, data, DATA_SZ, 0, (sockaddr *)&from, &from_sz);
+
+			if(sz == -1)
+				perror("recvfrom()");
+			else
+				sim.on_query(data, sz, from);
+		}
+
+		if(left > 0 and FD_ISSET(sim.serverfd, &rfds)) {
+
+			ssize_t sz = recv(sim.serverfd, data, DATA_SZ, 0);
+
+			if(sz == -1)
+				perror("recv()");
+			else
+				sim.on_answer(data, sz);
+		}
+
+		sim.flush(now_usec());
+	}
+
+	sim.print_report();
+
+	close(sim.clientfd);
+	close(sim.serverfd);
+}
+
+int main(int argc, char **argv) {
+
+	configuration config;
+
+	int lastopt = cliconfig(&config, argc, argv);
+
+	if (lastopt != argc) {
+		fprintf(stderr, "too many arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	simulate(&config);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,364 @@
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <80over53/store.hh>
+
+#define dfprintf(...)
+
+static const char store_magic[8] = { '8', '0', 'o', 'v', 'e', 'r', '5', '3' };
+
+static uint32_t checksum(const void *p, size_t sz) {
+	return crc32(0, (const Bytef *)p, sz);
+}
+
+static uint64_t record_data(const store_record *r) {
+	return (uint64_t)r->key_sz + r->url_sz + r->etag_sz + r->last_modified_sz + r->raw_sz;
+}
+
+static uint64_t record_total(const store_record *r) {
+	return (sizeof(store_record) + record_data(r) + STORE_ALIGN - 1) & ~(uint64_t)(STORE_ALIGN - 1);
+}
+
+store_record *cache_store::record(uint64_t offset) const {
+	return (store_record *)(data + STORE_HEADER_SZ + offset % capacity);
+}
+
+void cache_store::seal_header() {
+	header()->checksum = checksum(header(), offsetof(store_header, checksum));
+}
+
+void cache_store::seal_record(store_record *r) {
+	r->checksum = checksum(r, offsetof(store_record, checksum));
+}
+
+void cache_store::start_over() {
+
+	store_header *h = header();
+
+	memset(h, 0, sizeof(*h));
+
+	memcpy(h->magic, store_magic, sizeof(h->magic));
+
+	h->version = STORE_VERSION;
+	h->record_sz = sizeof(store_record);
+	h->capacity = capacity;
+
+	seal_header();
+
+	stats.started_over = true;
+}
+
+/*
+ * whether the record header at offset checks, and what it says fits
+ */
+
+bool cache_store::record_valid(uint64_t offset) const {
+
+	const uint64_t room = capacity - offset % capacity;
+
+	if(room < sizeof(store_record))
+		return true;
+
+	const store_record *r = record(offset);
+
+	if(r->magic != STORE_RECORD_MAGIC and r->magic != STORE_WRAP_MAGIC)
+		return false;
+
+	if(r->checksum != checksum(r, offsetof(store_record, checksum)))
+		return false;
+
+	return r->magic == STORE_WRAP_MAGIC or record_total(r) <= room;
+}
+
+/*
+ * the offset after the (valid) record at offset
+ */
+
+uint64_t cache_store::next(uint64_t offset) const {
+
+	const uint64_t room = capacity - offset % capacity;
+
+	if(room < sizeof(store_record) or record(offset)->magic == STORE_WRAP_MAGIC)
+		return offset + room;
+
+	return offset + record_total(record(offset));
+}
+
+bool cache_store::holds(uint64_t offset) const {
+	return opened() and offset >= header()->head and offset < header()->tail;
+}
+
+uint64_t cache_store::used() const {
+	return opened() ? header()->tail - header()->head : 0;
+}
+
+/*
+ * map path as a store of capacity bytes, filling items with the live records
+ * found in it, started over if it holds none usable. -1 with errno set if it
+ * can't be opened, locked or mapped.
+ */
+
+int cache_store::open(const char *my_path, uint64_t my_capacity, std::vector<store_item> *items) {
+
+	struct stat st;
+
+	path = my_path;
+	capacity = my_capacity & ~(uint64_t)(STORE_ALIGN - 1);
+
+	if(capacity < STORE_HEADER_SZ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd == -1)
+		return -1;
+
+	if(flock(fd, LOCK_EX | LOCK_NB) == -1 or fstat(fd, &st) == -1) {
+		close();
+		return -1;
+	}
+
+	data_sz = STORE_HEADER_SZ + capacity;
+
+	if((size_t)st.st_size != data_sz and ftruncate(fd, data_sz) == -1) {
+		close();
+		return -1;
+	}
+
+	void *p = mmap(nullptr, data_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) {
+		close();
+		return -1;
+	}
+
+	data = (uint8_t *)p;
+
+	madvise(p, data_sz, MADV_RANDOM);
+
+	store_header *h = header();
+
+	if(memcmp(h->magic, store_magic, sizeof(h->magic)) != 0
+			or h->version != STORE_VERSION
+			or h->record_sz != sizeof(store_record)
+			or h->capacity != capacity
+			or h->checksum != checksum(h, offsetof(store_header, checksum))
+			or h->head > h->tail
+			or h->tail - h->head > capacity) {
+		start_over();
+		return 0;
+	}
+
+	for(uint64_t offset = h->head; offset < h->tail; offset = next(offset)) {
+
+		if(not record_valid(offset) or next(offset) > h->tail) {
+			dfprintf(stderr, "store: %s: record at %lu doesn't check, dropping the rest\n", path, (unsigned long)offset);
+			stats.corrupt++;
+			h->tail = offset;
+			seal_header();
+			break;
+		}
+
+		const uint64_t room = capacity - offset % capacity;
+
+		if(room < sizeof(store_record))
+			continue;
+
+		const store_record *r = record(offset);
+
+		if(r->magic != STORE_RECORD_MAGIC or (r->flags & STORE_DEAD))
+			continue;
+
+		const char *s = (const char *)(r + 1);
+
+		store_item item;
+
+		item.offset = offset;
+		item.flags = r->flags;
+		item.fresh_until = r->fresh_until;
+		item.key.assign(s, r->key_sz);
+		s += r->key_sz;
+		item.url.assign(s, r->url_sz);
+		s += r->url_sz;
+		item.etag.assign(s, r->etag_sz);
+		s += r->etag_sz;
+		item.last_modified.assign(s, r->last_modified_sz);
+		item.raw_sz = r->raw_sz;
+
+		items->push_back(item);
+
+		stats.found++;
+	}
+
+	return 0;
+}
+
+void cache_store::close() {
+
+	if(data != nullptr) {
+		munmap(data, data_sz);
+		data = nullptr;
+	}
+
+	if(fd != -1) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+/*
+ * write item with raw as a new record, overwriting the oldest records as
+ * needed (the offsets of those still live into dropped), its offset or -1
+ * if it can't fit
+ */
+
+int64_t cache_store::append(const store_item& item, const buffer_chain& raw, std::vector<uint64_t> *dropped) {
+
+	if(not opened())
+		return -1;
+
+	store_record r;
+
+	memset(&r, 0, sizeof(r));
+
+	r.magic = STORE_RECORD_MAGIC;
+	r.flags = item.flags & ~STORE_DEAD;
+	r.fresh_until = item.fresh_until;
+	r.key_sz = item.key.size();
+	r.url_sz = item.url.size();
+	r.etag_sz = item.etag.size();
+	r.last_modified_sz = item.last_modified.size();
+	r.raw_sz = raw.size();
+
+	const uint64_t sz = record_total(&r);
+
+	if(sz > capacity)
+		return -1;
+
+	store_header *h = header();
+
+	const uint64_t room = capacity - h->tail % capacity;
+	const uint64_t offset = h->tail + (room < sz ? room : 0);
+
+	while(offset + sz - h->head > capacity) {
+
+		if(h->head == h->tail) {
+			h->head = h->tail = offset;
+			break;
+		}
+
+		if(capacity - h->head % capacity >= sizeof(store_record)) {
+
+			const store_record *old = record(h->head);
+
+			if(old->magic == STORE_RECORD_MAGIC and not (old->flags & STORE_DEAD)) {
+				dropped->push_back(h->head);
+				stats.overwritten++;
+			}
+		}
+
+		h->head = next(h->head);
+	}
+
+	seal_header();
+
+	if(h->tail < offset and offset - h->tail >= sizeof(store_record)) {
+
+		store_record *wrap = record(h->tail);
+
+		memset(wrap, 0, sizeof(*wrap));
+		wrap->magic = STORE_WRAP_MAGIC;
+		seal_record(wrap);
+	}
+
+	uint8_t *p = (uint8_t *)record(offset);
+	uint8_t *s = p + sizeof(store_record);
+
+	memcpy(s, item.key.data(), r.key_sz);
+	s += r.key_sz;
+	memcpy(s, item.url.data(), r.url_sz);
+	s += r.url_sz;
+	memcpy(s, item.etag.data(), r.etag_sz);
+	s += r.etag_sz;
+	memcpy(s, item.last_modified.data(), r.last_modified_sz);
+	s += r.last_modified_sz;
+	raw.copy(0, r.raw_sz, s);
+
+	r.data_checksum = checksum(p + sizeof(store_record), record_data(&r));
+
+	seal_record(&r);
+
+	memcpy(p, &r, sizeof(r));
+
+	h->tail = offset + sz;
+
+	seal_header();
+
+	stats.written++;
+
+	return offset;
+}
+
+/*
+ * the raw response of the record at offset into raw, -1 (and the record
+ * dropped) if its data doesn't check
+ */
+
+int cache_store::load(uint64_t offset, buffer_chain *raw) {
+
+	if(not holds(offset) or not record_valid(offset))
+		return -1;
+
+	const store_record *r = record(offset);
+
+	if(r->magic != STORE_RECORD_MAGIC or (r->flags & STORE_DEAD))
+		return -1;
+
+	const uint8_t *s = (const uint8_t *)(r + 1);
+
+	if(r->data_checksum != checksum(s, record_data(r))) {
+		stats.corrupt++;
+		kill(offset);
+		return -1;
+	}
+
+	raw->clear();
+	raw->append(s + r->key_sz + r->url_sz + r->etag_sz + r->last_modified_sz, r->raw_sz);
+
+	stats.loaded++;
+
+	return 0;
+}
+
+void cache_store::kill(uint64_t offset) {
+
+	if(not holds(offset))
+		return;
+
+	store_record *r = record(offset);
+
+	r->flags |= STORE_DEAD;
+
+	seal_record(r);
+}
+
+void cache_store::freshen(uint64_t offset, time_t fresh_until) {
+
+	if(not holds(offset))
+		return;
+
+	store_record *r = record(offset);
+
+	r->fresh_until = fresh_until;
+
+	seal_record(r);
+}
@@ -0,0 +1,217 @@
+#include <ctime>
+
+#include <algorithm>
+
+#include <80over53/timer.hh>
+
+#define dfprintf(...)
+
+#define TIMER_SPAN_MAX ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+static void link_empty(timer_link *head) {
+	head->prev = head;
+	head->next = head;
+}
+
+static void link_insert(timer_link *head, timer_link *x) {
+	x->prev = head->prev;
+	x->next = head;
+	head->prev->next = x;
+	head->prev = x;
+}
+
+static void link_remove(timer_link *x) {
+	x->prev->next = x->next;
+	x->next->prev = x->prev;
+	x->prev = nullptr;
+	x->next = nullptr;
+}
+
+void timer::cancel() {
+
+	if(not pending())
+		return;
+
+	link_remove(this);
+
+	wheel->count--;
+	wheel = nullptr;
+}
+
+timer_wheel::timer_wheel() {
+	for(int l = 0; l < TIMER_LEVELS; l++)
+		for(int i = 0; i < TIMER_SLOTS; i++)
+			link_empty(&slots[l][i]);
+}
+
+timer_wheel::~timer_wheel() {
+
+	for(int l = 0; l < TIMER_LEVELS; l++) {
+		for(int i = 0; i < TIMER_SLOTS; i++) {
+			while(slots[l][i].next != &slots[l][i]) {
+				timer *t = (timer *)slots[l][i].next;
+				link_remove(t);
+				t->wheel = nullptr;
+			}
+		}
+	}
+}
+
+uint64_t timer_clock_ms() {
+
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t timer_clock_ns() {
+
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void timer_wheel::start(uint64_t now_ms) {
+	now = now_ms / TIMER_TICK_MS;
+}
+
+/*
+ * put t in the slot of the lowest level spanning its delay, a timer already
+ * due going in the slot about to fire
+ */
+
+void timer_wheel::place(timer *t) {
+
+	const uint64_t delta = t->expires > now ? t->expires - now : 0;
+
+	int l = 0;
+
+	while(l < TIMER_LEVELS - 1 and delta >= (uint64_t)1 << (TIMER_SLOT_BITS * (l + 1)))
+		l++;
+
+	const uint64_t expires = delta == 0 ? now : t->expires;
+
+	link_insert(&slots[l][(expires >> (TIMER_SLOT_BITS * l)) & (TIMER_SLOTS - 1)], t);
+}
+
+/*
+ * arm t to fire delay_ms from now (at the earliest the next tick), moving it
+ * when it is armed already
+ */
+
+void timer_wheel::add(timer *t, uint64_t delay_ms) {
+
+	t->cancel();
+
+	uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+	if(ticks == 0)
+		ticks = 1;
+
+	if(ticks >= TIMER_SPAN_MAX)
+		ticks = TIMER_SPAN_MAX - 1;
+
+	t->expires = now + ticks;
+	t->wheel = this;
+
+	place(t);
+
+	count++;
+}
+
+/*
+ * run the wheel up to now_ms, firing what expires on the way
+ */
+
+void timer_wheel::advance(uint64_t now_ms, void *ctx) {
+
+	const uint64_t target = now_ms / TIMER_TICK_MS;
+
+	while(now < target) {
+
+		if(count == 0) {
+			now = target;
+			break;
+		}
+
+		now++;
+
+		for(int l = 1; l < TIMER_LEVELS; l++) {
+
+			if(((now >> (TIMER_SLOT_BITS * (l - 1))) & (TIMER_SLOTS - 1)) != 0)
+				break;
+
+			timer_link *head = &slots[l][(now >> (TIMER_SLOT_BITS * l)) & (TIMER_SLOTS - 1)];
+
+			timer_link cascade;
+
+			link_empty(&cascade);
+
+			if(head->next != head) {
+				cascade.next = head->next;
+				cascade.prev = head->prev;
+				cascade.next->prev = &cascade;
+				cascade.prev->next = &cascade;
+				link_empty(head);
+			}
+
+			while(cascade.next != &cascade) {
+				timer *t = (timer *)cascade.next;
+				link_remove(t);
+				place(t);
+			}
+		}
+
+		timer_link *head = &slots[0][now & (TIMER_SLOTS - 1)];
+
+		while(head->next != head) {
+
+			timer *t = (timer *)head->next;
+
+			t->cancel();
+
+			dfprintf(stderr, "timer %p fired at tick %lu\n", (void *)t, (unsigned long)now);
+
+			if(t->fire != nullptr)
+				t->fire(t, ctx);
+		}
+	}
+}
+
+/*
+ * ms until the wheel next needs advancing, a lower bound on the next expiry
+ * (a cascade may just move timers down), or -1 with nothing armed
+ */
+
+int64_t timer_wheel::next_ms() const {
+
+	if(count == 0)
+		return -1;
+
+	uint64_t best = UINT64_MAX;
+
+	for(int l = 0; l < TIMER_LEVELS; l++) {
+
+		const unsigned shift = TIMER_SLOT_BITS * l;
+		const uint64_t index = now >> shift;
+
+		for(uint64_t d = 1; d < TIMER_SLOTS; d++) {
+
+			const timer_link *head = &slots[l][(index + d) & (TIMER_SLOTS - 1)];
+
+			if(head->next != head) {
+				best = std::min(best, ((index + d) << shift) - now);
+				break;
+			}
+		}
+	}
+
+	if(best == UINT64_MAX)
+		best = TIMER_SLOTS - (now & (TIMER_SLOTS - 1));
+
+	return best * TIMER_TICK_MS;
+}
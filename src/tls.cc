@@ -0,0 +1,270 @@
+#include <cstdio>
+#include <cstring>
+
+#include <openssl/err.h>
+
+#include <80over53/tls.hh>
+
+#define dfprintf(...)
+
+/*
+ * a backend gave a session (after the handshake under TLS 1.3, in it before)
+ */
+
+static int tls_new_session(SSL *ssl, SSL_SESSION *session) {
+
+	tls_stream *stream = (tls_stream *)SSL_get_app_data(ssl);
+
+	if(stream == nullptr or stream->context == nullptr)
+		return 0;
+
+	stream->context->remember(stream->backend, session);
+	stream->context->stats.tickets++;
+
+	dfprintf(stderr, "tls: session for %s\n", stream->backend.c_str());
+
+	return 1;
+}
+
+/*
+ * verifying against the CA certificates in ca_file, or the system's when it
+ * is nullptr
+ */
+
+int tls_context::setup(const char *ca_file) {
+
+	if((ctx = SSL_CTX_new(TLS_client_method())) == nullptr)
+		return -1;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+
+	const int loaded = ca_file != nullptr
+			? SSL_CTX_load_verify_locations(ctx, ca_file, nullptr)
+			: SSL_CTX_set_default_verify_paths(ctx);
+
+	if(loaded != 1) {
+		teardown();
+		return -1;
+	}
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+
+	return 0;
+}
+
+void tls_context::teardown() {
+
+	for(auto& x : sessions)
+		SSL_SESSION_free(x.second.session);
+
+	sessions.clear();
+
+	if(ctx != nullptr)
+		SSL_CTX_free(ctx);
+
+	ctx = nullptr;
+}
+
+/*
+ * the session backend gave last, nullptr if there is none
+ */
+
+SSL_SESSION *tls_context::recall(const std::string& backend) {
+
+	auto x = sessions.find(backend);
+
+	if(x == sessions.end())
+		return nullptr;
+
+	lru.touch(&x->second.lru);
+
+	return x->second.session;
+}
+
+/*
+ * keep session (a reference given) for resuming with backend, in place of
+ * the one kept before. past TLS_SESSIONS_MAX backends the one resumed least
+ * recently is let go.
+ */
+
+void tls_context::remember(const std::string& backend, SSL_SESSION *session) {
+
+	auto x = sessions.find(backend);
+
+	if(x != sessions.end()) {
+		SSL_SESSION_free(x->second.session);
+		x->second.session = session;
+		lru.touch(&x->second.lru);
+		return;
+	}
+
+	if(sessions.size() >= TLS_SESSIONS_MAX) {
+		auto oldest = (std::pair<const std::string, tls_session> *)lru.oldest()->owner;
+		forget(oldest->first);
+	}
+
+	auto& entry = *sessions.try_emplace(backend).first;
+
+	entry.second.session = session;
+	entry.second.lru.owner = &entry;
+	lru.touch(&entry.second.lru);
+}
+
+void tls_context::forget(const std::string& backend) {
+
+	auto x = sessions.find(backend);
+
+	if(x == sessions.end())
+		return;
+
+	SSL_SESSION_free(x->second.session);
+	sessions.erase(x);
+}
+
+/*
+ * connections are closed without a close_notify, which OpenSSL would take
+ * for a broken one and no longer resume its session. a failed handshake
+ * forgets the session itself.
+ */
+
+tls_stream::~tls_stream() {
+
+	if(ssl == nullptr)
+		return;
+
+	SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(ssl);
+}
+
+/*
+ * a client stream to host (its name sent and verified) at backend, resuming
+ * the session backend gave last. the ClientHello is ready to drain.
+ */
+
+int tls_stream::start(tls_context *my_context, const char *host, const std::string& my_backend) {
+
+	context = my_context;
+	backend = my_backend;
+
+	if((ssl = SSL_new(context->ctx)) == nullptr)
+		return -1;
+
+	in = BIO_new(BIO_s_mem());
+	out = BIO_new(BIO_s_mem());
+
+	if(in == nullptr or out == nullptr) {
+		BIO_free(in);
+		BIO_free(out);
+		return -1;
+	}
+
+	SSL_set_bio(ssl, in, out);
+	SSL_set_connect_state(ssl);
+	SSL_set_app_data(ssl, this);
+
+	if(SSL_set_tlsext_host_name(ssl, host) != 1 or SSL_set1_host(ssl, host) != 1)
+		return -1;
+
+	if(SSL_SESSION *session = context->recall(backend))
+		SSL_set_session(ssl, session);
+
+	return handshake() == -1 ? -1 : 0;
+}
+
+/*
+ * 1 once established, 0 while it waits for the backend, -1 if it failed
+ * (the backend's session forgotten, in case that was why)
+ */
+
+int tls_stream::handshake() {
+
+	ERR_clear_error();
+
+	const int r = SSL_do_handshake(ssl);
+
+	if(r == 1) {
+
+		if(not counted) {
+			counted = true;
+			context->stats.handshakes++;
+			if(resumed())
+				context->stats.resumed++;
+		}
+
+		return 1;
+	}
+
+	switch(SSL_get_error(ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+		default:
+			break;
+	}
+
+	context->stats.failed++;
+	context->forget(backend);
+
+	return -1;
+}
+
+void tls_stream::feed(const void *data, size_t sz) {
+	BIO_write(in, data, sz);
+}
+
+void tls_stream::drain(std::string *s) {
+
+	char buf[4096];
+
+	int n;
+
+	while(BIO_ctrl_pending(out) > 0 and (n = BIO_read(out, buf, sizeof(buf))) > 0)
+		s->append(buf, n);
+}
+
+int tls_stream::write(const void *data, size_t sz) {
+
+	size_t written;
+
+	return sz == 0 or SSL_write_ex(ssl, data, sz, &written) == 1 ? 0 : -1;
+}
+
+/*
+ * plaintext into buf, 0 when more has to be fed first, -1 once the backend
+ * closed (close_notify) and -2 if it failed
+ */
+
+ssize_t tls_stream::read(void *buf, size_t sz) {
+
+	size_t n;
+
+	ERR_clear_error();
+
+	if(SSL_read_ex(ssl, buf, sz, &n) == 1)
+		return n;
+
+	switch(SSL_get_error(ssl, 0)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+		case SSL_ERROR_ZERO_RETURN:
+			return -1;
+		default:
+			return -2;
+	}
+}
+
+/*
+ * why the last operation on this thread failed
+ */
+
+const char *tls_error_str() {
+
+	const unsigned long e = ERR_get_error();
+
+	const char *reason = e != 0 ? ERR_reason_error_string(e) : nullptr;
+
+	return reason != nullptr ? reason : "unknown error";
+}
@@ -0,0 +1,573 @@
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+#include <algorithm>
+
+#include <80over53/tunnel.hh>
+
+#define dfprintf(...)
+
+/*
+ * an answer RR whose owner name is a compression pointer: pointer, type,
+ * class, ttl and rdlength
+ */
+
+#define RR_OVERHEAD_SZ 12
+
+static const char base32_alphabet[] = "abcdefghijklmnopqrstuvwxyz234567";
+
+const char *tunnel_op_str(tunnel_op x) {
+	switch(x) {
+		case tunnel_op::PUT:   return "PUT";
+		case tunnel_op::GET:   return "GET";
+		case tunnel_op::CLOSE: return "CLOSE";
+		case tunnel_op::REPAIR: return "REPAIR";
+	}
+
+	return nullptr;
+}
+
+size_t base32_encoded_sz(size_t sz) {
+	return (sz * 8 + 4) / 5;
+}
+
+size_t base32_decoded_sz(size_t sz) {
+	return sz * 5 / 8;
+}
+
+size_t base32_encode(const void *data, size_t data_sz, char *s) {
+
+	const uint8_t *p = (const uint8_t *)data;
+
+	uint32_t bits = 0;
+	int nbits = 0;
+
+	size_t n = 0;
+
+	for(size_t i = 0; i < data_sz; i++) {
+
+		bits = (bits << 8) | p[i];
+		nbits += 8;
+
+		while(nbits >= 5) {
+			nbits -= 5;
+			s[n++] = base32_alphabet[(bits >> nbits) & 0x1f];
+		}
+	}
+
+	if(nbits > 0)
+		s[n++] = base32_alphabet[(bits << (5 - nbits)) & 0x1f];
+
+	return n;
+}
+
+/*
+ * decode base32 text in either case, skipping label dots
+ */
+
+ssize_t base32_decode(const char *s, size_t s_sz, void *data, size_t data_sz) {
+
+	uint8_t *p = (uint8_t *)data;
+
+	uint32_t bits = 0;
+	int nbits = 0;
+
+	size_t n = 0;
+
+	for(size_t i = 0; i < s_sz; i++) {
+
+		int c = s[i];
+		int v;
+
+		if(c == '.')
+			continue;
+		else if(c >= 'a' and c <= 'z')
+			v = c - 'a';
+		else if(c >= 'A' and c <= 'Z')
+			v = c - 'A';
+		else if(c >= '2' and c <= '7')
+			v = c - '2' + 26;
+		else
+			return -1;
+
+		bits = (bits << 5) | v;
+		nbits += 5;
+
+		if(nbits >= 8) {
+
+			if(n == data_sz)
+				return -1;
+
+			nbits -= 8;
+			p[n++] = (bits >> nbits) & 0xff;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * the -d domain may be written as "$.zone" with $ marking where the data
+ * labels go, the zone itself is what follows
+ */
+
+const char *tunnel_zone(const char *domain) {
+
+	if(domain[0] == '$' and domain[1] == '.')
+		return domain + 2;
+
+	return domain;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u16(uint8_t *p, uint16_t x) {
+	p[0] = x >> 8;
+	p[1] = x;
+}
+
+static void put_u32(uint8_t *p, uint32_t x) {
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+/*
+ * the session of a tunnel query read straight off its dns message, for
+ * routing it before it is parsed: the first 8 characters of the first label
+ * decode to the op and session. -1 if that label can't hold them.
+ */
+
+int tunnel_peek_session(const void *msg, size_t msg_sz, uint32_t *session) {
+
+	const uint8_t *p = (const uint8_t *)msg;
+
+	const size_t label = sizeof(dns_header);
+
+	if(msg_sz < label + 1 + 8 or p[label] < 8 or p[label] > DNS_LABEL_MAX_SZ)
+		return -1;
+
+	uint8_t buf[5];
+
+	if(base32_decode((const char *)p + label + 1, 8, buf, sizeof(buf)) != sizeof(buf))
+		return -1;
+
+	*session = get_u32(buf + 1);
+
+	return 0;
+}
+
+int tunnel_query::parse(const dns_question& question, const char *zone) {
+
+	const size_t zone_sz = strlen(zone);
+
+	uint8_t buf[DNS_NAME_MAX_SZ];
+
+	if(not tunnel_qtype(question.qtype) or question.qclass != dns_class::IN)
+		return -1;
+
+	if(question.qname_sz < zone_sz + 3 or question.qname[question.qname_sz - 1] != '.')
+		return -1;
+
+	const size_t labels_sz = question.qname_sz - zone_sz - 2;
+
+	if(question.qname[labels_sz] != '.' or strncasecmp(question.qname + labels_sz + 1, zone, zone_sz) != 0)
+		return -1;
+
+	ssize_t n = base32_decode(question.qname, labels_sz, buf, sizeof(buf));
+	if(n < TUNNEL_QUERY_HEADER_SZ)
+		return -1;
+
+	op = (tunnel_op)buf[0];
+	qtype = question.qtype;
+	session = get_u32(buf + 1);
+	stream = get_u16(buf + 5);
+	nonce = get_u16(buf + 7);
+	seq = get_u32(buf + 9);
+	arg = get_u16(buf + 13);
+
+	data_sz = n - TUNNEL_QUERY_HEADER_SZ;
+	memcpy(data, buf + TUNNEL_QUERY_HEADER_SZ, data_sz);
+
+	switch(op) {
+		case tunnel_op::PUT:
+		case tunnel_op::GET:
+		case tunnel_op::CLOSE:
+		case tunnel_op::REPAIR:
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * write the query as qname text "<labels>.<zone>" without a trailing dot
+ */
+
+ssize_t tunnel_query::write(char *qname, size_t qname_sz, const char *zone) const {
+
+	uint8_t buf[DNS_NAME_MAX_SZ];
+	char text[DNS_NAME_MAX_SZ * 2];
+
+	if(data_sz > capacity(zone))
+		return -1;
+
+	buf[0] = (uint8_t)op;
+	put_u32(buf + 1, session);
+	put_u16(buf + 5, stream);
+	put_u16(buf + 7, nonce);
+	put_u32(buf + 9, seq);
+	put_u16(buf + 13, arg);
+
+	memcpy(buf + TUNNEL_QUERY_HEADER_SZ, data, data_sz);
+
+	size_t text_sz = base32_encode(buf, TUNNEL_QUERY_HEADER_SZ + data_sz, text);
+
+	size_t n = 0;
+
+	for(size_t i = 0; i < text_sz; i += DNS_LABEL_MAX_SZ) {
+
+		size_t label_sz = std::min((size_t)DNS_LABEL_MAX_SZ, text_sz - i);
+
+		if(n + label_sz + 1 >= qname_sz)
+			return -1;
+
+		memcpy(qname + n, text + i, label_sz);
+		n += label_sz;
+		qname[n++] = '.';
+	}
+
+	int m = snprintf(qname + n, qname_sz - n, "%s", zone);
+	if(m < 0 or n + m >= qname_sz or n + m > DNS_NAME_MAX_SZ - 2)
+		return -1;
+
+	return n + m;
+}
+
+int tunnel_query::sprint(char *s, size_t sz) const {
+	return snprintf(s, sz, "%s session %08x stream %u seq %u arg %u data (%d) nonce %04x",
+			tunnel_op_str(op),
+			session,
+			stream,
+			seq,
+			arg,
+			(int)data_sz,
+			nonce);
+}
+
+/*
+ * the most data bytes a PUT can carry in a name under zone
+ */
+
+size_t tunnel_query::capacity(const char *zone) {
+
+	const size_t zone_sz = strlen(zone);
+
+	for(size_t k = DNS_NAME_MAX_SZ - 2; k > 0; k--) {
+
+		size_t labels = (k + DNS_LABEL_MAX_SZ - 1) / DNS_LABEL_MAX_SZ;
+
+		if(k + labels + zone_sz <= DNS_NAME_MAX_SZ - 2) {
+
+			size_t n = base32_decoded_sz(k);
+
+			return n > TUNNEL_QUERY_HEADER_SZ ? n - TUNNEL_QUERY_HEADER_SZ : 0;
+		}
+	}
+
+	return 0;
+}
+
+int tunnel_reply::parse(const void *buf, size_t buf_sz) {
+
+	const uint8_t *p = (const uint8_t *)buf;
+
+	if(buf_sz < TUNNEL_REPLY_HEADER_SZ)
+		return -1;
+
+	status = p[0];
+	total = get_u32(p + 1);
+
+	data = p + TUNNEL_REPLY_HEADER_SZ;
+	data_sz = buf_sz - TUNNEL_REPLY_HEADER_SZ;
+
+	return 0;
+}
+
+ssize_t tunnel_reply::write(void *buf, size_t buf_sz) const {
+
+	uint8_t *p = (uint8_t *)buf;
+
+	if(buf_sz < TUNNEL_REPLY_HEADER_SZ + data_sz)
+		return -1;
+
+	p[0] = status;
+	put_u32(p + 1, total);
+
+	if(data_sz > 0)
+		memcpy(p + TUNNEL_REPLY_HEADER_SZ, data, data_sz);
+
+	return TUNNEL_REPLY_HEADER_SZ + data_sz;
+}
+
+bool tunnel_qtype(dns_type qtype) {
+	return qtype == dns_type::TXT or qtype == dns_type::NULL_ or qtype == dns_type::AAAA;
+}
+
+/*
+ * a response coding as the PUT flag accepting it and the DATA status
+ * flag announcing it
+ */
+
+uint16_t tunnel_coding_flag(coding x) {
+	switch(x) {
+		case coding::DEFLATE: return TUNNEL_FLAG_DEFLATE;
+		case coding::ZSTD:    return TUNNEL_FLAG_ZSTD;
+		default:              return 0;
+	}
+}
+
+uint8_t tunnel_coding_status(coding x) {
+	switch(x) {
+		case coding::DEFLATE: return TUNNEL_STATUS_DEFLATE;
+		case coding::ZSTD:    return TUNNEL_STATUS_ZSTD;
+		default:              return 0;
+	}
+}
+
+coding tunnel_status_coding(uint8_t status) {
+
+	if(status & TUNNEL_STATUS_ZSTD)
+		return coding::ZSTD;
+
+	if(status & TUNNEL_STATUS_DEFLATE)
+		return coding::DEFLATE;
+
+	return coding::IDENTITY;
+}
+
+/*
+ * the most chunk bytes a reply to a qtype question ending at question_end
+ * can carry within DNS_MSG_MAX_SZ
+ */
+
+size_t tunnel_reply::capacity(dns_type qtype, size_t question_end) {
+
+	if(question_end + RR_OVERHEAD_SZ >= DNS_MSG_MAX_SZ)
+		return 0;
+
+	const size_t room = DNS_MSG_MAX_SZ - question_end;
+	const size_t rdata_sz = room - RR_OVERHEAD_SZ;
+
+	size_t payload_sz = 0;
+
+	switch(qtype) {
+
+		case dns_type::TXT:
+
+			payload_sz = rdata_sz - (rdata_sz + TUNNEL_TXT_STRING_MAX_SZ) / (TUNNEL_TXT_STRING_MAX_SZ + 1);
+
+			while(payload_sz + (payload_sz + TUNNEL_TXT_STRING_MAX_SZ - 1) / TUNNEL_TXT_STRING_MAX_SZ > rdata_sz)
+				payload_sz--;
+			break;
+
+		case dns_type::NULL_:
+
+			payload_sz = rdata_sz;
+			break;
+
+		case dns_type::AAAA: {
+
+			size_t rrs = std::min(room / (RR_OVERHEAD_SZ + 16), (size_t)TUNNEL_ANSWERS_MAX);
+
+			payload_sz = rrs * TUNNEL_AAAA_DATA_SZ;
+			payload_sz = payload_sz > 2 ? payload_sz - 2 : 0;
+			break;
+		}
+
+		default:
+
+			break;
+	}
+
+	return payload_sz > TUNNEL_REPLY_HEADER_SZ ? payload_sz - TUNNEL_REPLY_HEADER_SZ : 0;
+}
+
+/*
+ * pack the reply into the rdata of up to answers_max answers for a qtype
+ * question, returning how many were used
+ */
+
+ssize_t tunnel_reply::pack(dns_type qtype, dns_rr *answers, size_t answers_max) const {
+
+	uint8_t buf[DNS_MSG_MAX_SZ];
+
+	ssize_t n = write(buf + 2, sizeof(buf) - 2);
+	if(n == -1 or answers_max == 0)
+		return -1;
+
+	switch(qtype) {
+
+		case dns_type::TXT: {
+
+			size_t m = 0;
+
+			for(ssize_t i = 0; i < n; i += TUNNEL_TXT_STRING_MAX_SZ) {
+
+				size_t sz = std::min((size_t)TUNNEL_TXT_STRING_MAX_SZ, (size_t)(n - i));
+
+				if(m + 1 + sz > sizeof(answers[0].rdata))
+					return -1;
+
+				answers[0].rdata[m++] = sz;
+				memcpy(answers[0].rdata + m, buf + 2 + i, sz);
+				m += sz;
+			}
+
+			answers[0].rdata_sz = m;
+			return 1;
+		}
+
+		case dns_type::NULL_:
+
+			if((size_t)n > sizeof(answers[0].rdata))
+				return -1;
+
+			memcpy(answers[0].rdata, buf + 2, n);
+			answers[0].rdata_sz = n;
+			return 1;
+
+		case dns_type::AAAA: {
+
+			put_u16(buf, n);
+
+			const size_t framed_sz = n + 2;
+			const size_t rrs = (framed_sz + TUNNEL_AAAA_DATA_SZ - 1) / TUNNEL_AAAA_DATA_SZ;
+
+			if(rrs > answers_max or rrs > TUNNEL_ANSWERS_MAX)
+				return -1;
+
+			for(size_t i = 0; i < rrs; i++) {
+
+				size_t sz = std::min((size_t)TUNNEL_AAAA_DATA_SZ, framed_sz - i * TUNNEL_AAAA_DATA_SZ);
+
+				memset(answers[i].rdata, 0, 16);
+				answers[i].rdata[0] = TUNNEL_AAAA_PREFIX | i;
+				memcpy(answers[i].rdata + 1, buf + i * TUNNEL_AAAA_DATA_SZ, sz);
+				answers[i].rdata_sz = 16;
+			}
+
+			return rrs;
+		}
+
+		default:
+
+			return -1;
+	}
+}
+
+/*
+ * reassemble the payload from the qtype answers among count (others, like a
+ * CNAME in front, are skipped) into buf and parse it. data points into buf.
+ */
+
+int tunnel_reply::unpack(dns_type qtype, const dns_rr *answers, size_t count, void *buf, size_t buf_sz) {
+
+	uint8_t *p = (uint8_t *)buf;
+
+	size_t n = 0;
+
+	switch(qtype) {
+
+		case dns_type::TXT:
+		case dns_type::NULL_:
+
+			for(size_t k = 0; k < count; k++) {
+
+				const dns_rr& rr = answers[k];
+
+				if(rr.qtype != qtype)
+					continue;
+
+				if(qtype == dns_type::NULL_) {
+
+					if(rr.rdata_sz > buf_sz)
+						return -1;
+
+					memcpy(p, rr.rdata, rr.rdata_sz);
+
+					return parse(p, rr.rdata_sz);
+				}
+
+				for(size_t i = 0; i < rr.rdata_sz; ) {
+
+					size_t sz = rr.rdata[i++];
+
+					if(i + sz > rr.rdata_sz or n + sz > buf_sz)
+						return -1;
+
+					memcpy(p + n, rr.rdata + i, sz);
+
+					n += sz;
+					i += sz;
+				}
+
+				return parse(p, n);
+			}
+
+			return -1;
+
+		case dns_type::AAAA: {
+
+			uint32_t seen = 0;
+
+			for(size_t k = 0; k < count; k++) {
+
+				const dns_rr& rr = answers[k];
+
+				if(rr.qtype != qtype or rr.rdata_sz != 16 or (rr.rdata[0] & 0xe0) != TUNNEL_AAAA_PREFIX)
+					continue;
+
+				size_t i = rr.rdata[0] & 0x1f;
+
+				if((i + 1) * TUNNEL_AAAA_DATA_SZ > buf_sz)
+					return -1;
+
+				memcpy(p + i * TUNNEL_AAAA_DATA_SZ, rr.rdata + 1, TUNNEL_AAAA_DATA_SZ);
+
+				seen |= 1U << i;
+			}
+
+			if((seen & 1) == 0)
+				return -1;
+
+			n = get_u16(p);
+
+			const size_t rrs = (n + 2 + TUNNEL_AAAA_DATA_SZ - 1) / TUNNEL_AAAA_DATA_SZ;
+
+			if(rrs > TUNNEL_ANSWERS_MAX)
+				return -1;
+
+			const uint32_t all = rrs == 32 ? UINT32_MAX : (1U << rrs) - 1;
+
+			if((seen & all) != all)
+				return -1;
+
+			memmove(p, p + 2, n);
+
+			return parse(p, n);
+		}
+
+		default:
+
+			return -1;
+	}
+}
@@ -0,0 +1,329 @@
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <80over53/uring.hh>
+
+#define dfprintf(...)
+
+static int uring_setup(unsigned entries, io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_sz) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_sz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * a ring of entries submissions and cq_entries completions
+ */
+
+int uring::setup(unsigned entries, unsigned cq_entries) {
+
+	io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+
+	if((fd = uring_setup(entries, &p)) == -1)
+		return -1;
+
+	if(not (p.features & IORING_FEAT_EXT_ARG) or not (p.features & IORING_FEAT_NODROP)) {
+		teardown();
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_sz = cq_ring_sz = std::max(sq_ring_sz, cq_ring_sz);
+
+	sq_ring = mmap(nullptr, sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	if(sq_ring == MAP_FAILED) {
+		sq_ring = nullptr;
+		teardown();
+		return -1;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else if((cq_ring = mmap(nullptr, cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		cq_ring = nullptr;
+		teardown();
+		return -1;
+	}
+
+	sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+
+	if((sqes = (io_uring_sqe *)mmap(nullptr, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		sqes = nullptr;
+		teardown();
+		return -1;
+	}
+
+	sq_head = (unsigned *)((uint8_t *)sq_ring + p.sq_off.head);
+	sq_tail = (unsigned *)((uint8_t *)sq_ring + p.sq_off.tail);
+	sq_mask = *(unsigned *)((uint8_t *)sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned *)((uint8_t *)sq_ring + p.sq_off.array);
+	sq_entries = p.sq_entries;
+
+	cq_head = (unsigned *)((uint8_t *)cq_ring + p.cq_off.head);
+	cq_tail = (unsigned *)((uint8_t *)cq_ring + p.cq_off.tail);
+	cq_mask = *(unsigned *)((uint8_t *)cq_ring + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)((uint8_t *)cq_ring + p.cq_off.cqes);
+
+	/*
+	 * entries are used in ring order, so the index array is the identity
+	 */
+
+	for(unsigned i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+
+	tail = *sq_tail;
+
+	return 0;
+}
+
+void uring::teardown() {
+
+	if(sqes != nullptr)
+		munmap(sqes, sqes_sz);
+
+	if(cq_ring != nullptr and cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_sz);
+
+	if(sq_ring != nullptr)
+		munmap(sq_ring, sq_ring_sz);
+
+	if(fd != -1)
+		close(fd);
+
+	sqes = nullptr;
+	cq_ring = nullptr;
+	sq_ring = nullptr;
+	fd = -1;
+}
+
+/*
+ * the next submission entry, zeroed but for op, fd and user_data, submitting
+ * what is queued first when the ring is full (unless that would split a
+ * chain). nullptr if it stays full.
+ */
+
+io_uring_sqe *uring::sqe(uint8_t op, int target_fd, uint64_t user_data) {
+
+	if(space() == 0 and not chained())
+		submit(0, 0);
+
+	if(space() == 0)
+		return nullptr;
+
+	io_uring_sqe *e = &sqes[tail & sq_mask];
+
+	memset(e, 0, sizeof(*e));
+
+	e->opcode = op;
+	e->fd = target_fd;
+	e->user_data = user_data;
+
+	tail++;
+
+	return e;
+}
+
+/*
+ * entries free for queueing
+ */
+
+unsigned uring::space() {
+	return sq_entries - (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * whether the last entry queued links to the next, its chain not done yet
+ */
+
+bool uring::chained() {
+
+	if(tail == __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))
+		return false;
+
+	return sqes[(tail - 1) & sq_mask].flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+}
+
+/*
+ * room for a chain of n entries, submitting what is queued first if there
+ * isn't. false if there still isn't.
+ */
+
+bool uring::reserve(unsigned n) {
+
+	if(space() < n and not chained())
+		submit(0, 0);
+
+	return space() >= n;
+}
+
+/*
+ * publish and submit what is queued and wait for at least wait completions,
+ * at most timeout_ms (or URING_NO_TIMEOUT). -1 with errno EINTR or ETIME
+ * when the wait was cut short with nothing submitted.
+ */
+
+int uring::submit(unsigned wait, int64_t timeout_ms) {
+
+	const unsigned queued = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+	unsigned flags = 0;
+
+	io_uring_getevents_arg arg;
+	__kernel_timespec ts;
+
+	memset(&arg, 0, sizeof(arg));
+
+	if(wait > 0) {
+
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+		if(timeout_ms != URING_NO_TIMEOUT) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = timeout_ms % 1000 * 1000000;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+
+	if(queued == 0 and wait == 0)
+		return 0;
+
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	enters++;
+
+	int n = uring_enter(fd, queued, wait, flags, wait > 0 ? &arg : nullptr, wait > 0 ? sizeof(arg) : 0);
+
+	if(n > 0)
+		submitted += n;
+
+	dfprintf(stderr, "io_uring_enter: %u queued, %d submitted\n", queued, n);
+
+	return n;
+}
+
+io_uring_cqe *uring::peek() {
+
+	const unsigned head = *cq_head;
+
+	if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return nullptr;
+
+	return &cqes[head & cq_mask];
+}
+
+void uring::seen() {
+
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+
+	completed++;
+}
+
+/*
+ * count (a power of two) buffers of sz bytes provided as group. the ring is
+ * indexed as a plain io_uring_buf array: the header's flexible array member
+ * is not at offset 0 when compiled as C++.
+ */
+
+int uring_buffers::setup(uring *my_ring, uint16_t my_group, unsigned my_count, unsigned my_sz) {
+
+	ring = my_ring;
+	group = my_group;
+	count = my_count;
+	sz = my_sz;
+
+	void *p = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(p == MAP_FAILED)
+		return -1;
+
+	br = (io_uring_buf_ring *)p;
+
+	io_uring_buf_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+
+	reg.ring_addr = (uint64_t)(uintptr_t)br;
+	reg.ring_entries = count;
+	reg.bgid = group;
+
+	if(uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(br, count * sizeof(io_uring_buf));
+		br = nullptr;
+		return -1;
+	}
+
+	data = new uint8_t[(size_t)count * sz];
+
+	br->tail = 0;
+
+	for(unsigned i = 0; i < count; i++) {
+		io_uring_buf *b = &((io_uring_buf *)br)[i];
+		b->addr = (uint64_t)(uintptr_t)buffer(i);
+		b->len = sz;
+		b->bid = i;
+	}
+
+	__atomic_store_n(&br->tail, (uint16_t)count, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void uring_buffers::teardown() {
+
+	if(br != nullptr) {
+
+		io_uring_buf_reg reg;
+
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = group;
+
+		if(ring->fd != -1)
+			uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+		munmap(br, count * sizeof(io_uring_buf));
+	}
+
+	delete[] data;
+
+	br = nullptr;
+	data = nullptr;
+}
+
+/*
+ * give buffer id back to the kernel
+ */
+
+void uring_buffers::recycle(uint16_t id) {
+
+	const uint16_t t = br->tail;
+
+	io_uring_buf *b = &((io_uring_buf *)br)[t & (count - 1)];
+
+	b->addr = (uint64_t)(uintptr_t)buffer(id);
+	b->len = sz;
+	b->bid = id;
+
+	__atomic_store_n(&br->tail, (uint16_t)(t + 1), __ATOMIC_RELEASE);
+}
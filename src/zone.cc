@@ -0,0 +1,192 @@
+#include <cstring>
+
+#include <80over53/zone.hh>
+#include <80over53/dns.hh>
+
+#define dfprintf(...)
+
+/*
+ * DNS names compare in ASCII case only, whatever the locale
+ */
+
+static inline uint8_t fold(uint8_t c) {
+	return c >= 'A' and c <= 'Z' ? c | 0x20 : c;
+}
+
+/*
+ * whether the sz bytes of a, folded already, match b folded
+ */
+
+static bool label_equal(const uint8_t *a, const uint8_t *b, size_t sz) {
+
+	for(size_t i = 0; i < sz; i++)
+		if(a[i] != fold(b[i]))
+			return false;
+
+	return true;
+}
+
+/*
+ * add the dotted zone name (a trailing dot is optional) as zone id, -1 if
+ * it is malformed or already added
+ */
+
+int zone_trie::add(const char *name, int id) {
+
+	const char *ends[ZONE_LABELS_MAX];
+	size_t count = 0;
+
+	size_t name_sz = strlen(name);
+
+	if(name_sz > 0 and name[name_sz - 1] == '.')
+		name_sz--;
+
+	if(name_sz == 0 or name_sz > DNS_NAME_MAX_SZ - 2)
+		return -1;
+
+	for(const char *p = name; p < name + name_sz; p++) {
+
+		const char *dot = (const char *)memchr(p, '.', name + name_sz - p);
+
+		p = dot == nullptr ? name + name_sz : dot;
+
+		if(count == ZONE_LABELS_MAX)
+			return -1;
+
+		ends[count++] = p;
+	}
+
+	int32_t at = 0;
+
+	for(size_t i = count; i-- > 0; ) {
+
+		const char *start = i == 0 ? name : ends[i - 1] + 1;
+		const size_t label_sz = ends[i] - start;
+
+		if(label_sz == 0 or label_sz > DNS_LABEL_MAX_SZ)
+			return -1;
+
+		int32_t child = nodes[at].child;
+
+		for( ; child != -1; child = nodes[child].sibling) {
+
+			const char *label = labels.data() + nodes[child].label;
+
+			if((size_t)(uint8_t)label[0] == label_sz and label_equal((const uint8_t *)label + 1, (const uint8_t *)start, label_sz))
+				break;
+		}
+
+		if(child == -1) {
+
+			node x;
+
+			x.label = labels.size();
+			x.sibling = nodes[at].child;
+
+			labels += (char)label_sz;
+			for(size_t j = 0; j < label_sz; j++)
+				labels += (char)fold(start[j]);
+
+			child = nodes.size();
+			nodes[at].child = child;
+			nodes.push_back(x);
+		}
+
+		at = child;
+	}
+
+	if(nodes[at].zone != ZONE_NONE)
+		return -1;
+
+	nodes[at].zone = id;
+
+	return 0;
+}
+
+/*
+ * the zone of the wire-format name at offset, or ZONE_NONE, setting end past
+ * the name (-1 when it is malformed). compression pointers are followed only
+ * backwards, as in expand_name().
+ */
+
+int zone_trie::match(size_t offset, const void *data, size_t data_sz, ssize_t *end) const {
+
+	const uint8_t *p = (const uint8_t *)data;
+
+	size_t at[ZONE_LABELS_MAX];
+	size_t count = 0;
+	size_t name_sz = 0;
+
+	*end = 0;
+
+	for(;;) {
+
+		if(offset >= data_sz) {
+			*end = -1;
+			return ZONE_NONE;
+		}
+
+		if(is_name_pointer(offset, data)) {
+
+			if(offset + 2 > data_sz or get_pointer_offset(offset, data) >= offset) {
+				*end = -1;
+				return ZONE_NONE;
+			}
+
+			if(*end == 0)
+				*end = offset + 2;
+
+			offset = get_pointer_offset(offset, data);
+			continue;
+		}
+
+		const size_t label_sz = p[offset];
+
+		if(label_sz == 0)
+			break;
+
+		name_sz += label_sz + 1;
+
+		if((label_sz & DNS_NAME_FORMAT_MASK) != 0 or offset + 1 + label_sz > data_sz
+				or name_sz > DNS_NAME_MAX_SZ or count == ZONE_LABELS_MAX) {
+			*end = -1;
+			return ZONE_NONE;
+		}
+
+		at[count++] = offset;
+		offset += 1 + label_sz;
+	}
+
+	if(*end == 0)
+		*end = offset + 1;
+
+	int zone = ZONE_NONE;
+	int32_t node_at = 0;
+
+	while(count-- > 0) {
+
+		const uint8_t *wire = p + at[count];
+
+		int32_t child = nodes[node_at].child;
+
+		for( ; child != -1; child = nodes[child].sibling) {
+
+			const uint8_t *label = (const uint8_t *)labels.data() + nodes[child].label;
+
+			if(label[0] == wire[0] and label_equal(label + 1, wire + 1, wire[0]))
+				break;
+		}
+
+		if(child == -1)
+			break;
+
+		node_at = child;
+
+		if(nodes[node_at].zone != ZONE_NONE)
+			zone = nodes[node_at].zone;
+	}
+
+	dfprintf(stderr, "zone match: %d\n", zone);
+
+	return zone;
+}